@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+
+# Repaints the whole screen with 256test.sh-like colour swatches: blocks of
+# background colour spanning several cells and rows, with underlined and
+# struck-through text on top.  Run it under "time" to compare the cost of
+# drawing backgrounds and decorations.
+
+cnt=$1
+[ -n "$cnt" ] || cnt=1000
+
+cols=$(tput cols)
+lines=$(tput lines)
+
+# Each frame shifts the colours so that every cell changes.
+frame() {
+  local shift=$1
+  local row col color
+  local e=$'\e'
+  local out="$e[H"
+
+  for ((row = 0; row < lines - 1; row++)); do
+    for ((col = 0; col + 4 <= cols; col += 4)); do
+      color=$(( (col / 4 + row / 3 * 6 + shift) % 240 + 16 ))
+      case $(( (col / 4 + row) % 4 )) in
+        0) out+="$e[48;5;${color}m$e[4m abc$e[24m" ;;
+        1) out+="$e[48;5;${color}m$e[9m def$e[29m" ;;
+        *) out+="$e[48;5;${color}m    " ;;
+      esac
+    done
+    out+="$e[0m"$'\r\n'
+  done
+  printf '%s' "$out"
+}
+
+frames=()
+for ((i = 0; i < 16; i++)); do
+  frames[i]=$(frame $((i * 7)))
+done
+
+x=0
+while [ $x -lt $cnt ]; do
+  printf '%s' "${frames[x % 16]}"
+  x=$(($x + 1))
+done
+printf '\e[0m\e[2J\e[H'
@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+
+# Scroll lots of wide, colorful lines through the scrollback.
+# Run it as "time ./wide.sh" in a terminal of 300+ columns.
+
+cnt=$1
+[ -n "$cnt" ] || cnt=100000
+cols=$2
+[ -n "$cols" ] || cols=320
+
+line=
+i=0
+while [ $i -lt $cols ]; do
+	if [ $(($i % 16)) -eq 0 ]; then
+		line="$line"$'\e'"[3$((($i / 16) % 8))m"
+	fi
+	line="$line$(printf "\\x$(printf %x $((97 + $i % 26)))")"
+	i=$(($i + 1))
+done
+line="$line"$'\e'"[m"
+
+x=0
+while [ $x -lt $cnt ]; do
+	echo "$line"
+	x=$(($x + 1))
+done
@@ -24,13 +24,14 @@
 #include "ring.h"
 
 #include <string.h>
+#include <atomic>
 #include <new>
 
 /*
  * VteRing: A buffer ring
  */
 
-#define hyperlink_get(ring, idx) ((GString *) g_ptr_array_index((ring)->hyperlinks, (idx)))
+#define hyperlink_get(ring, idx) (&g_array_index((ring)->hyperlinks, VteRingHyperlink, (idx)))
 
 #ifdef VTE_DEBUG
 static void
@@ -52,18 +53,320 @@ _vte_ring_validate (VteRing * ring)
 #define _vte_ring_validate(ring) G_STMT_START {} G_STMT_END
 #endif
 
+static void _vte_ring_hyperlink_uncount_cells (VteRing *ring, VteRowData *row);
+static void _vte_ring_rewrap_drop_pending (VteRing *ring);
+static void _vte_ring_rewrap_abandon (VteRing *ring);
+
+
+/*
+ * Thawed row cache
+ */
+
+/* Called before a row's cells may change, or the row leaves the writable region.
+ * Either way the row isn't counted afterwards, so it needs counting before the
+ * next reclaim, even if it wasn't counted before. */
+static inline void
+_vte_ring_hyperlink_uncount_row (VteRing *ring, VteRowData *row)
+{
+	if (G_UNLIKELY (row->hyperlinks_counted))
+		_vte_ring_hyperlink_uncount_cells (ring, row);
+	else
+		ring->hyperlink_rows_dirty = TRUE;
+}
+
+/* Clear a row that's about to be reused, making sure it takes its cells from
+ * the ring's pool. */
+static inline void
+_vte_ring_clear_row (VteRing *ring, VteRowData *row)
+{
+	_vte_ring_hyperlink_uncount_row (ring, row);
+	_vte_row_data_clear (row);
+	if (G_UNLIKELY (row->cells == NULL))
+		_vte_row_data_set_pool (row, &ring->cells_pool);
+}
+
+/* Keep this many screenfuls of thawed rows, so that scrolling around in the
+ * history doesn't decode the same rows from the streams over and over again. */
+#define VTE_RING_CACHED_SCREENS 4
+#define VTE_RING_CACHED_ROWS_MIN 32  /* Has to be a power of two. */
+
+static void
+_vte_ring_cached_rows_invalidate (VteRing *ring)
+{
+	gulong i;
+
+	for (i = 0; i <= ring->cached_rows_mask; i++) {
+		_vte_compact_row_data_clear (&ring->cached_rows[i].row, &ring->cached_rows_attrs);
+		ring->cached_rows[i].row_num = (gulong) -1;
+	}
+	for (i = 0; i <= ring->expanded_rows_mask; i++)
+		ring->expanded_rows[i].row_num = (gulong) -1;
+}
+
+static inline void
+_vte_ring_cached_row_invalidate (VteRing *ring, gulong position)
+{
+	VteRingCachedRow *entry = &ring->cached_rows[position & ring->cached_rows_mask];
+	VteRingExpandedRow *expanded = &ring->expanded_rows[position & ring->expanded_rows_mask];
+
+	if (entry->row_num == position)
+		entry->row_num = (gulong) -1;
+	if (expanded->row_num == position)
+		expanded->row_num = (gulong) -1;
+}
+
+/* Rows only go to the compact cache once they leave the expanded rows, which
+ * hold the visible ones: a row that's thawed and drawn is not compacted and
+ * expanded again while it stays in view, and only pays for compacting when it
+ * scrolls out of view, for being expanded rather than thawed when it's back. */
+static inline void
+_vte_ring_expanded_row_evict (VteRing *ring, VteRingExpandedRow *expanded)
+{
+	VteRingCachedRow *entry;
+	gulong row_num = expanded->row_num;
+
+	expanded->row_num = (gulong) -1;
+	if (row_num < ring->start || row_num >= ring->writable)
+		return;
+
+	entry = &ring->cached_rows[row_num & ring->cached_rows_mask];
+	if (entry->row_num == row_num)
+		return;
+	_vte_row_data_compact (&expanded->row, &entry->row, &ring->cached_rows_attrs);
+	entry->row_num = row_num;
+}
+
+static void
+_vte_ring_cached_rows_fini (VteRing *ring)
+{
+	gulong i;
+
+	if (ring->cached_rows == NULL)
+		return;
+
+	for (i = 0; i <= ring->cached_rows_mask; i++)
+		_vte_compact_row_data_fini (&ring->cached_rows[i].row, &ring->cached_rows_attrs);
+	g_free (ring->cached_rows);
+	ring->cached_rows = NULL;
+}
+
+/* Resize the cache so that it holds at least @rows rows. */
+static void
+_vte_ring_cached_rows_resize (VteRing *ring, gulong rows)
+{
+	gulong i, mask = VTE_RING_CACHED_ROWS_MIN - 1;
+
+	rows = MAX (rows, 1);
+	while (mask < rows - 1 && mask < G_MAXULONG / 2)
+		mask = (mask << 1) + 1;
+
+	if (ring->cached_rows != NULL && mask == ring->cached_rows_mask)
+		return;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Resizing thawed row cache to %lu rows\n", mask + 1);
+
+	_vte_ring_cached_rows_fini (ring);
+
+	ring->cached_rows_mask = mask;
+	ring->cached_rows = g_new0 (VteRingCachedRow, mask + 1);
+	for (i = 0; i <= mask; i++) {
+		_vte_compact_row_data_set_pool (&ring->cached_rows[i].row, &ring->cells_pool);
+		ring->cached_rows[i].row_num = (gulong) -1;
+	}
+}
+
+#define VTE_RING_EXPANDED_ROWS_MIN 8  /* Has to be a power of two. */
+
+static void
+_vte_ring_expanded_rows_fini (VteRing *ring)
+{
+	gulong i;
+
+	if (ring->expanded_rows == NULL)
+		return;
+
+	for (i = 0; i <= ring->expanded_rows_mask; i++)
+		_vte_row_data_fini (&ring->expanded_rows[i].row);
+	g_free (ring->expanded_rows);
+	ring->expanded_rows = NULL;
+}
+
+/* Resize the expanded rows so that @rows consecutive rows handed out by
+ * _vte_ring_index() stay valid at the same time. Rows stay expanded until
+ * another row maps to the same entry, so drawing a screenful of history
+ * doesn't expand its rows again every time. */
+static void
+_vte_ring_expanded_rows_resize (VteRing *ring, gulong rows)
+{
+	gulong i, mask = VTE_RING_EXPANDED_ROWS_MIN - 1;
+
+	rows = MAX (rows, 1);
+	while (mask < rows - 1 && mask < G_MAXULONG / 2)
+		mask = (mask << 1) + 1;
+
+	if (ring->expanded_rows != NULL && mask == ring->expanded_rows_mask)
+		return;
+
+	_vte_ring_expanded_rows_fini (ring);
+
+	ring->expanded_rows_mask = mask;
+	ring->expanded_rows = g_new0 (VteRingExpandedRow, mask + 1);
+	for (i = 0; i <= mask; i++) {
+		_vte_row_data_set_pool (&ring->expanded_rows[i].row, &ring->cells_pool);
+		ring->expanded_rows[i].row_num = (gulong) -1;
+	}
+}
+
+
+/*
+ * Search index
+ *
+ * For every VTE_RING_SEARCH_BLOCK_SIZE bytes of the text stream there's a
+ * bloom filter of the trigrams ending in that block, ASCII case folded, so
+ * that a search for a regex with a literal in it can skip the rows whose
+ * text can't contain that literal without reading them.
+ */
+
+static inline guint32
+_vte_ring_search_trigram (guchar a, guchar b, guchar c)
+{
+	guint32 v = (guchar) g_ascii_tolower (a) |
+		    (guchar) g_ascii_tolower (b) << 8 |
+		    (guchar) g_ascii_tolower (c) << 16;
+
+	return (v * 2654435761u) >> (32 - VTE_RING_SEARCH_BLOOM_SHIFT);
+}
+
+static void
+_vte_ring_search_index_init (VteRingSearchIndex *index)
+{
+	index->blooms = g_ptr_array_new_with_free_func (g_free);
+	index->first_block = 0;
+	index->carry_len = 0;
+	index->carry_offset = 0;
+}
+
+static void
+_vte_ring_search_index_fini (VteRingSearchIndex *index)
+{
+	g_ptr_array_free (index->blooms, TRUE);
+}
+
+/* Returns the filter of @block, or NULL if there's none (no text was added to it). */
+static guint32 *
+_vte_ring_search_index_bloom (VteRingSearchIndex *index, gsize block, gboolean create)
+{
+	gpointer *bloom;
+
+	if (G_UNLIKELY (index->blooms->len == 0 && create))
+		index->first_block = block;
+	if (G_UNLIKELY (block < index->first_block))
+		return NULL;
+	if (block - index->first_block >= index->blooms->len) {
+		if (!create)
+			return NULL;
+		g_ptr_array_set_size (index->blooms, block - index->first_block + 1);
+	}
+
+	bloom = &g_ptr_array_index (index->blooms, block - index->first_block);
+	if (*bloom == NULL && create)
+		*bloom = g_malloc0 (VTE_RING_SEARCH_BLOOM_BITS / 8);
+	return (guint32 *) *bloom;
+}
+
+/* Adds the trigrams of @len bytes of @text, about to be appended to the text stream at @offset. */
+static void
+_vte_ring_search_index_add (VteRing *ring, gsize offset, const char *text, gsize len)
+{
+	VteRingSearchIndex *index = &ring->search_index;
+	guint32 *bloom = NULL;
+	gsize i, block, bloom_block = (gsize) -1;
+
+	if (G_UNLIKELY (index->carry_offset != offset)) {
+		/* The stream was truncated or reset meanwhile */
+		index->carry_len = 0;
+		if (offset >= _vte_stream_tail (ring->text_stream) + 2 &&
+		    _vte_stream_read (ring->text_stream, offset - 2, (char *) index->carry, 2)) {
+			index->carry_len = 2;
+			for (i = 0; i < 2; i++)
+				if (index->carry[i] == '\0')
+					index->carry[i] = ' ';
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		/* Empty cells are searched as spaces */
+		guchar c = G_LIKELY (text[i] != '\0') ? text[i] : ' ';
+		guint32 h;
+
+		if (G_UNLIKELY (index->carry_len < 2)) {
+			index->carry[index->carry_len++] = c;
+			continue;
+		}
+
+		h = _vte_ring_search_trigram (index->carry[0], index->carry[1], c);
+		block = (offset + i) / VTE_RING_SEARCH_BLOCK_SIZE;
+		if (G_UNLIKELY (block != bloom_block)) {
+			bloom = _vte_ring_search_index_bloom (index, block, TRUE);
+			bloom_block = block;
+		}
+		bloom[h >> 5] |= 1u << (h & 31);
+		index->carry[0] = index->carry[1];
+		index->carry[1] = c;
+	}
+	index->carry_offset = offset + len;
+}
+
+/* Drops the filters of the blocks that scrolled out of the text stream. */
+static void
+_vte_ring_search_index_trim (VteRing *ring)
+{
+	VteRingSearchIndex *index = &ring->search_index;
+	gsize tail_block = _vte_stream_tail (ring->text_stream) / VTE_RING_SEARCH_BLOCK_SIZE;
+	gsize n;
+
+	if (G_LIKELY (tail_block <= index->first_block))
+		return;
+
+	n = MIN (tail_block - index->first_block, index->blooms->len);
+	g_ptr_array_remove_range (index->blooms, 0, n);
+	index->first_block = tail_block;
+}
+
+/* Whether the text from the start of @block to the end of the next one might
+ * contain all the trigrams of @query. */
+static gboolean
+_vte_ring_search_index_may_match (VteRing *ring, gsize block, const VteRingSearchQuery *query)
+{
+	const guint32 *blooms[2];
+	guint i;
+
+	blooms[0] = _vte_ring_search_index_bloom (&ring->search_index, block, FALSE);
+	blooms[1] = _vte_ring_search_index_bloom (&ring->search_index, block + 1, FALSE);
+	if (blooms[0] == NULL && blooms[1] == NULL)
+		return FALSE;
+
+	for (i = 0; i < query->n_trigrams; i++) {
+		guint32 h = query->trigrams[i];
+		if (!((blooms[0] != NULL && (blooms[0][h >> 5] & (1u << (h & 31)))) ||
+		      (blooms[1] != NULL && (blooms[1][h >> 5] & (1u << (h & 31))))))
+			return FALSE;
+	}
+
+	return TRUE;
+}
 
 void
 _vte_ring_init (VteRing *ring, gulong max_rows, gboolean has_streams)
 {
-        GString *empty_str;
-
 	_vte_debug_print(VTE_DEBUG_RING, "New ring %p.\n", ring);
 
 	memset (ring, 0, sizeof (*ring));
 
 	ring->max = MAX (max_rows, 3);
 
+	_vte_cells_pool_init (&ring->cells_pool);
+
 	ring->mask = 31;
 	ring->array = (VteRowData *) g_malloc0 (sizeof (ring->array[0]) * (ring->mask + 1));
 
@@ -80,19 +383,17 @@ _vte_ring_init (VteRing *ring, gulong max_rows, gboolean has_streams)
 	ring->last_attr_text_start_offset = 0;
 	ring->last_attr = basic_cell.attr;
 	ring->utf8_buffer = g_string_sized_new (128);
+	_vte_ring_search_index_init (&ring->search_index);
 
-	_vte_row_data_init (&ring->cached_row);
-	ring->cached_row_num = (gulong) -1;
+	_vte_cell_attr_table_init (&ring->cached_rows_attrs);
+	_vte_ring_cached_rows_resize (ring, VTE_RING_CACHED_ROWS_MIN);
+	_vte_ring_expanded_rows_resize (ring, VTE_RING_EXPANDED_ROWS_MIN);
 
         ring->visible_rows = 0;
 
-        ring->hyperlinks = g_ptr_array_new();
-        empty_str = g_string_new_len("", 0);
-        g_ptr_array_add(ring->hyperlinks, empty_str);
-        ring->hyperlink_highest_used_idx = 0;
+        _vte_ring_hyperlink_pool_init (ring);
         ring->hyperlink_current_idx = 0;
         ring->hyperlink_hover_idx = 0;
-        ring->hyperlink_maybe_gc_counter = 0;
 
         ring->image_map = new (std::nothrow) std::map<gint, vte::image::image_object *>();
         ring->image_onscreen_resource_counter = 0;
@@ -118,6 +419,7 @@ _vte_ring_fini (VteRing *ring)
 	image_map->clear();
 	delete ring->image_map;
 
+	_vte_ring_rewrap_drop_pending (ring);
 	if (ring->has_streams) {
 		g_object_unref (ring->attr_stream);
 		g_object_unref (ring->text_stream);
@@ -126,12 +428,15 @@ _vte_ring_fini (VteRing *ring)
 	}
 
 	g_string_free (ring->utf8_buffer, TRUE);
+	_vte_ring_search_index_fini (&ring->search_index);
+
+        _vte_ring_hyperlink_pool_fini (ring);
 
-        for (i = 0; i < ring->hyperlinks->len; i++)
-                g_string_free (hyperlink_get(ring, i), TRUE);
-        g_ptr_array_free (ring->hyperlinks, TRUE);
+	_vte_ring_cached_rows_fini (ring);
+	_vte_cell_attr_table_fini (&ring->cached_rows_attrs);
+	_vte_ring_expanded_rows_fini (ring);
 
-	_vte_row_data_fini (&ring->cached_row);
+	_vte_cells_pool_fini (&ring->cells_pool);
 }
 
 typedef struct _VteRowRecord {
@@ -152,88 +457,306 @@ typedef struct _VteCellTextOffset {
 static inline VteRowData *
 _vte_ring_writable_index (VteRing *ring, gulong position)
 {
+	gulong i = position - ring->rotated_start;
+
+	if (G_UNLIKELY (i < ring->rotated_len)) {
+		i += ring->rotated_offset;
+		if (i >= ring->rotated_len)
+			i -= ring->rotated_len;
+		position = ring->rotated_start + i;
+	}
 	return &ring->array[position & ring->mask];
 }
 
+/*
+ * Rotate the rows in the [start, end) part of the writable region by @count
+ * rows: positive moves the contents towards @end, negative towards @start.
+ * The rows that wrap around keep their cell storage; it's up to the caller
+ * to clear them.
+ *
+ * Every row is moved exactly once, no matter how many rows it's rotated by.
+ * This moves the rows as stored, so nothing may be rotated in place then.
+ */
+static void
+_vte_ring_rotate_array (VteRing *ring, gulong start, gulong end, glong count)
+{
+	VteRowData stack_tmp[32], *tmp;
+	gulong len = end - start, mask = ring->mask, k, i;
+	VteRowData *array = ring->array;
+
+	if (G_UNLIKELY (len == 0))
+		return;
+
+	count %= (glong) len;
+	if (count < 0)
+		count += len;
+	if (count == 0)
+		return;
+
+	/* Buffer the smaller one of the two parts that swap places. */
+	k = MIN ((gulong) count, len - count);
+	tmp = k <= G_N_ELEMENTS (stack_tmp) ? stack_tmp : g_new (VteRowData, k);
+
+	if ((gulong) count == k) {
+		for (i = 0; i < k; i++)
+			tmp[i] = array[(end - k + i) & mask];
+		for (i = end - 1; i >= start + k; i--)
+			array[i & mask] = array[(i - k) & mask];
+		for (i = 0; i < k; i++)
+			array[(start + i) & mask] = tmp[i];
+	} else {
+		for (i = 0; i < k; i++)
+			tmp[i] = array[(start + i) & mask];
+		for (i = start; i < end - k; i++)
+			array[i & mask] = array[(i + k) & mask];
+		for (i = 0; i < k; i++)
+			array[(end - k + i) & mask] = tmp[i];
+	}
+
+	if (tmp != stack_tmp)
+		g_free (tmp);
+}
+
+/* Move the rows rotated in place to where they belong. */
+static void
+_vte_ring_unrotate (VteRing *ring)
+{
+	gulong start = ring->rotated_start, len = ring->rotated_len, offset = ring->rotated_offset;
+
+	if (G_LIKELY (len == 0))
+		return;
+
+	ring->rotated_start = ring->rotated_len = ring->rotated_offset = 0;
+	_vte_ring_rotate_array (ring, start, start + len, -(glong) offset);
+}
+
+/* The rows rotated in place need to stay in the writable region. */
+static inline void
+_vte_ring_check_rotated (VteRing *ring)
+{
+	if (G_UNLIKELY (ring->rotated_len != 0 && ring->rotated_start < ring->writable))
+		_vte_ring_unrotate (ring);
+}
 
-#define SET_BIT(buf, n) buf[(n) / 8] |= (1 << ((n) % 8))
-#define GET_BIT(buf, n) ((buf[(n) / 8] >> ((n) % 8)) & 1)
 
 /*
- * Do a round of garbage collection. Hyperlinks that no longer occur in the ring are wiped out.
+ * The hyperlink pool
+ *
+ * The id;uri strings are interned in arena chunks, and looked up by a hash
+ * table. Every idx counts its references: the cells of the writable rows,
+ * and the current, hover and last_attr idxs. A row's cells are counted
+ * lazily: a row is uncounted when it's handed out for writing, cleared or
+ * frozen, and counted again before idxs are reclaimed. An idx whose count
+ * drops to zero is queued, and reclaimed in O(1) unless it got referenced
+ * again meanwhile.
  */
+
+#define VTE_RING_HYPERLINK_CHUNK_SIZE 16384  /* has to fit VTE_HYPERLINK_TOTAL_LENGTH_MAX + 1 */
+
+struct _VteRingHyperlinkChunk {
+	guint live;   /* strings in use */
+	gsize used;
+	char data[VTE_RING_HYPERLINK_CHUNK_SIZE];
+};
+
 static void
-_vte_ring_hyperlink_gc (VteRing *ring)
+_vte_ring_hyperlink_pool_init (VteRing *ring)
 {
-        gulong i, j;
-        hyperlink_idx_t idx;
-        VteRowData *row;
-        char *used;
+	VteRingHyperlink empty;
+
+	ring->hyperlinks = g_array_new (FALSE, FALSE, sizeof (VteRingHyperlink));
+	memset (&empty, 0, sizeof (empty));
+	empty.str = "";
+	g_array_append_val (ring->hyperlinks, empty);
+	ring->hyperlink_ids = g_hash_table_new (g_str_hash, g_str_equal);
+	ring->hyperlink_free_idxs = g_array_new (FALSE, FALSE, sizeof (hyperlink_idx_t));
+	ring->hyperlink_unreferenced = g_array_new (FALSE, FALSE, sizeof (hyperlink_idx_t));
+	ring->hyperlink_chunks = g_ptr_array_new_with_free_func (g_free);
+	ring->hyperlink_rows_dirty = FALSE;
+}
+
+static void
+_vte_ring_hyperlink_pool_fini (VteRing *ring)
+{
+	g_ptr_array_free (ring->hyperlink_chunks, TRUE);
+	g_array_free (ring->hyperlink_unreferenced, TRUE);
+	g_array_free (ring->hyperlink_free_idxs, TRUE);
+	g_hash_table_destroy (ring->hyperlink_ids);
+	g_array_free (ring->hyperlinks, TRUE);
+}
 
-        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                          "hyperlink: GC starting (highest used idx is %d)\n",
-                          ring->hyperlink_highest_used_idx);
+static inline void
+_vte_ring_hyperlink_ref (VteRing *ring, hyperlink_idx_t idx, guint n)
+{
+	if (idx == 0 || idx >= ring->hyperlinks->len)
+		return;
+	hyperlink_get(ring, idx)->refs += n;
+}
 
-        ring->hyperlink_maybe_gc_counter = 0;
+static inline void
+_vte_ring_hyperlink_unref (VteRing *ring, hyperlink_idx_t idx, guint n)
+{
+	VteRingHyperlink *link;
 
-        if (ring->hyperlink_highest_used_idx == 0) {
-                _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                                  "hyperlink: GC done (no links at all, nothing to do)\n");
-                return;
-        }
+	if (idx == 0 || idx >= ring->hyperlinks->len)
+		return;
+	link = hyperlink_get(ring, idx);
+	link->refs -= MIN (link->refs, n);
+	if (link->refs == 0 && !link->unreferenced) {
+		link->unreferenced = 1;
+		g_array_append_val (ring->hyperlink_unreferenced, idx);
+	}
+}
 
-        /* One bit for each idx to see if it's used. */
-        used = (char *) g_malloc0 (ring->hyperlink_highest_used_idx / 8 + 1);
+/* Makes *@holder refer to @idx instead of what it referred to. */
+static inline void
+_vte_ring_hyperlink_hold (VteRing *ring, hyperlink_idx_t *holder, hyperlink_idx_t idx)
+{
+	_vte_ring_hyperlink_ref (ring, idx, 1);
+	_vte_ring_hyperlink_unref (ring, *holder, 1);
+	*holder = idx;
+}
 
-        /* A few special values not to be garbage collected. */
-        SET_BIT(used, ring->hyperlink_current_idx);
-        SET_BIT(used, ring->hyperlink_hover_idx);
-        SET_BIT(used, ring->last_attr.hyperlink_idx);
+static void
+_vte_ring_set_last_attr (VteRing *ring, const VteCellAttr *attr)
+{
+	_vte_ring_hyperlink_ref (ring, attr->hyperlink_idx, 1);
+	_vte_ring_hyperlink_unref (ring, ring->last_attr.hyperlink_idx, 1);
+	ring->last_attr = *attr;
+}
 
-        for (i = ring->writable; i < ring->end; i++) {
-                row = _vte_ring_writable_index (ring, i);
-                for (j = 0; j < row->len; j++) {
-                        idx = row->cells[j].attr.hyperlink_idx;
-                        SET_BIT(used, idx);
-                }
-        }
+/* Adds (or removes) the references of @row's cells, run by run. */
+static void
+_vte_ring_hyperlink_count_cells (VteRing *ring, const VteRowData *row, gboolean add)
+{
+	gulong i, run_start;
+
+	for (i = 0; i < row->len; i = run_start) {
+		hyperlink_idx_t idx = row->cells[i].attr.hyperlink_idx;
+
+		run_start = i + 1;
+		if (G_LIKELY (idx == 0))
+			continue;
+		while (run_start < row->len && row->cells[run_start].attr.hyperlink_idx == idx)
+			run_start++;
+		if (add)
+			_vte_ring_hyperlink_ref (ring, idx, run_start - i);
+		else
+			_vte_ring_hyperlink_unref (ring, idx, run_start - i);
+	}
+}
 
-        for (idx = 1; idx <= ring->hyperlink_highest_used_idx; idx++) {
-                if (!GET_BIT(used, idx) && hyperlink_get(ring, idx)->len != 0) {
-                        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                                          "hyperlink: GC purging link %d to id;uri=\"%s\"\n",
-                                          idx, hyperlink_get(ring, idx)->str);
-                        /* Wipe out the ID and URI itself so it doesn't linger on in the memory for a long time */
-                        memset(hyperlink_get(ring, idx)->str, 0, hyperlink_get(ring, idx)->len);
-                        g_string_truncate (hyperlink_get(ring, idx), 0);
-                }
-        }
+static void
+_vte_ring_hyperlink_uncount_cells (VteRing *ring, VteRowData *row)
+{
+	/* Without any hyperlink ever, there's nothing the cells could refer to */
+	if (G_UNLIKELY (ring->hyperlinks->len > 1))
+		_vte_ring_hyperlink_count_cells (ring, row, FALSE);
+	row->hyperlinks_counted = 0;
+	ring->hyperlink_rows_dirty = TRUE;
+}
 
-        while (ring->hyperlink_highest_used_idx >= 1 && hyperlink_get(ring, ring->hyperlink_highest_used_idx)->len == 0) {
-               ring->hyperlink_highest_used_idx--;
-        }
+static void
+_vte_ring_hyperlink_count_rows (VteRing *ring)
+{
+	gulong i;
+
+	if (!ring->hyperlink_rows_dirty)
+		return;
+
+	for (i = ring->writable; i < ring->end; i++) {
+		VteRowData *row = _vte_ring_writable_index (ring, i);
+		if (row->hyperlinks_counted)
+			continue;
+		_vte_ring_hyperlink_count_cells (ring, row, TRUE);
+		row->hyperlinks_counted = 1;
+	}
+	ring->hyperlink_rows_dirty = FALSE;
+}
 
-        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                          "hyperlink: GC done (highest used idx is now %d)\n",
-                          ring->hyperlink_highest_used_idx);
+static void
+_vte_ring_hyperlink_free (VteRing *ring, hyperlink_idx_t idx)
+{
+	VteRingHyperlink *link = hyperlink_get(ring, idx);
+	VteRingHyperlinkChunk *chunk = link->chunk;
+
+	_vte_debug_print (VTE_DEBUG_HYPERLINK,
+			  "hyperlink: purging link %d to id;uri=\"%s\"\n",
+			  idx, link->str);
+
+	g_hash_table_remove (ring->hyperlink_ids, link->str);
+	/* Wipe out the ID and URI itself so it doesn't linger on in the memory for a long time */
+	memset ((char *) link->str, 0, link->len);
+	if (--chunk->live == 0) {
+		if (chunk == ring->hyperlink_chunk)
+			chunk->used = 0;
+		else
+			g_ptr_array_remove_fast (ring->hyperlink_chunks, chunk);
+	}
 
-        g_free (used);
+	link->str = "";
+	link->len = 0;
+	link->chunk = NULL;
+	g_array_append_val (ring->hyperlink_free_idxs, idx);
 }
 
 /*
- * Cumulate the given value, and do a GC when 65536 is reached.
+ * Reclaims the idxs no longer referenced, after counting the rows that
+ * changed since the last time. Cheap if there's nothing to reclaim.
  */
 void
-_vte_ring_hyperlink_maybe_gc (VteRing *ring, gulong increment)
+_vte_ring_hyperlink_reclaim (VteRing *ring)
+{
+	guint i;
+
+	if (ring->hyperlink_unreferenced->len == 0)
+		return;
+
+	_vte_ring_hyperlink_count_rows (ring);
+
+	for (i = 0; i < ring->hyperlink_unreferenced->len; i++) {
+		hyperlink_idx_t idx = g_array_index (ring->hyperlink_unreferenced, hyperlink_idx_t, i);
+		VteRingHyperlink *link = hyperlink_get(ring, idx);
+
+		link->unreferenced = 0;
+		if (link->refs == 0 && link->chunk != NULL)
+			_vte_ring_hyperlink_free (ring, idx);
+	}
+	g_array_set_size (ring->hyperlink_unreferenced, 0);
+
+	_vte_debug_print (VTE_DEBUG_HYPERLINK,
+			  "hyperlink: reclaimed, %u idxs in use\n",
+			  ring->hyperlinks->len - 1 - ring->hyperlink_free_idxs->len);
+}
+
+/* Copies @hyperlink of @len bytes into the arena. */
+static const char *
+_vte_ring_hyperlink_intern_str (VteRing *ring, const char *hyperlink, gsize len, VteRingHyperlinkChunk **chunk_out)
 {
-        ring->hyperlink_maybe_gc_counter += increment;
+	VteRingHyperlinkChunk *chunk = ring->hyperlink_chunk;
+	char *str;
+
+	if (chunk == NULL || chunk->used + len + 1 > sizeof (chunk->data)) {
+		if (chunk != NULL && chunk->live == 0) {
+			chunk->used = 0;
+		} else {
+			chunk = g_new (VteRingHyperlinkChunk, 1);
+			chunk->live = 0;
+			chunk->used = 0;
+			g_ptr_array_add (ring->hyperlink_chunks, chunk);
+			/* The previous chunk is freed along with its last string */
+			ring->hyperlink_chunk = chunk;
+		}
+	}
 
-        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                          "hyperlink: maybe GC, counter at %ld\n",
-                          ring->hyperlink_maybe_gc_counter);
+	str = chunk->data + chunk->used;
+	memcpy (str, hyperlink, len);
+	str[len] = '\0';
+	chunk->used += len + 1;
+	chunk->live++;
 
-        if (ring->hyperlink_maybe_gc_counter >= 65536)
-                _vte_ring_hyperlink_gc (ring);
+	*chunk_out = chunk;
+	return str;
 }
 
 /*
@@ -243,68 +766,60 @@ _vte_ring_hyperlink_maybe_gc (VteRing *ring, gulong increment)
  * Returns the idx (either already existing or newly allocated) from 1 up to
  * VTE_HYPERLINK_COUNT_MAX inclusive otherwise.
  *
- * FIXME do something more effective than a linear search
+ * A new idx isn't referenced by anything yet; unless it's stored somewhere
+ * that counts, it's reclaimed along with the others.
  */
 static hyperlink_idx_t
 _vte_ring_get_hyperlink_idx_no_update_current (VteRing *ring, const char *hyperlink)
 {
-        hyperlink_idx_t idx;
-        gsize len;
-        GString *str;
-
-        if (!hyperlink || !hyperlink[0])
-                return 0;
-
-        len = strlen(hyperlink);
-
-        /* Linear search for this particular URI */
-        for (idx = 1; idx <= ring->hyperlink_highest_used_idx; idx++) {
-                if (strcmp(hyperlink_get(ring, idx)->str, hyperlink) == 0) {
-                        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                                          "get_hyperlink_idx: already existing idx %d for id;uri=\"%s\"\n",
-                                          idx, hyperlink);
-                        return idx;
-                }
-        }
-
-        /* FIXME it's the second time we're GCing if coming from _vte_ring_get_hyperlink_idx */
-        _vte_ring_hyperlink_gc(ring);
-
-        /* Another linear search for an empty slot where a GString is already allocated */
-        for (idx = 1; idx < ring->hyperlinks->len; idx++) {
-                if (hyperlink_get(ring, idx)->len == 0) {
-                        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                                          "get_hyperlink_idx: reassigning old idx %d for id;uri=\"%s\"\n",
-                                          idx, hyperlink);
-                        /* Grow size if required, however, never shrink to avoid long-term memory fragmentation. */
-                        g_string_append_len (hyperlink_get(ring, idx), hyperlink, len);
-                        ring->hyperlink_highest_used_idx = MAX (ring->hyperlink_highest_used_idx, idx);
-                        return idx;
-                }
-        }
-
-        /* All allocated slots are in use. Gotta allocate a new one */
-        g_assert_cmpuint(ring->hyperlink_highest_used_idx + 1, ==, ring->hyperlinks->len);
-
-        /* VTE_HYPERLINK_COUNT_MAX should be big enough for this not to happen under
-           normal circumstances. Anyway, it's cheap to protect against extreme ones. */
-        if (ring->hyperlink_highest_used_idx == VTE_HYPERLINK_COUNT_MAX) {
-                _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                                  "get_hyperlink_idx: idx 0 (ran out of available idxs) for id;uri=\"%s\"\n",
-                                  hyperlink);
-                return 0;
-        }
+	hyperlink_idx_t idx;
+	gpointer value;
+	VteRingHyperlink *link;
+	gsize len;
+
+	if (!hyperlink || !hyperlink[0])
+		return 0;
+
+	if (g_hash_table_lookup_extended (ring->hyperlink_ids, hyperlink, NULL, &value)) {
+		idx = GPOINTER_TO_UINT (value);
+		_vte_debug_print (VTE_DEBUG_HYPERLINK,
+				  "get_hyperlink_idx: already existing idx %d for id;uri=\"%s\"\n",
+				  idx, hyperlink);
+		return idx;
+	}
 
-        idx = ++ring->hyperlink_highest_used_idx;
-        _vte_debug_print (VTE_DEBUG_HYPERLINK,
-                          "get_hyperlink_idx: brand new idx %d for id;uri=\"%s\"\n",
-                          idx, hyperlink);
-        str = g_string_new_len (hyperlink, len);
-        g_ptr_array_add(ring->hyperlinks, str);
+	if (ring->hyperlink_free_idxs->len > 0) {
+		idx = g_array_index (ring->hyperlink_free_idxs, hyperlink_idx_t, ring->hyperlink_free_idxs->len - 1);
+		g_array_set_size (ring->hyperlink_free_idxs, ring->hyperlink_free_idxs->len - 1);
+		_vte_debug_print (VTE_DEBUG_HYPERLINK,
+				  "get_hyperlink_idx: reassigning old idx %d for id;uri=\"%s\"\n",
+				  idx, hyperlink);
+	} else if (ring->hyperlinks->len <= VTE_HYPERLINK_COUNT_MAX) {
+		idx = ring->hyperlinks->len;
+		g_array_set_size (ring->hyperlinks, idx + 1);
+		memset (hyperlink_get(ring, idx), 0, sizeof (VteRingHyperlink));
+		_vte_debug_print (VTE_DEBUG_HYPERLINK,
+				  "get_hyperlink_idx: brand new idx %d for id;uri=\"%s\"\n",
+				  idx, hyperlink);
+	} else {
+		/* VTE_HYPERLINK_COUNT_MAX should be big enough for this not to happen under
+		   normal circumstances. Anyway, it's cheap to protect against extreme ones. */
+		_vte_debug_print (VTE_DEBUG_HYPERLINK,
+				  "get_hyperlink_idx: idx 0 (ran out of available idxs) for id;uri=\"%s\"\n",
+				  hyperlink);
+		return 0;
+	}
 
-        g_assert_cmpuint(ring->hyperlink_highest_used_idx + 1, ==, ring->hyperlinks->len);
+	len = strlen (hyperlink);
+	link = hyperlink_get(ring, idx);
+	link->str = _vte_ring_hyperlink_intern_str (ring, hyperlink, len, &link->chunk);
+	link->len = len;
+	link->refs = 0;
+	link->unreferenced = 1;
+	g_array_append_val (ring->hyperlink_unreferenced, idx);
+	g_hash_table_insert (ring->hyperlink_ids, (gpointer) link->str, GUINT_TO_POINTER (idx));
 
-        return idx;
+	return idx;
 }
 
 /*
@@ -314,41 +829,78 @@ _vte_ring_get_hyperlink_idx_no_update_current (VteRing *ring, const char *hyperl
  * Returns the idx (either already existing or newly allocated) from 1 up to
  * VTE_HYPERLINK_COUNT_MAX inclusive otherwise.
  *
- * The current idx is also updated, in order not to be garbage collected.
+ * The current idx is also updated, in order not to be reclaimed.
  */
 guint
 _vte_ring_get_hyperlink_idx (VteRing *ring, const char *hyperlink)
 {
-        /* Release current idx and do a round of GC to possibly purge its hyperlink,
-         * even if new hyperlink is NULL or empty. */
-        ring->hyperlink_current_idx = 0;
-        _vte_ring_hyperlink_gc(ring);
-
-        ring->hyperlink_current_idx = _vte_ring_get_hyperlink_idx_no_update_current(ring, hyperlink);
-        return ring->hyperlink_current_idx;
+	/* With the pool full, it's worth counting the rows right away. (Not so
+	 * while thawing a row, which would get counted half done.) */
+	if (G_UNLIKELY (ring->hyperlink_free_idxs->len == 0 && ring->hyperlinks->len > VTE_HYPERLINK_COUNT_MAX))
+		_vte_ring_hyperlink_reclaim (ring);
+
+	_vte_ring_hyperlink_hold (ring, &ring->hyperlink_current_idx,
+				  _vte_ring_get_hyperlink_idx_no_update_current (ring, hyperlink));
+	return ring->hyperlink_current_idx;
 }
 
 static gboolean
 _vte_ring_read_row_record (VteRing *ring, VteRowRecord *record, gulong position)
 {
+	if (G_UNLIKELY (position < ring->rewrap_boundary))
+		return _vte_stream_read (ring->rewrap_old_row_stream, (position - ring->rewrap_old_delta) * sizeof (*record),
+					 (char *) record, sizeof (*record));
 	return _vte_stream_read (ring->row_stream, position * sizeof (*record), (char *) record, sizeof (*record));
 }
 
+static inline gboolean
+_vte_ring_has_row_record (VteRing *ring, gulong position)
+{
+	return position < ring->rewrap_boundary ||
+		position * sizeof (VteRowRecord) < _vte_stream_head (ring->row_stream);
+}
+
 static void
 _vte_ring_append_row_record (VteRing *ring, const VteRowRecord *record, gulong position)
 {
 	_vte_stream_append (ring->row_stream, (const char *) record, sizeof (*record));
 }
 
+/*
+ * Appends the change from ring->last_attr to @attr, effective at @offset
+ * bytes into the row's text, to the attr stream.
+ */
+static void
+_vte_ring_freeze_attr_change (VteRing *ring, VteRowRecord *record, gsize offset, const VteCellAttr *attr)
+{
+	VteCellAttrChange attr_change;
+        VteRingHyperlink *hyperlink;
+        guint16 hyperlink_length;
+
+	ring->last_attr_text_start_offset = record->text_start_offset + offset;
+	memset(&attr_change, 0, sizeof (attr_change));
+	attr_change.text_end_offset = ring->last_attr_text_start_offset;
+        _attrcpy(&attr_change.attr, &ring->last_attr);
+        hyperlink = hyperlink_get(ring, ring->last_attr.hyperlink_idx);
+        attr_change.attr.hyperlink_length = hyperlink->len;
+	_vte_stream_append (ring->attr_stream, (const char *) &attr_change, sizeof (attr_change));
+        if (G_UNLIKELY (hyperlink->len != 0))
+                _vte_stream_append (ring->attr_stream, hyperlink->str, hyperlink->len);
+        hyperlink_length = attr_change.attr.hyperlink_length;
+        _vte_stream_append (ring->attr_stream, (const char *) &hyperlink_length, 2);
+	if (!offset)
+		/* This row doesn't use last_attr, adjust */
+                record->attr_start_offset += sizeof (attr_change) + hyperlink_length + 2;
+	_vte_ring_set_last_attr (ring, attr);
+}
+
 static void
 _vte_ring_freeze_row (VteRing *ring, gulong position, const VteRowData *row)
 {
 	VteRowRecord record;
-	VteCell *cell;
+	const VteCell *cells = row->cells;
 	GString *buffer = ring->utf8_buffer;
-        GString *hyperlink;
-	int i;
-        gboolean froze_hyperlink = FALSE;
+	int i, run_end;
 
 	_vte_debug_print (VTE_DEBUG_RING, "Freezing row %lu.\n", position);
 
@@ -357,84 +909,66 @@ _vte_ring_freeze_row (VteRing *ring, gulong position, const VteRowData *row)
 	memset(&record, 0, sizeof (record));
 	record.text_start_offset = _vte_stream_head (ring->text_stream);
 	record.attr_start_offset = _vte_stream_head (ring->attr_stream);
-	record.is_ascii = 1;
-
+	record.is_ascii = _vte_cells_are_printable_ascii (cells, row->len);
+
+	/* Attr storage:
+	 *
+	 * 1. We don't store attrs for fragments.  They can be
+	 * reconstructed using the columns of their start cell.
+	 *
+	 * 2. We store one attr per vteunistr character starting
+	 * from the second character, with columns=0.
+	 *
+	 * That's enough to reconstruct the attrs, and to store
+	 * the text in real UTF-8.
+	 */
 	g_string_set_size (buffer, 0);
-	for (i = 0, cell = row->cells; i < row->len; i++, cell++) {
-		VteCellAttr attr;
-		int num_chars;
-
-		/* Attr storage:
-		 *
-		 * 1. We don't store attrs for fragments.  They can be
-		 * reconstructed using the columns of their start cell.
-		 *
-		 * 2. We store one attr per vteunistr character starting
-		 * from the second character, with columns=0.
-		 *
-		 * That's enough to reconstruct the attrs, and to store
-		 * the text in real UTF-8.
-		 */
-		attr = cell->attr;
-		if (G_LIKELY (!attr.fragment)) {
-			VteCellAttrChange attr_change;
-                        guint16 hyperlink_length;
+	if (record.is_ascii) {
+		/* No combining characters: go run by run of equal attrs,
+		 * narrowing each run's text to UTF-8 in one go. */
+		for (i = 0; i < row->len; i = run_end) {
+			gsize len = buffer->len;
 
-			if (memcmp(&ring->last_attr, &attr, sizeof (VteCellAttr)) != 0) {
-				ring->last_attr_text_start_offset = record.text_start_offset + buffer->len;
-				memset(&attr_change, 0, sizeof (attr_change));
-				attr_change.text_end_offset = ring->last_attr_text_start_offset;
-                                _attrcpy(&attr_change.attr, &ring->last_attr);
-                                hyperlink = hyperlink_get(ring, ring->last_attr.hyperlink_idx);
-                                attr_change.attr.hyperlink_length = hyperlink->len;
-				_vte_stream_append (ring->attr_stream, (const char *) &attr_change, sizeof (attr_change));
-                                if (G_UNLIKELY (hyperlink->len != 0)) {
-                                        _vte_stream_append (ring->attr_stream, hyperlink->str, hyperlink->len);
-                                        froze_hyperlink = TRUE;
-                                }
-                                hyperlink_length = attr_change.attr.hyperlink_length;
-                                _vte_stream_append (ring->attr_stream, (const char *) &hyperlink_length, 2);
-				if (!buffer->len)
-					/* This row doesn't use last_attr, adjust */
-                                        record.attr_start_offset += sizeof (attr_change) + hyperlink_length + 2;
-				ring->last_attr = attr;
-			}
+			run_end = _vte_cells_attr_run_end (cells, i, row->len);
+			if (G_UNLIKELY (cells[i].attr.fragment))
+				continue;
 
-			num_chars = _vte_unistr_strlen (cell->c);
-			if (num_chars > 1) {
-                                /* Combining chars */
-				attr.columns = 0;
-				ring->last_attr_text_start_offset = record.text_start_offset + buffer->len
-								  + g_unichar_to_utf8 (_vte_unistr_get_base (cell->c), NULL);
-				memset(&attr_change, 0, sizeof (attr_change));
-				attr_change.text_end_offset = ring->last_attr_text_start_offset;
-                                _attrcpy(&attr_change.attr, &ring->last_attr);
-                                hyperlink = hyperlink_get(ring, ring->last_attr.hyperlink_idx);
-                                attr_change.attr.hyperlink_length = hyperlink->len;
-				_vte_stream_append (ring->attr_stream, (const char *) &attr_change, sizeof (attr_change));
-                                if (G_UNLIKELY (hyperlink->len != 0)) {
-                                        _vte_stream_append (ring->attr_stream, hyperlink->str, hyperlink->len);
-                                        froze_hyperlink = TRUE;
-                                }
-                                hyperlink_length = attr_change.attr.hyperlink_length;
-                                _vte_stream_append (ring->attr_stream, (const char *) &hyperlink_length, 2);
-				ring->last_attr = attr;
-			}
+			if (memcmp(&ring->last_attr, &cells[i].attr, sizeof (VteCellAttr)) != 0)
+				_vte_ring_freeze_attr_change (ring, &record, len, &cells[i].attr);
 
-			if (cell->c < 32 || cell->c > 126) record.is_ascii = 0;
-			_vte_unistr_append_to_string (cell->c, buffer);
+			g_string_set_size (buffer, len + run_end - i);
+			_vte_cells_to_ascii (&cells[i], run_end - i, buffer->str + len);
 		}
-	}
+	} else {
+		for (i = 0; i < row->len; i++) {
+			VteCellAttr attr;
+			vteunistr c = cells[i].c;
+
+			attr = cells[i].attr;
+			if (G_UNLIKELY (attr.fragment))
+				continue;
+
+			if (memcmp(&ring->last_attr, &attr, sizeof (VteCellAttr)) != 0)
+				_vte_ring_freeze_attr_change (ring, &record, buffer->len, &attr);
+
+			if (_vte_unistr_strlen (c) > 1) {
+                                /* Combining chars */
+				attr.columns = 0;
+				_vte_ring_freeze_attr_change (ring, &record,
+							      buffer->len + g_unichar_to_utf8 (_vte_unistr_get_base (c), NULL),
+							      &attr);
+			}
+
+			_vte_unistr_append_to_string (c, buffer);
+		}
+	}
 	if (!row->attr.soft_wrapped)
 		g_string_append_c (buffer, '\n');
 	record.soft_wrapped = row->attr.soft_wrapped;
 
+	_vte_ring_search_index_add (ring, _vte_stream_head (ring->text_stream), buffer->str, buffer->len);
 	_vte_stream_append (ring->text_stream, buffer->str, buffer->len);
 	_vte_ring_append_row_record (ring, &record, position);
-
-        /* After freezing some hyperlinks, do a hyperlink GC. The constant is totally arbitrary, feel free to fine tune. */
-        if (froze_hyperlink)
-                _vte_ring_hyperlink_maybe_gc(ring, 1024);
 }
 
 /* If do_truncate (data is placed back from the stream to the ring), real new hyperlink idxs are looked up or allocated.
@@ -465,13 +999,13 @@ _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do
 
         g_assert(ring->has_streams);
 
-	_vte_row_data_clear (row);
+	_vte_ring_clear_row (ring, row);
 
 	attr_change.text_end_offset = 0;
 
 	if (!_vte_ring_read_row_record (ring, &records[0], position))
 		return;
-	if ((position + 1) * sizeof (records[0]) < _vte_stream_head (ring->row_stream)) {
+	if (_vte_ring_has_row_record (ring, position + 1)) {
 		if (!_vte_ring_read_row_record (ring, &records[1], position + 1))
 			return;
 	} else
@@ -586,12 +1120,14 @@ _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do
 			/* Reconstruct last_attr from the first record of attr_stream that we cut off,
 			   last_attr_text_start_offset from the last record that we keep. */
 			if (_vte_stream_read (ring->attr_stream, attr_stream_truncate_at, (char *) &attr_change, sizeof (attr_change))) {
-                                _attrcpy(&ring->last_attr, &attr_change.attr);
-                                ring->last_attr.hyperlink_idx = 0;
+                                VteCellAttr last_attr;
+                                _attrcpy(&last_attr, &attr_change.attr);
+                                last_attr.hyperlink_idx = 0;
                                 if (attr_change.attr.hyperlink_length && _vte_stream_read (ring->attr_stream, attr_stream_truncate_at + sizeof (attr_change), (char *) &hyperlink_readbuf, attr_change.attr.hyperlink_length)) {
                                         hyperlink_readbuf[attr_change.attr.hyperlink_length] = '\0';
-                                        ring->last_attr.hyperlink_idx = _vte_ring_get_hyperlink_idx (ring, hyperlink_readbuf);
+                                        last_attr.hyperlink_idx = _vte_ring_get_hyperlink_idx_no_update_current (ring, hyperlink_readbuf);
                                 }
+                                _vte_ring_set_last_attr (ring, &last_attr);
                                 if (_vte_stream_read (ring->attr_stream, attr_stream_truncate_at - 2, (char *) &hyperlink_length, 2)) {
                                         g_assert_cmpuint (hyperlink_length, <=, VTE_HYPERLINK_TOTAL_LENGTH_MAX);
                                         if (_vte_stream_read (ring->attr_stream, attr_stream_truncate_at - 2 - hyperlink_length - sizeof (attr_change), (char *) &attr_change, sizeof (attr_change))) {
@@ -604,7 +1140,7 @@ _vte_ring_thaw_row (VteRing *ring, gulong position, VteRowData *row, gboolean do
 				}
 			} else {
 				ring->last_attr_text_start_offset = 0;
-				ring->last_attr = basic_cell.attr;
+				_vte_ring_set_last_attr (ring, &basic_cell.attr);
 			}
 		}
 		_vte_stream_truncate (ring->row_stream, position * sizeof (record));
@@ -618,14 +1154,18 @@ _vte_ring_reset_streams (VteRing *ring, gulong position)
 {
 	_vte_debug_print (VTE_DEBUG_RING, "Reseting streams to %lu.\n", position);
 
+	_vte_ring_rewrap_drop_pending (ring);
+
 	if (ring->has_streams) {
 		_vte_stream_reset (ring->row_stream, position * sizeof (VteRowRecord));
 		_vte_stream_reset (ring->text_stream, _vte_stream_head (ring->text_stream));
 		_vte_stream_reset (ring->attr_stream, _vte_stream_head (ring->attr_stream));
+		_vte_ring_search_index_trim (ring);
+		ring->search_index.carry_len = 0;
 	}
 
 	ring->last_attr_text_start_offset = 0;
-	ring->last_attr = basic_cell.attr;
+	_vte_ring_set_last_attr (ring, &basic_cell.attr);
 }
 
 long
@@ -637,7 +1177,9 @@ _vte_ring_reset (VteRing *ring)
 
         _vte_ring_reset_streams (ring, ring->end);
         ring->start = ring->writable = ring->end;
-        ring->cached_row_num = (gulong) -1;
+        _vte_ring_check_rotated (ring);
+        _vte_ring_cached_rows_invalidate (ring);
+        _vte_cells_pool_trim (&ring->cells_pool);
 
 	/* Clear SIXEL images */
 	for (auto it = image_map->begin (); it != image_map->end (); ++it)
@@ -652,16 +1194,27 @@ _vte_ring_reset (VteRing *ring)
 const VteRowData *
 _vte_ring_index (VteRing *ring, gulong position)
 {
+	VteRingCachedRow *entry;
+	VteRingExpandedRow *expanded;
+
 	if (G_LIKELY (position >= ring->writable))
 		return _vte_ring_writable_index (ring, position);
 
-	if (ring->cached_row_num != position) {
-		_vte_debug_print(VTE_DEBUG_RING, "Caching row %lu.\n", position);
-                _vte_ring_thaw_row (ring, position, &ring->cached_row, FALSE, -1, NULL);
-		ring->cached_row_num = position;
+	expanded = &ring->expanded_rows[position & ring->expanded_rows_mask];
+	if (expanded->row_num == position)
+		return &expanded->row;
+
+	_vte_ring_expanded_row_evict (ring, expanded);
+	entry = &ring->cached_rows[position & ring->cached_rows_mask];
+	if (entry->row_num != position) {
+		_vte_debug_print(VTE_DEBUG_RING, "Thawing row %lu.\n", position);
+                _vte_ring_thaw_row (ring, position, &expanded->row, FALSE, -1, NULL);
+	} else {
+		_vte_row_data_expand (&expanded->row, &entry->row, &ring->cached_rows_attrs);
 	}
 
-	return &ring->cached_row;
+	expanded->row_num = position;
+	return &expanded->row;
 }
 
 /*
@@ -689,12 +1242,12 @@ _vte_ring_get_hyperlink_at_position (VteRing *ring, gulong position, int col, bo
 
         if (update_hover_idx) {
                 /* Invalidate the cache because new hover idx might result in new idxs to report. */
-                ring->cached_row_num = (gulong) -1;
+                _vte_ring_cached_rows_invalidate (ring);
         }
 
         if (G_UNLIKELY (position == (gulong) -1 || col == -1)) {
                 if (update_hover_idx)
-                        ring->hyperlink_hover_idx = 0;
+                        _vte_ring_hyperlink_hold (ring, &ring->hyperlink_hover_idx, 0);
                 return 0;
         }
 
@@ -702,21 +1255,25 @@ _vte_ring_get_hyperlink_at_position (VteRing *ring, gulong position, int col, bo
                 VteRowData *row = _vte_ring_writable_index (ring, position);
                 if (col >= _vte_row_data_length(row)) {
                         if (update_hover_idx)
-                                ring->hyperlink_hover_idx = 0;
+                                _vte_ring_hyperlink_hold (ring, &ring->hyperlink_hover_idx, 0);
                         return 0;
                 }
                 *hyperlink = hyperlink_get(ring, row->cells[col].attr.hyperlink_idx)->str;
                 idx = row->cells[col].attr.hyperlink_idx;
         } else {
-                _vte_ring_thaw_row (ring, position, &ring->cached_row, FALSE, col, hyperlink);
-                /* Note: Intentionally don't set cached_row_num. We're about to update
+                VteRingExpandedRow *expanded = &ring->expanded_rows[position & ring->expanded_rows_mask];
+                _vte_ring_expanded_row_evict (ring, expanded);
+                _vte_ring_thaw_row (ring, position, &expanded->row, FALSE, col, hyperlink);
+                /* Note: Intentionally don't keep the entry if we're about to update
                  * ring->hyperlink_hover_idx which makes some idxs no longer valid. */
+                if (!update_hover_idx)
+                        expanded->row_num = position;
                 idx = _vte_ring_get_hyperlink_idx_no_update_current(ring, *hyperlink);
         }
         if (**hyperlink == '\0')
                 *hyperlink = NULL;
         if (update_hover_idx)
-                ring->hyperlink_hover_idx = idx;
+                _vte_ring_hyperlink_hold (ring, &ring->hyperlink_hover_idx, idx);
         return idx;
 }
 
@@ -726,8 +1283,12 @@ static void _vte_ring_ensure_writable_room (VteRing *ring);
 VteRowData *
 _vte_ring_index_writable (VteRing *ring, gulong position)
 {
+	VteRowData *row;
+
 	_vte_ring_ensure_writable (ring, position);
-	return _vte_ring_writable_index (ring, position);
+	row = _vte_ring_writable_index (ring, position);
+	_vte_ring_hyperlink_uncount_row (ring, row);
+	return row;
 }
 
 static void
@@ -740,8 +1301,10 @@ _vte_ring_freeze_one_row (VteRing *ring)
 
 	row = _vte_ring_writable_index (ring, ring->writable);
 	_vte_ring_freeze_row (ring, ring->writable, row);
+	_vte_ring_hyperlink_uncount_row (ring, row);
 
 	ring->writable++;
+	_vte_ring_check_rotated (ring);
 }
 
 static void
@@ -751,12 +1314,14 @@ _vte_ring_thaw_one_row (VteRing *ring)
 
 	g_assert (ring->start < ring->writable);
 
+	if (G_UNLIKELY (ring->writable <= ring->rewrap_boundary))
+		_vte_ring_rewrap_abandon (ring);
+
 	_vte_ring_ensure_writable_room (ring);
 
 	ring->writable--;
 
-	if (ring->writable == ring->cached_row_num)
-		ring->cached_row_num = (gulong) -1; /* Invalidate cached row */
+	_vte_ring_cached_row_invalidate (ring, ring->writable);
 
 	row = _vte_ring_writable_index (ring, ring->writable);
 
@@ -764,20 +1329,28 @@ _vte_ring_thaw_one_row (VteRing *ring)
 }
 
 static void
-_vte_ring_discard_one_row (VteRing *ring)
+_vte_ring_discard_rows (VteRing *ring, gulong n)
 {
-	ring->start++;
+	ring->start += n;
+	if (G_UNLIKELY (ring->rewrap_boundary != 0 && ring->start >= ring->rewrap_boundary))
+		_vte_ring_rewrap_drop_pending (ring);
 	if (G_UNLIKELY (ring->start == ring->writable)) {
 		_vte_ring_reset_streams (ring, ring->writable);
 	} else if (ring->start < ring->writable) {
 		VteRowRecord record;
-		_vte_stream_advance_tail (ring->row_stream, ring->start * sizeof (record));
+		if (G_UNLIKELY (ring->start < ring->rewrap_boundary))
+			_vte_stream_advance_tail (ring->rewrap_old_row_stream,
+						  (ring->start - ring->rewrap_old_delta) * sizeof (record));
+		else
+			_vte_stream_advance_tail (ring->row_stream, ring->start * sizeof (record));
 		if (G_LIKELY (_vte_ring_read_row_record (ring, &record, ring->start))) {
 			_vte_stream_advance_tail (ring->text_stream, record.text_start_offset);
 			_vte_stream_advance_tail (ring->attr_stream, record.attr_start_offset);
+			_vte_ring_search_index_trim (ring);
 		}
 	} else {
 		ring->writable = ring->start;
+		_vte_ring_check_rotated (ring);
 	}
 }
 
@@ -794,7 +1367,7 @@ static void
 _vte_ring_maybe_discard_one_row (VteRing *ring)
 {
 	if ((gulong) _vte_ring_length (ring) == ring->max)
-		_vte_ring_discard_one_row (ring);
+		_vte_ring_discard_rows (ring, 1);
 }
 
 static void
@@ -806,6 +1379,9 @@ _vte_ring_ensure_writable_room (VteRing *ring)
         if (G_LIKELY (ring->mask >= ring->visible_rows && ring->writable + ring->mask + 1 > ring->end))
 		return;
 
+	/* The rows rotated in place are where they belong with the old mask only */
+	_vte_ring_unrotate (ring);
+
 	old_mask = ring->mask;
 	old_array = ring->array;
 
@@ -855,9 +1431,12 @@ _vte_ring_resize (VteRing *ring, gulong max_rows)
 	/* Adjust the start of tail chunk now */
 	if ((gulong) _vte_ring_length (ring) > max_rows) {
 		ring->start = ring->end - max_rows;
+		if (ring->rewrap_boundary != 0 && ring->start >= ring->rewrap_boundary)
+			_vte_ring_rewrap_drop_pending (ring);
 		if (ring->start >= ring->writable) {
 			_vte_ring_reset_streams (ring, ring->writable);
 			ring->writable = ring->start;
+			_vte_ring_check_rotated (ring);
 		}
 	}
 
@@ -887,6 +1466,41 @@ _vte_ring_shrink (VteRing *ring, gulong max_len)
 	_vte_ring_validate(ring);
 }
 
+/*
+ * Like _vte_ring_rotate_array(), but scrolling the same part again and again,
+ * like a scrolling region does, only changes the offset of the part.
+ */
+static void
+_vte_ring_rotate_writable (VteRing *ring, gulong start, gulong end, glong count, gboolean in_place)
+{
+	gulong len = end - start;
+
+	g_assert (start >= ring->writable && start <= end);
+	g_assert (end - ring->writable <= ring->mask + 1);
+
+	if (G_UNLIKELY (len == 0))
+		return;
+
+	if (ring->rotated_len != 0 &&
+	    (!in_place || start != ring->rotated_start || len != ring->rotated_len))
+		_vte_ring_unrotate (ring);
+
+	if (!in_place) {
+		_vte_ring_rotate_array (ring, start, end, count);
+		return;
+	}
+
+	/* The row at p + count takes the place of the one at p. */
+	count %= (glong) len;
+	if (count < 0)
+		count += len;
+	ring->rotated_start = start;
+	ring->rotated_len = len;
+	ring->rotated_offset = (ring->rotated_offset + len - count) % len;
+	if (ring->rotated_offset == 0)
+		ring->rotated_len = 0;
+}
+
 /**
  * _vte_ring_insert_internal:
  * @ring: a #VteRing
@@ -900,8 +1514,7 @@ _vte_ring_shrink (VteRing *ring, gulong max_len)
 VteRowData *
 _vte_ring_insert (VteRing *ring, gulong position)
 {
-	gulong i;
-	VteRowData *row, tmp;
+	VteRowData *row;
 
 	_vte_debug_print(VTE_DEBUG_RING, "Inserting at position %lu.\n", position);
 	_vte_ring_validate(ring);
@@ -913,13 +1526,11 @@ _vte_ring_insert (VteRing *ring, gulong position)
 
 	g_assert (position >= ring->writable && position <= ring->end);
 
-	tmp = *_vte_ring_writable_index (ring, ring->end);
-	for (i = ring->end; i > position; i--)
-		*_vte_ring_writable_index (ring, i) = *_vte_ring_writable_index (ring, i - 1);
-	*_vte_ring_writable_index (ring, position) = tmp;
+	/* The spare row right after the end wraps around to @position. */
+	_vte_ring_rotate_writable (ring, position, ring->end + 1, 1, FALSE);
 
 	row = _vte_ring_writable_index (ring, position);
-	_vte_row_data_clear (row);
+	_vte_ring_clear_row (ring, row);
 	ring->end++;
 
 	_vte_ring_maybe_freeze_one_row (ring);
@@ -938,9 +1549,6 @@ _vte_ring_insert (VteRing *ring, gulong position)
 void
 _vte_ring_remove (VteRing * ring, gulong position)
 {
-	gulong i;
-	VteRowData tmp;
-
 	_vte_debug_print(VTE_DEBUG_RING, "Removing item at position %lu.\n", position);
 	_vte_ring_validate(ring);
 
@@ -949,10 +1557,7 @@ _vte_ring_remove (VteRing * ring, gulong position)
 
 	_vte_ring_ensure_writable (ring, position);
 
-	tmp = *_vte_ring_writable_index (ring, position);
-	for (i = position; i < ring->end - 1; i++)
-		*_vte_ring_writable_index (ring, i) = *_vte_ring_writable_index (ring, i + 1);
-	*_vte_ring_writable_index (ring, ring->end - 1) = tmp;
+	_vte_ring_rotate_writable (ring, position, ring->end, -1, FALSE);
 
 	if (ring->end > ring->writable)
 		ring->end--;
@@ -960,6 +1565,51 @@ _vte_ring_remove (VteRing * ring, gulong position)
 	_vte_ring_validate(ring);
 }
 
+/**
+ * _vte_ring_rotate:
+ * @ring: a #VteRing
+ * @start: the first row of the region
+ * @end: the row right after the last row of the region
+ * @count: the number of rows to scroll the region by: positive to move the
+ *   contents down (new rows appear at @start), negative to move them up
+ *   (new rows appear at the bottom)
+ *
+ * Scrolls the [@start, @end) region of @ring, like the corresponding number
+ * of _vte_ring_remove() and _vte_ring_insert() pairs would do. The rows of
+ * the region aren't moved, they're looked up at an offset instead, so that
+ * scrolling the same region again and again only costs the rows scrolled
+ * in, which are cleared.
+ */
+void
+_vte_ring_rotate (VteRing *ring, gulong start, gulong end, glong count)
+{
+	gulong i, n;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Rotating rows %lu to %lu by %ld.\n", start, end, count);
+	_vte_ring_validate(ring);
+
+	start = MAX (start, ring->start);
+	end = MIN (end, ring->end);
+	if (G_UNLIKELY (start >= end || count == 0))
+		return;
+
+	n = MIN ((gulong) ABS (count), end - start);
+
+	_vte_ring_ensure_writable (ring, start);
+
+	_vte_ring_rotate_writable (ring, start, end, count > 0 ? (glong) n : -(glong) n, TRUE);
+
+	if (count < 0)
+		start = end - n;
+	for (i = start; i < start + n; i++) {
+		VteRowData *row = _vte_ring_writable_index (ring, i);
+		_vte_ring_hyperlink_uncount_row (ring, row);
+		_vte_row_data_clear (row);
+	}
+
+	_vte_ring_validate(ring);
+}
+
 
 /**
  * _vte_ring_append:
@@ -992,6 +1642,7 @@ _vte_ring_drop_scrollback (VteRing * ring, gulong position)
         _vte_ring_ensure_writable (ring, position);
 
         ring->start = ring->writable = position;
+        _vte_ring_check_rotated (ring);
         _vte_ring_reset_streams (ring, position);
 }
 
@@ -1008,6 +1659,137 @@ void
 _vte_ring_set_visible_rows (VteRing *ring, gulong rows)
 {
         ring->visible_rows = rows;
+
+        if (ring->has_streams) {
+                _vte_ring_cached_rows_resize (ring, rows * VTE_RING_CACHED_SCREENS);
+                _vte_ring_expanded_rows_resize (ring, rows);
+        }
+}
+
+/* The bytes the frozen streams take up on disk, compressed */
+static gsize
+_vte_ring_get_disk_usage (VteRing *ring)
+{
+	VteStream *streams[] = { ring->row_stream, ring->text_stream, ring->attr_stream, ring->image_stream };
+	gsize bytes = 0;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (streams); i++)
+		bytes += _vte_stream_disk_usage (streams[i]);
+	if (ring->rewrap_old_row_stream != NULL)
+		bytes += _vte_stream_disk_usage (ring->rewrap_old_row_stream);
+	return bytes;
+}
+
+/**
+ * _vte_ring_get_usage:
+ * @ring: a #VteRing
+ *
+ * Reports how many bytes @ring holds on to: the frozen rows as stored on
+ * disk, the cells of the writable rows and the images kept in memory.
+ *
+ * Returns: the usage in bytes
+ */
+gsize
+_vte_ring_get_usage (VteRing *ring)
+{
+	gsize usage = ring->cells_pool.stats.in_use_bytes + ring->image_onscreen_resource_counter;
+
+	if (ring->has_streams)
+		usage += _vte_ring_get_disk_usage (ring);
+	return usage;
+}
+
+/* How many of the @frozen rows, taking up @disk of the @usage bytes, to drop
+ * to get under @max_bytes, at the average size of a frozen row.  None if the
+ * rest alone is over the budget: dropping the scrollback wouldn't help. */
+static gulong
+_vte_ring_rows_to_trim (gsize usage, gsize disk, gulong frozen, gsize max_bytes)
+{
+	gsize row_bytes;
+
+	if (usage <= max_bytes || frozen == 0 || disk == 0 || usage - disk >= max_bytes)
+		return 0;
+
+	row_bytes = (disk + frozen - 1) / frozen;
+	return MIN (frozen, (usage - max_bytes + row_bytes - 1) / row_bytes);
+}
+
+/**
+ * _vte_ring_trim_to_bytes:
+ * @ring: a #VteRing
+ * @max_bytes: the budget for _vte_ring_get_usage()
+ *
+ * Drops the oldest frozen rows until the usage of @ring fits in @max_bytes,
+ * or no frozen rows are left.  The streams give disk space back a whole block
+ * at a time, so each round drops as many rows as the excess is worth at the
+ * average size of a frozen row, rather than measuring row by row.  If the
+ * writable rows and images alone exceed @max_bytes, nothing is dropped.
+ *
+ * Returns: %TRUE if any rows were dropped
+ */
+gboolean
+_vte_ring_trim_to_bytes (VteRing *ring, gsize max_bytes)
+{
+	gsize usage;
+	gulong n;
+	gboolean dropped = FALSE;
+
+	if (!ring->has_streams)
+		return FALSE;
+
+	while ((n = _vte_ring_rows_to_trim (usage = _vte_ring_get_usage (ring),
+					    _vte_ring_get_disk_usage (ring),
+					    ring->writable - ring->start,
+					    max_bytes)) > 0) {
+		_vte_debug_print(VTE_DEBUG_RING, "Trimming %lu rows, usage %" G_GSIZE_FORMAT " over %" G_GSIZE_FORMAT ".\n",
+				 n, usage, max_bytes);
+		_vte_ring_discard_rows (ring, n);
+		dropped = TRUE;
+	}
+
+	return dropped;
+}
+
+/**
+ * _vte_ring_get_memory_stats:
+ * @ring: a #VteRing
+ * @stats: (out): the place to store the statistics
+ *
+ * Reports how much memory the rows of @ring take.
+ */
+void
+_vte_ring_get_memory_stats (VteRing *ring, VteRingMemoryStats *stats)
+{
+	gulong i;
+
+	stats->cells = ring->cells_pool.stats;
+	stats->rows_bytes = (ring->mask + 1) * sizeof (VteRowData) +
+			    (ring->expanded_rows_mask + 1) * sizeof (VteRingExpandedRow) +
+			    (ring->cached_rows_mask + 1) * sizeof (VteRingCachedRow);
+	stats->cached_rows_bytes = 0;
+	for (i = 0; i <= ring->cached_rows_mask; i++)
+		stats->cached_rows_bytes += ring->cached_rows[i].row.alloc_len * sizeof (VteCompactCell);
+	stats->n_cached_attrs = _vte_cell_attr_table_size (&ring->cached_rows_attrs);
+	stats->stream_bytes = 0;
+	stats->stream_disk_bytes = 0;
+	stats->search_index_bytes = 0;
+
+	if (ring->has_streams) {
+		VteStream *streams[] = { ring->row_stream, ring->text_stream, ring->attr_stream, ring->image_stream };
+
+		for (i = 0; i < G_N_ELEMENTS (streams); i++)
+			stats->stream_bytes += _vte_stream_head (streams[i]) - _vte_stream_tail (streams[i]);
+		if (ring->rewrap_old_row_stream != NULL)
+			stats->stream_bytes += _vte_stream_head (ring->rewrap_old_row_stream) -
+				_vte_stream_tail (ring->rewrap_old_row_stream);
+		stats->stream_disk_bytes = _vte_ring_get_disk_usage (ring);
+
+		stats->search_index_bytes = ring->search_index.blooms->len * sizeof (gpointer);
+		for (i = 0; i < ring->search_index.blooms->len; i++)
+			if (g_ptr_array_index (ring->search_index.blooms, i) != NULL)
+				stats->search_index_bytes += VTE_RING_SEARCH_BLOOM_BITS / 8;
+	}
 }
 
 
@@ -1044,7 +1826,7 @@ _vte_frozen_row_column_to_text_offset (VteRing *ring,
 	g_assert(position < ring->writable);
 	if (!_vte_ring_read_row_record (ring, &records[0], position))
 		return FALSE;
-	if ((position + 1) * sizeof (records[0]) < _vte_stream_head (ring->row_stream)) {
+	if (_vte_ring_has_row_record (ring, position + 1)) {
 		if (!_vte_ring_read_row_record (ring, &records[1], position + 1))
 			return FALSE;
 	} else
@@ -1120,7 +1902,7 @@ _vte_frozen_row_text_offset_to_column (VteRing *ring,
 	g_assert_cmpuint(position, <, ring->writable);
 	if (!_vte_ring_read_row_record (ring, &records[0], position))
 		return FALSE;
-	if ((position + 1) * sizeof (records[0]) < _vte_stream_head (ring->row_stream)) {
+	if (_vte_ring_has_row_record (ring, position + 1)) {
 		if (!_vte_ring_read_row_record (ring, &records[1], position + 1))
 			return FALSE;
 	} else
@@ -1165,107 +1947,174 @@ _vte_frozen_row_text_offset_to_column (VteRing *ring,
 }
 
 
-/**
- * _vte_ring_rewrap:
- * @ring: a #VteRing
- * @columns: new number of columns
- * @markers: NULL-terminated array of #VteVisualPosition
+/*
+ * Rewrapping
  *
- * Reflow the @ring to match the new number of @columns.
- * For all @markers, find the cell at that position and update them to
- * reflect the cell's new position.
+ * Rewrapping writes new row records for a range of frozen rows, walking
+ * them paragraph by paragraph. The text and attr streams stay as they are.
+ * See ../doc/rewrap.txt for design and implementation details.
+ *
+ * With a long scrollback, only the bottom of the ring (everything that can
+ * be onscreen right after the resize, and everything a marker points to)
+ * is rewrapped right away. The rows above it, the pending ones, keep their
+ * old records in rewrap_old_row_stream and are rewrapped in slices by
+ * _vte_ring_rewrap_step(). When that's done the new records are put in
+ * place and ring->start moves, so that the rows below keep their numbers.
+ * Since the pending rows might end up taking more rows than now, the rows
+ * below are numbered with enough of a gap to fit them.
+ *
+ * Resizing again while rows are pending only rewraps a new bottom part, the
+ * pending rows are only ever rewrapped for the width that sticks.
  */
-/* See ../doc/rewrap.txt for design and implementation details. */
-void
-_vte_ring_rewrap (VteRing *ring,
-		  glong columns,
-		  VteVisualPosition **markers)
-{
-	gulong old_row_index, new_row_index;
-	int i;
-	int num_markers = 0;
-	VteCellTextOffset *marker_text_offsets;
-	VteVisualPosition *new_markers;
-	VteRowRecord old_record;
-	VteCellAttrChange attr_change;
+
+/* Rewrap everything at once below this number of rows */
+#define VTE_RING_REWRAP_SYNC_ROWS 20000
+/* Otherwise rewrap this many screenfuls at the bottom right away */
+#define VTE_RING_REWRAP_SYNC_SCREENS 4
+#define VTE_RING_REWRAP_MIN_MARGIN 100
+
+typedef struct _VteRingRewrapState {
+	glong columns;
 	VteStream *new_row_stream;
+	gulong new_row_index;   /* number of the next new row */
+	gulong old_row_index;   /* the row after the one in old_record */
+	gulong end_row;         /* rewrap up to this row (exclusive) */
+	gsize end_text_offset;  /* text offset of end_row */
+	VteRowRecord old_record;
 	gsize paragraph_start_text_offset;
-	gsize paragraph_end_text_offset;
-	gsize paragraph_len;  /* excluding trailing '\n' */
 	gsize attr_offset;
-	gsize old_ring_end;
+	VteCellAttrChange attr_change;
+	int num_markers;
+	const VteCellTextOffset *marker_text_offsets;
+	VteVisualPosition *new_markers;
+} VteRingRewrapState;
 
-	if (_vte_ring_length(ring) == 0)
-		return;
-	_vte_debug_print(VTE_DEBUG_RING, "Ring before rewrapping:\n");
-	_vte_ring_validate(ring);
-	new_row_stream = _vte_file_stream_new ();
+struct _VteRingRewrapJob {
+	VteRingRewrapState state;  /* the new rows are numbered from 0 */
 
-	/* Freeze everything, because rewrapping is really complicated and we don't want to
-	   duplicate the code for frozen and thawed rows. */
-	while (ring->writable < ring->end)
-		_vte_ring_freeze_one_row(ring);
+	/* Once all the pending rows are rewrapped, the new row stream is
+	 * assembled in finish_stream, starting at row finish_start: the new
+	 * records from finish_new on, then the rows from finish_next on. */
+	VteStream *finish_stream;
+	gulong finish_start, finish_new, finish_next;
+};
 
-	/* For markers given as (row,col) pairs find their offsets in the text stream.
-	   This code requires that the rows are already frozen. */
-	while (markers[num_markers] != NULL)
-		num_markers++;
-	marker_text_offsets = (VteCellTextOffset *) g_malloc(num_markers * sizeof (marker_text_offsets[0]));
-	new_markers = (VteVisualPosition *) g_malloc(num_markers * sizeof (new_markers[0]));
-	for (i = 0; i < num_markers; i++) {
-		/* Convert visual column into byte offset */
-		if (!_vte_frozen_row_column_to_text_offset(ring, markers[i]->row, markers[i]->col, &marker_text_offsets[i]))
-			goto err;
-		new_markers[i].row = new_markers[i].col = -1;
-		_vte_debug_print(VTE_DEBUG_RING,
-				"Marker #%d old coords:  row %ld  col %ld  ->  text_offset %" G_GSIZE_FORMAT " fragment_cells %d  eol_cells %d\n",
-				i, markers[i]->row, markers[i]->col, marker_text_offsets[i].text_offset,
-				marker_text_offsets[i].fragment_cells, marker_text_offsets[i].eol_cells);
+static void
+_vte_ring_rewrap_read_attr_change (VteRing *ring, VteRingRewrapState *state)
+{
+	if (!_vte_stream_read(ring->attr_stream, state->attr_offset, (char *) &state->attr_change, sizeof (state->attr_change))) {
+                _attrcpy(&state->attr_change.attr, &ring->last_attr);
+                state->attr_change.attr.hyperlink_length = hyperlink_get(ring, ring->last_attr.hyperlink_idx)->len;
+		state->attr_change.text_end_offset = _vte_stream_head (ring->text_stream);
 	}
+}
+
+static void
+_vte_ring_rewrap_next_attr_change (VteRing *ring, VteRingRewrapState *state)
+{
+        state->attr_offset += sizeof (state->attr_change) + state->attr_change.attr.hyperlink_length + 2;
+	_vte_ring_rewrap_read_attr_change (ring, state);
+}
+
+/* Prepare to rewrap rows @first_row up to @end_row, numbering the new rows from @new_first_row. */
+static gboolean
+_vte_ring_rewrap_begin (VteRing *ring, VteRingRewrapState *state, glong columns,
+			gulong first_row, gulong end_row, gulong new_first_row)
+{
+	VteRowRecord end_record;
+
+	memset (state, 0, sizeof (*state));
+	state->columns = columns;
+	state->end_row = end_row;
+	if (end_row < ring->end) {
+		if (!_vte_ring_read_row_record (ring, &end_record, end_row))
+			return FALSE;
+		state->end_text_offset = end_record.text_start_offset;
+	} else {
+		state->end_text_offset = _vte_stream_head (ring->text_stream);
+	}
+
+	if (!_vte_ring_read_row_record (ring, &state->old_record, first_row))
+		return FALSE;
+	state->paragraph_start_text_offset = state->old_record.text_start_offset;
+	state->old_row_index = first_row + 1;
+
+	state->attr_offset = state->old_record.attr_start_offset;
+	_vte_ring_rewrap_read_attr_change (ring, state);
+
+	state->new_row_stream = _vte_file_stream_new ();
+	_vte_stream_reset (state->new_row_stream, new_first_row * sizeof (VteRowRecord));
+	state->new_row_index = new_first_row;
 
-	/* Prepare for rewrapping */
-	if (!_vte_ring_read_row_record(ring, &old_record, ring->start))
-		goto err;
-	paragraph_start_text_offset = old_record.text_start_offset;
-	paragraph_end_text_offset = _vte_stream_head (ring->text_stream);  /* initialized to silence gcc */
-	new_row_index = 0;
+	return TRUE;
+}
+
+static void
+_vte_ring_rewrap_append_record (VteRingRewrapState *state, const VteRowRecord *new_record,
+				gsize end_text_offset)
+{
+	int i;
 
-	attr_offset = old_record.attr_start_offset;
-	if (!_vte_stream_read(ring->attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
-                _attrcpy(&attr_change.attr, &ring->last_attr);
-                attr_change.attr.hyperlink_length = hyperlink_get(ring, ring->last_attr.hyperlink_idx)->len;
-		attr_change.text_end_offset = _vte_stream_head (ring->text_stream);
+	_vte_stream_append(state->new_row_stream, (const char *) new_record, sizeof (*new_record));
+	_vte_debug_print(VTE_DEBUG_RING,
+			"    New row %lu  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "%s\n",
+			state->new_row_index,
+			new_record->text_start_offset, new_record->attr_start_offset,
+			new_record->soft_wrapped ? "  soft_wrapped" : "");
+	for (i = 0; i < state->num_markers; i++) {
+		if (G_UNLIKELY (state->marker_text_offsets[i].text_offset >= new_record->text_start_offset &&
+				state->marker_text_offsets[i].text_offset < end_text_offset)) {
+			state->new_markers[i].row = state->new_row_index;
+			_vte_debug_print(VTE_DEBUG_RING,
+					"      Marker #%d will be here in row %lu\n", i, state->new_row_index);
+		}
 	}
+	state->new_row_index++;
+}
+
+/*
+ * Rewrap whole paragraphs until at least @max_rows old rows are done, or
+ * the end is reached.
+ *
+ * Returns: %FALSE on error.
+ */
+static gboolean
+_vte_ring_rewrap_paragraphs (VteRing *ring, VteRingRewrapState *state, gulong max_rows)
+{
+	gulong first_row = state->old_row_index;
+	int i;
 
-	old_row_index = ring->start + 1;
-	while (paragraph_start_text_offset < _vte_stream_head (ring->text_stream)) {
+	while (state->paragraph_start_text_offset < state->end_text_offset &&
+	       state->old_row_index - first_row < max_rows) {
 		/* Find the boundaries of the next paragraph */
 		gboolean prev_record_was_soft_wrapped = FALSE;
 		gboolean paragraph_is_ascii = TRUE;
-		gsize paragraph_start_row = old_row_index - 1;
+		gsize paragraph_start_row = state->old_row_index - 1;
 		gsize paragraph_end_row;  /* points to beyond the end */
-		gsize text_offset = paragraph_start_text_offset;
+		gsize paragraph_end_text_offset = state->end_text_offset;
+		gsize paragraph_len;  /* excluding trailing '\n' */
+		gsize text_offset = state->paragraph_start_text_offset;
 		VteRowRecord new_record;
 		glong col = 0;
 		_vte_debug_print(VTE_DEBUG_RING,
 				"  Old paragraph:  row %" G_GSIZE_FORMAT "  (text_offset %" G_GSIZE_FORMAT ")  up to (exclusive)  ",  /* no '\n' */
-				paragraph_start_row, paragraph_start_text_offset);
-		while (old_row_index <= ring->end) {
-			prev_record_was_soft_wrapped = old_record.soft_wrapped;
-			paragraph_is_ascii = paragraph_is_ascii && old_record.is_ascii;
-			if (G_LIKELY (old_row_index < ring->end)) {
-				if (!_vte_ring_read_row_record(ring, &old_record, old_row_index))
-					goto err;
-				paragraph_end_text_offset = old_record.text_start_offset;
+				paragraph_start_row, state->paragraph_start_text_offset);
+		while (state->old_row_index <= state->end_row) {
+			prev_record_was_soft_wrapped = state->old_record.soft_wrapped;
+			paragraph_is_ascii = paragraph_is_ascii && state->old_record.is_ascii;
+			if (G_LIKELY (state->old_row_index < state->end_row)) {
+				if (!_vte_ring_read_row_record(ring, &state->old_record, state->old_row_index))
+					return FALSE;
+				paragraph_end_text_offset = state->old_record.text_start_offset;
 			} else {
-				paragraph_end_text_offset = _vte_stream_head (ring->text_stream);
+				paragraph_end_text_offset = state->end_text_offset;
 			}
-			old_row_index++;
+			state->old_row_index++;
 			if (!prev_record_was_soft_wrapped)
 				break;
 		}
-		paragraph_end_row = old_row_index - 1;
-		paragraph_len = paragraph_end_text_offset - paragraph_start_text_offset;
+		paragraph_end_row = state->old_row_index - 1;
+		paragraph_len = paragraph_end_text_offset - state->paragraph_start_text_offset;
 		if (!prev_record_was_soft_wrapped)  /* The last paragraph can be soft wrapped! */
 			paragraph_len--;  /* Strip trailing '\n' */
 		_vte_debug_print(VTE_DEBUG_RING,
@@ -1275,65 +2124,42 @@ _vte_ring_rewrap (VteRing *ring,
 				paragraph_len, paragraph_is_ascii);
 
 		/* Wrap the paragraph */
-		if (attr_change.text_end_offset <= text_offset) {
+		if (state->attr_change.text_end_offset <= text_offset) {
 			/* Attr change at paragraph boundary, advance to next attr. */
-                        attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length + 2;
-			if (!_vte_stream_read(ring->attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
-                                _attrcpy(&attr_change.attr, &ring->last_attr);
-                                attr_change.attr.hyperlink_length = hyperlink_get(ring, ring->last_attr.hyperlink_idx)->len;
-				attr_change.text_end_offset = _vte_stream_head (ring->text_stream);
-			}
+			_vte_ring_rewrap_next_attr_change (ring, state);
 		}
 		memset(&new_record, 0, sizeof (new_record));
 		new_record.text_start_offset = text_offset;
-		new_record.attr_start_offset = attr_offset;
+		new_record.attr_start_offset = state->attr_offset;
 		new_record.is_ascii = paragraph_is_ascii;
 
 		while (paragraph_len > 0) {
 			/* Wrap one continuous run of identical attributes within the paragraph. */
 			gsize runlength;  /* number of bytes we process in one run: identical attributes, within paragraph */
-			if (attr_change.text_end_offset <= text_offset) {
+			if (state->attr_change.text_end_offset <= text_offset) {
 				/* Attr change at line boundary, advance to next attr. */
-                                attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length + 2;
-				if (!_vte_stream_read(ring->attr_stream, attr_offset, (char *) &attr_change, sizeof (attr_change))) {
-                                        _attrcpy(&attr_change.attr, &ring->last_attr);
-                                        attr_change.attr.hyperlink_length = hyperlink_get(ring, ring->last_attr.hyperlink_idx)->len;
-					attr_change.text_end_offset = _vte_stream_head (ring->text_stream);
-				}
+				_vte_ring_rewrap_next_attr_change (ring, state);
 			}
-			runlength = MIN(paragraph_len, attr_change.text_end_offset - text_offset);
+			runlength = MIN(paragraph_len, state->attr_change.text_end_offset - text_offset);
 
-			if (G_UNLIKELY (attr_change.attr.columns == 0)) {
+			if (G_UNLIKELY (state->attr_change.attr.columns == 0)) {
 				/* Combining characters all fit in the current row */
 				text_offset += runlength;
 				paragraph_len -= runlength;
 			} else {
 				while (runlength) {
-					if (col >= columns - attr_change.attr.columns + 1) {
+					if (col >= state->columns - state->attr_change.attr.columns + 1) {
 						/* Wrap now, write the soft wrapped row's record */
 						new_record.soft_wrapped = 1;
-						_vte_stream_append(new_row_stream, (const char *) &new_record, sizeof (new_record));
-						_vte_debug_print(VTE_DEBUG_RING,
-								"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "  soft_wrapped\n",
-								new_row_index,
-								new_record.text_start_offset, new_record.attr_start_offset);
-						for (i = 0; i < num_markers; i++) {
-							if (G_UNLIKELY (marker_text_offsets[i].text_offset >= new_record.text_start_offset &&
-									marker_text_offsets[i].text_offset < text_offset)) {
-								new_markers[i].row = new_row_index;
-								_vte_debug_print(VTE_DEBUG_RING,
-										"      Marker #%d will be here in row %lu\n", i, new_row_index);
-							}
-						}
-						new_row_index++;
+						_vte_ring_rewrap_append_record (state, &new_record, text_offset);
 						new_record.text_start_offset = text_offset;
-						new_record.attr_start_offset = attr_offset;
+						new_record.attr_start_offset = state->attr_offset;
 						col = 0;
 					}
 					if (paragraph_is_ascii) {
 						/* Shortcut for quickly wrapping ASCII (excluding TAB) text.
 						   Don't read text_stream, and advance by a whole row of characters. */
-						int len = MIN(runlength, (gsize) (columns - col));
+						int len = MIN(runlength, (gsize) (state->columns - col));
 						col += len;
 						text_offset += len;
 						paragraph_len -= len;
@@ -1342,12 +2168,12 @@ _vte_ring_rewrap (VteRing *ring,
 						/* Process one character only. */
 						char textbuf[6];  /* fits at least one UTF-8 character */
 						int textbuf_len;
-						col += attr_change.attr.columns;
+						col += state->attr_change.attr.columns;
 						/* Find beginning of next UTF-8 character */
 						text_offset++; paragraph_len--; runlength--;
 						textbuf_len = MIN(runlength, sizeof (textbuf));
 						if (!_vte_stream_read(ring->text_stream, text_offset, textbuf, textbuf_len))
-							goto err;
+							return FALSE;
 						for (i = 0; i < textbuf_len && (textbuf[i] & 0xC0) == 0x80; i++) {
 							text_offset++; paragraph_len--; runlength--;
 						}
@@ -1359,87 +2185,453 @@ _vte_ring_rewrap (VteRing *ring,
 		/* Write the record of the paragraph's last row. */
 		/* Hard wrapped, except maybe at the end of the very last paragraph */
 		new_record.soft_wrapped = prev_record_was_soft_wrapped;
-		_vte_stream_append(new_row_stream, (const char *) &new_record, sizeof (new_record));
-		_vte_debug_print(VTE_DEBUG_RING,
-				"    New row %ld  text_offset %" G_GSIZE_FORMAT "  attr_offset %" G_GSIZE_FORMAT "\n",
-				new_row_index,
-				new_record.text_start_offset, new_record.attr_start_offset);
-		for (i = 0; i < num_markers; i++) {
-			if (G_UNLIKELY (marker_text_offsets[i].text_offset >= new_record.text_start_offset &&
-					marker_text_offsets[i].text_offset < paragraph_end_text_offset)) {
-				new_markers[i].row = new_row_index;
-				_vte_debug_print(VTE_DEBUG_RING,
-						"      Marker #%d will be here in row %lu\n", i, new_row_index);
-			}
-		}
-		new_row_index++;
-		paragraph_start_text_offset = paragraph_end_text_offset;
+		_vte_ring_rewrap_append_record (state, &new_record, paragraph_end_text_offset);
+		state->paragraph_start_text_offset = paragraph_end_text_offset;
 	}
 
-	/* Update the ring. */
-	old_ring_end = ring->end;
-	g_object_unref(ring->row_stream);
-	ring->row_stream = new_row_stream;
-	ring->writable = ring->end = new_row_index;
-	ring->start = 0;
-	if (ring->end > ring->max)
-		ring->start = ring->end - ring->max;
-	ring->cached_row_num = (gulong) -1;
+	return TRUE;
+}
 
-	/* Find the markers. This requires that the ring is already updated. */
-	for (i = 0; i < num_markers; i++) {
-		/* Compute the row for markers beyond the ring */
-		if (new_markers[i].row == -1)
-			new_markers[i].row = markers[i]->row - old_ring_end + ring->end;
-		/* Convert byte offset into visual column */
-		if (!_vte_frozen_row_text_offset_to_column(ring, new_markers[i].row, &marker_text_offsets[i], &new_markers[i].col))
-			goto err;
-		_vte_debug_print(VTE_DEBUG_RING,
-				"Marker #%d new coords:  text_offset %" G_GSIZE_FORMAT "  fragment_cells %d  eol_cells %d  ->  row %ld  col %ld\n",
-				i, marker_text_offsets[i].text_offset, marker_text_offsets[i].fragment_cells,
-				marker_text_offsets[i].eol_cells, new_markers[i].row, new_markers[i].col);
-		markers[i]->row = new_markers[i].row;
-		markers[i]->col = new_markers[i].col;
-	}
-	g_free(marker_text_offsets);
-	g_free(new_markers);
+/* Returns the first row of the paragraph containing @position. */
+static gulong
+_vte_ring_paragraph_start (VteRing *ring, gulong position)
+{
+	VteRowRecord record;
 
-	_vte_debug_print(VTE_DEBUG_RING, "Ring after rewrapping:\n");
-	_vte_ring_validate(ring);
-	return;
+	while (position > ring->start) {
+		if (!_vte_ring_read_row_record (ring, &record, position - 1) || !record.soft_wrapped)
+			break;
+		position--;
+	}
 
-err:
-#ifdef VTE_DEBUG
-	_vte_debug_print(VTE_DEBUG_RING,
-			"Error while rewrapping\n");
-	g_assert_not_reached();
-#endif
-	g_object_unref(new_row_stream);
-	g_free(marker_text_offsets);
-	g_free(new_markers);
+	return position;
 }
 
-
-/**
- * _vte_ring_append_image:
- * @ring: a #VteRing
- * @surface: a Cairo surface object
- * @pixelwidth: image width in pixels
- * @pixelheight: image height in pixels
- * @left: left position of image in cell unit
- * @top: left position of image in cell unit
- * @width: width of image in cell unit
- * @height: width of image in cell unit
- *
- * Append an image into the internal image list.
- */
-void
-_vte_ring_append_image (VteRing *ring, cairo_surface_t *surface, gint pixelwidth, gint pixelheight, glong left, glong top, glong width, glong height)
+static void
+_vte_ring_rewrap_job_free (VteRing *ring)
 {
-	using namespace vte::image;
-	image_object *image;
-	auto image_map = ring->image_map;
-	gulong char_width, char_height;
+	VteRingRewrapJob *job = ring->rewrap_job;
+
+	if (job == NULL)
+		return;
+
+	if (job->state.new_row_stream != NULL)
+		g_object_unref (job->state.new_row_stream);
+	if (job->finish_stream != NULL)
+		g_object_unref (job->finish_stream);
+	g_free (job);
+	ring->rewrap_job = NULL;
+}
+
+/* Forget about the pending rows, because they're gone. */
+static void
+_vte_ring_rewrap_drop_pending (VteRing *ring)
+{
+	_vte_ring_rewrap_job_free (ring);
+
+	if (ring->rewrap_old_row_stream != NULL)
+		g_object_unref (ring->rewrap_old_row_stream);
+	ring->rewrap_old_row_stream = NULL;
+	ring->rewrap_old_delta = 0;
+	ring->rewrap_boundary = 0;
+}
+
+/*
+ * Give up on rewrapping the pending rows, and put their old records in the
+ * row stream along with the rest. This is only needed if a pending row is
+ * about to be thawed for writing, which shouldn't really happen since they
+ * are well above the screen.
+ */
+static void
+_vte_ring_rewrap_abandon (VteRing *ring)
+{
+	VteStream *row_stream;
+	VteRowRecord record;
+	gulong i;
+
+	if (ring->rewrap_boundary == 0)
+		return;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Abandoning the rewrap of rows %lu to %lu.\n",
+			 ring->start, ring->rewrap_boundary);
+
+	row_stream = _vte_file_stream_new ();
+	_vte_stream_reset (row_stream, ring->start * sizeof (record));
+	for (i = ring->start; i < ring->writable; i++) {
+		if (!_vte_ring_read_row_record (ring, &record, i))
+			memset (&record, 0, sizeof (record));
+		_vte_stream_append (row_stream, (const char *) &record, sizeof (record));
+	}
+
+	_vte_ring_rewrap_drop_pending (ring);
+	g_object_unref (ring->row_stream);
+	ring->row_stream = row_stream;
+}
+
+static void
+_vte_ring_rewrap_job_start (VteRing *ring, glong columns)
+{
+	VteRingRewrapJob *job;
+
+	_vte_ring_rewrap_job_free (ring);
+
+	job = g_new0 (VteRingRewrapJob, 1);
+	ring->rewrap_job = job;
+
+	if (!_vte_ring_rewrap_begin (ring, &job->state, columns, ring->start, ring->rewrap_boundary, 0))
+		_vte_ring_rewrap_abandon (ring);
+}
+
+/*
+ * The pending rows' new records are complete, start assembling the new row
+ * stream: first the new records, then the ones that came after the pending
+ * rows. Rows that scrolled out at the top meanwhile are skipped, the new rows
+ * of a paragraph that got partially scrolled out might lose a few characters
+ * at their start.
+ */
+static void
+_vte_ring_rewrap_job_finish_begin (VteRing *ring)
+{
+	VteRingRewrapJob *job = ring->rewrap_job;
+	VteRowRecord record;
+	gsize start_text_offset;
+	gulong skip = 0;
+
+	if (!_vte_ring_read_row_record (ring, &record, ring->start)) {
+		_vte_ring_rewrap_abandon (ring);
+		return;
+	}
+	start_text_offset = record.text_start_offset;
+	while (skip < job->state.new_row_index &&
+	       _vte_stream_read (job->state.new_row_stream, skip * sizeof (record), (char *) &record, sizeof (record)) &&
+	       record.text_start_offset < start_text_offset)
+		skip++;
+
+	job->finish_start = ring->rewrap_boundary - (job->state.new_row_index - skip);
+	job->finish_new = skip;
+	job->finish_next = ring->rewrap_boundary;
+	job->finish_stream = _vte_file_stream_new ();
+	_vte_stream_reset (job->finish_stream, job->finish_start * sizeof (record));
+}
+
+/*
+ * Copies at most @max_rows records into the new row stream, and once they
+ * are all there, puts it in place. Returns %TRUE if there is more to copy.
+ */
+static gboolean
+_vte_ring_rewrap_job_finish_step (VteRing *ring, gulong max_rows)
+{
+	VteRingRewrapJob *job = ring->rewrap_job;
+	VteStream *row_stream;
+	VteRowRecord record;
+	gsize start_text_offset;
+	gulong n = 0;
+
+	for (; n < max_rows && job->finish_new < job->state.new_row_index; n++, job->finish_new++) {
+		if (!_vte_stream_read (job->state.new_row_stream, job->finish_new * sizeof (record), (char *) &record, sizeof (record)))
+			memset (&record, 0, sizeof (record));
+		_vte_stream_append (job->finish_stream, (const char *) &record, sizeof (record));
+	}
+	if (job->finish_new < job->state.new_row_index)
+		return TRUE;
+
+	/* The rows after the pending ones keep their numbers, but some of
+	 * them might have been thawed since they were copied */
+	if (job->finish_next > ring->writable) {
+		_vte_stream_truncate (job->finish_stream, ring->writable * sizeof (record));
+		job->finish_next = ring->writable;
+	}
+	for (; n < max_rows && job->finish_next < ring->writable; n++, job->finish_next++) {
+		if (!_vte_ring_read_row_record (ring, &record, job->finish_next))
+			memset (&record, 0, sizeof (record));
+		_vte_stream_append (job->finish_stream, (const char *) &record, sizeof (record));
+	}
+	if (job->finish_next < ring->writable)
+		return TRUE;
+
+	/* Skip the new rows whose text scrolled out while copying */
+	if (!_vte_ring_read_row_record (ring, &record, ring->start)) {
+		_vte_ring_rewrap_abandon (ring);
+		return FALSE;
+	}
+	start_text_offset = record.text_start_offset;
+	while (job->finish_start < ring->rewrap_boundary &&
+	       _vte_stream_read (job->finish_stream, job->finish_start * sizeof (record), (char *) &record, sizeof (record)) &&
+	       record.text_start_offset < start_text_offset)
+		job->finish_start++;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Rewrapped rows %lu to %lu into %lu rows.\n",
+			 ring->start, ring->rewrap_boundary, ring->rewrap_boundary - job->finish_start);
+
+	ring->start = job->finish_start;
+	if (ring->end - ring->start > ring->max)
+		ring->start = ring->end - ring->max;
+	row_stream = job->finish_stream;
+	job->finish_stream = NULL;
+	_vte_stream_advance_tail (row_stream, ring->start * sizeof (record));
+	_vte_ring_rewrap_drop_pending (ring);
+	g_object_unref (ring->row_stream);
+	ring->row_stream = row_stream;
+	_vte_ring_cached_rows_invalidate (ring);
+	return FALSE;
+}
+
+/**
+ * _vte_ring_rewrap_pending:
+ * @ring: a #VteRing
+ *
+ * Returns: whether some rows still need to be rewrapped by _vte_ring_rewrap_step().
+ */
+gboolean
+_vte_ring_rewrap_pending (VteRing *ring)
+{
+	return ring->rewrap_job != NULL;
+}
+
+/**
+ * _vte_ring_rewrap_step:
+ * @ring: a #VteRing
+ * @max_rows: the approximate number of rows to process
+ *
+ * Continues rewrapping the rows that _vte_ring_rewrap() left pending.
+ * Once that's done, they get new row numbers right above the rows that were
+ * rewrapped at once, and ring->start changes accordingly.
+ *
+ * Returns: %TRUE if there are still rows left to rewrap.
+ */
+gboolean
+_vte_ring_rewrap_step (VteRing *ring, gulong max_rows)
+{
+	VteRingRewrapJob *job = ring->rewrap_job;
+	VteRowRecord record;
+
+	if (job == NULL)
+		return FALSE;
+
+	if (ring->start >= ring->rewrap_boundary) {
+		/* The pending rows have all scrolled out meanwhile */
+		_vte_ring_rewrap_drop_pending (ring);
+		return FALSE;
+	}
+	if (job->finish_stream != NULL)
+		return _vte_ring_rewrap_job_finish_step (ring, max_rows);
+	if (!_vte_ring_read_row_record (ring, &record, ring->start)) {
+		_vte_ring_rewrap_abandon (ring);
+		return FALSE;
+	}
+	if (job->state.paragraph_start_text_offset < record.text_start_offset) {
+		/* The rows being rewrapped have scrolled out, catch up */
+		_vte_ring_rewrap_job_start (ring, job->state.columns);
+		return _vte_ring_rewrap_pending (ring);
+	}
+
+	if (!_vte_ring_rewrap_paragraphs (ring, &job->state, max_rows)) {
+		_vte_ring_rewrap_abandon (ring);
+		return FALSE;
+	}
+	if (job->state.paragraph_start_text_offset < job->state.end_text_offset)
+		return TRUE;
+
+	_vte_ring_rewrap_job_finish_begin (ring);
+	return _vte_ring_rewrap_pending (ring);
+}
+
+/**
+ * _vte_ring_rewrap:
+ * @ring: a #VteRing
+ * @columns: new number of columns
+ * @markers: NULL-terminated array of #VteVisualPosition
+ *
+ * Reflow the @ring to match the new number of @columns.
+ * For all @markers, find the cell at that position and update them to
+ * reflect the cell's new position.
+ *
+ * With a long scrollback, rows well above the screen and the markers are
+ * left for _vte_ring_rewrap_step().
+ */
+void
+_vte_ring_rewrap (VteRing *ring,
+		  glong columns,
+		  VteVisualPosition **markers)
+{
+	VteRingRewrapState state;
+	int i;
+	int num_markers = 0;
+	VteCellTextOffset *marker_text_offsets;
+	VteVisualPosition *new_markers;
+	gulong old_ring_end, first_row, new_first_row, margin, gap;
+
+	if (_vte_ring_length(ring) == 0)
+		return;
+	_vte_debug_print(VTE_DEBUG_RING, "Ring before rewrapping:\n");
+	_vte_ring_validate(ring);
+
+	/* Freeze everything, because rewrapping is really complicated and we don't want to
+	   duplicate the code for frozen and thawed rows. */
+	while (ring->writable < ring->end)
+		_vte_ring_freeze_one_row(ring);
+
+	/* Whatever was pending is going to be rewrapped for the new width. */
+	_vte_ring_rewrap_job_free (ring);
+
+	/* For markers given as (row,col) pairs find their offsets in the text stream.
+	   This code requires that the rows are already frozen. */
+	while (markers[num_markers] != NULL)
+		num_markers++;
+	marker_text_offsets = (VteCellTextOffset *) g_malloc(num_markers * sizeof (marker_text_offsets[0]));
+	new_markers = (VteVisualPosition *) g_malloc(num_markers * sizeof (new_markers[0]));
+	for (i = 0; i < num_markers; i++) {
+		/* Convert visual column into byte offset */
+		if (!_vte_frozen_row_column_to_text_offset(ring, markers[i]->row, markers[i]->col, &marker_text_offsets[i]))
+			goto err;
+		_vte_debug_print(VTE_DEBUG_RING,
+				"Marker #%d old coords:  row %ld  col %ld  ->  text_offset %" G_GSIZE_FORMAT " fragment_cells %d  eol_cells %d\n",
+				i, markers[i]->row, markers[i]->col, marker_text_offsets[i].text_offset,
+				marker_text_offsets[i].fragment_cells, marker_text_offsets[i].eol_cells);
+	}
+
+	/* Find out where to start right now: a few screenfuls from the bottom,
+	   or higher up if a marker is there or a previous rewrap is pending. */
+	first_row = ring->start;
+	margin = MAX (ring->visible_rows, VTE_RING_REWRAP_MIN_MARGIN) * VTE_RING_REWRAP_SYNC_SCREENS;
+	if (ring->end - ring->start > VTE_RING_REWRAP_SYNC_ROWS && ring->end - ring->start > 2 * margin) {
+		first_row = ring->end - margin;
+		for (i = 0; i < num_markers; i++)
+			if (markers[i]->row >= (glong) ring->start && markers[i]->row < (glong) first_row)
+				first_row = markers[i]->row;
+		if (ring->rewrap_boundary != 0)
+			first_row = MIN (first_row, ring->rewrap_boundary);
+		first_row = _vte_ring_paragraph_start (ring, first_row);
+	}
+
+	for (;;) {
+		gap = 0;
+		if (first_row > ring->start) {
+			/* Leave room for the pending rows to become as many as their
+			   text has bytes, one byte per row being the worst case. */
+			VteRowRecord top_record, first_record;
+			gsize top_bytes;
+			if (!_vte_ring_read_row_record (ring, &top_record, ring->start) ||
+			    !_vte_ring_read_row_record (ring, &first_record, first_row))
+				goto err;
+			top_bytes = first_record.text_start_offset - top_record.text_start_offset;
+			if (top_bytes > first_row - ring->start)
+				gap = top_bytes - (first_row - ring->start);
+			if (G_UNLIKELY (gap > G_MAXLONG / 4 - ring->end)) {
+				/* Out of row numbers, do it all right now */
+				first_row = ring->start;
+				gap = 0;
+			}
+		}
+		new_first_row = first_row == ring->start ? 0 : first_row + gap;
+
+		if (!_vte_ring_rewrap_begin (ring, &state, columns, first_row, ring->end, new_first_row))
+			goto err;
+		state.num_markers = num_markers;
+		state.marker_text_offsets = marker_text_offsets;
+		state.new_markers = new_markers;
+		for (i = 0; i < num_markers; i++)
+			new_markers[i].row = new_markers[i].col = -1;
+
+		if (!_vte_ring_rewrap_paragraphs (ring, &state, G_MAXULONG)) {
+			g_object_unref (state.new_row_stream);
+			goto err;
+		}
+
+		/* The screen has to fit in the rows rewrapped now. If not (the window
+		   got much wider), try again from higher up. */
+		if (first_row == ring->start || state.new_row_index - new_first_row >= margin / 2)
+			break;
+		g_object_unref (state.new_row_stream);
+		first_row = _vte_ring_paragraph_start (ring, MAX (ring->start, first_row - MIN (first_row, ring->end - first_row)));
+	}
+
+	/* Update the ring. */
+	old_ring_end = ring->end;
+	if (first_row == ring->start) {
+		_vte_ring_rewrap_drop_pending (ring);
+		g_object_unref(ring->row_stream);
+		ring->row_stream = state.new_row_stream;
+		ring->writable = ring->end = state.new_row_index;
+		ring->start = 0;
+		if (ring->end > ring->max)
+			ring->start = ring->end - ring->max;
+	} else {
+		_vte_debug_print(VTE_DEBUG_RING, "Leaving rows %lu to %lu pending, moving them by %lu.\n",
+				 ring->start, first_row, gap);
+		if (ring->rewrap_boundary == 0) {
+			ring->rewrap_old_row_stream = ring->row_stream;
+			ring->rewrap_old_delta = 0;
+		} else {
+			g_object_unref (ring->row_stream);
+		}
+		ring->row_stream = state.new_row_stream;
+		ring->rewrap_old_delta += gap;
+		ring->rewrap_boundary = first_row + gap;
+		ring->start += gap;
+		ring->writable = ring->end = state.new_row_index;
+		if (ring->end - ring->start > ring->max)
+			ring->start = ring->end - ring->max;
+		if (ring->start >= ring->rewrap_boundary)
+			_vte_ring_rewrap_drop_pending (ring);
+		else
+			_vte_ring_rewrap_job_start (ring, columns);
+	}
+	_vte_ring_cached_rows_invalidate (ring);
+
+	/* Find the markers. This requires that the ring is already updated. */
+	for (i = 0; i < num_markers; i++) {
+		/* Compute the row for markers beyond the ring */
+		if (new_markers[i].row == -1)
+			new_markers[i].row = markers[i]->row - old_ring_end + ring->end;
+		/* Convert byte offset into visual column */
+		if (!_vte_frozen_row_text_offset_to_column(ring, new_markers[i].row, &marker_text_offsets[i], &new_markers[i].col))
+			goto err;
+		_vte_debug_print(VTE_DEBUG_RING,
+				"Marker #%d new coords:  text_offset %" G_GSIZE_FORMAT "  fragment_cells %d  eol_cells %d  ->  row %ld  col %ld\n",
+				i, marker_text_offsets[i].text_offset, marker_text_offsets[i].fragment_cells,
+				marker_text_offsets[i].eol_cells, new_markers[i].row, new_markers[i].col);
+		markers[i]->row = new_markers[i].row;
+		markers[i]->col = new_markers[i].col;
+	}
+	g_free(marker_text_offsets);
+	g_free(new_markers);
+
+	_vte_debug_print(VTE_DEBUG_RING, "Ring after rewrapping:\n");
+	_vte_ring_validate(ring);
+	return;
+
+err:
+#ifdef VTE_DEBUG
+	_vte_debug_print(VTE_DEBUG_RING,
+			"Error while rewrapping\n");
+	g_assert_not_reached();
+#endif
+	g_free(marker_text_offsets);
+	g_free(new_markers);
+}
+
+
+/**
+ * _vte_ring_append_image:
+ * @ring: a #VteRing
+ * @surface: a Cairo surface object
+ * @pixelwidth: image width in pixels
+ * @pixelheight: image height in pixels
+ * @left: left position of image in cell unit
+ * @top: left position of image in cell unit
+ * @width: width of image in cell unit
+ * @height: width of image in cell unit
+ *
+ * Append an image into the internal image list.
+ */
+void
+_vte_ring_append_image (VteRing *ring, cairo_surface_t *surface, gint pixelwidth, gint pixelheight, glong left, glong top, glong width, glong height)
+{
+	using namespace vte::image;
+	image_object *image;
+	auto image_map = ring->image_map;
+	gulong char_width, char_height;
 
 	g_assert_true (image_map != NULL);
 
@@ -1562,92 +2754,1248 @@ _vte_ring_shrink_image_stream (VteRing *ring)
 			_vte_stream_advance_tail (ring->image_stream, first_image->get_stream_position ());
 }
 
-static gboolean
-_vte_ring_write_row (VteRing *ring,
-		     GOutputStream *stream,
-		     VteRowData *row,
-		     VteWriteFlags flags,
-		     GCancellable *cancellable,
-		     GError **error)
+/**
+ * _vte_ring_search_query_init:
+ * @query: the #VteRingSearchQuery to fill in
+ * @literal: (allow-none): text that every match contains
+ * @length: the length of @literal in bytes
+ *
+ * Prepares a query for _vte_ring_search_index_next() and
+ * _vte_ring_search_index_prev(). With no @literal, or one too short, the
+ * query rules out nothing.
+ */
+void
+_vte_ring_search_query_init (VteRingSearchQuery *query, const char *literal, gsize length)
 {
-	VteCell *cell;
-	GString *buffer = ring->utf8_buffer;
-	int i;
-	gsize bytes_written;
-
-	/* Simple version of the loop in _vte_ring_freeze_row().
-	 * TODO Should unify one day */
-	g_string_set_size (buffer, 0);
-	for (i = 0, cell = row->cells; i < row->len; i++, cell++) {
-		if (G_LIKELY (!cell->attr.fragment))
-			_vte_unistr_append_to_string (cell->c, buffer);
+	const guchar *s = (const guchar *) literal;
+	gsize i;
+
+	query->n_trigrams = 0;
+	query->span = length;
+	for (i = 0; literal != NULL && i + 2 < length && query->n_trigrams < VTE_RING_SEARCH_TRIGRAMS_MAX; i++) {
+		/* Whitespace and control characters might not come out of
+		 * the stream the same as they were searched for. */
+		if (s[i] <= ' ' || s[i + 1] <= ' ' || s[i + 2] <= ' ' ||
+		    s[i] == 0x7f || s[i + 1] == 0x7f || s[i + 2] == 0x7f)
+			continue;
+		query->trigrams[query->n_trigrams++] = _vte_ring_search_trigram (s[i], s[i + 1], s[i + 2]);
 	}
-	if (!row->attr.soft_wrapped)
-		g_string_append_c (buffer, '\n');
-
-	return g_output_stream_write_all (stream, buffer->str, buffer->len, &bytes_written, cancellable, error);
 }
 
 /**
- * _vte_ring_write_contents:
+ * _vte_ring_search_index_next:
  * @ring: a #VteRing
- * @stream: a #GOutputStream to write to
- * @flags: a set of #VteWriteFlags
- * @cancellable: optional #GCancellable object, %NULL to ignore
- * @error: a #GError location to store the error occuring, or %NULL to ignore
+ * @offset: the text offset to start searching at
+ * @end_offset: the text offset to stop searching at
+ * @query: the #VteRingSearchQuery
  *
- * Write entire ring contents to @stream according to @flags.
- *
- * Return: %TRUE on success, %FALSE if there was an error
+ * Returns: the first text offset at or after @offset where a match of
+ *   @query might start, or @end_offset if none.
  */
-gboolean
-_vte_ring_write_contents (VteRing *ring,
-			  GOutputStream *stream,
-			  VteWriteFlags flags,
-			  GCancellable *cancellable,
-			  GError **error)
+gsize
+_vte_ring_search_index_next (VteRing *ring, gsize offset, gsize end_offset, const VteRingSearchQuery *query)
 {
-	gulong i;
+	gsize block;
+
+	if (query->n_trigrams == 0 || offset >= end_offset)
+		return offset;
+
+	for (block = offset / VTE_RING_SEARCH_BLOCK_SIZE;
+	     block * VTE_RING_SEARCH_BLOCK_SIZE < end_offset;
+	     block++) {
+		if (_vte_ring_search_index_may_match (ring, block, query)) {
+			/* The literal may start a bit before the block */
+			gsize candidate = block * VTE_RING_SEARCH_BLOCK_SIZE;
+			candidate = candidate > query->span ? candidate - query->span : 0;
+			return MAX (offset, candidate);
+		}
+	}
 
-	_vte_debug_print(VTE_DEBUG_RING, "Writing contents to GOutputStream.\n");
+	return end_offset;
+}
 
-	if (ring->start < ring->writable)
-	{
-		VteRowRecord record;
+/**
+ * _vte_ring_search_index_prev:
+ * @ring: a #VteRing
+ * @start_offset: the text offset to stop searching at
+ * @offset: the text offset to search backwards from
+ * @query: the #VteRingSearchQuery
+ *
+ * Returns: the text offset such that no match of @query lies between it
+ *   and @offset, or @start_offset if none lies after @start_offset.
+ */
+gsize
+_vte_ring_search_index_prev (VteRing *ring, gsize start_offset, gsize offset, const VteRingSearchQuery *query)
+{
+	gsize block, first_block;
 
-		if (_vte_ring_read_row_record (ring, &record, ring->start))
-		{
-			gsize start_offset = record.text_start_offset;
-			gsize end_offset = _vte_stream_head (ring->text_stream);
-			char buf[4096];
-			while (start_offset < end_offset)
-			{
-				gsize bytes_written, len;
+	if (query->n_trigrams == 0 || offset <= start_offset)
+		return offset;
 
-				len = MIN (G_N_ELEMENTS (buf), end_offset - start_offset);
+	first_block = start_offset / VTE_RING_SEARCH_BLOCK_SIZE;
+	for (block = (offset - 1) / VTE_RING_SEARCH_BLOCK_SIZE + 1; block-- > first_block; ) {
+		if (_vte_ring_search_index_may_match (ring, block, query)) {
+			/* The literal ends before the end of the next block */
+			return MIN (offset, (block + 2) * VTE_RING_SEARCH_BLOCK_SIZE);
+		}
+	}
 
-				if (!_vte_stream_read (ring->text_stream, start_offset,
-						       buf, len))
-					return FALSE;
+	return start_offset;
+}
 
-				if (!g_output_stream_write_all (stream, buf, len,
-								&bytes_written, cancellable,
-								error))
-					return FALSE;
+/**
+ * _vte_ring_search_index_ranges:
+ * @ring: a #VteRing
+ * @start_offset: the text offset to start at
+ * @end_offset: the text offset to stop at
+ * @query: the #VteRingSearchQuery
+ * @ranges: a #GArray of #VteRingTextRange
+ *
+ * Appends to @ranges the parts of [@start_offset, @end_offset) where a match
+ * of @query might start, in order. Unlike the index itself, the ranges can be
+ * used from another thread.
+ */
+void
+_vte_ring_search_index_ranges (VteRing *ring, gsize start_offset, gsize end_offset,
+			       const VteRingSearchQuery *query, GArray *ranges)
+{
+	VteRingTextRange range;
+	gsize block;
+
+	if (start_offset >= end_offset)
+		return;
+
+	if (query->n_trigrams == 0) {
+		range.start = start_offset;
+		range.end = end_offset;
+		g_array_append_val (ranges, range);
+		return;
+	}
 
-				start_offset += len;
+	for (block = start_offset / VTE_RING_SEARCH_BLOCK_SIZE;
+	     block * VTE_RING_SEARCH_BLOCK_SIZE < end_offset;
+	     block++) {
+		if (!_vte_ring_search_index_may_match (ring, block, query))
+			continue;
+
+		/* The same margin as _vte_ring_search_index_next() */
+		range.start = block * VTE_RING_SEARCH_BLOCK_SIZE;
+		range.start = range.start > query->span ? range.start - query->span : 0;
+		range.start = MAX (range.start, start_offset);
+		range.end = MIN ((block + 1) * VTE_RING_SEARCH_BLOCK_SIZE, end_offset);
+
+		if (ranges->len > 0) {
+			VteRingTextRange *last = &g_array_index (ranges, VteRingTextRange, ranges->len - 1);
+			if (last->end >= range.start) {
+				last->end = MAX (last->end, range.end);
+				continue;
 			}
 		}
+		g_array_append_val (ranges, range);
+	}
+}
+
+/**
+ * _vte_ring_get_text_range:
+ * @ring: a #VteRing
+ * @start: the first row
+ * @end: the row after the last one, at most the first writable row
+ * @start_offset: (out): the text offset where @start begins
+ * @end_offset: (out): the text offset where @end begins
+ *
+ * Finds where the text of the frozen rows [@start, @end) is in the text stream.
+ *
+ * Returns: %FALSE on error.
+ */
+gboolean
+_vte_ring_get_text_range (VteRing *ring, gulong start, gulong end,
+			  gsize *start_offset, gsize *end_offset)
+{
+	VteRowRecord record;
+
+	g_assert (ring->start <= start && start <= end && end <= ring->writable);
+
+	if (start == end) {
+		*start_offset = *end_offset = 0;
+		return TRUE;
+	}
+
+	if (!_vte_ring_read_row_record (ring, &record, start))
+		return FALSE;
+	*start_offset = record.text_start_offset;
+	if (end < ring->writable) {
+		if (!_vte_ring_read_row_record (ring, &record, end))
+			return FALSE;
+		*end_offset = record.text_start_offset;
+	} else {
+		*end_offset = _vte_stream_head (ring->text_stream);
+	}
+
+	return TRUE;
+}
+
+/**
+ * _vte_ring_snapshot_text:
+ * @ring: a #VteRing
+ *
+ * The UTF-8 text of the frozen rows, as stored in the text stream: rows end
+ * in a newline unless they're soft wrapped. The snapshot can be read from
+ * another thread; text the ring drops meanwhile may fail to read.
+ *
+ * Returns: (transfer full): a read-only #VteStream
+ */
+VteStream *
+_vte_ring_snapshot_text (VteRing *ring)
+{
+	g_assert (ring->has_streams);
+
+	return _vte_stream_snapshot (ring->text_stream);
+}
+
+/**
+ * _vte_ring_text_offset_to_position:
+ * @ring: a #VteRing
+ * @start: the first frozen row to look in
+ * @end: the row after the last frozen row to look in
+ * @offset: a text offset within the frozen rows [@start, @end)
+ * @position: (out): the row and column of the character at @offset
+ *
+ * Returns: %FALSE on error.
+ */
+gboolean
+_vte_ring_text_offset_to_position (VteRing *ring, gulong start, gulong end, gsize offset,
+				   VteVisualPosition *position)
+{
+	VteRowRecord record;
+	VteCellTextOffset text_offset;
+
+	/* Find the last row starting at or before offset */
+	while (end - start > 1) {
+		gulong mid = start + (end - start) / 2;
+		if (!_vte_ring_read_row_record (ring, &record, mid))
+			return FALSE;
+		if (record.text_start_offset <= offset)
+			start = mid;
 		else
+			end = mid;
+	}
+
+	text_offset.text_offset = offset;
+	text_offset.fragment_cells = 0;
+	text_offset.eol_cells = -1;
+	position->row = start;
+	return _vte_frozen_row_text_offset_to_column (ring, start, &text_offset, &position->col);
+}
+
+/*
+ * VteRingExport: The contents of a ring, to be written out from any thread
+ */
+
+#define VTE_RING_EXPORT_CHUNK_SIZE (1 << 20)  /* bytes of text read from the stream, and of markup buffered, at once */
+
+struct _VteRingExport {
+	VteWriteFlags flags;
+	guint32 palette[VTE_PALETTE_SIZE];  /* 0xRRGGBB, for VTE_WRITE_HTML */
+
+	/* The frozen rows' streams, from the first row on */
+	VteStream *text_stream, *attr_stream;  /* snapshots, NULL if there are no frozen rows */
+	VteStream *row_stream;  /* snapshot, NULL if there are no frozen rows or some wait to be rewrapped */
+	gulong start, writable, end;
+	gsize text_start, text_end;
+	gsize attr_start, attr_end;
+
+	/* The writable rows, frozen the same way to memory. Their text
+	 * offsets continue from text_end. */
+	GString *tail_text;
+	GByteArray *tail_attrs;
+	GByteArray *tail_rows;  /* VteRowRecord */
+
+	/* The attr that applies after the last attr change */
+	VteStreamCellAttr last_attr;
+	char last_hyperlink[VTE_HYPERLINK_TOTAL_LENGTH_MAX + 1];
+	gsize last_attr_text_start_offset;
+
+	/* Writing: the current run of equal attrs */
+	gsize attr_offset;  /* of the next attr change, in the streams and then in tail_attrs */
+	gsize run_end;
+	VteStreamCellAttr run_attr;
+	char run_hyperlink[VTE_HYPERLINK_TOTAL_LENGTH_MAX + 1];
+	GString *open, *close;  /* the markup around the run's text; for ANSI, the escapes
+				   to switch to it and the SGR sequence in effect */
+	GString *sgr;
+	char prev_hyperlink[VTE_HYPERLINK_TOTAL_LENGTH_MAX + 1];  /* in effect, for ANSI */
+	GString *out;
+
+	gsize bytes_total;
+	std::atomic<gsize> bytes_written;
+};
+
+/* Appends the change from *@attr to @new_attr, effective at the end of the
+ * tail text so far, like _vte_ring_freeze_attr_change() does to the streams. */
+static void
+_vte_ring_export_attr_change (VteRingExport *exp, VteRing *ring, VteRowRecord *record,
+			      VteCellAttr *attr, const VteCellAttr *new_attr)
+{
+	VteCellAttrChange attr_change;
+	VteRingHyperlink *hyperlink = hyperlink_get(ring, attr->hyperlink_idx);
+	guint16 hyperlink_length = hyperlink->len;
+
+	exp->last_attr_text_start_offset = exp->text_end + exp->tail_text->len;
+	memset(&attr_change, 0, sizeof (attr_change));
+	attr_change.text_end_offset = exp->last_attr_text_start_offset;
+	_attrcpy(&attr_change.attr, attr);
+	attr_change.attr.hyperlink_length = hyperlink_length;
+	g_byte_array_append (exp->tail_attrs, (const guint8 *) &attr_change, sizeof (attr_change));
+	g_byte_array_append (exp->tail_attrs, (const guint8 *) hyperlink->str, hyperlink_length);
+	g_byte_array_append (exp->tail_attrs, (const guint8 *) &hyperlink_length, 2);
+	if (record->text_start_offset == attr_change.text_end_offset)
+		/* This row doesn't use the previous attr, adjust */
+		record->attr_start_offset = exp->attr_end + exp->tail_attrs->len;
+	*attr = *new_attr;
+}
+
+/* Simple version of the loop in _vte_ring_freeze_row(); combining characters
+ * don't need an attr of their own to be written out. */
+static void
+_vte_ring_export_freeze_row (VteRingExport *exp, VteRing *ring, VteCellAttr *attr, const VteRowData *row)
+{
+	VteRowRecord record;
+	const VteCell *cell;
+	gsize i;
+
+	memset(&record, 0, sizeof (record));
+	record.text_start_offset = exp->text_end + exp->tail_text->len;
+	record.attr_start_offset = exp->attr_end + exp->tail_attrs->len;
+	record.soft_wrapped = row->attr.soft_wrapped;
+
+	for (i = 0, cell = row->cells; i < row->len; i++, cell++) {
+		if (G_UNLIKELY (cell->attr.fragment))
+			continue;
+		if (memcmp(attr, &cell->attr, sizeof (VteCellAttr)) != 0)
+			_vte_ring_export_attr_change (exp, ring, &record, attr, &cell->attr);
+		_vte_unistr_append_to_string (cell->c, exp->tail_text);
+	}
+
+	record.is_ascii = TRUE;
+	for (i = record.text_start_offset - exp->text_end; i < exp->tail_text->len; i++) {
+		guchar c = exp->tail_text->str[i];
+		if (c < 0x20 || c >= 0x7f) {
+			record.is_ascii = FALSE;
+			break;
+		}
+	}
+
+	if (!row->attr.soft_wrapped)
+		g_string_append_c (exp->tail_text, '\n');
+	g_byte_array_append (exp->tail_rows, (const guint8 *) &record, sizeof (record));
+}
+
+/**
+ * _vte_ring_export_new:
+ * @ring: a #VteRing
+ * @flags: a set of #VteWriteFlags
+ * @palette: (allow-none): the RGB values of the colors up to VTE_PALETTE_SIZE,
+ *   as 0xRRGGBB, for %VTE_WRITE_HTML
+ *
+ * Takes what _vte_ring_export_write() needs to write out the ring's contents:
+ * snapshots of the frozen rows' streams, and the writable rows frozen to
+ * memory. Later changes to the ring don't affect the export, except that text
+ * the ring drops meanwhile fails to be written.
+ *
+ * Returns: (transfer full): a new #VteRingExport
+ */
+VteRingExport *
+_vte_ring_export_new (VteRing *ring, VteWriteFlags flags, const guint32 *palette)
+{
+	VteRingExport *exp = new VteRingExport();
+	VteCellAttr attr;
+	gulong i;
+
+	exp->flags = flags;
+	if (palette != NULL)
+		memcpy (exp->palette, palette, sizeof (exp->palette));
+
+	exp->start = exp->writable = ring->writable;
+	exp->end = ring->end;
+	if (ring->start < ring->writable) {
+		VteRowRecord record;
+
+		if (_vte_ring_read_row_record (ring, &record, ring->start)) {
+			exp->text_stream = _vte_ring_snapshot_text (ring);
+			exp->attr_stream = _vte_stream_snapshot (ring->attr_stream);
+			if (!_vte_ring_rewrap_pending (ring))
+				exp->row_stream = _vte_stream_snapshot (ring->row_stream);
+			exp->start = ring->start;
+			exp->text_start = record.text_start_offset;
+			exp->attr_start = record.attr_start_offset;
+		}
+	}
+	if (ring->has_streams) {
+		exp->text_end = _vte_stream_head (ring->text_stream);
+		exp->attr_end = _vte_stream_head (ring->attr_stream);
+	}
+	if (exp->text_stream == NULL) {
+		exp->text_start = exp->text_end;
+		exp->attr_start = exp->attr_end;
+	}
+	exp->last_attr_text_start_offset = ring->last_attr_text_start_offset;
+
+	exp->tail_text = g_string_sized_new ((ring->end - ring->writable) * 81);
+	exp->tail_attrs = g_byte_array_new ();
+	exp->tail_rows = g_byte_array_sized_new ((ring->end - ring->writable) * sizeof (VteRowRecord));
+	attr = ring->last_attr;
+	for (i = ring->writable; i < ring->end; i++)
+		_vte_ring_export_freeze_row (exp, ring, &attr, _vte_ring_writable_index (ring, i));
+	_attrcpy(&exp->last_attr, &attr);
+	exp->last_attr.hyperlink_length = hyperlink_get(ring, attr.hyperlink_idx)->len;
+	strcpy (exp->last_hyperlink, hyperlink_get(ring, attr.hyperlink_idx)->str);
+
+	exp->open = g_string_new (NULL);
+	exp->close = g_string_new (NULL);
+	exp->sgr = g_string_new (NULL);
+	exp->out = g_string_sized_new (flags & (VTE_WRITE_ANSI | VTE_WRITE_HTML) ? VTE_RING_EXPORT_CHUNK_SIZE + 4096 : 0);
+
+	exp->bytes_total = exp->text_end - exp->text_start + exp->tail_text->len;
+	exp->bytes_written = 0;
+
+	return exp;
+}
+
+void
+_vte_ring_export_free (VteRingExport *exp)
+{
+	if (exp->text_stream != NULL)
+		g_object_unref (exp->text_stream);
+	if (exp->attr_stream != NULL)
+		g_object_unref (exp->attr_stream);
+	if (exp->row_stream != NULL)
+		g_object_unref (exp->row_stream);
+	g_string_free (exp->tail_text, TRUE);
+	g_byte_array_free (exp->tail_attrs, TRUE);
+	g_byte_array_free (exp->tail_rows, TRUE);
+	g_string_free (exp->open, TRUE);
+	g_string_free (exp->close, TRUE);
+	g_string_free (exp->sgr, TRUE);
+	g_string_free (exp->out, TRUE);
+	delete exp;
+}
+
+/**
+ * _vte_ring_export_get_progress:
+ * @exp: a #VteRingExport
+ *
+ * Can be called from any thread while _vte_ring_export_write() is running.
+ *
+ * Returns: the part of the text written so far, from 0 to 1
+ */
+double
+_vte_ring_export_get_progress (VteRingExport *exp)
+{
+	if (exp->bytes_total == 0)
+		return 1.;
+	return MIN ((double) exp->bytes_written / exp->bytes_total, 1.);
+}
+
+/* Reads the attr change at exp->attr_offset into the current run. */
+static gboolean
+_vte_ring_export_next_run (VteRingExport *exp)
+{
+	VteCellAttrChange attr_change;
+	guint16 hyperlink_length;
+
+	if (exp->attr_stream != NULL && exp->attr_offset < exp->attr_end) {
+		if (!_vte_stream_read (exp->attr_stream, exp->attr_offset, (char *) &attr_change, sizeof (attr_change)))
+			return FALSE;
+		hyperlink_length = MIN (attr_change.attr.hyperlink_length, VTE_HYPERLINK_TOTAL_LENGTH_MAX);
+		if (hyperlink_length && !_vte_stream_read (exp->attr_stream, exp->attr_offset + sizeof (attr_change),
+							   exp->run_hyperlink, hyperlink_length))
 			return FALSE;
+		exp->attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length + 2;
+		if (exp->attr_offset >= exp->attr_end)
+			exp->attr_offset = exp->attr_end;
+	} else if (exp->attr_offset - exp->attr_end < exp->tail_attrs->len) {
+		const guint8 *p = exp->tail_attrs->data + (exp->attr_offset - exp->attr_end);
+
+		memcpy (&attr_change, p, sizeof (attr_change));
+		hyperlink_length = attr_change.attr.hyperlink_length;
+		memcpy (exp->run_hyperlink, p + sizeof (attr_change), hyperlink_length);
+		exp->attr_offset += sizeof (attr_change) + hyperlink_length + 2;
+	} else {
+		attr_change.text_end_offset = G_MAXSIZE;
+		attr_change.attr = exp->last_attr;
+		hyperlink_length = exp->last_attr.hyperlink_length;
+		memcpy (exp->run_hyperlink, exp->last_hyperlink, hyperlink_length);
 	}
+	exp->run_hyperlink[hyperlink_length] = '\0';
+	exp->run_attr = attr_change.attr;
+	exp->run_end = attr_change.text_end_offset;
 
-	for (i = ring->writable; i < ring->end; i++) {
-		if (!_vte_ring_write_row (ring, stream,
-					  _vte_ring_writable_index (ring, i),
-					  flags, cancellable, error))
+	return TRUE;
+}
+
+static void
+_vte_ring_export_escape (GString *out, const char *text, gsize len)
+{
+	const char *end = text + len;
+
+	for (; text < end; text++) {
+		switch (*text) {
+		case '&': g_string_append (out, "&amp;"); break;
+		case '<': g_string_append (out, "&lt;"); break;
+		case '>': g_string_append (out, "&gt;"); break;
+		case '"': g_string_append (out, "&quot;"); break;
+		default: g_string_append_c (out, *text); break;
+		}
+	}
+}
+
+static void
+_vte_ring_export_append_sgr_color (GString *out, guint color, guint base, guint bright_base)
+{
+	if (color >= VTE_LEGACY_COLORS_OFFSET && color < VTE_LEGACY_COLORS_OFFSET + VTE_LEGACY_FULL_COLOR_SET_SIZE) {
+		color -= VTE_LEGACY_COLORS_OFFSET;
+		if (color < VTE_LEGACY_COLOR_SET_SIZE)
+			g_string_append_printf (out, ";%u", base + color);
+		else
+			g_string_append_printf (out, ";%u", bright_base + color - VTE_COLOR_BRIGHT_OFFSET);
+	} else if (color & VTE_RGB_COLOR) {
+		g_string_append_printf (out, ";%u;2;%u;%u;%u", base + 8,
+					(color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+	} else if (color < 256) {
+		g_string_append_printf (out, ";%u;5;%u", base + 8, color);
+	}
+}
+
+/* The ANSI escape sequences that switch from the previous run's attrs to
+ * the current one's, if they differ. */
+static void
+_vte_ring_export_ansi_markup (VteRingExport *exp, const VteCellAttr *attr)
+{
+	const char *hyperlink = exp->run_hyperlink;
+	GString *sgr = exp->sgr;
+
+	g_string_assign (sgr, "\033[0");
+	if (attr->bold)
+		g_string_append (sgr, ";1");
+	if (attr->dim)
+		g_string_append (sgr, ";2");
+	if (attr->italic)
+		g_string_append (sgr, ";3");
+	if (attr->underline)
+		g_string_append (sgr, ";4");
+	if (attr->blink)
+		g_string_append (sgr, ";5");
+	if (attr->reverse)
+		g_string_append (sgr, ";7");
+	if (attr->invisible)
+		g_string_append (sgr, ";8");
+	if (attr->strikethrough)
+		g_string_append (sgr, ";9");
+	_vte_ring_export_append_sgr_color (sgr, attr->fore, 30, 90);
+	_vte_ring_export_append_sgr_color (sgr, attr->back, 40, 100);
+	g_string_append_c (sgr, 'm');
+
+	g_string_truncate (exp->open, 0);
+	if (!g_string_equal (sgr, exp->close)) {
+		g_string_append_len (exp->open, sgr->str, sgr->len);
+		g_string_assign (exp->close, sgr->str);
+	}
+
+	/* Hyperlinks are "id;uri"; ids starting with ':' were made up by us */
+	if (strcmp (hyperlink, exp->prev_hyperlink) != 0) {
+		const char *uri = strchr (hyperlink, ';');
+
+		g_string_append (exp->open, "\033]8;");
+		if (uri != NULL) {
+			if (hyperlink[0] != ':')
+				g_string_append_printf (exp->open, "id=%.*s", (int) (uri - hyperlink), hyperlink);
+			g_string_append (exp->open, uri);
+		} else {
+			g_string_append_c (exp->open, ';');
+		}
+		g_string_append (exp->open, "\033\\");
+		strcpy (exp->prev_hyperlink, hyperlink);
+	}
+}
+
+static guint32
+_vte_ring_export_rgb (VteRingExport *exp, guint color)
+{
+	if (color >= VTE_LEGACY_COLORS_OFFSET && color < VTE_LEGACY_COLORS_OFFSET + VTE_LEGACY_FULL_COLOR_SET_SIZE)
+		color -= VTE_LEGACY_COLORS_OFFSET;
+	if (color & VTE_RGB_COLOR)
+		return color & 0xffffff;
+	return exp->palette[MIN (color, (guint) VTE_PALETTE_SIZE - 1)];
+}
+
+/* The HTML tags around the current run's text, the same as
+ * VteTerminalPrivate::cellattr_to_html() uses. */
+static void
+_vte_ring_export_html_markup (VteRingExport *exp, const VteCellAttr *attr)
+{
+	GString *open = exp->open, *close = exp->close;
+	const char *uri = strchr (exp->run_hyperlink, ';');
+	guint fore = attr->fore, back = attr->back;
+
+	g_string_truncate (open, 0);
+	g_string_truncate (close, 0);
+
+	if (attr->bold && fore >= VTE_LEGACY_COLORS_OFFSET && fore < VTE_LEGACY_COLORS_OFFSET + VTE_LEGACY_COLOR_SET_SIZE)
+		fore += VTE_COLOR_BRIGHT_OFFSET;
+	if (attr->reverse) {
+		guint tmp = fore;
+		fore = back;
+		back = tmp;
+	}
+
+	if (uri != NULL) {
+		g_string_append (open, "<a href=\"");
+		_vte_ring_export_escape (open, uri + 1, strlen (uri + 1));
+		g_string_append (open, "\">");
+		g_string_prepend (close, "</a>");
+	}
+	if (attr->bold) {
+		g_string_append (open, "<b>");
+		g_string_prepend (close, "</b>");
+	}
+	if (attr->italic) {
+		g_string_append (open, "<i>");
+		g_string_prepend (close, "</i>");
+	}
+	if (attr->fore != VTE_DEFAULT_FG || attr->reverse) {
+		g_string_append_printf (open, "<font color=\"#%06X\">", _vte_ring_export_rgb (exp, fore));
+		g_string_prepend (close, "</font>");
+	}
+	if (attr->back != VTE_DEFAULT_BG || attr->reverse) {
+		g_string_append_printf (open, "<span style=\"background-color:#%06X\">", _vte_ring_export_rgb (exp, back));
+		g_string_prepend (close, "</span>");
+	}
+	if (attr->underline) {
+		g_string_append (open, "<u>");
+		g_string_prepend (close, "</u>");
+	}
+	if (attr->strikethrough) {
+		g_string_append (open, "<strike>");
+		g_string_prepend (close, "</strike>");
+	}
+	if (attr->blink) {
+		g_string_append (open, "<blink>");
+		g_string_prepend (close, "</blink>");
+	}
+}
+
+static gboolean
+_vte_ring_export_flush (VteRingExport *exp, GOutputStream *stream, GCancellable *cancellable, GError **error)
+{
+	gsize bytes_written;
+
+	if (exp->out->len == 0)
+		return TRUE;
+	if (!g_output_stream_write_all (stream, exp->out->str, exp->out->len, &bytes_written, cancellable, error))
+		return FALSE;
+	g_string_truncate (exp->out, 0);
+	return TRUE;
+}
+
+/* Appends the part of the current run in @text, @len bytes of text at @offset. */
+static void
+_vte_ring_export_append_run (VteRingExport *exp, const char *text, gsize len)
+{
+	GString *out = exp->out;
+	const char *end = text + len;
+
+	if (exp->flags & VTE_WRITE_HTML) {
+		/* Keep the tags within lines, like attributes_to_html() */
+		while (text < end) {
+			const char *nl = (const char *) memchr (text, '\n', end - text);
+			const char *line_end = nl ? nl : end;
+
+			if (line_end > text) {
+				g_string_append_len (out, exp->open->str, exp->open->len);
+				_vte_ring_export_escape (out, text, line_end - text);
+				g_string_append_len (out, exp->close->str, exp->close->len);
+			}
+			if (nl != NULL)
+				g_string_append_c (out, '\n');
+			text = nl ? nl + 1 : end;
+		}
+	} else {
+		g_string_append_len (out, exp->open->str, exp->open->len);
+		g_string_truncate (exp->open, 0);
+		g_string_append_len (out, text, len);
+	}
+}
+
+/* Writes @len bytes of text at @offset, marked up with its attrs if asked to. */
+static gboolean
+_vte_ring_export_write_text (VteRingExport *exp,
+			     GOutputStream *stream,
+			     const char *text,
+			     gsize offset,
+			     gsize len,
+			     GCancellable *cancellable,
+			     GError **error)
+{
+	gsize bytes_written;
+
+	if (!(exp->flags & (VTE_WRITE_ANSI | VTE_WRITE_HTML))) {
+		return g_output_stream_write_all (stream, text, len, &bytes_written, cancellable, error);
+	}
+
+	while (len) {
+		gsize l;
+
+		if (offset >= exp->run_end) {
+			VteCellAttr attr;
+
+			do {
+				if (!_vte_ring_export_next_run (exp)) {
+					g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+							     "Failed to read the attributes");
+					return FALSE;
+				}
+			} while (offset >= exp->run_end);
+
+			_attrcpy (&attr, &exp->run_attr);
+			if (exp->flags & VTE_WRITE_HTML)
+				_vte_ring_export_html_markup (exp, &attr);
+			else
+				_vte_ring_export_ansi_markup (exp, &attr);
+		}
+
+		l = MIN (len, exp->run_end - offset);
+		_vte_ring_export_append_run (exp, text, l);
+		text += l; offset += l; len -= l;
+
+		if (exp->out->len >= VTE_RING_EXPORT_CHUNK_SIZE) {
+			if (!_vte_ring_export_flush (exp, stream, cancellable, error))
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * _vte_ring_export_write:
+ * @exp: a #VteRingExport
+ * @stream: a #GOutputStream to write to
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @error: a #GError location to store the error occuring, or %NULL to ignore
+ *
+ * Writes the exported contents to @stream, according to the #VteWriteFlags
+ * given to _vte_ring_export_new(). The frozen text is read from the streams
+ * in large chunks, straight into the buffer written to @stream. Can be called
+ * from any thread, once.
+ *
+ * Return: %TRUE on success, %FALSE if there was an error
+ */
+gboolean
+_vte_ring_export_write (VteRingExport *exp,
+			GOutputStream *stream,
+			GCancellable *cancellable,
+			GError **error)
+{
+	gsize offset, len;
+	char *buf = NULL;
+	gboolean ret = FALSE;
+
+	exp->attr_offset = exp->attr_stream != NULL ? exp->attr_start : exp->attr_end;
+	exp->run_end = 0;
+	g_string_assign (exp->close, "\033[0m");
+	exp->prev_hyperlink[0] = '\0';
+
+	if (exp->flags & VTE_WRITE_HTML)
+		g_string_append (exp->out, "<pre>");
+
+	if (exp->text_stream != NULL && exp->text_start < exp->text_end) {
+		buf = (char *) g_malloc (MIN (VTE_RING_EXPORT_CHUNK_SIZE, exp->text_end - exp->text_start));
+		for (offset = exp->text_start; offset < exp->text_end; offset += len) {
+			len = MIN (VTE_RING_EXPORT_CHUNK_SIZE, exp->text_end - offset);
+
+			if (g_cancellable_set_error_if_cancelled (cancellable, error))
+				goto out;
+			if (!_vte_stream_read (exp->text_stream, offset, buf, len)) {
+				g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+						     "Failed to read the scrollback");
+				goto out;
+			}
+			if (!_vte_ring_export_write_text (exp, stream, buf, offset, len, cancellable, error))
+				goto out;
+			exp->bytes_written += len;
+		}
+	}
+
+	/* The writable rows are written right from memory */
+	if (!_vte_ring_export_write_text (exp, stream, exp->tail_text->str, exp->text_end,
+					  exp->tail_text->len, cancellable, error))
+		goto out;
+	exp->bytes_written += exp->tail_text->len;
+
+	if (exp->flags & VTE_WRITE_HTML)
+		g_string_append (exp->out, "</pre>");
+	else if (exp->flags & VTE_WRITE_ANSI) {
+		if (strcmp (exp->close->str, "\033[0m") != 0)
+			g_string_append (exp->out, "\033[0m");
+		if (exp->prev_hyperlink[0] != '\0')
+			g_string_append (exp->out, "\033]8;;\033\\");
+	}
+	if (!_vte_ring_export_flush (exp, stream, cancellable, error))
+		goto out;
+
+	ret = TRUE;
+out:
+	g_free (buf);
+	return ret;
+}
+
+/* Writes the stream's contents from @start to @end, through @buf. */
+static gboolean
+_vte_ring_export_copy_stream (VteRingExport *exp,
+			      VteStream *from,
+			      gsize start,
+			      gsize end,
+			      char *buf,
+			      GOutputStream *stream,
+			      GCancellable *cancellable,
+			      GError **error)
+{
+	gsize offset, len, bytes_written;
+
+	for (offset = start; offset < end; offset += len) {
+		len = MIN (VTE_RING_EXPORT_CHUNK_SIZE, end - offset);
+
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
+		if (!_vte_stream_read (from, offset, buf, len)) {
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+					     "Failed to read the scrollback");
 			return FALSE;
+		}
+		if (!g_output_stream_write_all (stream, buf, len, &bytes_written, cancellable, error))
+			return FALSE;
+		exp->bytes_written += len;
 	}
 
 	return TRUE;
 }
+
+/**
+ * _vte_ring_export_save:
+ * @exp: a #VteRingExport
+ * @columns: the width the rows are wrapped at
+ * @cursor: the cursor's position, to be restored along with the rows
+ * @stream: a #GOutputStream to write to
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @error: a #GError location to store the error occuring, or %NULL to ignore
+ *
+ * Writes the exported rows to @stream in the format _vte_ring_load_snapshot()
+ * reads, see #VteRingSnapshotHeader. The streams' contents are written as is,
+ * but not as stored: each ring encrypts its streams with a key of its own that
+ * never leaves the process, so they're decrypted to be written, and the ring
+ * that loads them encrypts them again. The file contains the rows in the clear.
+ *
+ * The export must have been made with no rows waiting to be rewrapped.
+ * Can be called from any thread, instead of _vte_ring_export_write().
+ *
+ * Return: %TRUE on success, %FALSE if there was an error
+ */
+gboolean
+_vte_ring_export_save (VteRingExport *exp,
+		       glong columns,
+		       const VteVisualPosition *cursor,
+		       GOutputStream *stream,
+		       GCancellable *cancellable,
+		       GError **error)
+{
+	VteRingSnapshotHeader header;
+	VteRingSnapshotSection *sections = header.sections;
+	gsize rows_start = exp->start * sizeof (VteRowRecord);
+	gsize rows_end = exp->writable * sizeof (VteRowRecord);
+	gsize bytes_written, hyperlink_length;
+	guint64 offset;
+	char *buf;
+	gboolean ret = FALSE;
+	int i;
+
+	if (exp->start < exp->writable && exp->row_stream == NULL) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+				     "The scrollback is being rewrapped");
+		return FALSE;
+	}
+
+	hyperlink_length = strlen (exp->last_hyperlink);
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, VTE_RING_SNAPSHOT_MAGIC, sizeof (header.magic));
+	header.start = exp->start;
+	header.end = exp->end;
+	header.text_start = exp->text_start;
+	header.attr_start = exp->attr_start;
+	header.last_attr_text_start_offset = exp->last_attr_text_start_offset;
+	header.columns = columns;
+	header.cursor_row = cursor->row;
+	header.cursor_col = cursor->col;
+	header.last_attr = exp->last_attr;
+
+	offset = sizeof (header);
+	sections[VTE_RING_SNAPSHOT_ROWS].length = rows_end - rows_start + exp->tail_rows->len;
+	sections[VTE_RING_SNAPSHOT_TEXT].length = exp->text_end - exp->text_start + exp->tail_text->len;
+	sections[VTE_RING_SNAPSHOT_ATTRS].length = exp->attr_end - exp->attr_start + exp->tail_attrs->len;
+	sections[VTE_RING_SNAPSHOT_HYPERLINK].length = hyperlink_length;
+	for (i = 0; i < VTE_RING_SNAPSHOT_N_SECTIONS; i++) {
+		sections[i].offset = offset;
+		offset += sections[i].length;
+	}
+
+	exp->bytes_total = offset;
+	exp->bytes_written = 0;
+
+	if (!g_output_stream_write_all (stream, &header, sizeof (header), &bytes_written, cancellable, error))
+		return FALSE;
+
+	buf = (char *) g_malloc (VTE_RING_EXPORT_CHUNK_SIZE);
+	if (exp->start < exp->writable) {
+		if (!_vte_ring_export_copy_stream (exp, exp->row_stream, rows_start, rows_end,
+						   buf, stream, cancellable, error))
+			goto out;
+	}
+	if (!g_output_stream_write_all (stream, exp->tail_rows->data, exp->tail_rows->len,
+					&bytes_written, cancellable, error))
+		goto out;
+	if (exp->text_stream != NULL) {
+		if (!_vte_ring_export_copy_stream (exp, exp->text_stream, exp->text_start, exp->text_end,
+						   buf, stream, cancellable, error))
+			goto out;
+	}
+	if (!g_output_stream_write_all (stream, exp->tail_text->str, exp->tail_text->len,
+					&bytes_written, cancellable, error))
+		goto out;
+	if (exp->attr_stream != NULL) {
+		if (!_vte_ring_export_copy_stream (exp, exp->attr_stream, exp->attr_start, exp->attr_end,
+						   buf, stream, cancellable, error))
+			goto out;
+	}
+	if (!g_output_stream_write_all (stream, exp->tail_attrs->data, exp->tail_attrs->len,
+					&bytes_written, cancellable, error))
+		goto out;
+	if (!g_output_stream_write_all (stream, exp->last_hyperlink, hyperlink_length,
+					&bytes_written, cancellable, error))
+		goto out;
+	exp->bytes_written = exp->bytes_total;
+
+	ret = TRUE;
+out:
+	g_free (buf);
+	return ret;
+}
+
+/*
+ * Checks that the row records and attr changes of a snapshot are consistent
+ * with each other and with its sections, as thawing the rows relies on that.
+ */
+static gboolean
+_vte_ring_snapshot_validate (const VteRingSnapshotHeader *header, const char *data)
+{
+	const VteRingSnapshotSection *sections = header->sections;
+	const char *rows = data + sections[VTE_RING_SNAPSHOT_ROWS].offset;
+	const char *attrs = data + sections[VTE_RING_SNAPSHOT_ATTRS].offset;
+	guint64 text_end = header->text_start + sections[VTE_RING_SNAPSHOT_TEXT].length;
+	guint64 attr_end = header->attr_start + sections[VTE_RING_SNAPSHOT_ATTRS].length;
+	guint64 attr_offset = header->attr_start, text_offset = header->text_start;
+	guint64 i, n_rows = header->end - header->start;
+	VteCellAttrChange attr_change;
+	VteRowRecord record;
+	guint16 hyperlink_length;
+
+	if (n_rows > sections[VTE_RING_SNAPSHOT_ROWS].length / sizeof (record) ||
+	    text_end < header->text_start || attr_end < header->attr_start)
+		return FALSE;
+
+	for (i = 0; i <= n_rows; i++) {
+		if (i < n_rows) {
+			memcpy (&record, rows + i * sizeof (record), sizeof (record));
+		} else {
+			/* The attr changes after the last row's start need checking too */
+			record.text_start_offset = text_end;
+			record.attr_start_offset = attr_end;
+		}
+		if (record.text_start_offset < text_offset || record.text_start_offset > text_end ||
+		    record.attr_start_offset < attr_offset || record.attr_start_offset > attr_end)
+			return FALSE;
+		text_offset = record.text_start_offset;
+
+		/* Walk the attr changes up to the row's first one */
+		while (attr_offset < record.attr_start_offset) {
+			if (attr_end - attr_offset < sizeof (attr_change) + 2)
+				return FALSE;
+			memcpy (&attr_change, attrs + (attr_offset - header->attr_start), sizeof (attr_change));
+			if (attr_change.attr.hyperlink_length > VTE_HYPERLINK_TOTAL_LENGTH_MAX ||
+			    attr_end - attr_offset < sizeof (attr_change) + attr_change.attr.hyperlink_length + 2 ||
+			    attr_change.text_end_offset < header->text_start || attr_change.text_end_offset > text_end)
+				return FALSE;
+			attr_offset += sizeof (attr_change) + attr_change.attr.hyperlink_length;
+			memcpy (&hyperlink_length, attrs + (attr_offset - header->attr_start), 2);
+			if (hyperlink_length != attr_change.attr.hyperlink_length)
+				return FALSE;
+			attr_offset += 2;
+		}
+		if (attr_offset != record.attr_start_offset)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * _vte_ring_load_snapshot:
+ * @ring: a #VteRing with streams
+ * @data: the contents of a file written by _vte_ring_export_save()
+ * @len: the length of @data
+ * @columns: (out): the width the rows are wrapped at
+ * @cursor: (out): the cursor's position
+ * @error: a #GError location to store the error occuring, or %NULL to ignore
+ *
+ * Replaces the ring's contents with the rows in @data, which can be a mapped
+ * file: the sections are appended to the streams straight from it. The rows
+ * keep their numbers and stream offsets, so the row records and attr changes
+ * are used as they are, once checked to be consistent. All the rows are frozen; the ones written to are
+ * thawed as usual.
+ *
+ * Returns: %FALSE if @data isn't a snapshot, leaving the ring alone.
+ */
+gboolean
+_vte_ring_load_snapshot (VteRing *ring,
+			 const char *data,
+			 gsize len,
+			 glong *columns,
+			 VteVisualPosition *cursor,
+			 GError **error)
+{
+	VteRingSnapshotHeader header;
+	const VteRingSnapshotSection *sections = header.sections;
+	char hyperlink[VTE_HYPERLINK_TOTAL_LENGTH_MAX + 1];
+	VteCellAttr attr;
+	const char *text;
+	gsize text_len;
+	int i;
+
+	g_assert (ring->has_streams);
+
+	if (len < sizeof (header))
+		goto invalid;
+	memcpy (&header, data, sizeof (header));
+	if (memcmp (header.magic, VTE_RING_SNAPSHOT_MAGIC, sizeof (header.magic)) != 0)
+		goto invalid;
+	for (i = 0; i < VTE_RING_SNAPSHOT_N_SECTIONS; i++) {
+		if (sections[i].offset > len || sections[i].length > len - sections[i].offset)
+			goto invalid;
+	}
+	if (header.end < header.start ||
+	    sections[VTE_RING_SNAPSHOT_ROWS].length != (header.end - header.start) * sizeof (VteRowRecord) ||
+	    sections[VTE_RING_SNAPSHOT_HYPERLINK].length != header.last_attr.hyperlink_length ||
+	    header.last_attr.hyperlink_length > VTE_HYPERLINK_TOTAL_LENGTH_MAX ||
+	    header.last_attr_text_start_offset > header.text_start + sections[VTE_RING_SNAPSHOT_TEXT].length ||
+	    !_vte_ring_snapshot_validate (&header, data))
+		goto invalid;
+
+	_vte_debug_print (VTE_DEBUG_RING, "Loading rows %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT ".\n",
+			  header.start, header.end);
+
+	_vte_ring_reset (ring);
+	ring->start = ring->writable = ring->end = header.start;
+	_vte_stream_reset (ring->row_stream, header.start * sizeof (VteRowRecord));
+	_vte_stream_reset (ring->text_stream, header.text_start);
+	_vte_stream_reset (ring->attr_stream, header.attr_start);
+
+	/* The search index starts over at the new offsets */
+	g_ptr_array_set_size (ring->search_index.blooms, 0);
+	ring->search_index.carry_len = 0;
+	ring->search_index.carry_offset = header.text_start;
+
+	text = data + sections[VTE_RING_SNAPSHOT_TEXT].offset;
+	text_len = sections[VTE_RING_SNAPSHOT_TEXT].length;
+	_vte_ring_search_index_add (ring, header.text_start, text, text_len);
+	_vte_stream_append (ring->text_stream, text, text_len);
+	_vte_stream_append (ring->attr_stream,
+			    data + sections[VTE_RING_SNAPSHOT_ATTRS].offset,
+			    sections[VTE_RING_SNAPSHOT_ATTRS].length);
+	_vte_stream_append (ring->row_stream,
+			    data + sections[VTE_RING_SNAPSHOT_ROWS].offset,
+			    sections[VTE_RING_SNAPSHOT_ROWS].length);
+
+	memcpy (hyperlink, data + sections[VTE_RING_SNAPSHOT_HYPERLINK].offset, header.last_attr.hyperlink_length);
+	hyperlink[header.last_attr.hyperlink_length] = '\0';
+	attr = basic_cell.attr;
+	_attrcpy (&attr, &header.last_attr);
+	attr.hyperlink_idx = hyperlink[0] ? _vte_ring_get_hyperlink_idx_no_update_current (ring, hyperlink) : 0;
+	_vte_ring_set_last_attr (ring, &attr);
+	ring->last_attr_text_start_offset = header.last_attr_text_start_offset;
+
+	ring->writable = ring->end = header.end;
+	if (ring->end - ring->start > ring->max)
+		_vte_ring_discard_rows (ring, ring->end - ring->max - ring->start);
+	_vte_ring_cached_rows_invalidate (ring);
+
+	*columns = header.columns;
+	cursor->row = header.cursor_row;
+	cursor->col = header.cursor_col;
+
+	return TRUE;
+
+invalid:
+	g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			     "Not a scrollback snapshot");
+	return FALSE;
+}
+
+/**
+ * _vte_ring_write_contents:
+ * @ring: a #VteRing
+ * @stream: a #GOutputStream to write to
+ * @flags: a set of #VteWriteFlags
+ * @palette: (allow-none): the palette for %VTE_WRITE_HTML, see _vte_ring_export_new()
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @error: a #GError location to store the error occuring, or %NULL to ignore
+ *
+ * Write entire ring contents to @stream according to @flags.
+ *
+ * Return: %TRUE on success, %FALSE if there was an error
+ */
+gboolean
+_vte_ring_write_contents (VteRing *ring,
+			  GOutputStream *stream,
+			  VteWriteFlags flags,
+			  const guint32 *palette,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	VteRingExport *exp;
+	gboolean ret;
+
+	_vte_debug_print(VTE_DEBUG_RING, "Writing contents to GOutputStream.\n");
+
+	exp = _vte_ring_export_new (ring, flags, palette);
+	ret = _vte_ring_export_write (exp, stream, cancellable, error);
+	_vte_ring_export_free (exp);
+
+	return ret;
+}
+
+#ifdef RING_MAIN
+
+/* Appends @text to @row, the cells referring to hyperlink @idx. */
+static void
+append_text (VteRowData *row, const char *text, hyperlink_idx_t idx)
+{
+	VteCell cell = basic_cell;
+
+	cell.attr.hyperlink_idx = idx;
+	for (; *text; text++) {
+		cell.c = *text;
+		_vte_row_data_append (row, &cell);
+	}
+}
+
+/* \e]8;;URI\e\\text\e]8;;\e\\ on a fresh line: the row was never counted,
+ * still the link must survive the reclaim that follows. */
+static void
+test_ring_hyperlink_fresh_row (void)
+{
+	VteRing ring;
+	VteRowData *row;
+	hyperlink_idx_t idx;
+	const char *hyperlink;
+
+	_vte_ring_init (&ring, 100, TRUE);
+	_vte_ring_append (&ring);
+
+	idx = _vte_ring_get_hyperlink_idx (&ring, ":1;http://example.com/");
+	g_assert_cmpuint (idx, !=, 0);
+	row = _vte_ring_index_writable (&ring, 0);
+	append_text (row, "text", idx);
+	_vte_ring_get_hyperlink_idx (&ring, NULL);
+	_vte_ring_hyperlink_reclaim (&ring);
+
+	g_assert_cmpuint (_vte_ring_get_hyperlink_at_position (&ring, 0, 0, false, &hyperlink), ==, idx);
+	g_assert_cmpstr (hyperlink, ==, ":1;http://example.com/");
+
+	/* Once the text is gone, so is the link */
+	row = _vte_ring_index_writable (&ring, 0);
+	_vte_row_data_shrink (row, 0);
+	_vte_ring_hyperlink_reclaim (&ring);
+	g_assert_cmpuint (ring.hyperlink_free_idxs->len, ==, 1);
+
+	_vte_ring_fini (&ring);
+}
+
+/* Scrolling a region in place must look the same as moving its rows. */
+static void
+test_ring_rotate (void)
+{
+	static const char *const expected[] = { "a", "b", "f", "g", "h", "", "", "", "i", "j" };
+	VteRing ring;
+	gulong i;
+	char text[2] = { 0, 0 };
+
+	_vte_ring_init (&ring, 100, FALSE);
+	for (i = 0; i < 10; i++) {
+		text[0] = 'a' + i;
+		append_text (_vte_ring_append (&ring), text, 0);
+	}
+
+	/* Like a scrolling region of rows 2 to 7 scrolling up line by line */
+	for (i = 0; i < 3; i++)
+		_vte_ring_rotate (&ring, 2, 8, -1);
+	for (i = 0; i < 10; i++) {
+		const VteRowData *row = _vte_ring_index (&ring, i);
+		text[0] = row->len ? row->cells[0].c : 0;
+		g_assert_cmpstr (text, ==, expected[i]);
+	}
+
+	/* Inserting elsewhere moves the rows back in place first */
+	text[0] = 'x';
+	append_text (_vte_ring_insert (&ring, 0), text, 0);
+	g_assert_cmpuint (ring.rotated_len, ==, 0);
+	for (i = 0; i < 10; i++) {
+		const VteRowData *row = _vte_ring_index (&ring, i + 1);
+		text[0] = row->len ? row->cells[0].c : 0;
+		g_assert_cmpstr (text, ==, expected[i]);
+	}
+
+	_vte_ring_fini (&ring);
+}
+
+static void
+test_ring_rows_to_trim (void)
+{
+	/* Within the budget */
+	g_assert_cmpuint (_vte_ring_rows_to_trim (1000, 800, 100, 1000), ==, 0);
+	/* 8 bytes a row, 50 bytes over: 7 rows */
+	g_assert_cmpuint (_vte_ring_rows_to_trim (1050, 800, 100, 1000), ==, 7);
+	/* Rounded up: 801 bytes take 9 bytes a row */
+	g_assert_cmpuint (_vte_ring_rows_to_trim (1001, 801, 100, 1000), ==, 1);
+	/* All of them, leaving just the rest */
+	g_assert_cmpuint (_vte_ring_rows_to_trim (1799, 800, 100, 1000), ==, 100);
+	/* The writable rows alone are at or over the budget */
+	g_assert_cmpuint (_vte_ring_rows_to_trim (5000, 800, 100, 4000), ==, 0);
+	g_assert_cmpuint (_vte_ring_rows_to_trim (5000, 800, 100, 4200), ==, 0);
+	g_assert_cmpuint (_vte_ring_rows_to_trim (5000, 800, 100, 4300), ==, 88);
+	/* Nothing to drop */
+	g_assert_cmpuint (_vte_ring_rows_to_trim (5000, 800, 0, 1000), ==, 0);
+	g_assert_cmpuint (_vte_ring_rows_to_trim (5000, 0, 100, 1000), ==, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_test_init (&argc, &argv, nullptr);
+
+	g_test_add_func ("/vte/ring/hyperlink/fresh-row", test_ring_hyperlink_fresh_row);
+	g_test_add_func ("/vte/ring/rotate", test_ring_rotate);
+	g_test_add_func ("/vte/ring/rows-to-trim", test_ring_rows_to_trim);
+
+	return g_test_run ();
+}
+
+#endif /* RING_MAIN */
@@ -45,11 +45,128 @@ typedef struct _VteCellAttrChange {
         VteStreamCellAttr attr;
 } VteCellAttrChange;
 
+/*
+ * VteRingCachedRow: A thawed copy of a frozen row, stored compactly
+ */
+
+typedef struct _VteRingCachedRow {
+	VteCompactRowData row;
+	gulong row_num;  /* (gulong) -1 if the entry is unused */
+} VteRingCachedRow;
+
+typedef struct _VteRingExpandedRow {
+	VteRowData row;
+	gulong row_num;  /* (gulong) -1 if the entry is unused */
+} VteRingExpandedRow;
+
+
+/*
+ * VteRingSearchIndex: Trigrams occurring in each block of the text stream
+ */
+
+#define VTE_RING_SEARCH_BLOCK_SIZE 16384  /* bytes of text per bloom filter */
+#define VTE_RING_SEARCH_BLOOM_SHIFT 13
+#define VTE_RING_SEARCH_BLOOM_BITS (1 << VTE_RING_SEARCH_BLOOM_SHIFT)
+#define VTE_RING_SEARCH_TRIGRAMS_MAX 16
+
+typedef struct _VteRingSearchIndex {
+	GPtrArray *blooms;   /* a VTE_RING_SEARCH_BLOOM_BITS bit filter per block, NULL if nothing was added */
+	gsize first_block;   /* the block of blooms[0] */
+	guchar carry[2];     /* the text right before carry_offset, for trigrams across rows */
+	guint carry_len;
+	gsize carry_offset;
+} VteRingSearchIndex;
+
+typedef struct _VteRingSearchQuery {
+	guint n_trigrams;    /* 0 if the index can't help */
+	guint32 trigrams[VTE_RING_SEARCH_TRIGRAMS_MAX];
+	gsize span;          /* length of the literal the trigrams come from */
+} VteRingSearchQuery;
+
+typedef struct _VteRingTextRange {
+	gsize start, end;    /* text offsets */
+} VteRingTextRange;
+
+
+/*
+ * VteRingHyperlink: An id;uri pair in the hyperlink pool
+ */
+
+typedef struct _VteRingHyperlinkChunk VteRingHyperlinkChunk;
+
+typedef struct _VteRingHyperlink {
+	const char *str;               /* NUL terminated, "" if the idx is free */
+	VteRingHyperlinkChunk *chunk;  /* the arena chunk str is in, NULL if the idx is free */
+	guint32 refs;
+	guint16 len;
+	guint8 unreferenced: 1;        /* queued in hyperlink_unreferenced */
+} VteRingHyperlink;
+
+
+/*
+ * VteRingMemoryStats: Memory used by a ring
+ */
+
+typedef struct _VteRingMemoryStats {
+	VteCellsPoolStats cells;  /* the rows' cell arrays */
+	gsize rows_bytes;         /* the writable and thawed row headers */
+	gsize cached_rows_bytes;  /* the compact cells of the thawed rows */
+	guint n_cached_attrs;     /* distinct attributes among the thawed rows */
+	gsize stream_bytes;       /* uncompressed length of the frozen streams' contents */
+	gsize stream_disk_bytes;  /* what they take up on disk, compressed */
+	gsize search_index_bytes; /* the trigram filters of the text stream */
+} VteRingMemoryStats;
+
+
+/*
+ * VteRingExport: The ring's contents, being written out
+ */
+
+typedef struct _VteRingExport VteRingExport;
+
+
+/*
+ * VteRingSnapshotHeader: The start of a file that _vte_ring_load_snapshot()
+ * restores a ring from, in host byte order
+ *
+ * The sections are the row records of the rows [start, end), their text and
+ * attr changes, just as in the streams, and the hyperlink of last_attr.
+ */
+
+#define VTE_RING_SNAPSHOT_MAGIC "VTERING\001"
+
+enum {
+	VTE_RING_SNAPSHOT_ROWS,
+	VTE_RING_SNAPSHOT_TEXT,
+	VTE_RING_SNAPSHOT_ATTRS,
+	VTE_RING_SNAPSHOT_HYPERLINK,
+	VTE_RING_SNAPSHOT_N_SECTIONS
+};
+
+typedef struct _VteRingSnapshotSection {
+	guint64 offset, length;  /* in the file */
+} VteRingSnapshotSection;
+
+typedef struct _VteRingSnapshotHeader {
+	char magic[8];
+	guint64 start, end;
+	guint64 text_start, attr_start;  /* the stream offsets of the sections */
+	guint64 last_attr_text_start_offset;
+	guint64 columns;                 /* the width the rows are wrapped at */
+	gint64 cursor_row, cursor_col;
+	VteStreamCellAttr last_attr;
+	guint8 padding[6];
+	VteRingSnapshotSection sections[VTE_RING_SNAPSHOT_N_SECTIONS];
+} VteRingSnapshotHeader;
+G_STATIC_ASSERT (sizeof (VteRingSnapshotHeader) == 88 + 16 * VTE_RING_SNAPSHOT_N_SECTIONS);
+
 
 /*
  * VteRing: A scrollback buffer ring
  */
 
+typedef struct _VteRingRewrapJob VteRingRewrapJob;
+
 typedef struct _VteRing VteRing;
 struct _VteRing {
 	gulong max;
@@ -59,6 +176,14 @@ struct _VteRing {
 	/* Writable */
 	gulong writable, mask;
 	VteRowData *array;
+	/* _vte_ring_rotate() rotates the rows [rotated_start, rotated_start +
+	 * rotated_len) of the writable region without moving them: the row at
+	 * position p is kept where p + rotated_offset, wrapped around within
+	 * those rows, would be. */
+	gulong rotated_start, rotated_len, rotated_offset;
+
+	/* Cell arrays of the writable and thawed rows */
+	VteCellsPool cells_pool;
 
         /* Storage:
          *
@@ -80,22 +205,42 @@ struct _VteRing {
 	gsize last_attr_text_start_offset;
 	VteCellAttr last_attr;
 	GString *utf8_buffer;
+	VteRingSearchIndex search_index;
+
+	/* Rows below rewrap_boundary (0 if none) are still waiting to be rewrapped;
+	 * their records are in rewrap_old_row_stream, at position - rewrap_old_delta. */
+	VteStream *rewrap_old_row_stream;
+	gulong rewrap_old_delta, rewrap_boundary;
+	VteRingRewrapJob *rewrap_job;
+
+	/* Thawed frozen rows, direct-mapped by row number so that a screenful
+	 * of consecutive rows never evicts each other. */
+	VteRingCachedRow *cached_rows;
+	gulong cached_rows_mask;
+	VteCellAttrTable cached_rows_attrs;
 
-	VteRowData cached_row;
-	gulong cached_row_num;
+	/* The rows handed out by _vte_ring_index(), a screenful of them,
+	 * direct-mapped the same way.  Rows are thawed or expanded from the
+	 * cache into these, and go to the cache when they're evicted. */
+	VteRingExpandedRow *expanded_rows;
+	gulong expanded_rows_mask;
 
 	gboolean has_streams;
         gulong visible_rows;  /* to keep at least a screenful of lines in memory, bug 646098 comment 12 */
 
-        GPtrArray *hyperlinks;  /* The hyperlink pool. Contains GString* items.
-                                   [0] points to an empty GString, [1] to [VTE_HYPERLINK_COUNT_MAX] contain the id;uri pairs. */
+        GArray *hyperlinks;  /* The hyperlink pool. Contains VteRingHyperlink items.
+                                [0] is the empty string, [1] to [VTE_HYPERLINK_COUNT_MAX] the id;uri pairs. */
+        GHashTable *hyperlink_ids;  /* The id;uri strings, to their idx. */
+        GArray *hyperlink_free_idxs;  /* Reclaimed idxs to hand out again. */
+        GArray *hyperlink_unreferenced;  /* Idxs whose reference count dropped to 0, to be reclaimed. */
+        GPtrArray *hyperlink_chunks;  /* The arena the strings are in. */
+        VteRingHyperlinkChunk *hyperlink_chunk;  /* The chunk new strings go to. */
+        gboolean hyperlink_rows_dirty;  /* Some writable rows' cells aren't counted. */
         char hyperlink_buf[VTE_HYPERLINK_TOTAL_LENGTH_MAX + 1];  /* One more hyperlink buffer to get the value if it's not placed in the pool. */
-        hyperlink_idx_t hyperlink_highest_used_idx;  /* 0 if no hyperlinks at all in the pool. */
         hyperlink_idx_t hyperlink_current_idx;  /* The hyperlink idx used for newly created cells.
-                                                   Must not be GC'd even if doesn't occur onscreen. */
+                                                   Holds a reference even if doesn't occur onscreen. */
         hyperlink_idx_t hyperlink_hover_idx;  /* The hyperlink idx of the hovered cell.
                                                  An idx is allocated on hover even if the cell is scrolled out to the streams. */
-        gulong hyperlink_maybe_gc_counter;  /* Do a GC when it reaches 65536. */
 
         /* The SIXEL image list, registered with bottom position of image. */
         std::map<gint, vte::image::image_object *> *image_map;
@@ -111,13 +256,14 @@ struct _VteRing {
 #define _vte_ring_delta(__ring) ((glong) (__ring)->start)
 #define _vte_ring_length(__ring) ((glong) ((__ring)->end - (__ring)->start))
 #define _vte_ring_next(__ring) ((glong) (__ring)->end)
+#define _vte_ring_writable(__ring) ((glong) (__ring)->writable)
 
 const VteRowData *_vte_ring_index (VteRing *ring, gulong position);
 VteRowData *_vte_ring_index_writable (VteRing *ring, gulong position);
 
 void _vte_ring_init (VteRing *ring, gulong max_rows, gboolean has_streams);
 void _vte_ring_fini (VteRing *ring);
-void _vte_ring_hyperlink_maybe_gc (VteRing *ring, gulong increment);
+void _vte_ring_hyperlink_reclaim (VteRing *ring);
 hyperlink_idx_t _vte_ring_get_hyperlink_idx (VteRing *ring, const char *hyperlink);
 hyperlink_idx_t _vte_ring_get_hyperlink_at_position (VteRing *ring, gulong position, int col, bool update_hover_idx, const char **hyperlink);
 long _vte_ring_reset (VteRing *ring);
@@ -126,14 +272,47 @@ void _vte_ring_shrink (VteRing *ring, gulong max_len);
 VteRowData *_vte_ring_insert (VteRing *ring, gulong position);
 VteRowData *_vte_ring_append (VteRing *ring);
 void _vte_ring_remove (VteRing *ring, gulong position);
+void _vte_ring_rotate (VteRing *ring, gulong start, gulong end, glong count);
 void _vte_ring_drop_scrollback (VteRing *ring, gulong position);
 void _vte_ring_set_visible_rows (VteRing *ring, gulong rows);
+void _vte_ring_get_memory_stats (VteRing *ring, VteRingMemoryStats *stats);
+gsize _vte_ring_get_usage (VteRing *ring);
+gboolean _vte_ring_trim_to_bytes (VteRing *ring, gsize max_bytes);
 void _vte_ring_rewrap (VteRing *ring, glong columns, VteVisualPosition **markers);
+gboolean _vte_ring_rewrap_step (VteRing *ring, gulong max_rows);
+gboolean _vte_ring_rewrap_pending (VteRing *ring);
 void _vte_ring_append_image (VteRing *ring, cairo_surface_t *surface, gint pixelwidth, gint pixelheight, glong left, glong top, glong width, glong height);
 void _vte_ring_shrink_image_stream (VteRing *ring);
+void _vte_ring_search_query_init (VteRingSearchQuery *query, const char *literal, gsize length);
+gsize _vte_ring_search_index_next (VteRing *ring, gsize offset, gsize end_offset, const VteRingSearchQuery *query);
+gsize _vte_ring_search_index_prev (VteRing *ring, gsize start_offset, gsize offset, const VteRingSearchQuery *query);
+void _vte_ring_search_index_ranges (VteRing *ring, gsize start_offset, gsize end_offset, const VteRingSearchQuery *query, GArray *ranges);
+gboolean _vte_ring_get_text_range (VteRing *ring, gulong start, gulong end, gsize *start_offset, gsize *end_offset);
+VteStream *_vte_ring_snapshot_text (VteRing *ring);
+gboolean _vte_ring_text_offset_to_position (VteRing *ring, gulong start, gulong end, gsize offset, VteVisualPosition *position);
+VteRingExport *_vte_ring_export_new (VteRing *ring, VteWriteFlags flags, const guint32 *palette);
+gboolean _vte_ring_export_write (VteRingExport *exp,
+				 GOutputStream *stream,
+				 GCancellable *cancellable,
+				 GError **error);
+gboolean _vte_ring_export_save (VteRingExport *exp,
+				glong columns,
+				const VteVisualPosition *cursor,
+				GOutputStream *stream,
+				GCancellable *cancellable,
+				GError **error);
+double _vte_ring_export_get_progress (VteRingExport *exp);
+void _vte_ring_export_free (VteRingExport *exp);
+gboolean _vte_ring_load_snapshot (VteRing *ring,
+				  const char *data,
+				  gsize len,
+				  glong *columns,
+				  VteVisualPosition *cursor,
+				  GError **error);
 gboolean _vte_ring_write_contents (VteRing *ring,
 				   GOutputStream *stream,
 				   VteWriteFlags flags,
+				   const guint32 *palette,
 				   GCancellable *cancellable,
 				   GError **error);
 
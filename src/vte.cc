@@ -70,6 +70,7 @@
 #include "vtegtk.hh"
 
 #include <new> /* placement new */
+#include <atomic>
 
 /* Some sanity checks */
 /* FIXMEchpe: move this to there when splitting _vte_incoming_chunk into its own file */
@@ -103,7 +104,6 @@ static void remove_update_timeout(VteTerminalPrivate *that);
 
 static gboolean process_timeout (gpointer data);
 static gboolean update_timeout (gpointer data);
-static cairo_region_t *vte_cairo_get_clip_region (cairo_t *cr);
 
 /* these static variables are guarded by the GDK mutex */
 static guint process_timeout_tag = 0;
@@ -262,6 +262,37 @@ VteTerminalPrivate::ring_remove(vte::grid::row_t position)
 	_vte_ring_remove(m_screen->row_data, position);
 }
 
+/*
+ * Scrolls the rows @start to @end (inclusive) by @count rows, downwards if
+ * @count is positive and upwards if negative, in a single pass over the
+ * ring. The rows scrolled in are filled like ring_insert() would.
+ */
+// FIXMEchpe replace this with a method on VteRing
+void
+VteTerminalPrivate::ring_rotate(vte::grid::row_t start,
+                                vte::grid::row_t end,
+                                vte::grid::row_t count)
+{
+	VteRing *ring = m_screen->row_data;
+	vte::grid::row_t i, n;
+
+	while (G_UNLIKELY (_vte_ring_next (ring) <= end))
+		ring_append(true);
+
+	n = MIN(ABS(count), end - start + 1);
+	if (G_UNLIKELY (n <= 0))
+		return;
+
+	_vte_ring_rotate (ring, start, end + 1, count > 0 ? n : -n);
+
+	if (m_fill_defaults.attr.back == VTE_DEFAULT_BG)
+		return;
+	if (count < 0)
+		start = end - n + 1;
+	for (i = start; i < start + n; i++)
+		_vte_row_data_fill (_vte_ring_index_writable (ring, i), &m_fill_defaults, m_column_count);
+}
+
 /* Reset defaults for character insertion. */
 void
 VteTerminalPrivate::reset_default_attributes(bool reset_hyperlink)
@@ -342,6 +373,9 @@ VteTerminalPrivate::invalidate_cells(vte::grid::column_t column_start,
         if (n_columns <= 0 || n_rows <= 0)
                 return;
 
+        /* The pixel position computed below is for the current scroll offset */
+        blit_track_scroll();
+
 	if (m_invalidated_all) {
 		return;
 	}
@@ -358,30 +392,19 @@ VteTerminalPrivate::invalidate_cells(vte::grid::column_t column_start,
 		return;
 	}
 
-        cairo_rectangle_int_t rect;
-	/* Convert the column and row start and end to pixel values
-	 * by multiplying by the size of a character cell.
-	 * Always include the extra pixel border and overlap pixel.
-	 */
-        rect.x = column_start * m_char_width - 1;
-        /* The extra + 1 is for the faux-bold overdraw */
-        int xend = (column_start + n_columns) * m_char_width + 1 + 1;
-        rect.width = xend - rect.x;
-
-        rect.y = row_to_pixel(row_start) - 1;
-        int yend = row_to_pixel(row_start + n_rows) + 1;
-        rect.height = yend - rect.y;
-
-	_vte_debug_print (VTE_DEBUG_UPDATES,
-			"Invalidating pixels at (%d,%d)x(%d,%d).\n",
-			rect.x, rect.y, rect.width, rect.height);
+        damage_cells(column_start, n_columns, row_start, n_rows);
 
 	if (m_active_terminals_link != nullptr) {
-                g_array_append_val(m_update_rects, rect);
 		/* Wait a bit before doing any invalidation, just in
 		 * case updates are coming in really soon. */
 		add_update_timeout(this);
 	} else {
+                auto rect = cells_rect(column_start, n_columns, row_start, n_rows);
+
+                _vte_debug_print (VTE_DEBUG_UPDATES,
+                                  "Invalidating pixels at (%d,%d)x(%d,%d).\n",
+                                  rect.x, rect.y, rect.width, rect.height);
+
                 auto allocation = get_allocated_rect();
                 rect.x += allocation.x + m_padding.left;
                 rect.y += allocation.y + m_padding.top;
@@ -393,6 +416,45 @@ VteTerminalPrivate::invalidate_cells(vte::grid::column_t column_start,
 	_vte_debug_print (VTE_DEBUG_WORK, "!");
 }
 
+/* Invalidate the cells [start, end) of @row which differ from @cell, before
+ * they get overwritten by it. A NULL @rowdata or @cell, and cells past the
+ * end of the row, stand for blank cells. */
+void
+VteTerminalPrivate::invalidate_changed_cells(VteRowData const* rowdata,
+                                             vte::grid::row_t row,
+                                             vte::grid::column_t start,
+                                             vte::grid::column_t end,
+                                             VteCell const* cell)
+{
+        if (start >= end)
+                return;
+
+        if (cell == nullptr)
+                cell = &basic_cell;
+
+        /* Blank cells past the end of the row stay blank */
+        auto len = rowdata ? (vte::grid::column_t)_vte_row_data_length(rowdata) : 0;
+        auto scan_end = _vte_cell_equal(cell, &basic_cell) ? MIN(end, len) : end;
+
+        vte::grid::column_t first = -1, last = -1;
+        long n_changed = 0;
+        for (auto col = start; col < scan_end; col++) {
+                VteCell const* old = col < len ? _vte_row_data_get(rowdata, col) : &basic_cell;
+                if (_vte_cell_equal(old, cell))
+                        continue;
+                if (first < 0)
+                        first = col;
+                last = col;
+                n_changed++;
+        }
+
+        m_cell_writes += end - start;
+        m_cell_writes_elided += end - start - n_changed;
+
+        if (first >= 0)
+                invalidate_cells(first, last - first + 1, row, 1);
+}
+
 void
 VteTerminalPrivate::invalidate_region(vte::grid::column_t scolumn,
                                       vte::grid::column_t ecolumn,
@@ -439,18 +501,12 @@ VteTerminalPrivate::invalidate_all()
 	_vte_debug_print (VTE_DEBUG_UPDATES, "Invalidating all.\n");
 
 	/* replace invalid regions with one covering the whole terminal */
-	reset_update_rects();
+	reset_damage();
 	m_invalidated_all = TRUE;
+        m_damage_expose_all = TRUE;
+        blit_damage_all();
 
         if (m_active_terminals_link != nullptr) {
-                auto allocation = get_allocated_rect();
-                cairo_rectangle_int_t rect;
-                rect.x = -m_padding.left;
-                rect.y = -m_padding.top;
-                rect.width = allocation.width;
-                rect.height = allocation.height;
-
-                g_array_append_val(m_update_rects, rect);
 		/* Wait a bit before doing any invalidation, just in
 		 * case updates are coming in really soon. */
 		add_update_timeout(this);
@@ -459,6 +515,229 @@ VteTerminalPrivate::invalidate_all()
 	}
 }
 
+/* The pixels covered by a block of cells, in view coordinates. Always
+ * include the extra pixel border and overlap pixel. */
+cairo_rectangle_int_t
+VteTerminalPrivate::cells_rect(vte::grid::column_t column_start,
+                               int n_columns,
+                               vte::grid::row_t row_start,
+                               int n_rows) const
+{
+        cairo_rectangle_int_t rect;
+
+        rect.x = column_start * m_char_width - 1;
+        /* The extra + 1 is for the faux-bold overdraw */
+        int xend = (column_start + n_columns) * m_char_width + 1 + 1;
+        rect.width = xend - rect.x;
+
+        rect.y = row_to_pixel(row_start) - 1;
+        int yend = row_to_pixel(row_start + n_rows) + 1;
+        rect.height = yend - rect.y;
+
+        return rect;
+}
+
+/* Record damage to a block of cells. Only the visible rows are recorded;
+ * the others get damaged when they are scrolled into view. */
+void
+VteTerminalPrivate::damage_cells(vte::grid::column_t column_start,
+                                 int n_columns,
+                                 vte::grid::row_t row_start,
+                                 int n_rows)
+{
+        auto top_row = first_displayed_row();
+        auto bottom_row = last_displayed_row();
+        auto first = MAX(row_start, top_row);
+        auto last = MIN(row_start + n_rows - 1, bottom_row);
+        if (first > last)
+                return;
+
+        /* Grow the table to hold all the visible rows */
+        guint size = m_damage_spans->len;
+        if (size <= (guint)(bottom_row - top_row + 1)) {
+                GArray *old = m_damage_spans;
+                size = 1u << g_bit_storage(bottom_row - top_row + 1);
+                m_damage_spans = g_array_sized_new(FALSE, FALSE, sizeof(damage_span), size);
+                g_array_set_size(m_damage_spans, size);
+                damage_clear();
+                for (guint i = 0; i < old->len; i++) {
+                        auto span = &g_array_index(old, damage_span, i);
+                        if (span->end >= span->start)
+                                damage_cells(span->start, span->end - span->start + 1,
+                                             span->row, 1);
+                }
+                g_array_free(old, TRUE);
+        }
+
+        auto mask = size - 1;
+        auto column_end = column_start + n_columns - 1;
+        for (auto row = first; row <= last; row++) {
+                auto span = &g_array_index(m_damage_spans, damage_span, row & mask);
+                if (span->end < span->start) {
+                        m_damage_n_rows++;
+                } else if (span->row == row) {
+                        span->start = MIN(span->start, column_start);
+                        span->end = MAX(span->end, column_end);
+                        continue;
+                }
+                /* A different row in the slot has scrolled out of view */
+                span->row = row;
+                span->start = column_start;
+                span->end = column_end;
+        }
+}
+
+/* Turn the recorded damage into a region in view coordinates, merging
+ * runs of rows with the same span into one rectangle, and clear it. */
+cairo_region_t *
+VteTerminalPrivate::damage_take_region()
+{
+        auto region = cairo_region_create();
+        if (m_damage_n_rows == 0)
+                return region;
+
+        auto mask = m_damage_spans->len - 1;
+        auto first = first_displayed_row();
+        auto last = last_displayed_row();
+        vte::grid::row_t band_row = -1;
+        int band_rows = 0;
+        damage_span const* band = nullptr;
+        long cells = 0;
+        for (auto row = first; row <= last + 1; row++) {
+                damage_span const* span = nullptr;
+                if (row <= last) {
+                        span = &g_array_index(m_damage_spans, damage_span, row & mask);
+                        if (span->row != row || span->end < span->start)
+                                span = nullptr;
+                }
+                if (span != nullptr) {
+                        cells += span->end - span->start + 1;
+                        if (band != nullptr &&
+                            span->start == band->start &&
+                            span->end == band->end) {
+                                band_rows++;
+                                continue;
+                        }
+                }
+
+                if (band != nullptr) {
+                        auto rect = cells_rect(band->start, band->end - band->start + 1,
+                                               band_row, band_rows);
+                        cairo_region_union_rectangle(region, &rect);
+                }
+                band = span;
+                band_row = row;
+                band_rows = 1;
+        }
+
+        if (m_column_count > 0 && m_row_count > 0) {
+                double area = (double)cells / (m_column_count * m_row_count);
+                m_damage_frames++;
+                m_damage_area_sum += area;
+                _vte_debug_print (VTE_DEBUG_UPDATES,
+                                  "Damage: %u rows, %d rectangles, %.1f%% of the screen "
+                                  "(%.1f%% on average over %" G_GUINT64_FORMAT " frames)\n",
+                                  m_damage_n_rows, cairo_region_num_rectangles(region),
+                                  100. * area, 100. * m_damage_area_sum / m_damage_frames,
+                                  m_damage_frames);
+        }
+
+        damage_clear();
+        return region;
+}
+
+void
+VteTerminalPrivate::damage_clear()
+{
+        for (guint i = 0; i < m_damage_spans->len; i++) {
+                auto span = &g_array_index(m_damage_spans, damage_span, i);
+                span->row = -1;
+                span->start = 0;
+                span->end = -1;
+        }
+        m_damage_n_rows = 0;
+}
+
+/* Mark the whole backing store as needing to be repainted. */
+void
+VteTerminalPrivate::blit_damage_all()
+{
+        auto allocation = get_allocated_rect();
+        cairo_rectangle_int_t rect;
+        rect.x = -m_padding.left;
+        rect.y = -m_padding.top;
+        rect.width = allocation.width;
+        rect.height = allocation.height;
+
+        cairo_region_destroy(m_blit_damage);
+        m_blit_damage = cairo_region_create_rectangle(&rect);
+        m_blit_scroll_pixel = scroll_delta_pixel();
+        m_blit_dy = 0;
+}
+
+/* Follow the scroll offset of the view. Instead of repainting everything,
+ * the next draw shifts the backing store by the distance scrolled, and only
+ * the rows scrolled into view are added to the damage. Damage recorded so
+ * far moves along with the contents. */
+void
+VteTerminalPrivate::blit_track_scroll()
+{
+        long pixel = scroll_delta_pixel();
+        long dy = pixel - m_blit_scroll_pixel;
+        if (dy == 0)
+                return;
+
+        m_blit_scroll_pixel = pixel;
+
+        /* Everything is getting repainted anyway */
+        if (G_UNLIKELY(!widget_realized()) || m_invalidated_all) {
+                m_blit_dy = 0;
+                return;
+        }
+
+        long height = m_view_usable_extents.height();
+        if (m_blit_surface == nullptr ||
+            ABS(m_blit_dy + dy) >= height) {
+                invalidate_all();
+                return;
+        }
+
+        _vte_debug_print (VTE_DEBUG_UPDATES,
+                          "Scrolling backing store by %ld pixels.\n", dy);
+
+        m_blit_dy += dy;
+        cairo_region_translate(m_blit_damage, 0, -dy);
+
+        auto allocation = get_allocated_rect();
+        cairo_rectangle_int_t rect;
+        rect.x = -m_padding.left;
+        rect.y = dy > 0 ? height - dy : 0;
+        rect.width = allocation.width;
+        rect.height = ABS(dy);
+        cairo_region_union_rectangle(m_blit_damage, &rect);
+
+        /* The whole view needs to be copied from the backing store again */
+        if (m_damage_expose_all)
+                return;
+
+        m_damage_expose_all = TRUE;
+        if (m_active_terminals_link != nullptr) {
+		add_update_timeout(this);
+	} else {
+                gtk_widget_queue_draw(m_widget);
+	}
+}
+
+void
+VteTerminalPrivate::blit_free()
+{
+        if (m_blit_surface == nullptr)
+                return;
+
+        cairo_surface_destroy(m_blit_surface);
+        m_blit_surface = nullptr;
+}
+
 /* FIXMEchpe: remove this obsolete function. It became useless long ago
  * when we stopped moving window contents around on scrolling. */
 /* Scroll a rectangular region up or down by a fixed number of lines,
@@ -749,6 +1028,24 @@ VteTerminalPrivate::emit_selection_changed()
 	g_signal_emit(m_terminal, signals[SIGNAL_SELECTION_CHANGED], 0);
 }
 
+/* Emit a "search-progress" signal. */
+void
+VteTerminalPrivate::emit_search_progress(double fraction)
+{
+	_vte_debug_print(VTE_DEBUG_SIGNALS,
+			"Emitting `search-progress'(%.2f).\n", fraction);
+	g_signal_emit(m_terminal, signals[SIGNAL_SEARCH_PROGRESS], 0, fraction);
+}
+
+/* Emit a "write-contents-progress" signal. */
+void
+VteTerminalPrivate::emit_write_contents_progress(double fraction)
+{
+	_vte_debug_print(VTE_DEBUG_SIGNALS,
+			"Emitting `write-contents-progress'(%.2f).\n", fraction);
+	g_signal_emit(m_terminal, signals[SIGNAL_WRITE_CONTENTS_PROGRESS], 0, fraction);
+}
+
 /* Emit a "commit" signal. */
 void
 VteTerminalPrivate::emit_commit(char const* text,
@@ -2370,6 +2667,7 @@ VteTerminalPrivate::set_color(int entry,
         }
         palette_color->sources[source].is_set = TRUE;
         palette_color->sources[source].color = proposed;
+        color_cache_invalidate();
 
 	/* If we're not realized yet, there's nothing else to do. */
 	if (!widget_realized())
@@ -2399,6 +2697,7 @@ VteTerminalPrivate::reset_color(int entry,
                 return;
         }
         palette_color->sources[source].is_set = FALSE;
+        color_cache_invalidate();
 
 	/* If we're not realized yet, there's nothing else to do. */
 	if (!widget_realized())
@@ -2852,8 +3151,7 @@ VteTerminalPrivate::cursor_down(bool explicit_sequence)
 				/* If we're at the bottom of the scrolling
 				 * region, add a line at the top to scroll the
 				 * bottom off. */
-				ring_remove(start);
-				ring_insert(end, true);
+				ring_rotate(start, end, -1);
 				/* Update the display. */
 				scroll_region(start,
 							   end - start + 1, -1);
@@ -2939,10 +3237,11 @@ VteTerminalPrivate::save_cursor(VteScreen *screen__)
 /* Insert a single character into the stored data array. */
 bool
 VteTerminalPrivate::insert_char(gunichar c,
-                                bool insert,
-                                bool invalidate_now)
+                                bool insert)
 {
 	VteCellAttr attr;
+        VteCell cell;
+        bool changed = false;
 	VteRowData *row;
 	long col;
 	int columns, i;
@@ -2984,7 +3283,6 @@ VteTerminalPrivate::insert_char(gunichar c,
         };
 
         insert |= m_insert_mode;
-	invalidate_now |= insert;
 
 	/* If we've enabled the special drawing set, map the characters to
 	 * Unicode. */
@@ -3113,27 +3411,30 @@ VteTerminalPrivate::insert_char(gunichar c,
         attr.back = m_color_defaults.attr.back;
 	attr.columns = columns;
 
-	{
-		VteCell *pcell = _vte_row_data_get_writable (row, col);
-		pcell->c = c;
-		pcell->attr = attr;
-		col++;
-	}
-
-	/* insert wide-char fragments */
-	attr.fragment = 1;
-	for (i = 1; i < columns; i++) {
+        /* Only write, and repaint, the cells whose contents change; full
+         * screen applications often rewrite what is already there. */
+        cell.c = c;
+        cell.attr = attr;
+	for (i = 0; i < columns; i++) {
 		VteCell *pcell = _vte_row_data_get_writable (row, col);
-		pcell->c = c;
-		pcell->attr = attr;
+                if (!_vte_cell_equal(pcell, &cell)) {
+                        *pcell = cell;
+                        changed = true;
+                }
 		col++;
+                /* insert wide-char fragments */
+                cell.attr.fragment = 1;
 	}
 	if (_vte_row_data_length (row) > m_column_count)
 		cleanup_fragments(m_column_count, _vte_row_data_length (row));
 	_vte_row_data_shrink (row, m_column_count);
 
+        m_cell_writes += columns;
+        if (!changed && !insert)
+                m_cell_writes_elided += columns;
+
 	/* Signal that this part of the window needs drawing. */
-	if (G_UNLIKELY (invalidate_now)) {
+	if (insert || changed) {
 		invalidate_cells(
 				col - columns,
 				insert ? m_column_count : columns,
@@ -3502,12 +3803,9 @@ VteTerminalPrivate::process_incoming()
 	VteVisualPosition saved_cursor;
 	gboolean saved_cursor_visible;
         VteCursorStyle saved_cursor_style;
-	GdkPoint bbox_topleft, bbox_bottomright;
 	gunichar *wbuf, c;
 	long wcount, start;
 	gboolean leftovers, modified, bottom, again;
-	gboolean invalidated_text;
-	gboolean in_scroll_region;
 	GArray *unichars;
 	struct _vte_incoming_chunk *chunk, *next_chunk, *achunk = NULL;
 
@@ -3522,18 +3820,11 @@ VteTerminalPrivate::process_incoming()
 
         bottom = m_screen->insert_delta == (long)m_screen->scroll_delta;
 
-        auto top_row = first_displayed_row();
-        auto bottom_row = last_displayed_row();
-
 	/* Save the current cursor position. */
         saved_cursor = m_screen->cursor;
 	saved_cursor_visible = m_cursor_visible;
         saved_cursor_style = m_cursor_style;
 
-        in_scroll_region = m_scrolling_restricted
-            && (m_screen->cursor.row >= (m_screen->insert_delta + m_scrolling_region.start))
-            && (m_screen->cursor.row <= (m_screen->insert_delta + m_scrolling_region.end));
-
 	/* We should only be called when there's data to process. */
 	g_assert(m_incoming ||
 		 (m_pending->len > 0));
@@ -3608,10 +3899,6 @@ skip_chunk:
 	/* Try initial substrings. */
 	start = 0;
 	modified = leftovers = again = FALSE;
-	invalidated_text = FALSE;
-
-	bbox_bottomright.x = bbox_bottomright.y = -G_MAXINT;
-	bbox_topleft.x = bbox_topleft.y = G_MAXINT;
 
 	while (start < wcount && !leftovers) {
 		const char *seq_match;
@@ -3630,8 +3917,6 @@ skip_chunk:
 		 * points to the first character which isn't part of this
 		 * sequence. */
 		if ((seq_match != NULL) && (seq_match[0] != '\0')) {
-			gboolean new_in_scroll_region;
-
 			/* Call the right sequence handler for the requested
 			 * behavior. */
 			handle_sequence(seq_match, params);
@@ -3639,47 +3924,6 @@ skip_chunk:
 			/* Skip over the proper number of unicode chars. */
 			start = (next - wbuf);
 			modified = TRUE;
-
-                        // FIXME m_screen may be != previous_screen, check for that!
-
-                        new_in_scroll_region = m_scrolling_restricted
-                            && (m_screen->cursor.row >= (m_screen->insert_delta + m_scrolling_region.start))
-                            && (m_screen->cursor.row <= (m_screen->insert_delta + m_scrolling_region.end));
-
-                        /* delta may have changed from sequence. */
-                        top_row = first_displayed_row();
-                        bottom_row = last_displayed_row();
-
-			/* if we have moved greatly during the sequence handler, or moved
-                         * into a scroll_region from outside it, restart the bbox.
-                         */
-			if (invalidated_text &&
-					((new_in_scroll_region && !in_scroll_region) ||
-                                         (m_screen->cursor.col > bbox_bottomright.x + VTE_CELL_BBOX_SLACK ||
-                                          m_screen->cursor.col < bbox_topleft.x - VTE_CELL_BBOX_SLACK     ||
-                                          m_screen->cursor.row > bbox_bottomright.y + VTE_CELL_BBOX_SLACK ||
-                                          m_screen->cursor.row < bbox_topleft.y - VTE_CELL_BBOX_SLACK))) {
-				/* Clip off any part of the box which isn't already on-screen. */
-				bbox_topleft.x = MAX(bbox_topleft.x, 0);
-                                bbox_topleft.y = MAX(bbox_topleft.y, top_row);
-				bbox_bottomright.x = MIN(bbox_bottomright.x,
-						m_column_count);
-				/* lazily apply the +1 to the cursor_row */
-				bbox_bottomright.y = MIN(bbox_bottomright.y + 1,
-                                                bottom_row + 1);
-
-				invalidate_cells(
-						bbox_topleft.x,
-						bbox_bottomright.x - bbox_topleft.x,
-						bbox_topleft.y,
-						bbox_bottomright.y - bbox_topleft.y);
-
-				invalidated_text = FALSE;
-				bbox_bottomright.x = bbox_bottomright.y = -G_MAXINT;
-				bbox_topleft.x = bbox_topleft.y = G_MAXINT;
-			}
-
-			in_scroll_region = new_in_scroll_region;
 		} else
 		/* Second, we have a NULL match, and next points to the very
 		 * next character in the buffer.  Insert the character which
@@ -3737,50 +3981,9 @@ skip_chunk:
 				}
 			}
 
-			bbox_topleft.x = MIN(bbox_topleft.x,
-                                             m_screen->cursor.col);
-			bbox_topleft.y = MIN(bbox_topleft.y,
-                                             m_screen->cursor.row);
-
-			/* Insert the character. */
-                        // FIXMEchpe should not use UNLIKELY here
-			if (G_UNLIKELY(insert_char(c, false, false))) {
-				/* line wrapped, correct bbox */
-				if (invalidated_text &&
-                                                (m_screen->cursor.col > bbox_bottomright.x + VTE_CELL_BBOX_SLACK	||
-                                                 m_screen->cursor.col < bbox_topleft.x - VTE_CELL_BBOX_SLACK	||
-                                                 m_screen->cursor.row > bbox_bottomright.y + VTE_CELL_BBOX_SLACK	||
-                                                 m_screen->cursor.row < bbox_topleft.y - VTE_CELL_BBOX_SLACK)) {
-					/* Clip off any part of the box which isn't already on-screen. */
-					bbox_topleft.x = MAX(bbox_topleft.x, 0);
-                                        bbox_topleft.y = MAX(bbox_topleft.y, top_row);
-					bbox_bottomright.x = MIN(bbox_bottomright.x,
-							m_column_count);
-					/* lazily apply the +1 to the cursor_row */
-					bbox_bottomright.y = MIN(bbox_bottomright.y + 1,
-                                                        bottom_row + 1);
-
-					invalidate_cells(
-							bbox_topleft.x,
-							bbox_bottomright.x - bbox_topleft.x,
-							bbox_topleft.y,
-							bbox_bottomright.y - bbox_topleft.y);
-					bbox_bottomright.x = bbox_bottomright.y = -G_MAXINT;
-					bbox_topleft.x = bbox_topleft.y = G_MAXINT;
-
-				}
-				bbox_topleft.x = MIN(bbox_topleft.x, 0);
-				bbox_topleft.y = MIN(bbox_topleft.y,
-                                                     m_screen->cursor.row);
-			}
-			/* Add the cells over which we have moved to the region
-			 * which we need to refresh for the user. */
-			bbox_bottomright.x = MAX(bbox_bottomright.x,
-                                                 m_screen->cursor.col);
-                        /* cursor.row + 1 (defer until inv.) */
-			bbox_bottomright.y = MAX(bbox_bottomright.y,
-                                                 m_screen->cursor.row);
-			invalidated_text = TRUE;
+			/* Insert the character; it invalidates the cells
+			 * it changes. */
+			insert_char(c, false);
 
 			/* We *don't* emit flush pending signals here. */
 			modified = TRUE;
@@ -3863,22 +4066,10 @@ next_match:
 
 	emit_pending_signals();
 
-	if (invalidated_text) {
-		/* Clip off any part of the box which isn't already on-screen. */
-		bbox_topleft.x = MAX(bbox_topleft.x, 0);
-                bbox_topleft.y = MAX(bbox_topleft.y, top_row);
-		bbox_bottomright.x = MIN(bbox_bottomright.x,
-				m_column_count);
-		/* lazily apply the +1 to the cursor_row */
-		bbox_bottomright.y = MIN(bbox_bottomright.y + 1,
-                                bottom_row + 1);
-
-		invalidate_cells(
-				bbox_topleft.x,
-				bbox_bottomright.x - bbox_topleft.x,
-				bbox_topleft.y,
-				bbox_bottomright.y - bbox_topleft.y);
-	}
+	_vte_debug_print (VTE_DEBUG_UPDATES,
+			"%" G_GUINT64_FORMAT " cells written, %.1f%% of them unchanged.\n",
+			m_cell_writes,
+			m_cell_writes ? 100. * m_cell_writes_elided / m_cell_writes : 0.);
 
         // FIXMEchpe: also need to take into account if the number of columns the cursor 
         // occupies has changed due to the cell it's on being changed...
@@ -3900,8 +4091,11 @@ next_match:
 	/* Tell the input method where the cursor is. */
         im_update_cursor();
 
-        /* After processing some data, do a hyperlink GC. The multiplier is totally arbitrary, feel free to fine tune. */
-        _vte_ring_hyperlink_maybe_gc(m_screen->row_data, wcount * 4);
+        /* After processing some data, reclaim the hyperlinks no longer referenced. */
+        _vte_ring_hyperlink_reclaim(m_screen->row_data);
+
+        /* Keep the scrollback within its byte budget; before the images of the dropped rows go. */
+        update_scrollback_usage();
 
 	if (m_sixel_enabled)
 		maybe_remove_images ();
@@ -4366,10 +4560,7 @@ VteTerminalPrivate::send_child(char const* data,
 				int len;
 				len = g_utf8_strlen(cooked, cooked_length);
 				for (i = 0; i < len; i++) {
-					insert_char(
-								 ucs4[i],
-								 false,
-								 true);
+					insert_char(ucs4[i], false);
 				}
 				g_free(ucs4);
 			}
@@ -5387,6 +5578,36 @@ VteTerminalPrivate::cell_is_selected(vte::grid::column_t col,
 	return vte_cell_is_between(col, row, ss.col, ss.row, se.col, se.row);
 }
 
+/* Computes the columns [*start, *end) of @row that are selected, with
+ * the same semantics as cell_is_selected(); the range is empty if
+ * nothing on the row is. */
+void
+VteTerminalPrivate::selection_columns(vte::grid::row_t row,
+                                      vte::grid::column_t *start,
+                                      vte::grid::column_t *end) const
+{
+        auto const& ss = m_selection_start;
+        auto const& se = m_selection_end;
+
+        *start = *end = 0;
+        if (!m_has_selection ||
+            ss.row < 0 || se.row < 0 ||
+            row < ss.row || row > se.row ||
+            (ss.row == se.row && ss.col > se.col))
+                return;
+
+        *start = (row == ss.row) ? ss.col : 0;
+        *end = (row == se.row) ? se.col + 1 : G_MAXLONG;
+
+        /* Limit selection in block mode. */
+        if (m_selection_block_mode) {
+                *start = MAX(*start, ss.col);
+                *end = MIN(*end, se.col + 1);
+        }
+        if (*end < *start)
+                *end = *start;
+}
+
 void
 VteTerminalPrivate::widget_paste_received(char const* text)
 {
@@ -6111,6 +6332,7 @@ VteTerminalPrivate::get_text(vte::grid::row_t start_row,
 		VteRowData const* row_data = find_row_data(row);
                 gsize last_empty, last_nonempty;
                 vte::grid::column_t last_emptycol, last_nonemptycol;
+                vte::grid::column_t run_end = -1;
                 vte::grid::column_t line_last_column = (block || row == end_row) ? end_col : G_MAXLONG;
 
 		last_empty = last_nonempty = string->len;
@@ -6129,17 +6351,22 @@ VteTerminalPrivate::get_text(vte::grid::row_t start_row,
 				 * and passes the selection criterion, add it to
 				 * the selection. */
 				if (!pcell->attr.fragment) {
-					/* Store the attributes of this character. */
-					rgb_from_index(pcell->attr.fore, fore);
-					rgb_from_index(pcell->attr.back, back);
-					attr.fore.red = fore.red;
-					attr.fore.green = fore.green;
-					attr.fore.blue = fore.blue;
-					attr.back.red = back.red;
-					attr.back.green = back.green;
-					attr.back.blue = back.blue;
-					attr.underline = pcell->attr.underline;
-					attr.strikethrough = pcell->attr.strikethrough;
+					/* Store the attributes of this character,
+					 * resolved once per run of equal attributes. */
+					if (attributes && col >= run_end) {
+						run_end = _vte_cells_attr_run_end (row_data->cells, col,
+										   _vte_row_data_length (row_data));
+						rgb_from_index(pcell->attr.fore, fore);
+						rgb_from_index(pcell->attr.back, back);
+						attr.fore.red = fore.red;
+						attr.fore.green = fore.green;
+						attr.fore.blue = fore.blue;
+						attr.back.red = back.red;
+						attr.back.green = back.green;
+						attr.back.blue = back.blue;
+						attr.underline = pcell->attr.underline;
+						attr.strikethrough = pcell->attr.strikethrough;
+					}
 
 					/* Store the cell string */
 					if (pcell->c == 0) {
@@ -6171,18 +6398,11 @@ VteTerminalPrivate::get_text(vte::grid::row_t start_row,
 
 			col = last_emptycol + 1;
 
-			if (row_data != NULL) {
-				while ((pcell = _vte_row_data_get (row_data, col))) {
-					col++;
-
-					if (pcell->attr.fragment)
-						continue;
-
-					if (pcell->c != 0)
-						break;
-				}
-			}
-			if (pcell == NULL) {
+			/* Only if the rest of the row is empty too.  Any
+			 * fragment there follows its character there. */
+			if (row_data == NULL ||
+			    _vte_cells_nonempty_length (row_data->cells + col,
+							_vte_row_data_length (row_data) - col) == 0) {
 				g_string_truncate(string, last_nonempty);
 				if (attributes)
 					g_array_set_size(attributes, string->len);
@@ -7213,6 +7433,62 @@ VteTerminalPrivate::stop_autoscroll()
         m_mouse_autoscroll_tag = 0;
 }
 
+/* Rewrap a slice of the scrollback. */
+static gboolean
+vte_terminal_rewrap_cb(VteTerminalPrivate *that)
+{
+        return that->rewrap_scrollback() ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+/*
+ * VteTerminalPrivate::rewrap_scrollback():
+ *
+ * Rewraps some of the scrollback rows that resizing left for later.
+ *
+ * Returns: %true if there's more to do.
+ */
+bool
+VteTerminalPrivate::rewrap_scrollback()
+{
+        if (_vte_ring_rewrap_step(m_normal_screen.row_data, VTE_REWRAP_SLICE_ROWS))
+                return true;
+
+        _vte_debug_print(VTE_DEBUG_RESIZE, "Finished rewrapping the scrollback\n");
+        m_rewrap_tag = 0;
+
+        /* The rewrapped rows got new numbers, and so did the top of the scrollback. */
+        if (m_screen == &m_normal_screen) {
+                adjust_adjustments_full();
+                queue_adjustment_value_changed_clamped(m_screen->scroll_delta);
+                invalidate_all();
+        }
+        return false;
+}
+
+/* Start rewrapping the scrollback in the background. */
+void
+VteTerminalPrivate::start_rewrap_scrollback()
+{
+        if (m_rewrap_tag != 0)
+                return;
+
+        m_rewrap_tag = g_idle_add_full(G_PRIORITY_LOW,
+                                       (GSourceFunc)vte_terminal_rewrap_cb,
+                                       this,
+                                       NULL);
+}
+
+/* Stop rewrapping the scrollback. */
+void
+VteTerminalPrivate::stop_rewrap_scrollback()
+{
+        if (m_rewrap_tag == 0)
+                return;
+
+        g_source_remove(m_rewrap_tag);
+        m_rewrap_tag = 0;
+}
+
 bool
 VteTerminalPrivate::widget_motion_notify(GdkEventMotion *event)
 {
@@ -7617,6 +7893,7 @@ VteTerminalPrivate::widget_visibility_notify(GdkEventVisibility *event)
 		/* if fully obscured, just act like we have invalidated all,
 		 * so no updates are accumulated. */
 		m_invalidated_all = TRUE;
+                blit_damage_all();
 	}
 }
 
@@ -8002,6 +8279,9 @@ VteTerminalPrivate::set_size(long columns,
 
 		/* Resize the normal screen and (if rewrapping is enabled) rewrap it even if the alternate screen is visible: bug 415277 */
 		screen_set_size(&m_normal_screen, old_columns, old_rows, m_rewrap_on_resize);
+		/* The scrollback well above the screen is rewrapped in the background */
+		if (_vte_ring_rewrap_pending(m_normal_screen.row_data))
+			start_rewrap_scrollback();
 		/* Resize the alternate screen if it's the current one, but never rewrap it: bug 336238 comment 60 */
 		if (m_screen == &m_alternate_screen)
 			screen_set_size(&m_alternate_screen, old_columns, old_rows, false);
@@ -8053,7 +8333,7 @@ VteTerminalPrivate::vadjustment_value_changed()
 
 		_vte_debug_print(VTE_DEBUG_ADJ,
 			    "Scrolling by %f\n", dy);
-                invalidate_all();
+                blit_track_scroll();
 		emit_text_scrolled(dy);
 		queue_contents_changed();
 	} else {
@@ -8126,10 +8406,25 @@ VteTerminalPrivate::VteTerminalPrivate(VteTerminal *t) :
 	gtk_widget_set_redraw_on_allocate(m_widget, FALSE);
 
         m_invalidated_all = false;
-        m_update_rects = g_array_sized_new(FALSE /* zero terminated */,
-                                           FALSE /* clear */,
-                                           sizeof(cairo_rectangle_int_t),
-                                           32 /* preallocated size */);
+        m_damage_spans = g_array_new(FALSE /* zero terminated */,
+                                     FALSE /* clear */,
+                                     sizeof(damage_span));
+        m_damage_n_rows = 0;
+        m_damage_expose_all = false;
+        m_damage_frames = 0;
+        m_damage_area_sum = 0.;
+        m_cell_writes = 0;
+        m_cell_writes_elided = 0;
+
+        m_blit_surface = nullptr;
+        m_blit_width = m_blit_height = m_blit_scale = 0;
+        m_blit_damage = cairo_region_create();
+        m_blit_scroll_pixel = 0;
+        m_blit_dy = 0;
+        m_threaded_rendering = false;
+        m_render_pool = nullptr;
+        memset(m_color_cache, 0, sizeof(m_color_cache));
+        m_color_cache_gen = 1;
 
 	/* Set an adjustment for the application to use to control scrolling. */
         m_vadjustment = nullptr;
@@ -8206,6 +8501,8 @@ VteTerminalPrivate::VteTerminalPrivate(VteTerminal *t) :
 	m_alternate_screen_scroll = TRUE;
         m_scrollback_lines = -1; /* force update in vte_terminal_set_scrollback_lines */
 	set_scrollback_lines(VTE_SCROLLBACK_INIT);
+        m_scrollback_bytes = 0;
+        m_scrollback_usage = 0;
 
 	/* Selection info. */
 	display = gtk_widget_get_display(m_widget);
@@ -8258,6 +8555,7 @@ VteTerminalPrivate::VteTerminalPrivate(VteTerminal *t) :
         /* Search data */
         m_search_regex.regex = nullptr;
         m_search_regex.match_flags = 0;
+        m_search_match_count = -1;
 
 	/* Rendering data */
 	m_draw = _vte_draw_new();
@@ -8404,7 +8702,7 @@ VteTerminalPrivate::widget_size_allocate(GtkAllocation *allocation)
 					allocation->height);
 		/* Force a repaint if we were resized. */
 		if (repaint) {
-			reset_update_rects();
+			reset_damage();
 			invalidate_all();
 		}
 	}
@@ -8468,6 +8766,7 @@ VteTerminalPrivate::widget_unrealize()
 
 	/* Cancel any pending redraws. */
 	remove_update_timeout(this);
+        blit_free();
 
 	/* Cancel any pending signals */
 	m_contents_changed_pending = FALSE;
@@ -8590,10 +8889,22 @@ VteTerminalPrivate::~VteTerminalPrivate()
         regex_and_flags_clear(&m_search_regex);
 	if (m_search_attrs)
 		g_array_free (m_search_attrs, TRUE);
+        search_highlight_clear();
+        if (m_search_count_source != 0)
+                g_source_remove(m_search_count_source);
+        if (m_search_count_cancellable != nullptr) {
+                g_cancellable_cancel(m_search_count_cancellable);
+                g_object_unref(m_search_count_cancellable);
+        }
+        if (m_search_count_matches != nullptr)
+                g_array_free(m_search_count_matches, TRUE);
 
 	/* Disconnect from autoscroll requests. */
 	stop_autoscroll();
 
+	/* Stop rewrapping the scrollback. */
+	stop_rewrap_scrollback();
+
 	/* Cancel pending adjustment change notifications. */
 	m_adjustment_changed_pending = FALSE;
 
@@ -8705,8 +9016,12 @@ VteTerminalPrivate::~VteTerminalPrivate()
                                               0, 0, NULL, NULL,
                                               this);
 
-        /* Update rects */
-        g_array_free(m_update_rects, TRUE /* free segment */);
+        /* Damage */
+        g_array_free(m_damage_spans, TRUE /* free segment */);
+        blit_free();
+        cairo_region_destroy(m_blit_damage);
+        if (m_render_pool != nullptr)
+                g_thread_pool_free(m_render_pool, FALSE /* immediate */, TRUE /* wait */);
 }
 
 void
@@ -8919,6 +9234,44 @@ VteTerminalPrivate::determine_colors(VteCell const* cell,
                          fore, back);
 }
 
+/* Like determine_colors() for a cell drawn outside the cursor, but served
+ * from m_color_cache and with the background already resolved to RGB. */
+VteTerminalPrivate::color_cache_entry const*
+VteTerminalPrivate::resolve_colors(VteCell const* cell,
+                                   bool selected)
+{
+        VteCellAttr const* attr = cell ? &cell->attr : &basic_cell.attr;
+        guint64 key = (guint64)attr->fore |
+                       ((guint64)attr->back << 25) |
+                       ((guint64)attr->bold << 50) |
+                       ((guint64)attr->dim << 51) |
+                       ((guint64)attr->reverse << 52) |
+                       ((guint64)attr->invisible << 53) |
+                       ((guint64)selected << 54) |
+                       ((guint64)(m_reverse_mode != FALSE) << 55);
+
+        auto entry = &m_color_cache[((key * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15)) >> 56) &
+                                    (G_N_ELEMENTS(m_color_cache) - 1)];
+        if (entry->gen == m_color_cache_gen && entry->key == key)
+                return entry;
+
+        entry->key = key;
+        entry->gen = m_color_cache_gen;
+        determine_colors(attr, selected, false /* not cursor */,
+                         &entry->fore, &entry->back);
+        rgb_from_index(entry->back, entry->back_rgb);
+        return entry;
+}
+
+/* Drops all entries of the colour cache.  Generation 0 is never used so
+ * that the zero-filled initial entries can't match. */
+void
+VteTerminalPrivate::color_cache_invalidate()
+{
+        if (++m_color_cache_gen == 0)
+                m_color_cache_gen = 1;
+}
+
 void
 VteTerminalPrivate::determine_cursor_colors(VteCell const* cell,
                                             bool highlight,
@@ -8982,8 +9335,8 @@ VteTerminalPrivate::draw_cells(struct _vte_draw_text_request *items,
 			columns += items[i].columns;
 		}
 		if (clear && (draw_default_bg || back != VTE_DEFAULT_BG)) {
-			gint bold_offset = _vte_draw_has_bold(m_draw,
-									VTE_DRAW_BOLD) ? 0 : bold;
+			gint bold_offset = bold && !_vte_draw_has_bold(m_draw,
+										       VTE_DRAW_BOLD);
 			_vte_draw_fill_rectangle(m_draw,
 					x,
                                         y,
@@ -8997,7 +9350,8 @@ VteTerminalPrivate::draw_cells(struct _vte_draw_text_request *items,
 			&fg, VTE_DRAW_OPAQUE,
 			_vte_draw_get_style(bold, italic));
 
-	/* Draw whatever SFX are required. */
+	/* Draw whatever SFX are required, batched per run so they go over
+	 * this run's text but under the glyphs of the runs drawn after it. */
         if (underline | strikethrough | hyperlink | hilite | boxed) {
 		i = 0;
 		do {
@@ -9007,7 +9361,7 @@ VteTerminalPrivate::draw_cells(struct _vte_draw_text_request *items,
 				columns += items[i].columns;
 			}
 			if (underline) {
-                                _vte_draw_draw_line(m_draw,
+                                _vte_draw_queue_line(m_draw,
 						x,
 						y + m_underline_position,
 						x + (columns * column_width) - 1,
@@ -9016,7 +9370,7 @@ VteTerminalPrivate::draw_cells(struct _vte_draw_text_request *items,
                                                     &fg, VTE_DRAW_OPAQUE);
 			}
 			if (strikethrough) {
-                                _vte_draw_draw_line(m_draw,
+                                _vte_draw_queue_line(m_draw,
 						x,
 						y + m_strikethrough_position,
 						x + (columns * column_width) - 1,
@@ -9025,7 +9379,7 @@ VteTerminalPrivate::draw_cells(struct _vte_draw_text_request *items,
                                                        &fg, VTE_DRAW_OPAQUE);
 			}
 			if (hilite) {
-                                _vte_draw_draw_line(m_draw,
+                                _vte_draw_queue_line(m_draw,
 						x,
 						y + row_height - 1,
 						x + (columns * column_width) - 1,
@@ -9034,7 +9388,7 @@ VteTerminalPrivate::draw_cells(struct _vte_draw_text_request *items,
                                                        &fg, VTE_DRAW_OPAQUE);
                         } else if (hyperlink) {
                                 for (double j = 0.125; j < columns; j += 0.5) {
-                                        _vte_draw_fill_rectangle(m_draw,
+                                        _vte_draw_queue_rectangle(m_draw,
                                                                  x + j * column_width,
                                                                  y + row_height - 1,
                                                                  column_width * 0.25,
@@ -9050,6 +9404,7 @@ VteTerminalPrivate::draw_cells(struct _vte_draw_text_request *items,
                                                          &fg, VTE_DRAW_OPAQUE);
 			}
 		}while (i < n);
+		_vte_draw_flush_rectangles(m_draw);
 	}
 }
 
@@ -9301,10 +9656,12 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 	guint fore, nfore, back, nback;
         gboolean underline, nunderline, bold, nbold, italic, nitalic,
                  hyperlink, nhyperlink, hilite, nhilite,
-		 selected, nselected, strikethrough, nstrikethrough;
+		 selected, strikethrough, nstrikethrough;
 	guint item_count;
 	const VteCell *cell;
 	VteRowData const* row_data;
+        vte::grid::column_t sel_start, sel_end;
+        vte::color::rgb bg;
 
 	/* adjust for the absolute start of row */
 	start_x -= start_column * column_width;
@@ -9316,6 +9673,7 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 	rows = end_row - start_row;
 	do {
 		row_data = find_row_data(row);
+		selection_columns(row, &sel_start, &sel_end);
 		/* Back up in case this is a multicolumn character,
 		 * making the drawing area a little wider. */
 		i = start_column;
@@ -9331,12 +9689,26 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 				/* Get the character cell's contents. */
 				cell = _vte_row_data_get (row_data, i);
 				/* Find the colors for this cell. */
-				selected = cell_is_selected(i, row);
-				determine_colors(cell, selected, &fore, &back);
+				auto colors = resolve_colors(cell, i >= sel_start && i < sel_end);
+				back = colors->back;
+				bg = colors->back_rgb;
 
 				bold = cell && cell->attr.bold;
 				j = i + (cell ? cell->attr.columns : 1);
 
+				/* The cells up to the end of this run of equal
+				 * attributes resolve the same, unless the selection
+				 * starts or ends in between. */
+				if (cell != NULL) {
+					vte::grid::column_t run_end = _vte_cells_attr_run_end(row_data->cells, i,
+												_vte_row_data_length(row_data));
+					if (i < sel_start)
+						run_end = MIN(run_end, sel_start);
+					else if (i < sel_end)
+						run_end = MIN(run_end, sel_end);
+					j = MAX(j, MIN(run_end, end_column));
+				}
+
 				while (j < end_column){
 					/* Retrieve the cell. */
 					cell = _vte_row_data_get (row_data, j);
@@ -9350,8 +9722,7 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 					/* Resolve attributes to colors where possible and
 					 * compare visual attributes to the first character
 					 * in this chunk. */
-					selected = cell_is_selected(j, row);
-					determine_colors(cell, selected, &nfore, &nback);
+					nback = resolve_colors(cell, j >= sel_start && j < sel_end)->back;
 					if (nback != back) {
 						break;
 					}
@@ -9359,11 +9730,15 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 					j += cell ? cell->attr.columns : 1;
 				}
 				if (back != VTE_DEFAULT_BG) {
-					vte::color::rgb bg;
-					gint bold_offset = _vte_draw_has_bold(m_draw,
-											VTE_DRAW_BOLD) ? 0 : bold;
-					rgb_from_index(back, bg);
-					_vte_draw_fill_rectangle (
+					/* Only ask when needed, it loads the bold font */
+					gint bold_offset = bold && !_vte_draw_has_bold(m_draw,
+												       VTE_DRAW_BOLD);
+					/* The display list is painted out of order, so
+					 * don't let the pixel of fake bold overlap the
+					 * next run when that one is filled anyway. */
+					if (j < end_column && nback != VTE_DEFAULT_BG)
+						bold_offset = 0;
+					_vte_draw_queue_rectangle (
 							m_draw,
 							x + i * column_width,
 							y,
@@ -9377,25 +9752,24 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 			} while (i < end_column);
 		} else {
 			do {
-				selected = cell_is_selected(i, row);
-				j = i + 1;
-				while (j < end_column){
-					nselected = cell_is_selected(j, row);
-					if (nselected != selected) {
-						break;
-					}
-					j++;
-				}
-				determine_colors(nullptr, selected, &fore, &back);
+				/* Blank rows only change colour at the selection's edges. */
+				selected = i >= sel_start && i < sel_end;
+				if (selected)
+					j = sel_end;
+				else if (i < sel_start)
+					j = sel_start;
+				else
+					j = end_column;
+				j = MIN(j, end_column);
+				auto colors = resolve_colors(nullptr, selected);
+				back = colors->back;
 				if (back != VTE_DEFAULT_BG) {
-					vte::color::rgb bg;
-					rgb_from_index(back, bg);
-					_vte_draw_fill_rectangle (m_draw,
+					_vte_draw_queue_rectangle (m_draw,
 								  x + i *column_width,
 								  y,
 								  (j - i)  * column_width,
 								  row_height,
-								  &bg, VTE_DRAW_OPAQUE);
+								  &colors->back_rgb, VTE_DRAW_OPAQUE);
 				}
 				i = j;
 			} while (i < end_column);
@@ -9403,7 +9777,10 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 		row++;
 		y += row_height;
 	} while (--rows);
+	_vte_draw_flush_rectangles(m_draw);
 
+        draw_search_highlights(start_row, end_row, start_column, end_column,
+                               start_x, start_y, column_width, row_height);
 
 	/* render the text */
 	y = start_y;
@@ -9415,6 +9792,7 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 		if (row_data == NULL) {
 			goto fg_skip_row;
 		}
+		selection_columns(row, &sel_start, &sel_end);
 		/* Back up in case this is a multicolumn character,
 		 * making the drawing area a little wider. */
 		i = start_column;
@@ -9447,8 +9825,11 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 				}
 			}
 			/* Find the colors for this cell. */
-			selected = cell_is_selected(i, row);
-			determine_colors(cell, selected, &fore, &back);
+			{
+				auto colors = resolve_colors(cell, i >= sel_start && i < sel_end);
+				fore = colors->fore;
+				back = colors->back;
+			}
 			underline = cell->attr.underline;
 			strikethrough = cell->attr.strikethrough;
                         hyperlink = (m_allow_hyperlink && cell->attr.hyperlink_idx != 0);
@@ -9498,8 +9879,7 @@ VteTerminalPrivate::draw_rows(VteScreen *screen_,
 					/* Resolve attributes to colors where possible and
 					 * compare visual attributes to the first character
 					 * in this chunk. */
-					selected = cell_is_selected(j, row);
-					determine_colors(cell, selected, &nfore, &nback);
+					nfore = resolve_colors(cell, j >= sel_start && j < sel_end)->fore;
 					if (nfore != fore) {
 						break;
 					}
@@ -9559,6 +9939,7 @@ fg_next_row:
 						y += row_height;
 						row_data = find_row_data(row);
 					} while (row_data == NULL);
+					selection_columns(row, &sel_start, &sel_end);
 
 					/* Back up in case this is a
 					 * multicolumn character, making the drawing
@@ -9877,81 +10258,68 @@ VteTerminalPrivate::paint_im_preedit_string()
 	}
 }
 
+/* Paints @region, in widget coordinates, of the view into @cr. */
 void
-VteTerminalPrivate::widget_draw(cairo_t *cr)
+VteTerminalPrivate::paint_region(cairo_t *cr,
+                                 cairo_region_t const* region)
 {
-        cairo_rectangle_int_t clip_rect;
-        cairo_region_t *region;
-        int allocated_width, allocated_height;
-        int extra_area_for_cursor;
+        int allocated_width = get_allocated_width();
+        int allocated_height = get_allocated_height();
         VteRing *ring = m_screen->row_data;
 
-        if (!gdk_cairo_get_clip_rectangle (cr, &clip_rect))
-                return;
+        cairo_save(cr);
+        gdk_cairo_region(cr, region);
+        cairo_clip(cr);
 
-        _vte_debug_print(VTE_DEBUG_LIFECYCLE, "vte_terminal_draw()\n");
-        _vte_debug_print (VTE_DEBUG_WORK, "+");
-        _vte_debug_print (VTE_DEBUG_UPDATES, "Draw (%d,%d)x(%d,%d)\n",
-                          clip_rect.x, clip_rect.y,
-                          clip_rect.width, clip_rect.height);
-
-        region = vte_cairo_get_clip_region (cr);
-        if (region == NULL)
-                return;
-
-        allocated_width = get_allocated_width();
-        allocated_height = get_allocated_height();
-
-	/* Designate the start of the drawing operation and clear the area. */
-	_vte_draw_set_cairo(m_draw, cr);
+        /* Designate the start of the drawing operation and clear the area. */
+        _vte_draw_set_cairo(m_draw, cr);
 
-	_vte_draw_clear (m_draw, 0, 0,
-			 allocated_width, allocated_height,
+        _vte_draw_clear (m_draw, 0, 0,
+                         allocated_width, allocated_height,
                          get_color(VTE_DEFAULT_BG), m_background_alpha);
 
-	/* Draw SIXEL images */
-	if (m_sixel_enabled) {
-		vte::grid::row_t top_row = first_displayed_row();
-		vte::grid::row_t bottom_row = last_displayed_row();
-		auto image_map = ring->image_map;
-		auto it = image_map->lower_bound (top_row);
-		for (; it != image_map->end (); ++it) {
-			vte::image::image_object *image = it->second;
-			if (image->get_top () > bottom_row)
-				break;
-			if (image->is_freezed ()) {
-				ring->image_offscreen_resource_counter -= image->resource_size ();
-				image->thaw ();
-				ring->image_onscreen_resource_counter += image->resource_size ();
-				_vte_debug_print (VTE_DEBUG_IMAGE,
-				                  "thawn, onscreen: %zu, offscreen: %zu\n",
-				                  ring->image_onscreen_resource_counter,
-				                  ring->image_offscreen_resource_counter);
-			}
-			/* Display images */
-			int x = m_padding.left + image->get_left () * m_char_width;
-			int y = m_padding.top + (image->get_top () - m_screen->scroll_delta) * m_char_height;
-			image->paint (cr, x, y);
-		}
-	}
+        /* Draw SIXEL images */
+        if (m_sixel_enabled) {
+                vte::grid::row_t top_row = first_displayed_row();
+                vte::grid::row_t bottom_row = last_displayed_row();
+                auto image_map = ring->image_map;
+                auto it = image_map->lower_bound (top_row);
+                for (; it != image_map->end (); ++it) {
+                        vte::image::image_object *image = it->second;
+                        if (image->get_top () > bottom_row)
+                                break;
+                        if (image->is_freezed ()) {
+                                ring->image_offscreen_resource_counter -= image->resource_size ();
+                                image->thaw ();
+                                ring->image_onscreen_resource_counter += image->resource_size ();
+                                _vte_debug_print (VTE_DEBUG_IMAGE,
+                                                  "thawn, onscreen: %zu, offscreen: %zu\n",
+                                                  ring->image_onscreen_resource_counter,
+                                                  ring->image_offscreen_resource_counter);
+                        }
+                        /* Display images */
+                        int x = m_padding.left + image->get_left () * m_char_width;
+                        int y = m_padding.top + (image->get_top () - m_screen->scroll_delta) * m_char_height;
+                        image->paint (cr, x, y);
+                }
+        }
 
         /* Clip vertically, for the sake of smooth scrolling. We want the top and bottom paddings to be unused.
          * Don't clip horizontally so that antialiasing can legally overflow to the right padding. */
-        cairo_save(cr);
         cairo_rectangle(cr, 0, m_padding.top, allocated_width, allocated_height - m_padding.top - m_padding.bottom);
         cairo_clip(cr);
 
         cairo_translate(cr, m_padding.left, m_padding.top);
 
-        /* Transform to view coordinates */
-        cairo_region_translate(region, -m_padding.left, -m_padding.top);
-
         cairo_rectangle_int_t *rectangles;
         int n, n_rectangles;
         n_rectangles = cairo_region_num_rectangles (region);
         rectangles = g_new(cairo_rectangle_int_t, n_rectangles);
         for (n = 0; n < n_rectangles; n++) {
                 cairo_region_get_rectangle (region, n, &rectangles[n]);
+                /* Transform to view coordinates */
+                rectangles[n].x -= m_padding.left;
+                rectangles[n].y -= m_padding.top;
         }
 
         /* don't bother to enlarge an invalidate all */
@@ -9976,76 +10344,304 @@ VteTerminalPrivate::widget_draw(cairo_t *cr)
                 cairo_region_destroy(rr);
         }
 
+        _vte_debug_print (VTE_DEBUG_UPDATES, "Repainting %d rectangles\n", n_rectangles);
+
         /* and now paint them */
         for (n = 0; n < n_rectangles; n++) {
                 paint_area(&rectangles[n]);
         }
         g_free (rectangles);
 
-	paint_im_preedit_string();
+        _vte_draw_set_cairo(m_draw, NULL);
 
         cairo_restore(cr);
+}
 
-        /* Re-clip, allowing 1 more pixel row for the outline cursor. */
-        /* TODOegmont: It's really ugly to do it here. */
-        cairo_save(cr);
-        extra_area_for_cursor = (decscusr_cursor_shape() == VTE_CURSOR_SHAPE_BLOCK && !m_has_focus) ? 1 : 0;
-        cairo_rectangle(cr, 0, m_padding.top - extra_area_for_cursor, allocated_width, allocated_height - m_padding.top - m_padding.bottom + 2 * extra_area_for_cursor);
-        cairo_clip(cr);
+/* A horizontal band of the damage.  Its drawing is recorded on the main
+ * thread, where all of the terminal, font and glyph atlas state is used,
+ * and is then rasterized into an image surface of its own on a worker
+ * thread; the recording only refers to immutable cairo objects by then. */
+struct vte_render_band {
+        struct vte_render_job *job;
+        cairo_region_t *region;         /* widget coordinates */
+        cairo_rectangle_int_t extents;
+        int scale;
+        cairo_surface_t *recording;
+        cairo_surface_t *image;         /* nullptr until rasterized, or on failure */
+};
 
-        cairo_translate(cr, m_padding.left, m_padding.top);
+struct vte_render_job {
+        GMutex lock;
+        GCond done;
+        guint pending;
+};
 
-	paint_cursor();
+static void
+render_band_in_thread(gpointer data,
+                      gpointer user_data)
+{
+        auto band = reinterpret_cast<struct vte_render_band *>(data);
+        auto job = band->job;
+        auto image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                band->extents.width * band->scale,
+                                                band->extents.height * band->scale);
+
+        if (cairo_surface_status(image) == CAIRO_STATUS_SUCCESS) {
+                cairo_surface_set_device_scale(image, band->scale, band->scale);
+
+                auto cr = cairo_create(image);
+                cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+                cairo_set_source_surface(cr, band->recording, -band->extents.x, -band->extents.y);
+                cairo_paint(cr);
+                cairo_destroy(cr);
+                cairo_surface_flush(image);
+                band->image = image;
+        } else {
+                cairo_surface_destroy(image);
+        }
 
-	cairo_restore(cr);
+        g_mutex_lock(&job->lock);
+        if (--job->pending == 0)
+                g_cond_signal(&job->done);
+        g_mutex_unlock(&job->lock);
+}
 
-	/* Done with various structures. */
-	_vte_draw_set_cairo(m_draw, NULL);
+/* Like paint_region(), but splits large damage into bands of rows that are
+ * rasterized in parallel, and composited into @cr once all are done. */
+void
+VteTerminalPrivate::paint_region_threaded(cairo_t *cr,
+                                          cairo_region_t const* region)
+{
+        cairo_rectangle_int_t extents;
+        struct vte_render_band bands[VTE_RENDER_BANDS_MAX];
+        struct vte_render_job job;
+        double x_scale, y_scale;
+        long rows, band_rows, top, y0, y1;
+        int n_bands, i;
 
-        cairo_region_destroy (region);
+        cairo_region_get_extents(region, &extents);
 
-        m_invalidated_all = FALSE;
+        /* Bands start on row boundaries, so that no row is drawn twice.
+         * The top padding is above the first row, so round down to it. */
+        top = MAX(extents.y - m_padding.top, 0) / m_char_height * m_char_height + m_padding.top;
+        rows = (extents.y + extents.height - top + m_char_height - 1) / m_char_height;
+        n_bands = MIN(rows / VTE_RENDER_BAND_ROWS_MIN,
+                      MIN((int) g_get_num_processors(), VTE_RENDER_BANDS_MAX));
+        if (n_bands < 2) {
+                paint_region(cr, region);
+                return;
+        }
+        band_rows = (rows + n_bands - 1) / n_bands;
+
+        if (m_render_pool == nullptr)
+                m_render_pool = g_thread_pool_new(render_band_in_thread, nullptr,
+                                                  g_get_num_processors(), FALSE /* exclusive */, nullptr);
+
+        g_mutex_init(&job.lock);
+        g_cond_init(&job.done);
+        job.pending = 0;
+
+        cairo_surface_get_device_scale(cairo_get_target(cr), &x_scale, &y_scale);
+
+        /* Record every band before any is rasterized, since recording
+         * may still rasterize glyphs into the atlas. */
+        for (i = 0; i < n_bands; i++) {
+                auto band = &bands[i];
+
+                /* The first and last bands also take the padding. */
+                y0 = i == 0 ? extents.y : top + i * band_rows * m_char_height;
+                y1 = i == n_bands - 1 ? extents.y + extents.height
+                                      : top + (i + 1) * band_rows * m_char_height;
+                y1 = MAX(y1, y0);
+                cairo_rectangle_int_t rect = { extents.x, (int) y0,
+                                               extents.width, (int) (y1 - y0) };
+
+                band->job = &job;
+                band->image = nullptr;
+                band->recording = nullptr;
+                band->region = cairo_region_copy(region);
+                cairo_region_intersect_rectangle(band->region, &rect);
+                if (cairo_region_is_empty(band->region))
+                        continue;
+                cairo_region_get_extents(band->region, &band->extents);
+                band->scale = (int) x_scale;
+
+                band->recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, nullptr);
+                cairo_surface_set_device_scale(band->recording, x_scale, y_scale);
+                auto rcr = cairo_create(band->recording);
+                paint_region(rcr, band->region);
+                cairo_destroy(rcr);
+        }
+
+        _vte_debug_print (VTE_DEBUG_UPDATES, "Rasterizing %d bands of %ld rows\n",
+                          n_bands, band_rows);
+
+        g_mutex_lock(&job.lock);
+        for (i = 0; i < n_bands; i++) {
+                if (bands[i].recording == nullptr)
+                        continue;
+                job.pending++;
+                g_thread_pool_push(m_render_pool, &bands[i], nullptr);
+        }
+        while (job.pending > 0)
+                g_cond_wait(&job.done, &job.lock);
+        g_mutex_unlock(&job.lock);
+
+        for (i = 0; i < n_bands; i++) {
+                auto band = &bands[i];
+
+                if (band->recording == nullptr) {
+                        cairo_region_destroy(band->region);
+                        continue;
+                }
+
+                if (band->image != nullptr) {
+                        cairo_save(cr);
+                        gdk_cairo_region(cr, band->region);
+                        cairo_clip(cr);
+                        cairo_set_source_surface(cr, band->image, band->extents.x, band->extents.y);
+                        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+                        cairo_paint(cr);
+                        cairo_restore(cr);
+                        cairo_surface_destroy(band->image);
+                } else {
+                        /* Out of memory for the band; do it here then */
+                        paint_region(cr, band->region);
+                }
+
+                cairo_surface_destroy(band->recording);
+                cairo_region_destroy(band->region);
+        }
+
+        g_cond_clear(&job.done);
+        g_mutex_clear(&job.lock);
 }
 
-/* Handle an expose event by painting the exposed area. */
-static cairo_region_t *
-vte_cairo_get_clip_region (cairo_t *cr)
+void
+VteTerminalPrivate::widget_draw(cairo_t *cr)
 {
-        cairo_rectangle_list_t *list;
+        cairo_rectangle_int_t clip_rect;
+        cairo_t *bcr;
         cairo_region_t *region;
-        int i;
+        int allocated_width, allocated_height;
+        int extra_area_for_cursor;
+        int scale;
+
+        if (!gdk_cairo_get_clip_rectangle (cr, &clip_rect))
+                return;
+
+        _vte_debug_print(VTE_DEBUG_LIFECYCLE, "vte_terminal_draw()\n");
+        _vte_debug_print (VTE_DEBUG_WORK, "+");
+        _vte_debug_print (VTE_DEBUG_UPDATES, "Draw (%d,%d)x(%d,%d)\n",
+                          clip_rect.x, clip_rect.y,
+                          clip_rect.width, clip_rect.height);
+
+        allocated_width = get_allocated_width();
+        allocated_height = get_allocated_height();
 
-        list = cairo_copy_clip_rectangle_list (cr);
-        if (list->status == CAIRO_STATUS_CLIP_NOT_REPRESENTABLE) {
-                cairo_rectangle_int_t clip_rect;
+        /* (Re)create the backing store if the allocation changed; all of it
+         * needs to be painted then. */
+        scale = gtk_widget_get_scale_factor(m_widget);
+        if (m_blit_surface == nullptr ||
+            m_blit_width != allocated_width ||
+            m_blit_height != allocated_height ||
+            m_blit_scale != scale) {
+                blit_free();
+                m_blit_surface = gdk_window_create_similar_surface(gtk_widget_get_window(m_widget),
+                                                                   CAIRO_CONTENT_COLOR_ALPHA,
+                                                                   allocated_width,
+                                                                   allocated_height);
+                m_blit_width = allocated_width;
+                m_blit_height = allocated_height;
+                m_blit_scale = scale;
+                blit_damage_all();
+        } else {
+                blit_track_scroll();
+        }
 
-                cairo_rectangle_list_destroy (list);
+        bcr = cairo_create(m_blit_surface);
+
+        /* Shift the text area of the previous frame by however much the view
+         * scrolled since; the rows this uncovered are part of the damage. */
+        if (m_blit_dy != 0) {
+                _vte_debug_print (VTE_DEBUG_UPDATES, "Blit by %ld pixels\n", m_blit_dy);
+
+                cairo_save(bcr);
+                cairo_rectangle(bcr, 0, m_padding.top, allocated_width, allocated_height - m_padding.top - m_padding.bottom);
+                cairo_clip(bcr);
+                cairo_push_group(bcr);
+                cairo_set_source_surface(bcr, m_blit_surface, 0, -m_blit_dy);
+                cairo_paint(bcr);
+                cairo_pop_group_to_source(bcr);
+                cairo_set_operator(bcr, CAIRO_OPERATOR_SOURCE);
+                cairo_paint(bcr);
+                cairo_restore(bcr);
+
+                m_blit_dy = 0;
+        }
 
-                if (!gdk_cairo_get_clip_rectangle (cr, &clip_rect))
-                        return NULL;
-                return cairo_region_create_rectangle (&clip_rect);
+        /* Repaint the damaged parts of the backing store. */
+        region = damage_take_region();
+        cairo_region_union(region, m_blit_damage);
+        cairo_region_destroy(m_blit_damage);
+        m_blit_damage = cairo_region_create();
+        if (!cairo_region_is_empty(region)) {
+                /* Transform to widget coordinates */
+                cairo_region_translate(region, m_padding.left, m_padding.top);
+
+                if (m_threaded_rendering)
+                        paint_region_threaded(bcr, region);
+                else
+                        paint_region(bcr, region);
         }
+        cairo_region_destroy (region);
 
+        cairo_destroy(bcr);
 
-        region = cairo_region_create ();
-        for (i = list->num_rectangles - 1; i >= 0; --i) {
-                cairo_rectangle_t *rect = &list->rectangles[i];
-                cairo_rectangle_int_t clip_rect;
+        /* Drawing the whole window satisfies a pending request to copy all
+         * of it, which otherwise stays set when there's no update timeout. */
+        if (clip_rect.x <= 0 && clip_rect.y <= 0 &&
+            clip_rect.x + clip_rect.width >= allocated_width &&
+            clip_rect.y + clip_rect.height >= allocated_height)
+                m_damage_expose_all = false;
 
-                clip_rect.x = floor (rect->x);
-                clip_rect.y = floor (rect->y);
-                clip_rect.width = ceil (rect->x + rect->width) - clip_rect.x;
-                clip_rect.height = ceil (rect->y + rect->height) - clip_rect.y;
+        /* Copy the backing store to the window; the cursor and the preedit
+         * string go on top of it and are never part of the backing store. */
+        cairo_save(cr);
+        cairo_set_source_surface(cr, m_blit_surface, 0, 0);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_paint(cr);
+        cairo_restore(cr);
 
-                if (cairo_region_union_rectangle (region, &clip_rect) != CAIRO_STATUS_SUCCESS) {
-                        cairo_region_destroy (region);
-                        region = NULL;
-                        break;
-                }
-        }
+        _vte_draw_set_cairo(m_draw, cr);
 
-        cairo_rectangle_list_destroy (list);
-        return region;
+        cairo_save(cr);
+        cairo_rectangle(cr, 0, m_padding.top, allocated_width, allocated_height - m_padding.top - m_padding.bottom);
+        cairo_clip(cr);
+
+        cairo_translate(cr, m_padding.left, m_padding.top);
+
+	paint_im_preedit_string();
+
+        cairo_restore(cr);
+
+        /* Re-clip, allowing 1 more pixel row for the outline cursor. */
+        /* TODOegmont: It's really ugly to do it here. */
+        cairo_save(cr);
+        extra_area_for_cursor = (decscusr_cursor_shape() == VTE_CURSOR_SHAPE_BLOCK && !m_has_focus) ? 1 : 0;
+        cairo_rectangle(cr, 0, m_padding.top - extra_area_for_cursor, allocated_width, allocated_height - m_padding.top - m_padding.bottom + 2 * extra_area_for_cursor);
+        cairo_clip(cr);
+
+        cairo_translate(cr, m_padding.left, m_padding.top);
+
+	paint_cursor();
+
+	cairo_restore(cr);
+
+	/* Done with various structures. */
+	_vte_draw_set_cairo(m_draw, NULL);
+
+        m_invalidated_all = FALSE;
 }
 
 void
@@ -10189,6 +10785,16 @@ VteTerminalPrivate::set_allow_hyperlink(bool setting)
         return true;
 }
 
+bool
+VteTerminalPrivate::set_threaded_rendering(bool setting)
+{
+        if (setting == m_threaded_rendering)
+                return false;
+
+        m_threaded_rendering = setting;
+        return true;
+}
+
 bool
 VteTerminalPrivate::set_scroll_on_output(bool scroll)
 {
@@ -10398,6 +11004,52 @@ VteTerminalPrivate::set_scrollback_lines(long lines)
         return true;
 }
 
+bool
+VteTerminalPrivate::set_scrollback_bytes(gsize bytes)
+{
+        if (bytes == m_scrollback_bytes)
+                return false;
+
+	_vte_debug_print (VTE_DEBUG_MISC,
+			"Setting scrollback bytes to %" G_GSIZE_FORMAT "\n", bytes);
+
+        m_scrollback_bytes = bytes;
+        update_scrollback_usage();
+
+        return true;
+}
+
+/* Drops the oldest scrollback rows of the normal screen while it's over
+ * m_scrollback_bytes, and keeps the scrollback-usage property up to date. */
+void
+VteTerminalPrivate::update_scrollback_usage()
+{
+        VteScreen *scrn = &m_normal_screen;
+        VteRing *ring = scrn->row_data;
+
+        if (m_scrollback_bytes != 0 &&
+            _vte_ring_trim_to_bytes(ring, m_scrollback_bytes)) {
+                long low = _vte_ring_delta(ring);
+
+                scrn->insert_delta = MAX(scrn->insert_delta, low);
+                scrn->cursor.row = MAX(scrn->cursor.row, scrn->insert_delta);
+                if (scrn == m_screen) {
+                        if (scrn->scroll_delta < low)
+                                queue_adjustment_value_changed(low);
+                        adjust_adjustments();
+                } else {
+                        scrn->scroll_delta = MAX(scrn->scroll_delta, low);
+                }
+        }
+
+        gsize usage = _vte_ring_get_usage(ring);
+        if (usage == m_scrollback_usage)
+                return;
+
+        m_scrollback_usage = usage;
+        g_object_notify_by_pspec(G_OBJECT(m_terminal), pspecs[PROP_SCROLLBACK_USAGE]);
+}
+
 bool
 VteTerminalPrivate::set_backspace_binding(VteEraseBinding binding)
 {
@@ -10477,6 +11129,7 @@ VteTerminalPrivate::reset(bool clear_tabstops,
 	/* Reset the color palette. Only the 256 indexed colors, not the special ones, as per xterm. */
 	for (int i = 0; i < 256; i++)
 		m_palette[i].sources[VTE_COLOR_SOURCE_ESCAPE].is_set = FALSE;
+        color_cache_invalidate();
 	/* Reset the default attributes.  Reset the alternate attribute because
 	 * it's not a real attribute, but we need to treat it as one here. */
         reset_default_attributes(true);
@@ -10713,9 +11366,10 @@ add_update_timeout(VteTerminalPrivate *that)
 }
 
 void
-VteTerminalPrivate::reset_update_rects()
+VteTerminalPrivate::reset_damage()
 {
-        g_array_set_size(m_update_rects, 0);
+        damage_clear();
+        m_damage_expose_all = FALSE;
 
 	/* The invalidated_all flag also marks whether to skip processing
 	 * due to the widget being invisible.
@@ -10727,7 +11381,8 @@ static bool
 remove_from_active_list(VteTerminalPrivate *that)
 {
 	if (that->m_active_terminals_link == nullptr ||
-            that->m_update_rects->len != 0)
+            that->m_damage_n_rows != 0 ||
+            that->m_damage_expose_all)
                 return false;
 
         _vte_debug_print(VTE_DEBUG_TIMEOUT, "Removing terminal from active list\n");
@@ -10759,7 +11414,7 @@ stop_processing(VteTerminalPrivate *that)
 static void
 remove_update_timeout(VteTerminalPrivate *that)
 {
-	that->reset_update_rects();
+	that->reset_damage();
         stop_processing(that);
 }
 
@@ -10877,6 +11532,8 @@ VteTerminalPrivate::emit_pending_signals()
 				"Emitting `contents-changed'.\n");
 		g_signal_emit(m_terminal, signals[SIGNAL_CONTENTS_CHANGED], 0);
 		m_contents_changed_pending = false;
+
+                search_count_queue_update();
 	}
 
         g_object_thaw_notify(object);
@@ -10995,20 +11652,27 @@ VteTerminalPrivate::invalidate_dirty_rects_and_process_updates()
         if (G_UNLIKELY(!widget_realized()))
                 return false;
 	if (m_visibility_state == GDK_VISIBILITY_FULLY_OBSCURED) {
-		reset_update_rects();
+		reset_damage();
 		return false;
 	}
 
-	if (G_UNLIKELY (!m_update_rects->len))
+	if (G_UNLIKELY (m_damage_n_rows == 0 && !m_damage_expose_all))
 		return false;
 
-        auto region = cairo_region_create();
-        auto n_rects = m_update_rects->len;
-        for (guint i = 0; i < n_rects; i++) {
-                cairo_rectangle_int_t *rect = &g_array_index(m_update_rects, cairo_rectangle_int_t, i);
-                cairo_region_union_rectangle(region, rect);
-	}
-        g_array_set_size(m_update_rects, 0);
+        /* The damage becomes that of the backing store, which is repainted
+         * when drawing; it moves along if the view scrolls before that. */
+        auto region = damage_take_region();
+        cairo_region_union(m_blit_damage, region);
+        if (m_damage_expose_all) {
+                auto allocation = get_allocated_rect();
+                cairo_rectangle_int_t rect;
+                rect.x = -m_padding.left;
+                rect.y = -m_padding.top;
+                rect.width = allocation.width;
+                rect.height = allocation.height;
+                cairo_region_union_rectangle(region, &rect);
+        }
+        m_damage_expose_all = false;
 	m_invalidated_all = false;
 
         auto allocation = get_allocated_rect();
@@ -11167,17 +11831,227 @@ update_timeout (gpointer data)
 	return FALSE;
 }
 
+/* The palette as 0xRRGGBB values, for writing the contents as HTML. */
+void
+VteTerminalPrivate::get_palette_rgb(guint32 *palette) const
+{
+        for (int i = 0; i < VTE_PALETTE_SIZE; i++) {
+                auto color = get_color(i);
+                palette[i] = color ? ((color->red >> 8) << 16) | ((color->green >> 8) << 8) | (color->blue >> 8) : 0;
+        }
+}
+
 bool
 VteTerminalPrivate::write_contents_sync (GOutputStream *stream,
                                          VteWriteFlags flags,
                                          GCancellable *cancellable,
                                          GError **error)
 {
+        guint32 palette[VTE_PALETTE_SIZE];
+
+        get_palette_rgb(palette);
 	return _vte_ring_write_contents (m_screen->row_data,
-					 stream, flags,
+					 stream, flags, palette,
 					 cancellable, error);
 }
 
+struct vte_write_contents_job {
+        VteRingExport *exp;
+        GOutputStream *stream;
+        std::atomic<bool> done;
+};
+
+static void
+write_contents_job_free(gpointer data)
+{
+        auto job = reinterpret_cast<struct vte_write_contents_job *>(data);
+
+        _vte_ring_export_free(job->exp);
+        g_object_unref(job->stream);
+
+        delete job;
+}
+
+static void
+write_contents_job_run_in_thread(GTask *task,
+                                 gpointer source_object,
+                                 gpointer task_data,
+                                 GCancellable *cancellable)
+{
+        auto job = reinterpret_cast<struct vte_write_contents_job *>(task_data);
+        GError *error = nullptr;
+
+        bool ok = _vte_ring_export_write(job->exp, job->stream, cancellable, &error);
+        job->done = true;
+
+        if (!ok)
+                g_task_return_error(task, error);
+        else
+                g_task_return_boolean(task, TRUE);
+}
+
+static gboolean
+vte_terminal_write_contents_progress_cb(GTask *task)
+{
+        auto job = reinterpret_cast<struct vte_write_contents_job *>(g_task_get_task_data(task));
+        auto terminal = VTE_TERMINAL(g_task_get_source_object(task));
+        bool done = job->done;
+
+        _vte_terminal_get_impl(terminal)->emit_write_contents_progress(done ? 1. : _vte_ring_export_get_progress(job->exp));
+
+        return done ? G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+}
+
+/*
+ * VteTerminalPrivate::write_contents_async:
+ *
+ * Takes the contents as they are now, and writes them to @stream in a
+ * worker thread, see _vte_ring_export_write().
+ */
+void
+VteTerminalPrivate::write_contents_async(GOutputStream *stream,
+                                         VteWriteFlags flags,
+                                         GCancellable *cancellable,
+                                         GAsyncReadyCallback callback,
+                                         gpointer user_data)
+{
+        guint32 palette[VTE_PALETTE_SIZE];
+
+        auto task = g_task_new(m_terminal, cancellable, callback, user_data);
+        g_task_set_source_tag(task, (void *)vte_terminal_write_contents_async);
+
+        get_palette_rgb(palette);
+        auto job = new vte_write_contents_job();
+        job->exp = _vte_ring_export_new(m_screen->row_data, flags, palette);
+        job->stream = (GOutputStream *)g_object_ref(stream);
+        job->done = false;
+
+        g_task_set_task_data(task, job, write_contents_job_free);
+        g_task_run_in_thread(task, write_contents_job_run_in_thread);
+
+        g_timeout_add_full(G_PRIORITY_DEFAULT, VTE_WRITE_CONTENTS_PROGRESS_INTERVAL,
+                           (GSourceFunc)vte_terminal_write_contents_progress_cb,
+                           g_object_ref(task),
+                           g_object_unref);
+        g_object_unref(task);
+}
+
+bool
+VteTerminalPrivate::write_contents_finish(GAsyncResult *result,
+                                          GError **error)
+{
+        return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+/*
+ * VteTerminalPrivate::save_scrollback:
+ *
+ * Saves the normal screen's rows and cursor to @file, see _vte_ring_export_save().
+ */
+bool
+VteTerminalPrivate::save_scrollback(GFile *file,
+                                    GCancellable *cancellable,
+                                    GError **error)
+{
+        auto ring = m_normal_screen.row_data;
+
+        /* The snapshot has to have every row's record in the row stream */
+        if (_vte_ring_rewrap_pending(ring)) {
+                stop_rewrap_scrollback();
+                while (rewrap_scrollback())
+                        ;
+        }
+
+        auto stream = g_file_replace(file, nullptr, FALSE, G_FILE_CREATE_PRIVATE,
+                                     cancellable, error);
+        if (stream == nullptr)
+                return false;
+
+        auto exp = _vte_ring_export_new(ring, VTE_WRITE_DEFAULT, nullptr);
+        bool ret = _vte_ring_export_save(exp, m_column_count, &m_normal_screen.cursor,
+                                         G_OUTPUT_STREAM(stream), cancellable, error) &&
+                g_output_stream_close(G_OUTPUT_STREAM(stream), cancellable, error);
+        _vte_ring_export_free(exp);
+        g_object_unref(stream);
+
+        return ret;
+}
+
+/*
+ * VteTerminalPrivate::restore_scrollback:
+ *
+ * Resets the terminal, and restores the normal screen's rows and cursor from
+ * @file, which is mapped into memory meanwhile. Rewraps the rows if they were
+ * saved at another width.
+ */
+bool
+VteTerminalPrivate::restore_scrollback(GFile *file,
+                                       GCancellable *cancellable,
+                                       GError **error)
+{
+        auto path = g_file_get_path(file);
+        if (path == nullptr) {
+                g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                    "Scrollback snapshots can only be restored from local files");
+                return false;
+        }
+
+        auto mapped = g_mapped_file_new(path, FALSE, error);
+        g_free(path);
+        if (mapped == nullptr)
+                return false;
+
+        if (g_cancellable_set_error_if_cancelled(cancellable, error)) {
+                g_mapped_file_unref(mapped);
+                return false;
+        }
+
+        /* Check the snapshot before resetting anything */
+        auto data = g_mapped_file_get_contents(mapped);
+        auto len = g_mapped_file_get_length(mapped);
+        if (len < sizeof(VteRingSnapshotHeader) ||
+            memcmp(data, VTE_RING_SNAPSHOT_MAGIC, strlen(VTE_RING_SNAPSHOT_MAGIC)) != 0) {
+                g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                    "Not a scrollback snapshot");
+                g_mapped_file_unref(mapped);
+                return false;
+        }
+
+        reset(false, true, false);
+
+        auto ring = m_normal_screen.row_data;
+        glong columns;
+        VteVisualPosition cursor;
+        bool ret = _vte_ring_load_snapshot(ring, data, len, &columns, &cursor, error);
+        g_mapped_file_unref(mapped);
+        if (!ret)
+                return false;
+
+        m_normal_screen.cursor.row = CLAMP(cursor.row,
+                                           _vte_ring_delta(ring),
+                                           MAX(_vte_ring_delta(ring), _vte_ring_next(ring) - 1));
+        m_normal_screen.cursor.col = MAX(cursor.col, 0);
+        m_normal_screen.insert_delta = MAX(_vte_ring_delta(ring), _vte_ring_next(ring) - m_row_count);
+        m_normal_screen.scroll_delta = m_normal_screen.insert_delta;
+        save_cursor(&m_normal_screen);
+
+        if (columns != m_column_count && columns > 0) {
+                screen_set_size(&m_normal_screen, columns, m_row_count, m_rewrap_on_resize);
+                if (_vte_ring_rewrap_pending(ring))
+                        start_rewrap_scrollback();
+        }
+
+        /* Hack: force a change in scroll_delta even if the value remains, see reset(). */
+        m_screen->scroll_delta = -1;
+        queue_adjustment_value_changed(m_screen->insert_delta);
+        adjust_adjustments_full();
+        invalidate_all();
+        queue_contents_changed();
+        emit_text_modified();
+
+        return true;
+}
+
 /*
  * Buffer search
  */
@@ -11210,6 +12084,10 @@ VteTerminalPrivate::search_set_regex (VteRegex *regex,
                 rx->match_flags = flags;
         }
 
+        search_highlight_clear();
+        search_count_reset();
+        search_count_queue_update();
+
 	invalidate_all();
 
         return true;
@@ -11236,7 +12114,6 @@ VteTerminalPrivate::search_rows(pcre2_match_context_8 *match_context,
 	long start_col, end_col;
 	VteCharAttributes *ca;
 	GArray *attrs;
-	gdouble value, page_size;
 
 	auto row_text = get_text(start_row, 0,
                                  end_row, -1,
@@ -11300,6 +12177,21 @@ VteTerminalPrivate::search_rows(pcre2_match_context_8 *match_context,
 
 	g_string_free (row_text, TRUE);
 
+	search_select_match(start_row, start_col, end_row, end_col, backward);
+
+	return true;
+}
+
+/* Selects the match found, and scrolls to it. */
+void
+VteTerminalPrivate::search_select_match(vte::grid::row_t start_row,
+                                        vte::grid::column_t start_col,
+                                        vte::grid::row_t end_row,
+                                        vte::grid::column_t end_col,
+                                        bool backward)
+{
+	gdouble value, page_size;
+
 	select_text(start_col, start_row, end_col, end_row);
 	/* Quite possibly the math here should not access adjustment directly... */
 	value = gtk_adjustment_get_value(m_vadjustment);
@@ -11311,14 +12203,393 @@ VteTerminalPrivate::search_rows(pcre2_match_context_8 *match_context,
 		if (start_row < value || start_row > value + page_size - 1)
 			queue_adjustment_value_changed_clamped(start_row);
 	}
-
-	return true;
 }
 
-bool
-VteTerminalPrivate::search_rows_iter(pcre2_match_context_8 *match_context,
-                                     pcre2_match_data_8 *match_data,
-                                     vte::grid::row_t start_row,
+/*
+ * vte_search_stream: Matching the search regex in a stream of text, which
+ * is either the ring's text stream or a snapshot of it read from a worker
+ * thread.
+ */
+struct vte_search_stream {
+        VteStream *text;
+        VteRing *ring;                      /* for its search index, or nullptr */
+        VteRingSearchQuery const* query;
+        VteRegex *regex;
+        guint32 match_flags;
+        pcre2_match_context_8 *match_context;
+        pcre2_match_data_8 *match_data;
+        gsize text_start, text_end;         /* the text being searched */
+        GString *buffer;
+        GCancellable *cancellable;
+        std::atomic<gsize> *progress;       /* bytes scanned are added here, or nullptr */
+        gsize progress_offset;
+};
+
+static void
+search_stream_init(struct vte_search_stream *ss,
+                   VteStream *text,
+                   VteRegex *regex,
+                   guint32 match_flags,
+                   gsize text_start,
+                   gsize text_end)
+{
+        ss->text = text;
+        ss->ring = nullptr;
+        ss->query = nullptr;
+        ss->regex = regex;
+        ss->match_flags = match_flags;
+        ss->match_context = VteTerminalPrivate::create_match_context();
+        ss->match_data = pcre2_match_data_create_8(256 /* should be plenty */, nullptr /* general context */);
+        ss->text_start = text_start;
+        ss->text_end = text_end;
+        ss->buffer = g_string_sized_new(VTE_SEARCH_CHUNK_SIZE);
+        ss->cancellable = nullptr;
+        ss->progress = nullptr;
+        ss->progress_offset = text_start;
+}
+
+static void
+search_stream_clear(struct vte_search_stream *ss)
+{
+        g_string_free(ss->buffer, TRUE);
+        pcre2_match_data_free_8(ss->match_data);
+        pcre2_match_context_free_8(ss->match_context);
+}
+
+static inline void
+search_stream_progress(struct vte_search_stream *ss,
+                       gsize offset)
+{
+        if (offset <= ss->progress_offset)
+                return;
+        if (ss->progress != nullptr)
+                *ss->progress += offset - ss->progress_offset;
+        ss->progress_offset = offset;
+}
+
+/*
+ * search_stream_find:
+ * @from: the text offset to start looking for a match at
+ * @start_limit: only look for matches starting before this offset
+ * @match_start: (out): the text offset where the match starts
+ * @match_end: (out): the text offset where the match ends
+ *
+ * Finds the first match of the search regex in the text stream, a chunk at
+ * a time. When a match might go on beyond a chunk (PCRE2 reports a partial
+ * match), the text is read again starting from that match, with more
+ * following it.
+ *
+ * Returns: %true if a match was found
+ */
+static bool
+search_stream_find(struct vte_search_stream *ss,
+                   gsize from,
+                   gsize start_limit,
+                   gsize *match_start,
+                   gsize *match_end)
+{
+        auto code = _vte_regex_get_pcre(ss->regex);
+
+        int (* match_fn) (const pcre2_code_8 *,
+                          PCRE2_SPTR8, PCRE2_SIZE, PCRE2_SIZE, uint32_t,
+                          pcre2_match_data_8 *, pcre2_match_context_8 *);
+        if (_vte_regex_get_jited(ss->regex))
+                match_fn = pcre2_jit_match_8;
+        else
+                match_fn = pcre2_match_8;
+
+        /* Keep enough text before the start for lookbehinds, \b and multiline ^ */
+        uint32_t lookbehind = 0;
+        pcre2_pattern_info_8(code, PCRE2_INFO_MAXLOOKBEHIND, &lookbehind);
+        gsize context = (MIN(lookbehind, 255u) + 1) * VTE_UTF8_BPC;
+
+        auto buffer = ss->buffer;
+        gsize chunk_size = VTE_SEARCH_CHUNK_SIZE;
+        bool partial = false;
+        bool found = false;
+
+        start_limit = MIN(start_limit, ss->text_end);
+        while (from < start_limit) {
+                if (ss->cancellable != nullptr && g_cancellable_is_cancelled(ss->cancellable))
+                        return false;
+
+                /* Skip the text the search index rules out */
+                if (!partial && ss->ring != nullptr) {
+                        from = _vte_ring_search_index_next(ss->ring, from, start_limit, ss->query);
+                        if (from >= start_limit)
+                                break;
+                }
+
+                gsize buf_start = from - MIN(from - ss->text_start, context);
+                gsize buf_end = MIN(from + chunk_size, ss->text_end);
+                g_string_set_size(buffer, buf_end - buf_start);
+                if (!_vte_stream_read(ss->text, buf_start, buffer->str, buffer->len))
+                        break;
+
+                /* Don't cut UTF-8 characters at either end */
+                auto str = buffer->str;
+                gsize lead = 0, len = buffer->len;
+                while (lead < len && (str[lead] & 0xC0) == 0x80)
+                        lead++;
+                if (buf_end < ss->text_end) {
+                        gsize p = len;
+                        while (p > lead && (str[p - 1] & 0xC0) == 0x80)
+                                p--;
+                        if (p > lead && (gsize)g_utf8_skip[(guchar)str[p - 1]] > len - (p - 1))
+                                len = p - 1;
+                }
+                gsize start_offset = MAX(from - buf_start, lead);
+                while (start_offset < len && (str[start_offset] & 0xC0) == 0x80)
+                        start_offset++;
+                if (start_offset >= len) {
+                        from = buf_start + len;
+                        chunk_size *= 2;
+                        continue;
+                }
+
+                /* Empty cells are stored as NULs, but searched as spaces */
+                for (auto p = str + lead; (p = (char *) memchr(p, '\0', str + len - p)) != nullptr; )
+                        *p++ = ' ';
+
+                /* Match paragraph by paragraph, like rows were searched one
+                 * paragraph at a time before: matches don't go beyond hard
+                 * newlines, and ^ matches at each paragraph's start. */
+                gsize para_start = start_offset, para_end;
+                while (para_start > lead && str[para_start - 1] != '\n')
+                        para_start--;
+                int r;
+                while (true) {
+                        auto nl = (const char *) memchr(str + start_offset, '\n', len - start_offset);
+                        para_end = nl != nullptr ? nl - str + 1 : len;
+                        r = match_fn(code,
+                                     (PCRE2_SPTR8)str + para_start, para_end - para_start, /* subject, length */
+                                     start_offset - para_start,
+                                     ss->match_flags |
+                                     PCRE2_NO_UTF_CHECK | PCRE2_NOTEMPTY |
+                                     (para_start == lead && buf_start + lead > ss->text_start ? PCRE2_NOTBOL : 0) |
+                                     (nl == nullptr && buf_start + len < ss->text_end ? PCRE2_PARTIAL_HARD : 0),
+                                     ss->match_data,
+                                     ss->match_context);
+                        if (r != PCRE2_ERROR_NOMATCH ||
+                            para_end >= len || buf_start + para_end >= start_limit)
+                                break;
+                        para_start = start_offset = para_end;
+                }
+                auto ovector = pcre2_get_ovector_pointer_8(ss->match_data);
+
+                if (r == PCRE2_ERROR_NOMATCH) {
+                        /* Nothing starts in this chunk, not even partially */
+                        from = buf_start + para_end;
+                        partial = false;
+                        chunk_size = VTE_SEARCH_CHUNK_SIZE;
+                        search_stream_progress(ss, from);
+                        continue;
+                }
+                if (r == PCRE2_ERROR_PARTIAL) {
+                        gsize partial_start = buf_start + para_start + ovector[0];
+                        if (partial_start >= start_limit)
+                                break;
+                        /* Go on with more text, or if it didn't advance, with a bigger chunk */
+                        if (partial_start == from)
+                                chunk_size *= 2;
+                        from = partial_start;
+                        partial = true;
+                        search_stream_progress(ss, from);
+                        continue;
+                }
+                if (r < 0)
+                        break;
+                if (G_UNLIKELY(ovector[0] == PCRE2_UNSET || ovector[1] == PCRE2_UNSET))
+                        break;
+
+                *match_start = buf_start + para_start + ovector[0];
+                *match_end = buf_start + para_start + ovector[1];
+                found = *match_start < start_limit;
+                break;
+        }
+
+        search_stream_progress(ss, found ? *match_end : start_limit);
+        return found;
+}
+
+/*
+ * search_stream_find_last:
+ *
+ * Like search_stream_find(), but finds the last match starting in
+ * [@from, @start_limit), going backwards a chunk at a time.
+ *
+ * Returns: %true if a match was found
+ */
+static bool
+search_stream_find_last(struct vte_search_stream *ss,
+                        gsize from,
+                        gsize start_limit,
+                        gsize *match_start,
+                        gsize *match_end)
+{
+        gsize chunk_end = MIN(start_limit, ss->text_end);
+        bool found = false;
+
+        while (!found) {
+                if (ss->ring != nullptr)
+                        chunk_end = _vte_ring_search_index_prev(ss->ring, from, chunk_end, ss->query);
+                if (chunk_end <= from)
+                        break;
+
+                /* The last match in the chunk is the last of the ones found going forward */
+                gsize chunk_start = chunk_end - MIN(chunk_end - from, (gsize)VTE_SEARCH_CHUNK_SIZE);
+                gsize offset = chunk_start, so, eo;
+                while (offset < chunk_end &&
+                       search_stream_find(ss, offset, chunk_end, &so, &eo)) {
+                        *match_start = so;
+                        *match_end = eo;
+                        found = true;
+                        offset = so + 1;
+                }
+                chunk_end = chunk_start;
+        }
+
+        return found;
+}
+
+/*
+ * VteTerminalPrivate::search_select_stream_match:
+ * @text: the text stream of the ring, or a snapshot of it
+ * @start_row: the first frozen row the match can be in
+ * @end_row: the row after the last frozen row the match can be in
+ *
+ * Selects the match at [@so, @eo) in the text stream. Only the rows the match
+ * starts and ends in need to be thawed, to find the columns.
+ *
+ * Returns: %true if the match is still there to select
+ */
+bool
+VteTerminalPrivate::search_select_stream_match(VteStream *text,
+                                               vte::grid::row_t start_row,
+                                               vte::grid::row_t end_row,
+                                               gsize so,
+                                               gsize eo,
+                                               bool backward)
+{
+        auto ring = m_screen->row_data;
+
+        /* The match ends with the character whose last byte is at eo - 1 */
+        char tail[VTE_UTF8_BPC];
+        gsize tail_len = MIN(eo - so, sizeof(tail));
+        gsize last = eo - 1;
+        if (_vte_stream_read(text, eo - tail_len, tail, tail_len)) {
+                gsize i = tail_len - 1;
+                while (i > 0 && (tail[i] & 0xC0) == 0x80)
+                        i--;
+                last = eo - tail_len + i;
+        }
+
+        VteVisualPosition start, end;
+        if (!_vte_ring_text_offset_to_position(ring, start_row, end_row, so, &start) ||
+            !_vte_ring_text_offset_to_position(ring, start_row, end_row, last, &end))
+                return false;
+
+        search_select_match(start.row, start.col, end.row, end.col, backward);
+        return true;
+}
+
+/*
+ * VteTerminalPrivate::search_frozen_rows:
+ *
+ * Searches the frozen rows [@start_row, @end_row) for the first (or, if
+ * @backward, the last) match, right in the ring's text stream.
+ *
+ * Returns: %true if a match was found
+ */
+bool
+VteTerminalPrivate::search_frozen_rows(VteRingSearchQuery const* query,
+                                       vte::grid::row_t start_row,
+                                       vte::grid::row_t end_row,
+                                       bool backward)
+{
+        auto ring = m_screen->row_data;
+        struct vte_search_stream ss;
+        gsize text_start, text_end, so, eo;
+        bool found;
+
+        if (start_row >= end_row)
+                return false;
+        if (!_vte_ring_get_text_range(ring, start_row, end_row, &text_start, &text_end))
+                return false;
+
+        auto text = _vte_ring_snapshot_text(ring);
+        search_stream_init(&ss, text, m_search_regex.regex, m_search_regex.match_flags,
+                           text_start, text_end);
+        ss.ring = ring;
+        ss.query = query;
+
+        if (backward)
+                found = search_stream_find_last(&ss, text_start, text_end, &so, &eo);
+        else
+                found = search_stream_find(&ss, text_start, text_end, &so, &eo);
+        search_stream_clear(&ss);
+
+        if (found)
+                found = search_select_stream_match(text, start_row, end_row, so, eo, backward);
+
+        g_object_unref(text);
+        return found;
+}
+
+/*
+ * VteTerminalPrivate::search_split_row:
+ *
+ * Returns: the first row in [@start_row, @end_row) from which on the rows
+ *   are to be searched row by row rather than in the text stream: the
+ *   paragraph start at or before the first writable row.
+ */
+vte::grid::row_t
+VteTerminalPrivate::search_split_row(vte::grid::row_t start_row,
+                                     vte::grid::row_t end_row)
+{
+        auto ring = m_screen->row_data;
+        vte::grid::row_t split_row = CLAMP(_vte_ring_writable(ring), start_row, end_row);
+        const VteRowData *row;
+
+        while (split_row > start_row &&
+               (row = find_row_data(split_row - 1)) != nullptr &&
+               row->attr.soft_wrapped)
+                split_row--;
+
+        return split_row;
+}
+
+/*
+ * VteTerminalPrivate::search_rows_range:
+ *
+ * Searches the rows [@start_row, @end_row) for the first (or, if @backward,
+ * the last) match. The frozen rows up to a paragraph boundary are searched
+ * in the text stream, the rest of them row by row.
+ *
+ * Returns: %true if a match was found
+ */
+bool
+VteTerminalPrivate::search_rows_range(pcre2_match_context_8 *match_context,
+                                      pcre2_match_data_8 *match_data,
+                                      VteRingSearchQuery const* query,
+                                      vte::grid::row_t start_row,
+                                      vte::grid::row_t end_row,
+                                      bool backward)
+{
+        auto split_row = search_split_row(start_row, end_row);
+
+        if (backward)
+                return search_rows_iter(match_context, match_data, split_row, end_row, true) ||
+                        search_frozen_rows(query, start_row, split_row, true);
+        else
+                return search_frozen_rows(query, start_row, split_row, false) ||
+                        search_rows_iter(match_context, match_data, split_row, end_row, false);
+}
+
+bool
+VteTerminalPrivate::search_rows_iter(pcre2_match_context_8 *match_context,
+                                     pcre2_match_data_8 *match_data,
+                                     vte::grid::row_t start_row,
                                      vte::grid::row_t end_row,
                                      bool backward)
 {
@@ -11358,6 +12629,43 @@ VteTerminalPrivate::search_rows_iter(pcre2_match_context_8 *match_context,
 	return false;
 }
 
+/* The rows a search starts after (or, if backward, before). */
+void
+VteTerminalPrivate::search_get_last_rows(vte::grid::row_t *last_start_row,
+                                         vte::grid::row_t *last_end_row)
+{
+	if (m_has_selection) {
+		*last_start_row = m_selection_start.row;
+		*last_end_row = m_selection_end.row + 1;
+	} else {
+		*last_start_row = m_screen->scroll_delta + m_row_count;
+		*last_end_row = m_screen->scroll_delta;
+	}
+	*last_start_row = MAX (_vte_ring_delta (m_screen->row_data), *last_start_row);
+	*last_end_row = MIN (_vte_ring_next (m_screen->row_data), *last_end_row);
+}
+
+/* If search fails, we make an empty selection at the last searched
+ * position... */
+void
+VteTerminalPrivate::search_select_none(bool backward)
+{
+        if (!m_has_selection)
+                return;
+
+	if (backward) {
+                if (m_search_wrap_around)
+                        select_empty(m_selection_start.col, m_selection_start.row);
+                else
+                        select_empty(-1, _vte_ring_delta (m_screen->row_data) - 1);
+	} else {
+                if (m_search_wrap_around)
+                        select_empty(m_selection_end.col + 1, m_selection_end.row);
+                else
+                        select_empty(-1, _vte_ring_next (m_screen->row_data));
+	}
+}
+
 bool
 VteTerminalPrivate::search_find (bool backward)
 {
@@ -11376,52 +12684,35 @@ VteTerminalPrivate::search_find (bool backward)
         auto match_context = create_match_context();
         auto match_data = pcre2_match_data_create_8(256 /* should be plenty */, nullptr /* general context */);
 
+        /* Text that can't contain the regex's literal doesn't need to be read at all */
+        VteRingSearchQuery query;
+        gsize literal_length;
+        auto literal = _vte_regex_get_literal(m_search_regex.regex, &literal_length);
+        _vte_ring_search_query_init(&query, literal, literal_length);
+
 	buffer_start_row = _vte_ring_delta (m_screen->row_data);
 	buffer_end_row = _vte_ring_next (m_screen->row_data);
+        search_get_last_rows(&last_start_row, &last_end_row);
 
-	if (m_has_selection) {
-		last_start_row = m_selection_start.row;
-		last_end_row = m_selection_end.row + 1;
-	} else {
-		last_start_row = m_screen->scroll_delta + m_row_count;
-		last_end_row = m_screen->scroll_delta;
-	}
-	last_start_row = MAX (buffer_start_row, last_start_row);
-	last_end_row = MIN (buffer_end_row, last_end_row);
-
-	/* If search fails, we make an empty selection at the last searched
-	 * position... */
 	if (backward) {
-		if (search_rows_iter (match_context, match_data,
-                                      buffer_start_row, last_start_row, backward))
+		if (search_rows_range (match_context, match_data, &query,
+                                       buffer_start_row, last_start_row, backward))
 			goto found;
 		if (m_search_wrap_around &&
-		    search_rows_iter (match_context, match_data,
-                                      last_end_row, buffer_end_row, backward))
+		    search_rows_range (match_context, match_data, &query,
+                                       last_end_row, buffer_end_row, backward))
 			goto found;
-		if (m_has_selection) {
-			if (m_search_wrap_around)
-			    select_empty(m_selection_start.col, m_selection_start.row);
-			else
-			    select_empty(-1, buffer_start_row - 1);
-		}
-                match_found = false;
 	} else {
-		if (search_rows_iter (match_context, match_data,
-                                      last_end_row, buffer_end_row, backward))
+		if (search_rows_range (match_context, match_data, &query,
+                                       last_end_row, buffer_end_row, backward))
 			goto found;
 		if (m_search_wrap_around &&
-		    search_rows_iter (match_context, match_data,
-                                      buffer_start_row, last_start_row, backward))
+		    search_rows_range (match_context, match_data, &query,
+                                       buffer_start_row, last_start_row, backward))
 			goto found;
-		if (m_has_selection) {
-			if (m_search_wrap_around)
-                                select_empty(m_selection_end.col + 1, m_selection_end.row);
-			else
-                                select_empty(-1, buffer_end_row);
-		}
-                match_found = false;
 	}
+        search_select_none(backward);
+        match_found = false;
 
  found:
 
@@ -11431,6 +12722,844 @@ VteTerminalPrivate::search_find (bool backward)
 	return match_found;
 }
 
+/*
+ * vte_search_job: An asynchronous search of the whole buffer.
+ *
+ * The candidate text ranges of the frozen rows, as told by the search index,
+ * are split into parts of about equal size, each scanned by a worker thread
+ * in its own snapshot of the text stream. The writable rows are fetched as
+ * text up front, and scanned by the task's thread meanwhile. All matches are
+ * collected, so their number is known; the one to select is picked when the
+ * search is finished, on the main thread.
+ */
+struct vte_search_part {
+        GArray *ranges;   /* VteRingTextRange: the text to scan */
+        GArray *matches;  /* VteRingTextRange: the matches found, in order */
+        VteStream *text;
+};
+
+struct vte_search_job {
+        VteScreen *screen;
+        VteRegex *regex;
+        guint32 match_flags;
+        bool backward;
+        GCancellable *cancellable;
+
+        /* The frozen rows, searched in the text stream */
+        vte::grid::row_t start_row, split_row;
+        gsize text_start, text_end;
+        struct vte_search_part *parts;
+        guint n_parts;
+        GArray *matches;  /* VteRingTextRange: those of all the parts */
+
+        /* The rest of the rows, as text */
+        GString *tail_text;
+        GArray *tail_attrs;
+        GArray *tail_matches;  /* VteRingTextRange: byte offsets in tail_text */
+
+        gsize bytes_total;
+        std::atomic<gsize> bytes_scanned;
+        std::atomic<bool> done;
+};
+
+static void
+search_job_free(gpointer data)
+{
+        auto job = reinterpret_cast<struct vte_search_job *>(data);
+
+        for (guint i = 0; i < job->n_parts; i++) {
+                g_array_free(job->parts[i].ranges, TRUE);
+                g_array_free(job->parts[i].matches, TRUE);
+                g_object_unref(job->parts[i].text);
+        }
+        g_free(job->parts);
+        g_array_free(job->matches, TRUE);
+        if (job->tail_text != nullptr)
+                g_string_free(job->tail_text, TRUE);
+        g_array_free(job->tail_attrs, TRUE);
+        g_array_free(job->tail_matches, TRUE);
+        vte_regex_unref(job->regex);
+
+        delete job;
+}
+
+/* Scans one part of the frozen rows, in a worker thread. */
+static void
+search_job_scan_part(gpointer data,
+                     gpointer user_data)
+{
+        auto part = reinterpret_cast<struct vte_search_part *>(data);
+        auto job = reinterpret_cast<struct vte_search_job *>(user_data);
+        struct vte_search_stream ss;
+        VteRingTextRange match;
+
+        search_stream_init(&ss, part->text, job->regex, job->match_flags,
+                           job->text_start, job->text_end);
+        ss.cancellable = job->cancellable;
+        ss.progress = &job->bytes_scanned;
+
+        for (guint i = 0; i < part->ranges->len; i++) {
+                auto range = &g_array_index(part->ranges, VteRingTextRange, i);
+                gsize from = range->start;
+
+                ss.progress_offset = range->start;
+                while (from < range->end &&
+                       search_stream_find(&ss, from, range->end, &match.start, &match.end)) {
+                        g_array_append_val(part->matches, match);
+                        from = match.end;
+                }
+                search_stream_progress(&ss, range->end);
+
+                if (g_cancellable_is_cancelled(job->cancellable))
+                        break;
+        }
+
+        search_stream_clear(&ss);
+}
+
+/* Appends the matches of @regex in @str to @matches, as byte offsets in @str. */
+static void
+search_match_all(VteRegex *regex,
+                 guint32 match_flags,
+                 char const* str,
+                 gsize len,
+                 GArray *matches,
+                 GCancellable *cancellable,
+                 std::atomic<gsize> *progress)
+{
+        auto code = _vte_regex_get_pcre(regex);
+        int (* match_fn) (const pcre2_code_8 *,
+                          PCRE2_SPTR8, PCRE2_SIZE, PCRE2_SIZE, uint32_t,
+                          pcre2_match_data_8 *, pcre2_match_context_8 *);
+        if (_vte_regex_get_jited(regex))
+                match_fn = pcre2_jit_match_8;
+        else
+                match_fn = pcre2_match_8;
+
+        auto match_context = VteTerminalPrivate::create_match_context();
+        auto match_data = pcre2_match_data_create_8(256 /* should be plenty */, nullptr /* general context */);
+        auto ovector = pcre2_get_ovector_pointer_8(match_data);
+        gsize from = 0;
+        VteRingTextRange match;
+
+        while (from < len && !g_cancellable_is_cancelled(cancellable)) {
+                auto r = match_fn(code,
+                                  (PCRE2_SPTR8)str, len, /* subject, length */
+                                  from,
+                                  match_flags | PCRE2_NO_UTF_CHECK | PCRE2_NOTEMPTY,
+                                  match_data,
+                                  match_context);
+                if (r < 0)
+                        break;
+                if (G_UNLIKELY(ovector[0] == PCRE2_UNSET || ovector[1] == PCRE2_UNSET))
+                        break;
+
+                match.start = ovector[0];
+                match.end = ovector[1];
+                g_array_append_val(matches, match);
+                if (progress != nullptr)
+                        *progress += match.end - from;
+                from = match.end;
+        }
+        if (progress != nullptr)
+                *progress += len - MIN(from, len);
+
+        pcre2_match_data_free_8(match_data);
+        pcre2_match_context_free_8(match_context);
+}
+
+/* Scans the rows after the frozen ones, in the task's thread. */
+static void
+search_job_scan_tail(struct vte_search_job *job)
+{
+        if (job->tail_text == nullptr)
+                return;
+
+        search_match_all(job->regex, job->match_flags,
+                         job->tail_text->str, job->tail_text->len,
+                         job->tail_matches, job->cancellable, &job->bytes_scanned);
+}
+
+static void
+search_job_run_in_thread(GTask *task,
+                         gpointer source_object,
+                         gpointer task_data,
+                         GCancellable *cancellable)
+{
+        auto job = reinterpret_cast<struct vte_search_job *>(task_data);
+
+        if (job->n_parts > 0) {
+                auto pool = g_thread_pool_new(search_job_scan_part, job,
+                                              job->n_parts, FALSE /* exclusive */, nullptr);
+                for (guint i = 0; i < job->n_parts; i++)
+                        g_thread_pool_push(pool, &job->parts[i], nullptr);
+                search_job_scan_tail(job);
+                g_thread_pool_free(pool, FALSE /* immediate */, TRUE /* wait */);
+        } else {
+                search_job_scan_tail(job);
+        }
+
+        /* Join the parts' matches; one may overlap the previous one at a part boundary */
+        for (guint i = 0; i < job->n_parts; i++) {
+                auto matches = job->parts[i].matches;
+                for (guint j = 0; j < matches->len; j++) {
+                        auto match = &g_array_index(matches, VteRingTextRange, j);
+                        if (job->matches->len > 0 &&
+                            match->start < g_array_index(job->matches, VteRingTextRange, job->matches->len - 1).end)
+                                continue;
+                        g_array_append_val(job->matches, *match);
+                }
+        }
+
+        job->done = true;
+
+        if (g_task_return_error_if_cancelled(task))
+                return;
+        g_task_return_boolean(task, TRUE);
+}
+
+static struct vte_search_job *
+search_job_new(VteScreen *screen,
+               VteRegex *regex,
+               guint32 match_flags)
+{
+        auto job = new vte_search_job();
+        job->screen = screen;
+        job->regex = vte_regex_ref(regex);
+        job->match_flags = match_flags;
+        job->matches = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+        job->tail_attrs = g_array_new(FALSE, TRUE, sizeof(VteCharAttributes));
+        job->tail_matches = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+        job->bytes_scanned = 0;
+        job->done = false;
+        return job;
+}
+
+/* Splits the frozen text [text_start, text_end) between the job's parts. */
+static void
+search_job_split_frozen(struct vte_search_job *job,
+                        VteRing *ring)
+{
+        /* Text that can't contain the regex's literal doesn't need to be read at all */
+        VteRingSearchQuery query;
+        gsize literal_length;
+        auto literal = _vte_regex_get_literal(job->regex, &literal_length);
+        _vte_ring_search_query_init(&query, literal, literal_length);
+
+        auto ranges = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+        _vte_ring_search_index_ranges(ring, job->text_start, job->text_end, &query, ranges);
+        gsize total = 0;
+        for (guint i = 0; i < ranges->len; i++) {
+                auto range = &g_array_index(ranges, VteRingTextRange, i);
+                total += range->end - range->start;
+        }
+
+        /* Split the ranges into parts of about the same size */
+        if (total > 0) {
+                job->n_parts = CLAMP(total / VTE_SEARCH_PART_SIZE_MIN, 1, (gsize)g_get_num_processors());
+                job->parts = g_new0(struct vte_search_part, job->n_parts);
+                for (guint i = 0; i < job->n_parts; i++) {
+                        job->parts[i].ranges = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+                        job->parts[i].matches = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+                        job->parts[i].text = _vte_ring_snapshot_text(ring);
+                }
+
+                gsize part_size = (total + job->n_parts - 1) / job->n_parts;
+                gsize filled = 0;
+                guint p = 0;
+                for (guint i = 0; i < ranges->len; i++) {
+                        auto range = g_array_index(ranges, VteRingTextRange, i);
+                        while (range.start < range.end) {
+                                VteRingTextRange piece;
+                                piece.start = range.start;
+                                piece.end = range.start + MIN(range.end - range.start, part_size - filled);
+                                g_array_append_val(job->parts[p].ranges, piece);
+                                filled += piece.end - piece.start;
+                                range.start = piece.end;
+                                if (filled == part_size && p + 1 < job->n_parts) {
+                                        p++;
+                                        filled = 0;
+                                }
+                        }
+                }
+                job->bytes_total += total;
+        }
+        g_array_free(ranges, TRUE);
+}
+
+static gboolean
+vte_terminal_search_progress_cb(GTask *task)
+{
+        auto job = reinterpret_cast<struct vte_search_job *>(g_task_get_task_data(task));
+        auto terminal = VTE_TERMINAL(g_task_get_source_object(task));
+        bool done = job->done;
+        double fraction = 1.;
+
+        if (!done && job->bytes_total > 0)
+                fraction = MIN((double)job->bytes_scanned / job->bytes_total, 1.);
+        _vte_terminal_get_impl(terminal)->emit_search_progress(fraction);
+
+        return done ? G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+}
+
+/*
+ * VteTerminalPrivate::search_find_async:
+ *
+ * Starts searching the whole buffer in worker threads, see vte_search_job.
+ */
+void
+VteTerminalPrivate::search_find_async(bool backward,
+                                      GCancellable *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer user_data)
+{
+        auto task = g_task_new(m_terminal, cancellable, callback, user_data);
+        g_task_set_source_tag(task, (void *)vte_terminal_search_find_async);
+
+        if (m_search_regex.regex == nullptr) {
+                g_task_return_boolean(task, FALSE);
+                g_object_unref(task);
+                return;
+        }
+
+        auto ring = m_screen->row_data;
+        auto job = search_job_new(m_screen, m_search_regex.regex, m_search_regex.match_flags);
+        job->backward = backward;
+        job->cancellable = g_task_get_cancellable(task);
+
+        vte::grid::row_t end_row = _vte_ring_next(ring);
+        job->start_row = _vte_ring_delta(ring);
+        job->split_row = search_split_row(job->start_row, end_row);
+
+        if (job->start_row < job->split_row &&
+            _vte_ring_get_text_range(ring, job->start_row, job->split_row,
+                                     &job->text_start, &job->text_end))
+                search_job_split_frozen(job, ring);
+
+        if (job->split_row < end_row) {
+                job->tail_text = get_text(job->split_row, 0,
+                                          end_row, -1,
+                                          false /* block */,
+                                          true /* wrap */,
+                                          false /* include trailing whitespace */,
+                                          job->tail_attrs);
+                job->bytes_total += job->tail_text->len;
+        }
+
+        g_task_set_task_data(task, job, search_job_free);
+        g_task_run_in_thread(task, search_job_run_in_thread);
+
+        g_timeout_add_full(G_PRIORITY_DEFAULT, VTE_SEARCH_PROGRESS_INTERVAL,
+                           (GSourceFunc)vte_terminal_search_progress_cb,
+                           g_object_ref(task),
+                           g_object_unref);
+        g_object_unref(task);
+}
+
+/*
+ * VteTerminalPrivate::search_find_finish:
+ *
+ * Selects the next (or, if the search was backward, the previous) match from
+ * the ones an asynchronous search found, the same one search_find() would.
+ *
+ * Returns: %true if a match was selected
+ */
+bool
+VteTerminalPrivate::search_find_finish(GAsyncResult *result,
+                                       guint *n_matches,
+                                       GError **error)
+{
+        auto task = G_TASK(result);
+        auto job = reinterpret_cast<struct vte_search_job *>(g_task_get_task_data(task));
+
+        if (n_matches != nullptr)
+                *n_matches = 0;
+        if (!g_task_propagate_boolean(task, error) || job == nullptr)
+                return false;
+
+        guint n_frozen = job->matches->len;
+        guint n_tail = job->tail_matches->len;
+        if (n_matches != nullptr)
+                *n_matches = n_frozen + n_tail;
+
+        /* The screen the matches are in isn't shown anymore */
+        if (job->screen != m_screen)
+                return false;
+
+        bool backward = job->backward;
+        auto ring = m_screen->row_data;
+        vte::grid::row_t first_row = MAX(job->start_row, _vte_ring_delta(ring));
+        vte::grid::row_t last_row = MIN(job->split_row, _vte_ring_writable(ring));
+        auto frozen = reinterpret_cast<VteRingTextRange *>(job->matches->data);
+        auto tail = reinterpret_cast<VteRingTextRange *>(job->tail_matches->data);
+
+        /* Frozen matches compare to rows by the text offset the row starts at */
+        auto text_offset_of_row = [&](vte::grid::row_t row) -> gsize {
+                gsize start_offset, end_offset;
+                if (row <= first_row)
+                        return job->text_start;
+                if (row >= last_row ||
+                    !_vte_ring_get_text_range(ring, row, row + 1, &start_offset, &end_offset))
+                        return job->text_end;
+                return start_offset;
+        };
+        auto first_frozen_from = [&](gsize offset) -> guint {
+                guint lo = 0, hi = n_frozen;
+                while (lo < hi) {
+                        guint mid = lo + (hi - lo) / 2;
+                        if (frozen[mid].start < offset)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+                return lo;
+        };
+        auto tail_row = [&](guint i) -> vte::grid::row_t {
+                return g_array_index(job->tail_attrs, VteCharAttributes, tail[i].start).row;
+        };
+
+        vte::grid::row_t last_start_row, last_end_row;
+        search_get_last_rows(&last_start_row, &last_end_row);
+
+        VteRingTextRange const* match = nullptr;
+        bool in_tail = false;
+        if (!backward) {
+                guint i = first_frozen_from(text_offset_of_row(last_end_row));
+                if (i < n_frozen)
+                        match = &frozen[i];
+                for (i = 0; match == nullptr && i < n_tail; i++) {
+                        if (tail_row(i) >= last_end_row) {
+                                match = &tail[i];
+                                in_tail = true;
+                        }
+                }
+                if (match == nullptr && m_search_wrap_around) {
+                        if (n_frozen > 0 && frozen[0].start < text_offset_of_row(last_start_row)) {
+                                match = &frozen[0];
+                        } else if (n_tail > 0 && tail_row(0) < last_start_row) {
+                                match = &tail[0];
+                                in_tail = true;
+                        }
+                }
+        } else {
+                for (guint i = n_tail; match == nullptr && i-- > 0; ) {
+                        if (tail_row(i) < last_start_row) {
+                                match = &tail[i];
+                                in_tail = true;
+                        }
+                }
+                if (match == nullptr) {
+                        guint i = first_frozen_from(text_offset_of_row(last_start_row));
+                        if (i > 0)
+                                match = &frozen[i - 1];
+                }
+                if (match == nullptr && m_search_wrap_around) {
+                        if (n_tail > 0 && tail_row(n_tail - 1) >= last_end_row) {
+                                match = &tail[n_tail - 1];
+                                in_tail = true;
+                        } else if (n_frozen > 0 &&
+                                   frozen[n_frozen - 1].start >= text_offset_of_row(last_end_row)) {
+                                match = &frozen[n_frozen - 1];
+                        }
+                }
+        }
+
+        if (match == nullptr) {
+                search_select_none(backward);
+                return false;
+        }
+
+        if (in_tail) {
+                auto start = &g_array_index(job->tail_attrs, VteCharAttributes, match->start);
+                auto end = &g_array_index(job->tail_attrs, VteCharAttributes, match->end - 1);
+                search_select_match(start->row, start->column, end->row, end->column, backward);
+                return true;
+        }
+
+        /* The rows the match was in are gone */
+        if (first_row >= last_row)
+                return false;
+
+        auto text = _vte_ring_snapshot_text(ring);
+        bool selected = search_select_stream_match(text, first_row, last_row,
+                                                   match->start, match->end, backward);
+        g_object_unref(text);
+        return selected;
+}
+
+/*
+ * Highlighting all matches: each paragraph of the visible rows is matched
+ * when it is drawn, and its matches are cached as per-row column spans,
+ * keyed by a hash of its cells so they're reused until the text changes.
+ */
+
+static guint
+search_highlight_hash(VteRowData const* row_data,
+                      guint hash)
+{
+        if (row_data == nullptr)
+                return hash * 31;
+
+        for (gulong i = 0; i < row_data->len; i++) {
+                auto cell = _vte_row_data_get(row_data, i);
+                hash = hash * 31 + cell->c;
+                hash = hash * 31 + cell->attr.columns;
+        }
+        return hash * 31 + row_data->len * 2 + row_data->attr.soft_wrapped;
+}
+
+void
+VteTerminalPrivate::search_highlight_clear()
+{
+        if (m_search_highlight_cache == nullptr)
+                return;
+
+        for (guint i = 0; i < VTE_SEARCH_HIGHLIGHT_CACHE_ROWS; i++) {
+                auto entry = &m_search_highlight_cache[i];
+                if (entry->spans != nullptr)
+                        g_array_free(entry->spans, TRUE);
+        }
+        g_free(m_search_highlight_cache);
+        m_search_highlight_cache = nullptr;
+}
+
+/*
+ * VteTerminalPrivate::search_highlight_lookup:
+ *
+ * Returns: the cached matches of the paragraph @row is in, bounded to the
+ *   rows [@min_row, @max_row); computed anew if the paragraph changed.
+ */
+struct vte_search_highlight_entry *
+VteTerminalPrivate::search_highlight_lookup(vte::grid::row_t row,
+                                            vte::grid::row_t min_row,
+                                            vte::grid::row_t max_row)
+{
+        auto ring = m_screen->row_data;
+        VteRowData const* row_data;
+
+        min_row = MAX(min_row, _vte_ring_delta(ring));
+        max_row = MIN(max_row, _vte_ring_next(ring));
+
+        vte::grid::row_t start_row = row, end_row = row + 1;
+        while (start_row > min_row &&
+               (row_data = find_row_data(start_row - 1)) != nullptr &&
+               row_data->attr.soft_wrapped)
+                start_row--;
+        while (end_row < max_row &&
+               (row_data = find_row_data(end_row - 1)) != nullptr &&
+               row_data->attr.soft_wrapped)
+                end_row++;
+
+        guint hash = m_column_count;
+        for (auto r = start_row; r < end_row; r++)
+                hash = search_highlight_hash(find_row_data(r), hash);
+
+        if (m_search_highlight_cache == nullptr)
+                m_search_highlight_cache = g_new0(struct vte_search_highlight_entry,
+                                                  VTE_SEARCH_HIGHLIGHT_CACHE_ROWS);
+        auto entry = &m_search_highlight_cache[start_row & (VTE_SEARCH_HIGHLIGHT_CACHE_ROWS - 1)];
+        if (entry->spans != nullptr &&
+            entry->start_row == start_row &&
+            entry->end_row == end_row &&
+            entry->hash == hash)
+                return entry;
+
+        entry->start_row = start_row;
+        entry->end_row = end_row;
+        entry->hash = hash;
+        if (entry->spans == nullptr)
+                entry->spans = g_array_new(FALSE, FALSE, sizeof(struct vte_search_highlight_span));
+        g_array_set_size(entry->spans, 0);
+
+        if (m_search_regex.regex == nullptr || start_row >= _vte_ring_next(ring))
+                return entry;
+
+	if (!m_search_attrs)
+		m_search_attrs = g_array_new (FALSE, TRUE, sizeof (VteCharAttributes));
+        auto attrs = m_search_attrs;
+        auto text = get_text(start_row, 0,
+                             end_row, -1,
+                             false /* block */,
+                             true /* wrap */,
+                             false /* include trailing whitespace */,
+                             attrs);
+        auto matches = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+        search_match_all(m_search_regex.regex, m_search_regex.match_flags,
+                         text->str, text->len, matches, nullptr, nullptr);
+
+        for (guint i = 0; i < matches->len; i++) {
+                auto match = &g_array_index(matches, VteRingTextRange, i);
+                if (match->end > attrs->len)
+                        break;
+                auto start = &g_array_index(attrs, VteCharAttributes, match->start);
+                auto end = &g_array_index(attrs, VteCharAttributes, match->end - 1);
+                auto end_row_data = find_row_data(end->row);
+                auto end_cell = end_row_data ? _vte_row_data_get(end_row_data, end->column) : nullptr;
+                struct vte_search_highlight_span span;
+
+                for (span.row = start->row; span.row <= end->row; span.row++) {
+                        span.start_col = span.row == start->row ? start->column : 0;
+                        if (span.row == end->row)
+                                span.end_col = end->column + (end_cell ? end_cell->attr.columns : 1);
+                        else
+                                span.end_col = m_column_count;
+                        if (span.start_col < span.end_col)
+                                g_array_append_val(entry->spans, span);
+                }
+        }
+
+        g_array_free(matches, TRUE);
+        g_string_free(text, TRUE);
+
+        return entry;
+}
+
+/* Draws a translucent box over the matches in the visible rows, on top
+ * of the background and below the text. */
+void
+VteTerminalPrivate::draw_search_highlights(vte::grid::row_t start_row,
+                                           vte::grid::row_t end_row,
+                                           vte::grid::column_t start_column,
+                                           vte::grid::column_t end_column,
+                                           gint start_x,
+                                           gint start_y,
+                                           gint column_width,
+                                           gint row_height)
+{
+        if (!m_search_highlight_all || m_search_regex.regex == nullptr)
+                return;
+
+        vte::color::rgb color;
+        rgb_from_index(VTE_DEFAULT_FG, color);
+
+        vte::grid::row_t min_row = start_row - VTE_SEARCH_HIGHLIGHT_CONTEXT_ROWS;
+        vte::grid::row_t max_row = end_row + VTE_SEARCH_HIGHLIGHT_CONTEXT_ROWS;
+        vte::grid::row_t row = start_row;
+        while (row < end_row) {
+                auto entry = search_highlight_lookup(row, min_row, max_row);
+                for (guint i = 0; i < entry->spans->len; i++) {
+                        auto span = &g_array_index(entry->spans, struct vte_search_highlight_span, i);
+                        if (span->row < start_row || span->row >= end_row)
+                                continue;
+                        auto sc = MAX(span->start_col, start_column);
+                        auto ec = MIN(span->end_col, end_column);
+                        if (sc >= ec)
+                                continue;
+                        _vte_draw_fill_rectangle(m_draw,
+                                                 start_x + sc * column_width,
+                                                 start_y + (span->row - start_row) * row_height,
+                                                 (ec - sc) * column_width,
+                                                 row_height,
+                                                 &color, VTE_SEARCH_HIGHLIGHT_ALPHA);
+                }
+                row = MAX(entry->end_row, row + 1);
+        }
+}
+
+/*
+ * VteTerminalPrivate::search_set_highlight_all:
+ *
+ * Sets whether all matches of the search regex are highlighted, and
+ * counted, see search_count_update().
+ *
+ * Returns: %true iff the setting changed
+ */
+bool
+VteTerminalPrivate::search_set_highlight_all(bool setting)
+{
+        if (setting == m_search_highlight_all)
+                return false;
+
+        m_search_highlight_all = setting;
+        search_highlight_clear();
+        search_count_reset();
+        if (setting)
+                search_count_queue_update();
+
+        invalidate_all();
+
+        return true;
+}
+
+/*
+ * Counting the matches in the whole buffer: the frozen text's matches are
+ * kept by text offset, so only text frozen since the last count needs to be
+ * scanned, by a vte_search_job; the matches in text that was dropped from
+ * the scrollback are forgotten. The rows after the frozen ones are few, and
+ * matched on the main thread each time.
+ */
+
+void
+VteTerminalPrivate::search_count_set(int count)
+{
+        if (count == m_search_match_count)
+                return;
+
+        m_search_match_count = count;
+        g_object_notify_by_pspec(G_OBJECT(m_terminal), pspecs[PROP_SEARCH_MATCH_COUNT]);
+}
+
+void
+VteTerminalPrivate::search_count_reset()
+{
+        if (m_search_count_cancellable != nullptr) {
+                g_cancellable_cancel(m_search_count_cancellable);
+                g_clear_object(&m_search_count_cancellable);
+        }
+        if (m_search_count_source != 0) {
+                g_source_remove(m_search_count_source);
+                m_search_count_source = 0;
+        }
+        if (m_search_count_matches != nullptr)
+                g_array_set_size(m_search_count_matches, 0);
+        m_search_count_offset = 0;
+        m_search_count_screen = nullptr;
+
+        search_count_set(-1);
+}
+
+static gboolean
+vte_terminal_search_count_timeout_cb(VteTerminalPrivate *that)
+{
+        that->m_search_count_source = 0;
+        that->search_count_update();
+
+        return G_SOURCE_REMOVE;
+}
+
+/* Counts the matches again in a little while, e.g. once new output stops. */
+void
+VteTerminalPrivate::search_count_queue_update()
+{
+        if (!m_search_highlight_all || m_search_regex.regex == nullptr)
+                return;
+        if (m_search_count_source != 0)
+                return;
+
+        m_search_count_source = g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE, VTE_SEARCH_COUNT_DELAY,
+                                                   (GSourceFunc)vte_terminal_search_count_timeout_cb,
+                                                   this, nullptr);
+}
+
+static void
+vte_terminal_search_count_ready_cb(GObject *source,
+                                   GAsyncResult *result,
+                                   gpointer user_data)
+{
+        _vte_terminal_get_impl(VTE_TERMINAL(source))->search_count_finish(result);
+}
+
+void
+VteTerminalPrivate::search_count_update()
+{
+        if (!m_search_highlight_all || m_search_regex.regex == nullptr)
+                return;
+
+        auto ring = m_screen->row_data;
+        if (m_search_count_screen != m_screen) {
+                search_count_reset();
+                m_search_count_screen = m_screen;
+        }
+        if (m_search_count_matches == nullptr)
+                m_search_count_matches = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+
+        vte::grid::row_t start_row = _vte_ring_delta(ring);
+        vte::grid::row_t end_row = _vte_ring_next(ring);
+        auto split_row = search_split_row(start_row, end_row);
+        auto matches = m_search_count_matches;
+        gsize text_start, text_end;
+        guint i;
+
+        if (start_row < split_row &&
+            _vte_ring_get_text_range(ring, start_row, split_row, &text_start, &text_end)) {
+                /* Forget the matches in text gone from the scrollback... */
+                for (i = 0; i < matches->len; i++)
+                        if (g_array_index(matches, VteRingTextRange, i).start >= text_start)
+                                break;
+                g_array_remove_range(matches, 0, i);
+                /* ...and in text thawed back into writable rows */
+                for (i = matches->len; i > 0; i--)
+                        if (g_array_index(matches, VteRingTextRange, i - 1).end <= text_end)
+                                break;
+                g_array_set_size(matches, i);
+                m_search_count_offset = CLAMP(m_search_count_offset, text_start, text_end);
+        } else {
+                g_array_set_size(matches, 0);
+                text_start = text_end = m_search_count_offset = 0;
+        }
+
+        /* The frozen text that's new since the last count */
+        if (m_search_count_offset < text_end && m_search_count_cancellable == nullptr) {
+                auto job = search_job_new(m_screen, m_search_regex.regex, m_search_regex.match_flags);
+                job->start_row = start_row;
+                job->split_row = split_row;
+                job->text_start = m_search_count_offset;
+                job->text_end = text_end;
+                search_job_split_frozen(job, ring);
+
+                m_search_count_cancellable = g_cancellable_new();
+                auto task = g_task_new(m_terminal, m_search_count_cancellable,
+                                       vte_terminal_search_count_ready_cb, nullptr);
+                g_task_set_source_tag(task, (void *)vte_terminal_search_get_match_count);
+                job->cancellable = m_search_count_cancellable;
+                g_task_set_task_data(task, job, search_job_free);
+                g_task_run_in_thread(task, search_job_run_in_thread);
+                g_object_unref(task);
+        }
+
+        /* A count is only published once all the frozen text was counted;
+         * after that, it follows the output while the new text is counted. */
+        if (m_search_count_offset < text_end && m_search_match_count < 0)
+                return;
+
+        guint n_tail = 0;
+        if (split_row < end_row) {
+                auto tail_text = get_text(split_row, 0,
+                                          end_row, -1,
+                                          false /* block */,
+                                          true /* wrap */,
+                                          false /* include trailing whitespace */,
+                                          nullptr);
+                auto tail_matches = g_array_new(FALSE, FALSE, sizeof(VteRingTextRange));
+                search_match_all(m_search_regex.regex, m_search_regex.match_flags,
+                                 tail_text->str, tail_text->len, tail_matches, nullptr, nullptr);
+                n_tail = tail_matches->len;
+                g_array_free(tail_matches, TRUE);
+                g_string_free(tail_text, TRUE);
+        }
+
+        search_count_set((int)MIN((gsize)matches->len + n_tail, (gsize)G_MAXINT));
+}
+
+void
+VteTerminalPrivate::search_count_finish(GAsyncResult *result)
+{
+        auto task = G_TASK(result);
+        auto job = reinterpret_cast<struct vte_search_job *>(g_task_get_task_data(task));
+
+        /* Superseded by a reset */
+        if (g_task_get_cancellable(task) != m_search_count_cancellable)
+                return;
+        g_clear_object(&m_search_count_cancellable);
+
+        if (!g_task_propagate_boolean(task, nullptr))
+                return;
+
+        /* The text counted is still the one that was to be counted next */
+        if (job->screen == m_screen &&
+            job->text_start <= m_search_count_offset &&
+            m_search_count_offset < job->text_end) {
+                for (guint i = 0; i < job->matches->len; i++) {
+                        auto match = &g_array_index(job->matches, VteRingTextRange, i);
+                        if (match->start >= m_search_count_offset)
+                                g_array_append_val(m_search_count_matches, *match);
+                }
+                m_search_count_offset = job->text_end;
+        }
+
+        search_count_update();
+}
+
 /*
  * VteTerminalPrivate::set_input_enabled:
  * @enabled: whether to enable user input
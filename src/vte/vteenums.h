@@ -109,12 +109,18 @@ typedef enum {
 /**
  * VteWriteFlags:
  * @VTE_WRITE_DEFAULT: Write contents as UTF-8 text.  This is the default.
+ * @VTE_WRITE_ANSI: Write contents as UTF-8 text, with the text attributes as
+ *   ANSI escape sequences (SGR, and OSC 8 for hyperlinks). Since: 0.50
+ * @VTE_WRITE_HTML: Write contents as HTML, with the text attributes as
+ *   markup, in a &lt;pre&gt; element. Since: 0.50
  *
  * A flag type to determine how terminal contents should be written
  * to an output stream.
  */
 typedef enum {
-  VTE_WRITE_DEFAULT = 0
+  VTE_WRITE_DEFAULT = 0,
+  VTE_WRITE_ANSI    = 1,
+  VTE_WRITE_HTML    = 2
 } VteWriteFlags;
 
 /**
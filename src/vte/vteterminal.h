@@ -278,6 +278,15 @@ _VTE_PUBLIC
 void vte_terminal_set_scrollback_lines(VteTerminal *terminal,
                                        glong lines) _VTE_GNUC_NONNULL(1);
 
+/* Limit the scrollback by the bytes it takes up, and query its usage. */
+_VTE_PUBLIC
+void vte_terminal_set_scrollback_bytes(VteTerminal *terminal,
+                                       guint64 bytes) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+guint64 vte_terminal_get_scrollback_bytes(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+guint64 vte_terminal_get_scrollback_usage(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+
 /* Set or retrieve the current font. */
 _VTE_PUBLIC
 void vte_terminal_set_font(VteTerminal *terminal,
@@ -401,9 +410,27 @@ void      vte_terminal_search_set_wrap_around (VteTerminal *terminal,
 _VTE_PUBLIC
 gboolean  vte_terminal_search_get_wrap_around (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
 _VTE_PUBLIC
+void      vte_terminal_search_set_highlight_all (VteTerminal *terminal,
+                                                 gboolean     highlight_all) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+gboolean  vte_terminal_search_get_highlight_all (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+int       vte_terminal_search_get_match_count (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
 gboolean  vte_terminal_search_find_previous   (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
 _VTE_PUBLIC
 gboolean  vte_terminal_search_find_next       (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+void      vte_terminal_search_find_async      (VteTerminal *terminal,
+                                               gboolean backward,
+                                               GCancellable *cancellable,
+                                               GAsyncReadyCallback callback,
+                                               gpointer user_data) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+gboolean  vte_terminal_search_find_finish     (VteTerminal *terminal,
+                                               GAsyncResult *result,
+                                               guint *n_matches,
+                                               GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
 
 
 /* Set the character encoding.  Most of the time you won't need this. */
@@ -469,6 +496,29 @@ gboolean vte_terminal_write_contents_sync (VteTerminal *terminal,
                                            VteWriteFlags flags,
                                            GCancellable *cancellable,
                                            GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
+_VTE_PUBLIC
+void vte_terminal_write_contents_async (VteTerminal *terminal,
+                                        GOutputStream *stream,
+                                        VteWriteFlags flags,
+                                        GCancellable *cancellable,
+                                        GAsyncReadyCallback callback,
+                                        gpointer user_data) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
+_VTE_PUBLIC
+gboolean vte_terminal_write_contents_finish (VteTerminal *terminal,
+                                             GAsyncResult *result,
+                                             GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
+
+/* Saving and restoring the scrollback */
+_VTE_PUBLIC
+gboolean vte_terminal_save_scrollback (VteTerminal *terminal,
+                                       GFile *file,
+                                       GCancellable *cancellable,
+                                       GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
+_VTE_PUBLIC
+gboolean vte_terminal_restore_scrollback (VteTerminal *terminal,
+                                          GFile *file,
+                                          GCancellable *cancellable,
+                                          GError **error) _VTE_GNUC_NONNULL(1) _VTE_GNUC_NONNULL(2);
 
 /* Set or get maximum storage size for offscreen freezed images */
 _VTE_PUBLIC
@@ -486,6 +536,13 @@ void vte_terminal_set_sixel_enabled (VteTerminal *terminal,
 _VTE_PUBLIC
 gboolean vte_terminal_get_sixel_enabled (VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
 
+/* Rasterize large redraws on worker threads */
+_VTE_PUBLIC
+void vte_terminal_set_threaded_rendering(VteTerminal *terminal,
+                                         gboolean setting) _VTE_GNUC_NONNULL(1);
+_VTE_PUBLIC
+gboolean vte_terminal_get_threaded_rendering(VteTerminal *terminal) _VTE_GNUC_NONNULL(1);
+
 
 #if GLIB_CHECK_VERSION(2, 44, 0)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(VteTerminal, g_object_unref)
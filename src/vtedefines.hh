@@ -84,7 +84,17 @@
 #define VTE_UPDATE_TIMEOUT		15
 #define VTE_UPDATE_REPEAT_TIMEOUT	30
 #define VTE_MAX_PROCESS_TIME		100
-#define VTE_CELL_BBOX_SLACK		1
+#define VTE_REWRAP_SLICE_ROWS		10000  /* rows of scrollback rewrapped per idle callback */
+#define VTE_SEARCH_CHUNK_SIZE		65536  /* bytes of scrollback text matched at once */
+#define VTE_SEARCH_PART_SIZE_MIN	(1024 * 1024)  /* bytes of scrollback text per search thread, at least */
+#define VTE_SEARCH_PROGRESS_INTERVAL	100  /* ms between search-progress signals */
+#define VTE_WRITE_CONTENTS_PROGRESS_INTERVAL	100  /* ms between write-contents-progress signals */
+#define VTE_SEARCH_COUNT_DELAY		250  /* ms of quiet output before the matches are counted again */
+#define VTE_SEARCH_HIGHLIGHT_CACHE_ROWS	256  /* paragraphs whose matches are kept, a power of 2 */
+#define VTE_SEARCH_HIGHLIGHT_CONTEXT_ROWS 64  /* wrapped rows off screen matched along with the visible ones */
+#define VTE_SEARCH_HIGHLIGHT_ALPHA	(0.3)
+#define VTE_RENDER_BAND_ROWS_MIN	8  /* rows per band rasterized on a worker thread, at least */
+#define VTE_RENDER_BANDS_MAX		16
 #define VTE_DEFAULT_UTF8_AMBIGUOUS_WIDTH 1
 #define VTE_DEFAULT_FREEZED_IMAGE_LIMIT (16 * 1024 * 1024)  /* 16 MB */
 
@@ -107,8 +117,7 @@
  * VTE_HYPERLINK_COUNT_MAX inclusive, plus one more technical idx is also required, see below.
  * This is just a safety cap because the number of URIs is bound by the number of cells in the ring
  * (excluding the stream) which should be way lower than this at sane window sizes.
- * Make sure there are enough bits to store them in VteCellAttr.hyperlink_idx.
- * Also make sure _vte_ring_hyperlink_gc() can allocate a large enough bitmap. */
+ * Make sure there are enough bits to store them in VteCellAttr.hyperlink_idx. */
 #define VTE_HYPERLINK_COUNT_MAX         ((1 << 20) - 2)
 
 /* Used when thawing a row from the stream in order to display it, to denote
@@ -131,6 +131,27 @@ _vte_double_equal(double a,
  * letters if we can do that easily using COVERAGE_USE_CAIRO_GLYPH.  This
  * means that we precache all ASCII letters without any extra pango shaping
  * involved.
+ *
+ *
+ * Glyph atlas:
+ *
+ * Drawing a unistr through cairo or pango rasterizes and composites it again
+ * on every frame, which is especially costly for the characters that need a
+ * PangoLayoutLine.  So a font_info also keeps the glyphs it drew, rasterized
+ * into slots of a few image surfaces (pages), and draws them from there:
+ *
+ *   - A glyph drawn in the given color only is kept as an A8 mask in one
+ *     atlas, and drawn by masking the text color with it.  A color glyph
+ *     (emoji) is kept as ARGB32 in another, and painted as is.
+ *
+ *   - A slot is big enough for a double-width character with some room
+ *     around it for overhang.  A glyph that doesn't fit, or that mixes
+ *     colored and uncolored parts, is drawn directly every time.
+ *
+ *   - When all slots are taken, the least recently drawn glyph is evicted.
+ *
+ * The atlas is disabled for subpixel antialiasing, whose per-channel
+ * coverage a single mask can't hold, and for fractional device scales.
  */
 
 
@@ -179,11 +200,41 @@ union unistr_font_info {
 	} using_cairo_glyph;
 };
 
+enum atlas_state {
+	ATLAS_UNKNOWN = 0,	/* not rasterized yet, or evicted since */
+	ATLAS_CACHED,		/* in a slot of the atlas */
+	ATLAS_BLANK,		/* no ink at all, nothing to draw */
+	ATLAS_UNCACHABLE	/* drawn directly */
+};
+
 struct unistr_info {
 	guchar coverage;
 	guchar has_unknown_chars;
+	guchar atlas_state;
+	guchar atlas_color;	/* the slot is in the ARGB32 atlas */
 	guint16 width;
 	union unistr_font_info ufi;
+	struct atlas_slot *atlas_slot;
+};
+
+/* A page has ATLAS_PAGE_SLOTS × ATLAS_PAGE_SLOTS slots */
+#define ATLAS_PAGE_SLOTS (8)
+#define ATLAS_MAX_PAGES_A8 (16)
+#define ATLAS_MAX_PAGES_ARGB (4)
+
+struct atlas_slot {
+	GList link;			/* in the atlas' LRU list, data points back here */
+	struct unistr_info *uinfo;	/* the glyph in the slot, or NULL */
+	cairo_surface_t *surface;	/* the slot's rectangle of its page */
+};
+
+struct glyph_atlas {
+	cairo_format_t format;
+	guint max_pages;
+	GPtrArray *pages;		/* cairo_surface_t */
+	struct atlas_slot *slots;	/* for max_pages, allocated with the first page */
+	guint n_slots;			/* handed out so far */
+	GQueue lru;			/* the slots handed out, most recently drawn first */
 };
 
 static struct unistr_info *
@@ -197,6 +248,11 @@ unistr_info_finish (struct unistr_info *uinfo)
 {
 	union unistr_font_info *ufi = &uinfo->ufi;
 
+	if (uinfo->atlas_slot != NULL)
+		uinfo->atlas_slot->uinfo = NULL;
+	uinfo->atlas_slot = NULL;
+	uinfo->atlas_state = ATLAS_UNKNOWN;
+
 	switch (uinfo->coverage) {
 	default:
 	case COVERAGE_UNKNOWN:
@@ -229,6 +285,14 @@ unistr_info_destroy (struct unistr_info *uinfo)
 	g_slice_free (struct unistr_info, uinfo);
 }
 
+#define UNISTR_INFO_PAGE_BITS (8)
+#define UNISTR_INFO_PAGE_SIZE (1 << UNISTR_INFO_PAGE_BITS)
+#define UNISTR_INFO_N_PAGES (0x30000 >> UNISTR_INFO_PAGE_BITS)	/* planes 0-2 */
+
+/* Box Drawing & Block Elements, see _vte_draw_unichar_is_local_graphic() */
+#define GRAPHIC_FIRST (0x2500)
+#define GRAPHIC_N_CHARS (0x25a0 - GRAPHIC_FIRST)
+
 struct font_info {
 	/* lifecycle */
 	int ref_count;
@@ -237,16 +301,31 @@ struct font_info {
 	/* reusable layout set with font and everything set */
 	PangoLayout *layout;
 
-	/* cache of character info */
+	/* cache of character info: ASCII inline, the rest of planes 0-2 in
+	 * pages of UNISTR_INFO_PAGE_SIZE allocated on demand, and combined
+	 * vteunistr values (or the rare higher planes) in the hash table */
 	struct unistr_info ascii_unistr_info[128];
+	struct unistr_info *unistr_info_pages[UNISTR_INFO_N_PAGES];
 	GHashTable *other_unistr_info;
 
+	/* atlas state of the graphics we draw ourselves, see
+	 * font_info_find_graphic_info() */
+	struct unistr_info *graphic_info;
+
 	/* cell metrics */
 	gint width, height, ascent;
 
 	/* reusable string for UTF-8 conversion */
 	GString *string;
 
+	/* rasterized glyphs */
+	struct glyph_atlas atlas[2];	/* A8 masks, ARGB32 color glyphs */
+	double atlas_scale;		/* the device scale they're rasterized for, 0 before the first use */
+	gboolean atlas_disabled;
+	int atlas_pad, atlas_slot_width, atlas_slot_height;
+	cairo_surface_t *atlas_scratch[2];	/* a glyph drawn in black, and in white, with a slot's room around */
+	guint atlas_hits, atlas_misses;	/* since the draw last reported them */
+
 #ifdef VTE_DEBUG
 	/* profiling info */
 	int coverage_count[4];
@@ -263,6 +342,14 @@ font_info_find_unistr_info (struct font_info    *info,
 	if (G_LIKELY (c < G_N_ELEMENTS (info->ascii_unistr_info)))
 		return &info->ascii_unistr_info[c];
 
+	if (G_LIKELY (c < UNISTR_INFO_N_PAGES << UNISTR_INFO_PAGE_BITS)) {
+		struct unistr_info **page = &info->unistr_info_pages[c >> UNISTR_INFO_PAGE_BITS];
+
+		if (G_UNLIKELY (*page == NULL))
+			*page = g_new0 (struct unistr_info, UNISTR_INFO_PAGE_SIZE);
+		return &(*page)[c & (UNISTR_INFO_PAGE_SIZE - 1)];
+	}
+
 	if (G_UNLIKELY (info->other_unistr_info == NULL))
 		info->other_unistr_info = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) unistr_info_destroy);
 
@@ -275,6 +362,19 @@ font_info_find_unistr_info (struct font_info    *info,
 	return uinfo;
 }
 
+/* Returns the entry holding the atlas state of the local graphic @c drawn
+ * @columns (1 or 2) wide.  Only its atlas fields are used. */
+static struct unistr_info *
+font_info_find_graphic_info (struct font_info *info,
+			     vteunistr         c,
+			     int               columns)
+{
+	if (G_UNLIKELY (info->graphic_info == NULL))
+		info->graphic_info = g_new0 (struct unistr_info, 2 * GRAPHIC_N_CHARS);
+
+	return &info->graphic_info[(columns - 1) * GRAPHIC_N_CHARS + (c - GRAPHIC_FIRST)];
+}
+
 
 static void
 font_info_cache_ascii (struct font_info *info)
@@ -437,6 +537,301 @@ font_info_allocate (PangoContext *context)
 	return info;
 }
 
+static void
+glyph_atlas_init (struct glyph_atlas *atlas, cairo_format_t format, guint max_pages)
+{
+	atlas->format = format;
+	atlas->max_pages = max_pages;
+	atlas->pages = g_ptr_array_new_with_free_func ((GDestroyNotify) cairo_surface_destroy);
+	atlas->slots = NULL;
+	atlas->n_slots = 0;
+	g_queue_init (&atlas->lru);
+}
+
+static void
+glyph_atlas_fini (struct glyph_atlas *atlas)
+{
+	guint i;
+
+	if (atlas->pages == NULL)
+		return;
+
+	for (i = 0; i < atlas->n_slots; i++) {
+		struct atlas_slot *slot = &atlas->slots[i];
+
+		if (slot->uinfo != NULL) {
+			slot->uinfo->atlas_slot = NULL;
+			slot->uinfo->atlas_state = ATLAS_UNKNOWN;
+		}
+		if (slot->surface != NULL)
+			cairo_surface_destroy (slot->surface);
+	}
+	g_free (atlas->slots);
+	g_ptr_array_free (atlas->pages, TRUE);
+	memset (atlas, 0, sizeof (*atlas));
+}
+
+static void
+font_info_atlas_fini (struct font_info *info)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (info->atlas); i++) {
+		glyph_atlas_fini (&info->atlas[i]);
+		if (info->atlas_scratch[i] != NULL) {
+			cairo_surface_destroy (info->atlas_scratch[i]);
+			info->atlas_scratch[i] = NULL;
+		}
+	}
+}
+
+/* Starts the atlas over for drawing at device scale @scale */
+static void
+font_info_atlas_reset (struct font_info *info, double scale)
+{
+	const cairo_font_options_t *options;
+	guint i;
+
+	_vte_debug_print (VTE_DEBUG_PANGOCAIRO,
+			  "vtepangocairo: %p glyph atlas for scale %g\n",
+			  info, scale);
+
+	font_info_atlas_fini (info);
+	glyph_atlas_init (&info->atlas[0], CAIRO_FORMAT_A8, ATLAS_MAX_PAGES_A8);
+	glyph_atlas_init (&info->atlas[1], CAIRO_FORMAT_ARGB32, ATLAS_MAX_PAGES_ARGB);
+
+	info->atlas_scale = scale;
+	info->atlas_pad = MAX (info->height / 4, 1);
+	info->atlas_slot_width = 2 * info->width + 2 * info->atlas_pad;
+	info->atlas_slot_height = info->height + 2 * info->atlas_pad;
+
+	options = pango_cairo_context_get_font_options (pango_layout_get_context (info->layout));
+	info->atlas_disabled = (options != NULL &&
+				cairo_font_options_get_antialias (options) == CAIRO_ANTIALIAS_SUBPIXEL) ||
+			       !_vte_double_equal (scale, floor (scale)) || scale < 1;
+	if (info->atlas_disabled)
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS (info->atlas_scratch); i++) {
+		info->atlas_scratch[i] = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+								     3 * info->atlas_slot_width * (int) scale,
+								     3 * info->atlas_slot_height * (int) scale);
+		cairo_surface_set_device_scale (info->atlas_scratch[i], scale, scale);
+		if (cairo_surface_status (info->atlas_scratch[i]) != CAIRO_STATUS_SUCCESS)
+			info->atlas_disabled = TRUE;
+	}
+}
+
+/* Hands out a free slot, or the least recently drawn one, as the most recently drawn */
+static struct atlas_slot *
+font_info_atlas_take_slot (struct font_info *info, struct glyph_atlas *atlas)
+{
+	const guint per_page = ATLAS_PAGE_SLOTS * ATLAS_PAGE_SLOTS;
+	struct atlas_slot *slot;
+
+	if (atlas->n_slots < atlas->max_pages * per_page) {
+		if (atlas->n_slots == atlas->pages->len * per_page) {
+			int scale = (int) info->atlas_scale;
+			cairo_surface_t *page;
+
+			if (atlas->slots == NULL)
+				atlas->slots = g_new0 (struct atlas_slot, atlas->max_pages * per_page);
+			page = cairo_image_surface_create (atlas->format,
+							   ATLAS_PAGE_SLOTS * info->atlas_slot_width * scale,
+							   ATLAS_PAGE_SLOTS * info->atlas_slot_height * scale);
+			cairo_surface_set_device_scale (page, scale, scale);
+			g_ptr_array_add (atlas->pages, page);
+		}
+		slot = &atlas->slots[atlas->n_slots++];
+		slot->link.data = slot;
+	} else {
+		slot = (struct atlas_slot *) g_queue_pop_tail_link (&atlas->lru)->data;
+		if (slot->uinfo != NULL) {
+			slot->uinfo->atlas_slot = NULL;
+			slot->uinfo->atlas_state = ATLAS_UNKNOWN;
+			slot->uinfo = NULL;
+		}
+	}
+
+	g_queue_push_head_link (&atlas->lru, &slot->link);
+	return slot;
+}
+
+/* Draws the glyph of @uinfo with the left end of its baseline at @x, @y */
+static void
+unistr_info_draw (struct unistr_info *uinfo, cairo_t *cr, double x, double y)
+{
+	union unistr_font_info *ufi = &uinfo->ufi;
+	cairo_glyph_t glyph;
+
+	switch (uinfo->coverage) {
+	default:
+	case COVERAGE_UNKNOWN:
+		g_assert_not_reached ();
+		break;
+	case COVERAGE_USE_PANGO_LAYOUT_LINE:
+		cairo_move_to (cr, x, y);
+		pango_cairo_show_layout_line (cr, ufi->using_pango_layout_line.line);
+		break;
+	case COVERAGE_USE_PANGO_GLYPH_STRING:
+		cairo_move_to (cr, x, y);
+		pango_cairo_show_glyph_string (cr,
+					       ufi->using_pango_glyph_string.font,
+					       ufi->using_pango_glyph_string.glyph_string);
+		break;
+	case COVERAGE_USE_CAIRO_GLYPH:
+		glyph.index = ufi->using_cairo_glyph.glyph_index;
+		glyph.x = x;
+		glyph.y = y;
+		cairo_set_scaled_font (cr, ufi->using_cairo_glyph.scaled_font);
+		cairo_show_glyphs (cr, &glyph, 1);
+		break;
+	}
+}
+
+static void _vte_draw_terminal_draw_graphic (cairo_t *cr, vteunistr c, vte::color::rgb const* fg,
+                                             gint x, gint y,
+                                             gint column_width, gint columns, gint row_height);
+
+/* Rasterizes the glyph of @uinfo into a slot, and returns its new atlas state.
+ * If @graphic is nonzero, @uinfo is its entry from font_info_find_graphic_info()
+ * and the graphic is drawn instead. */
+static guchar
+font_info_atlas_rasterize (struct font_info *info, struct unistr_info *uinfo,
+			   vteunistr graphic, int columns)
+{
+	const guint per_page = ATLAS_PAGE_SLOTS * ATLAS_PAGE_SLOTS;
+	const int scale = (int) info->atlas_scale;
+	const int sw = info->atlas_slot_width * scale, sh = info->atlas_slot_height * scale;
+	struct glyph_atlas *atlas;
+	struct atlas_slot *slot;
+	cairo_surface_t *page;
+	const guchar *data[2];
+	guchar *page_data;
+	gboolean has_ink = FALSE, has_mono = FALSE, has_color = FALSE;
+	int stride, page_stride, index, px, py, x, y;
+	guint i;
+
+	/* Draw it in black and in white: the colored parts of a color glyph come
+	 * out the same in both, the rest takes the color it's drawn in. */
+	for (i = 0; i < G_N_ELEMENTS (info->atlas_scratch); i++) {
+		cairo_t *cr = cairo_create (info->atlas_scratch[i]);
+
+		cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+		cairo_paint (cr);
+		cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+		cairo_set_source_rgb (cr, i, i, i);
+		if (graphic != 0) {
+			vte::color::rgb ink;
+
+			ink.red = ink.green = ink.blue = i ? 0xffff : 0;
+			_vte_draw_terminal_draw_graphic (cr, graphic, &ink,
+							 info->atlas_slot_width + info->atlas_pad,
+							 info->atlas_slot_height + info->atlas_pad,
+							 info->width, columns, info->height);
+		} else {
+			unistr_info_draw (uinfo, cr,
+					  info->atlas_slot_width + info->atlas_pad,
+					  info->atlas_slot_height + info->atlas_pad + info->ascent);
+		}
+		cairo_destroy (cr);
+
+		cairo_surface_flush (info->atlas_scratch[i]);
+		data[i] = cairo_image_surface_get_data (info->atlas_scratch[i]);
+	}
+	stride = cairo_image_surface_get_stride (info->atlas_scratch[0]);
+
+	for (y = 0; y < 3 * sh; y++) {
+		const guint32 *black = (const guint32 *) (data[0] + y * stride);
+		const guint32 *white = (const guint32 *) (data[1] + y * stride);
+
+		for (x = 0; x < 3 * sw; x++) {
+			if ((black[x] | white[x]) == 0)
+				continue;
+			/* Ink outside of the slot */
+			if (y < sh || y >= 2 * sh || x < sw || x >= 2 * sw)
+				return ATLAS_UNCACHABLE;
+			has_ink = TRUE;
+			if (black[x] == white[x])
+				has_color = TRUE;
+			else
+				has_mono = TRUE;
+		}
+	}
+	if (!has_ink)
+		return ATLAS_BLANK;
+	if (has_mono && has_color)
+		return ATLAS_UNCACHABLE;
+
+	atlas = &info->atlas[has_color ? 1 : 0];
+	slot = font_info_atlas_take_slot (info, atlas);
+	index = slot - atlas->slots;
+	page = (cairo_surface_t *) g_ptr_array_index (atlas->pages, index / per_page);
+	px = (index % per_page) % ATLAS_PAGE_SLOTS * sw;
+	py = (index % per_page) / ATLAS_PAGE_SLOTS * sh;
+
+	cairo_surface_flush (page);
+	page_data = cairo_image_surface_get_data (page);
+	page_stride = cairo_image_surface_get_stride (page);
+	if (G_UNLIKELY (page_data == NULL))
+		return ATLAS_UNCACHABLE;
+	for (y = 0; y < sh; y++) {
+		const guint32 *src = (const guint32 *) (data[0] + (sh + y) * stride) + sw;
+		guchar *dst = page_data + (py + y) * page_stride;
+
+		if (has_color) {
+			memcpy (dst + px * 4, src, sw * 4);
+		} else {
+			for (x = 0; x < sw; x++)
+				dst[px + x] = src[x] >> 24;
+		}
+	}
+	cairo_surface_mark_dirty_rectangle (page, px, py, sw, sh);
+
+	/* A new view of the slot, so that nothing cached of the old one is reused */
+	if (slot->surface != NULL)
+		cairo_surface_destroy (slot->surface);
+	slot->surface = cairo_surface_create_for_rectangle (page,
+							    px / scale, py / scale,
+							    info->atlas_slot_width, info->atlas_slot_height);
+	slot->uinfo = uinfo;
+	uinfo->atlas_slot = slot;
+	uinfo->atlas_color = has_color;
+
+	return ATLAS_CACHED;
+}
+
+/* Returns the atlas state of @uinfo for drawing at device scale @scale,
+ * rasterizing it if needed; @graphic and @columns as for
+ * font_info_atlas_rasterize() */
+static guchar
+font_info_atlas_lookup (struct font_info *info, struct unistr_info *uinfo, double scale,
+			vteunistr graphic, int columns)
+{
+	if (G_UNLIKELY (!_vte_double_equal (info->atlas_scale, scale)))
+		font_info_atlas_reset (info, scale);
+	if (G_UNLIKELY (info->atlas_disabled))
+		return ATLAS_UNCACHABLE;
+
+	if (G_UNLIKELY (uinfo->atlas_state == ATLAS_UNKNOWN)) {
+		info->atlas_misses++;
+		uinfo->atlas_state = font_info_atlas_rasterize (info, uinfo, graphic, columns);
+		return uinfo->atlas_state;
+	}
+
+	info->atlas_hits++;
+	if (uinfo->atlas_state == ATLAS_CACHED) {
+		GQueue *lru = &info->atlas[uinfo->atlas_color].lru;
+		GList *link = &uinfo->atlas_slot->link;
+
+		if (lru->head != link) {
+			g_queue_unlink (lru, link);
+			g_queue_push_head_link (lru, link);
+		}
+	}
+	return uinfo->atlas_state;
+}
+
 static void
 font_info_free (struct font_info *info)
 {
@@ -457,11 +852,30 @@ font_info_free (struct font_info *info)
 
 	for (i = 0; i < G_N_ELEMENTS (info->ascii_unistr_info); i++)
 		unistr_info_finish (&info->ascii_unistr_info[i]);
+
+	for (i = 0; i < G_N_ELEMENTS (info->unistr_info_pages); i++) {
+		struct unistr_info *page = info->unistr_info_pages[i];
+		guint j;
+
+		if (page == NULL)
+			continue;
+		for (j = 0; j < UNISTR_INFO_PAGE_SIZE; j++)
+			unistr_info_finish (&page[j]);
+		g_free (page);
+	}
+
+	if (info->graphic_info != NULL) {
+		for (i = 0; i < 2 * GRAPHIC_N_CHARS; i++)
+			unistr_info_finish (&info->graphic_info[i]);
+		g_free (info->graphic_info);
+	}
 		
 	if (info->other_unistr_info) {
 		g_hash_table_destroy (info->other_unistr_info);
 	}
 
+	font_info_atlas_fini (info);
+
 	g_slice_free (struct font_info, info);
 }
 
@@ -656,16 +1070,6 @@ font_info_create_for_screen (GdkScreen                  *screen,
 					     desc, language, fontconfig_timestamp);
 }
 
-static struct font_info *
-font_info_create_for_widget (GtkWidget                  *widget,
-			     const PangoFontDescription *desc)
-{
-	GdkScreen *screen = gtk_widget_get_screen (widget);
-	PangoLanguage *language = pango_context_get_language (gtk_widget_get_pango_context (widget));
-
-	return font_info_create_for_screen (screen, desc, language);
-}
-
 static struct unistr_info *
 font_info_get_unistr_info (struct font_info *info,
 			   vteunistr c)
@@ -753,10 +1157,31 @@ guint _vte_draw_get_style(gboolean bold, gboolean italic) {
 	return style;
 }
 
+/* A solid rectangle waiting in the display list to be filled */
+struct _vte_draw_queued_rect {
+	vte::color::rgb color;
+	double alpha;
+	gint x, y, width, height;
+};
+
 struct _vte_draw {
 	struct font_info *fonts[4];
 
 	cairo_t *cr;
+	double scale;  /* the device scale of cr's target */
+
+	/* Display list of rectangle fills, see _vte_draw_queue_rectangle() */
+	GArray *queued_rects;
+
+	/* The styles other than VTE_DRAW_NORMAL are only loaded when first
+	 * used, see _vte_draw_get_font(); until then these are set */
+	PangoFontDescription *font_descs[4];
+	GdkScreen *screen;
+	PangoLanguage *language;
+
+	/* Idle source resolving common characters ahead of their first paint */
+	guint prewarm_source;
+	guint prewarm_next;
 };
 
 struct _vte_draw *
@@ -766,30 +1191,75 @@ _vte_draw_new (void)
 
 	/* Create the structure. */
 	draw = g_slice_new0 (struct _vte_draw);
+	draw->queued_rects = g_array_new (FALSE, FALSE, sizeof (struct _vte_draw_queued_rect));
 
 	_vte_debug_print (VTE_DEBUG_DRAW, "draw_new\n");
 
 	return draw;
 }
 
-void
-_vte_draw_free (struct _vte_draw *draw)
+static void
+_vte_draw_free_fonts (struct _vte_draw *draw)
 {
 	gint style;
-	_vte_debug_print (VTE_DEBUG_DRAW, "draw_free\n");
+
+	if (draw->prewarm_source != 0) {
+		g_source_remove (draw->prewarm_source);
+		draw->prewarm_source = 0;
+	}
 
 	/* Free all fonts (make sure to destroy every font only once)*/
 	for (style = 3; style >= 0; style--) {
 		if (draw->fonts[style] != NULL &&
-			(style == 0 || draw->fonts[style] != draw->fonts[style-1])) {
+			(style == 0 || draw->fonts[style] != draw->fonts[style-1]))
 			font_info_destroy (draw->fonts[style]);
-			draw->fonts[style] = NULL;
+	}
+	/* Rejected bold fonts alias the regular ones, forget them all */
+	for (style = 0; style < 4; style++)
+		draw->fonts[style] = NULL;
+
+	for (style = 0; style < (gint) G_N_ELEMENTS (draw->font_descs); style++) {
+		if (draw->font_descs[style] != NULL) {
+			pango_font_description_free (draw->font_descs[style]);
+			draw->font_descs[style] = NULL;
 		}
 	}
+}
+
+void
+_vte_draw_free (struct _vte_draw *draw)
+{
+	_vte_debug_print (VTE_DEBUG_DRAW, "draw_free\n");
+
+	_vte_draw_free_fonts (draw);
+
+	g_array_free (draw->queued_rects, TRUE);
 
 	g_slice_free (struct _vte_draw, draw);
 }
 
+/* Reports the glyph atlas hits and misses of the frame just drawn */
+static void
+_vte_draw_report_atlas (struct _vte_draw *draw)
+{
+	guint style, hits = 0, misses = 0;
+
+	for (style = 0; style < G_N_ELEMENTS (draw->fonts); style++) {
+		struct font_info *info = draw->fonts[style];
+
+		if (info == NULL || (style != 0 && info == draw->fonts[style - 1]))
+			continue;
+		hits += info->atlas_hits;
+		misses += info->atlas_misses;
+		info->atlas_hits = info->atlas_misses = 0;
+	}
+
+	if (hits + misses != 0)
+		_vte_debug_print (VTE_DEBUG_PANGOCAIRO,
+				  "vtepangocairo: glyph atlas %u hits, %u misses (%u%%)\n",
+				  hits, misses, hits * 100 / (hits + misses));
+}
+
 void
 _vte_draw_set_cairo (struct _vte_draw *draw,
                      cairo_t *cr)
@@ -797,11 +1267,16 @@ _vte_draw_set_cairo (struct _vte_draw *draw,
         _vte_debug_print (VTE_DEBUG_DRAW, "%s cairo context\n", cr ? "Settings" : "Unsetting");
 
         if (cr) {
+                double y_scale;
+
                 g_assert (draw->cr == NULL);
                 draw->cr = cr;
+                cairo_surface_get_device_scale (cairo_get_target (cr), &draw->scale, &y_scale);
         } else {
                 g_assert (draw->cr != NULL);
+                _vte_draw_flush_rectangles (draw);
                 draw->cr = NULL;
+                _vte_draw_report_atlas (draw);
         }
 }
 
@@ -832,69 +1307,146 @@ _vte_draw_clear (struct _vte_draw *draw, gint x, gint y, gint width, gint height
 	cairo_fill (draw->cr);
 }
 
+/* Returns the font of @style, loading it first if it hasn't been yet */
+static struct font_info *
+_vte_draw_get_font (struct _vte_draw *draw, guint style)
+{
+	struct font_info *info, *base;
+	gint ratio;
+
+	if (G_LIKELY (draw->fonts[style] != NULL))
+		return draw->fonts[style];
+
+	if (G_UNLIKELY (draw->font_descs[style] == NULL))
+		return NULL;	/* no font set yet */
+
+	info = font_info_create_for_screen (draw->screen, draw->font_descs[style], draw->language);
+	pango_font_description_free (draw->font_descs[style]);
+	draw->font_descs[style] = NULL;
+
+	/* Decide if we should keep this bold font face, per bug 54926:
+	 *  - reject bold font if it is not within 10% of normal font width
+	 */
+	if (style & VTE_DRAW_BOLD) {
+		base = _vte_draw_get_font (draw, style & ~VTE_DRAW_BOLD);
+		ratio = info->width * 100 / base->width;
+		if (abs(ratio - 100) > 10) {
+			_vte_debug_print (VTE_DEBUG_DRAW,
+				"Rejecting %sbold font (%i%%).\n",
+				(style & VTE_DRAW_ITALIC) ? "italic " : "", ratio);
+			font_info_destroy (info);
+			info = base;
+		}
+	}
+
+	_vte_debug_print (VTE_DEBUG_DRAW, "Loaded font for style %u\n", style);
+
+	draw->fonts[style] = info;
+	return info;
+}
+
+/* Characters resolved in idle time after a font change, so that the
+ * fallback fonts of common scripts are found before the first paint that
+ * needs them.  One of each script is enough to load its fallback font;
+ * ranges are for blocks commonly seen in terminals. */
+static const struct {
+	gunichar first, last;
+} prewarm_ranges[] = {
+	{ 0x00a0, 0x00ff },	/* Latin-1 Supplement */
+	{ 0x0100, 0x0100 },	/* Latin Extended-A */
+	{ 0x0391, 0x0391 },	/* Greek */
+	{ 0x0410, 0x0410 },	/* Cyrillic */
+	{ 0x05d0, 0x05d0 },	/* Hebrew */
+	{ 0x0627, 0x0627 },	/* Arabic */
+	{ 0x0e01, 0x0e01 },	/* Thai */
+	{ 0x2010, 0x205e },	/* General Punctuation */
+	{ 0x2190, 0x21ff },	/* Arrows */
+	{ 0x2200, 0x2200 },	/* Mathematical Operators */
+	{ 0x2300, 0x2300 },	/* Miscellaneous Technical */
+	{ 0x2600, 0x2600 },	/* Miscellaneous Symbols */
+	{ 0x2713, 0x2718 },	/* Dingbats: check marks and crosses */
+	{ 0x3000, 0x3002 },	/* CJK Symbols and Punctuation */
+	{ 0x3042, 0x3042 },	/* Hiragana */
+	{ 0x30a2, 0x30a2 },	/* Katakana */
+	{ 0x4e00, 0x4e00 },	/* CJK Unified Ideographs */
+	{ 0xac00, 0xac00 },	/* Hangul Syllables */
+	{ 0xe0a0, 0xe0b3 },	/* Powerline symbols */
+	{ 0xff01, 0xff01 },	/* Halfwidth and Fullwidth Forms */
+	{ 0x1f600, 0x1f600 },	/* Emoticons */
+};
+
+#define PREWARM_CHARS_PER_SLICE (16)
+
+static gboolean
+_vte_draw_prewarm_cb (struct _vte_draw *draw)
+{
+	struct font_info *info = draw->fonts[VTE_DRAW_NORMAL];
+	guint i, n, next = draw->prewarm_next;
+
+	for (n = 0; n < PREWARM_CHARS_PER_SLICE; ) {
+		gunichar first, last;
+
+		/* Find the range @next falls in, counting from the start of the table */
+		for (i = 0; i < G_N_ELEMENTS (prewarm_ranges); i++) {
+			guint size = prewarm_ranges[i].last - prewarm_ranges[i].first + 1;
+			if (next < size)
+				break;
+			next -= size;
+		}
+		if (i == G_N_ELEMENTS (prewarm_ranges)) {
+			_vte_debug_print (VTE_DEBUG_DRAW, "Prewarmed %u characters\n",
+					  draw->prewarm_next);
+			draw->prewarm_source = 0;
+			return G_SOURCE_REMOVE;
+		}
+
+		first = prewarm_ranges[i].first + next;
+		last = prewarm_ranges[i].last;
+		for (; first <= last && n < PREWARM_CHARS_PER_SLICE; first++, n++) {
+			font_info_get_unistr_info (info, first);
+			draw->prewarm_next++;
+		}
+		next = draw->prewarm_next;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
 void
 _vte_draw_set_text_font (struct _vte_draw *draw,
                          GtkWidget *widget,
                          const PangoFontDescription *fontdesc)
 {
-	PangoFontDescription *bolddesc   = NULL;
-	PangoFontDescription *italicdesc = NULL;
-	PangoFontDescription *bolditalicdesc = NULL;
-	gint style, normal, bold, ratio;
+	PangoFontDescription *bolddesc;
 
 	_vte_debug_print (VTE_DEBUG_DRAW, "draw_set_text_font\n");
 
-	/* Free all fonts (make sure to destroy every font only once)*/
-	for (style = 3; style >= 0; style--) {
-		if (draw->fonts[style] != NULL &&
-			(style == 0 || draw->fonts[style] != draw->fonts[style-1])) {
-			font_info_destroy (draw->fonts[style]);
-			draw->fonts[style] = NULL;
-		}
-	}
+	_vte_draw_free_fonts (draw);
+
+	draw->screen = gtk_widget_get_screen (widget);
+	draw->language = pango_context_get_language (gtk_widget_get_pango_context (widget));
+
+	/* Only the normal font is needed for the metrics; the other styles
+	 * are loaded when first drawn with */
+	draw->fonts[VTE_DRAW_NORMAL] = font_info_create_for_screen (draw->screen, fontdesc, draw->language);
 
 	/* calculate bold font desc */
 	bolddesc = pango_font_description_copy (fontdesc);
 	pango_font_description_set_weight (bolddesc, PANGO_WEIGHT_BOLD);
+	draw->font_descs[VTE_DRAW_BOLD] = bolddesc;
 
 	/* calculate italic font desc */
-	italicdesc = pango_font_description_copy (fontdesc);
-	pango_font_description_set_style (italicdesc, PANGO_STYLE_ITALIC);
+	draw->font_descs[VTE_DRAW_ITALIC] = pango_font_description_copy (fontdesc);
+	pango_font_description_set_style (draw->font_descs[VTE_DRAW_ITALIC], PANGO_STYLE_ITALIC);
 
 	/* calculate bold italic font desc */
-	bolditalicdesc = pango_font_description_copy (bolddesc);
-	pango_font_description_set_style (bolditalicdesc, PANGO_STYLE_ITALIC);
-
-	draw->fonts[VTE_DRAW_NORMAL]  = font_info_create_for_widget (widget, fontdesc);
-	draw->fonts[VTE_DRAW_BOLD]    = font_info_create_for_widget (widget, bolddesc);
-	draw->fonts[VTE_DRAW_ITALIC]  = font_info_create_for_widget (widget, italicdesc);
-	draw->fonts[VTE_DRAW_ITALIC | VTE_DRAW_BOLD] =
-                font_info_create_for_widget (widget, bolditalicdesc);
-	pango_font_description_free (bolddesc);
-	pango_font_description_free (italicdesc);
-	pango_font_description_free (bolditalicdesc);
+	draw->font_descs[VTE_DRAW_ITALIC | VTE_DRAW_BOLD] = pango_font_description_copy (bolddesc);
+	pango_font_description_set_style (draw->font_descs[VTE_DRAW_ITALIC | VTE_DRAW_BOLD], PANGO_STYLE_ITALIC);
 
-	/* Decide if we should keep this bold font face, per bug 54926:
-	 *  - reject bold font if it is not within 10% of normal font width
-	 */
-	normal = VTE_DRAW_NORMAL;
-	bold   = normal | VTE_DRAW_BOLD;
-	ratio = draw->fonts[bold]->width * 100 / draw->fonts[normal]->width;
-	if (abs(ratio - 100) > 10) {
-		_vte_debug_print (VTE_DEBUG_DRAW,
-			"Rejecting bold font (%i%%).\n", ratio);
-		font_info_destroy (draw->fonts[bold]);
-		draw->fonts[bold] = draw->fonts[normal];
-	}
-	normal = VTE_DRAW_ITALIC;
-	bold   = normal | VTE_DRAW_BOLD;
-	ratio = draw->fonts[bold]->width * 100 / draw->fonts[normal]->width;
-	if (abs(ratio - 100) > 10) {
-		_vte_debug_print (VTE_DEBUG_DRAW,
-			"Rejecting italic bold font (%i%%).\n", ratio);
-		font_info_destroy (draw->fonts[bold]);
-		draw->fonts[bold] = draw->fonts[normal];
-	}
+	draw->prewarm_next = 0;
+	draw->prewarm_source = g_idle_add_full (G_PRIORITY_LOW,
+						(GSourceFunc) _vte_draw_prewarm_cb,
+						draw, NULL);
 }
 
 void
@@ -920,14 +1472,14 @@ _vte_draw_get_char_width (struct _vte_draw *draw, vteunistr c, int columns,
 
 	g_return_val_if_fail (draw->fonts[VTE_DRAW_NORMAL] != NULL, 0);
 
-	uinfo = font_info_get_unistr_info (draw->fonts[style], c);
+	uinfo = font_info_get_unistr_info (_vte_draw_get_font (draw, style), c);
 	return uinfo->width;
 }
 
 gboolean
 _vte_draw_has_bold (struct _vte_draw *draw, guint style)
 {
-	return (draw->fonts[style ^ VTE_DRAW_BOLD] != draw->fonts[style]);
+	return (_vte_draw_get_font (draw, style ^ VTE_DRAW_BOLD) != _vte_draw_get_font (draw, style));
 }
 
 /* Check if a unicode character is actually a graphic character we draw
@@ -944,7 +1496,7 @@ _vte_draw_unichar_is_local_graphic(vteunistr c)
 /* Draw the graphic representation of a line-drawing or special graphics
  * character. */
 static void
-_vte_draw_terminal_draw_graphic(struct _vte_draw *draw, vteunistr c, vte::color::rgb const* fg,
+_vte_draw_terminal_draw_graphic(cairo_t *cr, vteunistr c, vte::color::rgb const* fg,
                                 gint x, gint y,
                                 gint column_width, gint columns, gint row_height)
 {
@@ -952,7 +1504,6 @@ _vte_draw_terminal_draw_graphic(struct _vte_draw *draw, vteunistr c, vte::color:
         int upper_half, lower_half, left_half, right_half;
         int light_line_width, heavy_line_width;
         double adjust;
-        cairo_t *cr = draw->cr;
 
         cairo_save (cr);
 
@@ -1410,7 +1961,7 @@ _vte_draw_text_internal (struct _vte_draw *draw,
 	cairo_scaled_font_t *last_scaled_font = NULL;
 	int n_cr_glyphs = 0;
 	cairo_glyph_t cr_glyphs[MAX_RUN_LENGTH];
-	struct font_info *font = draw->fonts[style];
+	struct font_info *font = _vte_draw_get_font (draw, style);
 
 	g_return_if_fail (font != NULL);
 
@@ -1422,31 +1973,69 @@ _vte_draw_text_internal (struct _vte_draw *draw,
 		vteunistr c = requests[i].c;
 		int x = requests[i].x;
 		int y = requests[i].y + font->ascent;
-		struct unistr_info *uinfo = font_info_get_unistr_info (font, c);
-		union unistr_font_info *ufi = &uinfo->ufi;
+		struct unistr_info *uinfo;
+		union unistr_font_info *ufi;
 
                 if (_vte_draw_unichar_is_local_graphic(c)) {
-                        _vte_draw_terminal_draw_graphic(draw, c, color,
+                        int columns = requests[i].columns;
+
+                        /* Rasterized once per font, then stamped as a mask */
+                        if (columns == 1 || columns == 2) {
+                                uinfo = font_info_find_graphic_info (font, c, columns);
+                                switch (font_info_atlas_lookup (font, uinfo, draw->scale, c, columns)) {
+                                case ATLAS_BLANK:
+                                        continue;
+                                case ATLAS_CACHED:
+                                        cairo_mask_surface (draw->cr, uinfo->atlas_slot->surface,
+                                                            requests[i].x - font->atlas_pad,
+                                                            requests[i].y - font->atlas_pad);
+                                        continue;
+                                default:
+                                        break;
+                                }
+                        }
+                        _vte_draw_terminal_draw_graphic(draw->cr, c, color,
                                                         requests[i].x, requests[i].y,
-                                                        font->width, requests[i].columns, font->height);
+                                                        font->width, columns, font->height);
                         continue;
                 }
 
+		uinfo = font_info_get_unistr_info (font, c);
+		ufi = &uinfo->ufi;
+
+		switch (font_info_atlas_lookup (font, uinfo, draw->scale, 0, 1)) {
+		case ATLAS_BLANK:
+			continue;
+		case ATLAS_CACHED: {
+			cairo_surface_t *mask = uinfo->atlas_slot->surface;
+			int mask_x = requests[i].x - font->atlas_pad;
+			int mask_y = requests[i].y - font->atlas_pad;
+
+			if (uinfo->atlas_color) {
+				cairo_save (draw->cr);
+				cairo_set_source_surface (draw->cr, mask, mask_x, mask_y);
+				cairo_rectangle (draw->cr, mask_x, mask_y,
+						 font->atlas_slot_width, font->atlas_slot_height);
+				cairo_clip (draw->cr);
+				cairo_paint_with_alpha (draw->cr, alpha);
+				cairo_restore (draw->cr);
+			} else {
+				cairo_mask_surface (draw->cr, mask, mask_x, mask_y);
+			}
+			continue;
+		}
+		default:
+			break;
+		}
+
 		switch (uinfo->coverage) {
 		default:
 		case COVERAGE_UNKNOWN:
 			g_assert_not_reached ();
 			break;
 		case COVERAGE_USE_PANGO_LAYOUT_LINE:
-			cairo_move_to (draw->cr, x, y);
-			pango_cairo_show_layout_line (draw->cr,
-						      ufi->using_pango_layout_line.line);
-			break;
 		case COVERAGE_USE_PANGO_GLYPH_STRING:
-			cairo_move_to (draw->cr, x, y);
-			pango_cairo_show_glyph_string (draw->cr,
-						       ufi->using_pango_glyph_string.font,
-						       ufi->using_pango_glyph_string.glyph_string);
+			unistr_info_draw (uinfo, draw->cr, x, y);
 			break;
 		case COVERAGE_USE_CAIRO_GLYPH:
 			if (last_scaled_font != ufi->using_cairo_glyph.scaled_font || n_cr_glyphs == MAX_RUN_LENGTH) {
@@ -1530,7 +2119,7 @@ _vte_draw_has_char (struct _vte_draw *draw, vteunistr c, guint style)
 
 	g_return_val_if_fail (draw->fonts[VTE_DRAW_NORMAL] != NULL, FALSE);
 
-	uinfo = font_info_get_unistr_info (draw->fonts[style], c);
+	uinfo = font_info_get_unistr_info (_vte_draw_get_font (draw, style), c);
 	return !uinfo->has_unknown_chars;
 }
 
@@ -1595,6 +2184,127 @@ _vte_draw_fill_rectangle (struct _vte_draw *draw,
 	cairo_fill (draw->cr);
 }
 
+/* Adds a solid rectangle to the display list instead of filling it right
+ * away.  Rectangles continuing the previous one on the same row are
+ * merged; the rest of the merging happens in _vte_draw_flush_rectangles().
+ * Since the list is painted sorted by colour, queued rectangles must not
+ * overlap each other. */
+void
+_vte_draw_queue_rectangle (struct _vte_draw *draw,
+			   gint x, gint y, gint width, gint height,
+			   vte::color::rgb const* color, double alpha)
+{
+	struct _vte_draw_queued_rect rect;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	if (draw->queued_rects->len > 0) {
+		auto last = &g_array_index (draw->queued_rects,
+					    struct _vte_draw_queued_rect,
+					    draw->queued_rects->len - 1);
+		if (last->y == y && last->height == height &&
+		    last->x + last->width == x &&
+		    last->alpha == alpha && last->color == *color) {
+			last->width += width;
+			return;
+		}
+	}
+
+	rect.color = *color;
+	rect.alpha = alpha;
+	rect.x = x;
+	rect.y = y;
+	rect.width = width;
+	rect.height = height;
+	g_array_append_val (draw->queued_rects, rect);
+}
+
+void
+_vte_draw_queue_line (struct _vte_draw *draw,
+		      gint x, gint y, gint xp, gint yp,
+		      int line_width,
+		      vte::color::rgb const *color, double alpha)
+{
+	_vte_draw_queue_rectangle (draw,
+				   x, y,
+				   MAX(line_width, xp - x + 1), MAX(line_width, yp - y + 1),
+				   color, alpha);
+}
+
+/* Orders the display list by colour, then column, so that rectangles
+ * stacked on consecutive rows end up next to each other. */
+static gint
+_vte_draw_compare_queued_rects (gconstpointer a,
+				gconstpointer b)
+{
+	auto ra = reinterpret_cast<struct _vte_draw_queued_rect const*>(a);
+	auto rb = reinterpret_cast<struct _vte_draw_queued_rect const*>(b);
+
+	if (ra->color.red != rb->color.red)
+		return ra->color.red < rb->color.red ? -1 : 1;
+	if (ra->color.green != rb->color.green)
+		return ra->color.green < rb->color.green ? -1 : 1;
+	if (ra->color.blue != rb->color.blue)
+		return ra->color.blue < rb->color.blue ? -1 : 1;
+	if (ra->alpha != rb->alpha)
+		return ra->alpha < rb->alpha ? -1 : 1;
+	if (ra->x != rb->x)
+		return ra->x < rb->x ? -1 : 1;
+	if (ra->width != rb->width)
+		return ra->width < rb->width ? -1 : 1;
+	if (ra->y != rb->y)
+		return ra->y < rb->y ? -1 : 1;
+	return 0;
+}
+
+/* Paints and empties the display list, merging rectangles that stack
+ * vertically and issuing a single fill per colour. */
+void
+_vte_draw_flush_rectangles (struct _vte_draw *draw)
+{
+	guint i, n_rects, n_fills = 0;
+
+	n_rects = draw->queued_rects->len;
+	if (n_rects == 0)
+		return;
+
+	g_assert(draw->cr);
+
+	g_array_sort (draw->queued_rects, _vte_draw_compare_queued_rects);
+
+	cairo_set_operator (draw->cr, CAIRO_OPERATOR_OVER);
+	for (i = 0; i < n_rects; ) {
+		auto first = &g_array_index (draw->queued_rects, struct _vte_draw_queued_rect, i);
+
+		do {
+			auto rect = &g_array_index (draw->queued_rects, struct _vte_draw_queued_rect, i);
+			gint height = rect->height;
+
+			for (i++; i < n_rects; i++) {
+				auto next = &g_array_index (draw->queued_rects, struct _vte_draw_queued_rect, i);
+				if (!(next->color == rect->color) || next->alpha != rect->alpha ||
+				    next->x != rect->x || next->width != rect->width ||
+				    next->y != rect->y + height)
+					break;
+				height += next->height;
+			}
+			cairo_rectangle (draw->cr, rect->x, rect->y, rect->width, height);
+		} while (i < n_rects &&
+			 g_array_index (draw->queued_rects, struct _vte_draw_queued_rect, i).color == first->color &&
+			 g_array_index (draw->queued_rects, struct _vte_draw_queued_rect, i).alpha == first->alpha);
+
+		_vte_draw_set_source_color_alpha (draw, &first->color, first->alpha);
+		cairo_fill (draw->cr);
+		n_fills++;
+	}
+
+	_vte_debug_print (VTE_DEBUG_DRAW,
+			  "flush_rectangles: %u rectangles in %u fills\n",
+			  n_rects, n_fills);
+
+	g_array_set_size (draw->queued_rects, 0);
+}
 
 void
 _vte_draw_draw_line(struct _vte_draw *draw,
@@ -89,6 +89,17 @@ void _vte_draw_draw_line(struct _vte_draw *draw,
                          int line_width,
                          vte::color::rgb const *color, double alpha);
 
+/* Display list: queued rectangles are painted by _vte_draw_flush_rectangles()
+ * (or when the cairo context is unset), batched by colour. */
+void _vte_draw_queue_rectangle(struct _vte_draw *draw,
+			       gint x, gint y, gint width, gint height,
+			       vte::color::rgb const* color, double alpha);
+void _vte_draw_queue_line(struct _vte_draw *draw,
+                          gint x, gint y, gint xp, gint yp,
+                          int line_width,
+                          vte::color::rgb const *color, double alpha);
+void _vte_draw_flush_rectangles(struct _vte_draw *draw);
+
 G_END_DECLS
 
 #endif
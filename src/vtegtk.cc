@@ -471,15 +471,30 @@ vte_terminal_get_property (GObject *object,
                 case PROP_REWRAP_ON_RESIZE:
                         g_value_set_boolean (value, vte_terminal_get_rewrap_on_resize (terminal));
                         break;
+                case PROP_SCROLLBACK_BYTES:
+                        g_value_set_uint64 (value, vte_terminal_get_scrollback_bytes (terminal));
+                        break;
                 case PROP_SCROLLBACK_LINES:
                         g_value_set_uint (value, impl->m_scrollback_lines);
                         break;
+                case PROP_SCROLLBACK_USAGE:
+                        g_value_set_uint64 (value, vte_terminal_get_scrollback_usage (terminal));
+                        break;
                 case PROP_SCROLL_ON_KEYSTROKE:
                         g_value_set_boolean (value, impl->m_scroll_on_keystroke);
                         break;
                 case PROP_SCROLL_ON_OUTPUT:
                         g_value_set_boolean (value, impl->m_scroll_on_output);
                         break;
+                case PROP_SEARCH_HIGHLIGHT_ALL:
+                        g_value_set_boolean (value, vte_terminal_search_get_highlight_all (terminal));
+                        break;
+                case PROP_SEARCH_MATCH_COUNT:
+                        g_value_set_int (value, vte_terminal_search_get_match_count (terminal));
+                        break;
+                case PROP_THREADED_RENDERING:
+                        g_value_set_boolean (value, vte_terminal_get_threaded_rendering (terminal));
+                        break;
                 case PROP_WINDOW_TITLE:
                         g_value_set_string (value, vte_terminal_get_window_title (terminal));
                         break;
@@ -560,6 +575,9 @@ vte_terminal_set_property (GObject *object,
                 case PROP_REWRAP_ON_RESIZE:
                         vte_terminal_set_rewrap_on_resize (terminal, g_value_get_boolean (value));
                         break;
+                case PROP_SCROLLBACK_BYTES:
+                        vte_terminal_set_scrollback_bytes (terminal, g_value_get_uint64 (value));
+                        break;
                 case PROP_SCROLLBACK_LINES:
                         vte_terminal_set_scrollback_lines (terminal, g_value_get_uint (value));
                         break;
@@ -569,6 +587,12 @@ vte_terminal_set_property (GObject *object,
                 case PROP_SCROLL_ON_OUTPUT:
                         vte_terminal_set_scroll_on_output (terminal, g_value_get_boolean (value));
                         break;
+                case PROP_SEARCH_HIGHLIGHT_ALL:
+                        vte_terminal_search_set_highlight_all (terminal, g_value_get_boolean (value));
+                        break;
+                case PROP_THREADED_RENDERING:
+                        vte_terminal_set_threaded_rendering (terminal, g_value_get_boolean (value));
+                        break;
                 case PROP_WORD_CHAR_EXCEPTIONS:
                         vte_terminal_set_word_char_exceptions (terminal, g_value_get_string (value));
                         break;
@@ -578,6 +602,8 @@ vte_terminal_set_property (GObject *object,
                 case PROP_CURRENT_FILE_URI:
                 case PROP_HYPERLINK_HOVER_URI:
                 case PROP_ICON_TITLE:
+                case PROP_SCROLLBACK_USAGE:
+                case PROP_SEARCH_MATCH_COUNT:
                 case PROP_WINDOW_TITLE:
                         g_assert_not_reached ();
                         break;
@@ -759,6 +785,26 @@ vte_terminal_class_init(VteTerminalClass *klass)
                              g_cclosure_marshal_VOID__VOID,
                              G_TYPE_NONE, 0);
 
+        /**
+         * VteTerminal::write-contents-progress:
+         * @vteterminal: the object which received the signal
+         * @fraction: the part of the contents written so far, from 0 to 1
+         *
+         * Emitted periodically while vte_terminal_write_contents_async() is
+         * writing, and once more with @fraction 1 when it's done.
+         *
+         * Since: 0.50
+         */
+        signals[SIGNAL_WRITE_CONTENTS_PROGRESS] =
+                g_signal_new(I_("write-contents-progress"),
+                             G_OBJECT_CLASS_TYPE(klass),
+                             G_SIGNAL_RUN_LAST,
+                             0,
+                             NULL,
+                             NULL,
+                             g_cclosure_marshal_VOID__DOUBLE,
+                             G_TYPE_NONE, 1, G_TYPE_DOUBLE);
+
         /**
          * VteTerminal::icon-title-changed:
          * @vteterminal: the object which received the signal
@@ -907,6 +953,26 @@ vte_terminal_class_init(VteTerminalClass *klass)
                               g_cclosure_marshal_VOID__VOID,
                               G_TYPE_NONE, 0);
 
+        /**
+         * VteTerminal::search-progress:
+         * @vteterminal: the object which received the signal
+         * @fraction: the part of the buffer searched so far, from 0 to 1
+         *
+         * Emitted periodically while vte_terminal_search_find_async() is
+         * searching, and once more with @fraction 1 when it's done.
+         *
+         * Since: 0.50
+         */
+        signals[SIGNAL_SEARCH_PROGRESS] =
+                g_signal_new(I_("search-progress"),
+                             G_OBJECT_CLASS_TYPE(klass),
+                             G_SIGNAL_RUN_LAST,
+                             0,
+                             NULL,
+                             NULL,
+                             g_cclosure_marshal_VOID__DOUBLE,
+                             G_TYPE_NONE, 1, G_TYPE_DOUBLE);
+
         /**
          * VteTerminal::contents-changed:
          * @vteterminal: the object which received the signal
@@ -1445,6 +1511,21 @@ vte_terminal_class_init(VteTerminalClass *klass)
                                       TRUE,
                                       (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
 
+        /**
+         * VteTerminal:scrollback-bytes:
+         *
+         * The number of bytes the scrollback buffer may use, or 0 for no
+         * limit besides #VteTerminal:scrollback-lines. See
+         * vte_terminal_set_scrollback_bytes().
+         *
+         * Since: 0.50
+         */
+        pspecs[PROP_SCROLLBACK_BYTES] =
+                g_param_spec_uint64 ("scrollback-bytes", NULL, NULL,
+                                     0, G_MAXUINT64,
+                                     0,
+                                     (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
+
         /**
          * VteTerminal:scrollback-lines:
          *
@@ -1461,6 +1542,20 @@ vte_terminal_class_init(VteTerminalClass *klass)
                                    VTE_SCROLLBACK_INIT,
                                    (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
 
+        /**
+         * VteTerminal:scrollback-usage:
+         *
+         * The number of bytes the scrollback buffer currently uses, as
+         * counted against #VteTerminal:scrollback-bytes.
+         *
+         * Since: 0.50
+         */
+        pspecs[PROP_SCROLLBACK_USAGE] =
+                g_param_spec_uint64 ("scrollback-usage", NULL, NULL,
+                                     0, G_MAXUINT64,
+                                     0,
+                                     (GParamFlags) (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
+
         /**
          * VteTerminal:scroll-on-keystroke:
          *
@@ -1484,6 +1579,34 @@ vte_terminal_class_init(VteTerminalClass *klass)
                                       TRUE,
                                       (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
 
+        /**
+         * VteTerminal:search-highlight-all:
+         *
+         * Whether all matches of the search regex are highlighted, and
+         * counted in #VteTerminal:search-match-count.
+         *
+         * Since: 0.50
+         */
+        pspecs[PROP_SEARCH_HIGHLIGHT_ALL] =
+                g_param_spec_boolean ("search-highlight-all", NULL, NULL,
+                                      FALSE,
+                                      (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
+
+        /**
+         * VteTerminal:search-match-count:
+         *
+         * The number of matches of the search regex in the whole buffer,
+         * or -1 while it isn't known. Only counted while
+         * #VteTerminal:search-highlight-all is enabled.
+         *
+         * Since: 0.50
+         */
+        pspecs[PROP_SEARCH_MATCH_COUNT] =
+                g_param_spec_int ("search-match-count", NULL, NULL,
+                                  -1, G_MAXINT,
+                                  -1,
+                                  (GParamFlags) (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
+
         /**
          * VteTerminal:sixel-enabled:
          *
@@ -1494,6 +1617,19 @@ vte_terminal_class_init(VteTerminalClass *klass)
                                       TRUE,
                                       (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
 
+        /**
+         * VteTerminal:threaded-rendering:
+         *
+         * Whether large damaged areas are rasterized on worker threads.
+         * See vte_terminal_set_threaded_rendering().
+         *
+         * Since: 0.50
+         */
+        pspecs[PROP_THREADED_RENDERING] =
+                g_param_spec_boolean ("threaded-rendering", NULL, NULL,
+                                      FALSE,
+                                      (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY));
+
 
         /**
          * VteTerminal:window-title:
@@ -2132,6 +2268,66 @@ vte_terminal_search_find_next (VteTerminal *terminal)
 	return IMPL(terminal)->search_find(false);
 }
 
+/**
+ * vte_terminal_search_find_async:
+ * @terminal: a #VteTerminal
+ * @backward: whether to search for the previous match rather than the next one
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @callback: (scope async): a #GAsyncReadyCallback, or %NULL
+ * @user_data: (closure callback): user data for @callback
+ *
+ * Searches the whole buffer for the search regex set with
+ * vte_terminal_search_set_regex(), without blocking. The scrollback is
+ * searched by several threads at once, each in its own part of it. The
+ * #VteTerminal::search-progress signal is emitted meanwhile.
+ *
+ * When the search is done, @callback is called; call
+ * vte_terminal_search_find_finish() from it to select the match found and
+ * get the number of matches.
+ *
+ * Since: 0.50
+ */
+void
+vte_terminal_search_find_async (VteTerminal *terminal,
+                                gboolean backward,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+        g_return_if_fail(cancellable == nullptr || G_IS_CANCELLABLE(cancellable));
+
+        IMPL(terminal)->search_find_async(backward != FALSE, cancellable, callback, user_data);
+}
+
+/**
+ * vte_terminal_search_find_finish:
+ * @terminal: a #VteTerminal
+ * @result: a #GAsyncResult
+ * @n_matches: (out) (allow-none): a location to store the number of matches, or %NULL
+ * @error: (allow-none): return location for a #GError, or %NULL
+ *
+ * Finishes a search started with vte_terminal_search_find_async(), selecting
+ * the next (or previous) match like vte_terminal_search_find_next() (or
+ * vte_terminal_search_find_previous()) would.
+ *
+ * Returns: %TRUE if a match was found
+ *
+ * Since: 0.50
+ */
+gboolean
+vte_terminal_search_find_finish (VteTerminal *terminal,
+                                 GAsyncResult *result,
+                                 guint *n_matches,
+                                 GError **error)
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+        g_return_val_if_fail(g_task_is_valid(result, terminal), FALSE);
+        g_return_val_if_fail(error == nullptr || *error == nullptr, FALSE);
+
+        return IMPL(terminal)->search_find_finish(result, n_matches, error);
+}
+
 /**
  * vte_terminal_search_set_regex:
  * @terminal: a #VteTerminal
@@ -2244,6 +2440,65 @@ vte_terminal_search_get_wrap_around (VteTerminal *terminal)
 	return IMPL(terminal)->m_search_wrap_around;
 }
 
+/**
+ * vte_terminal_search_set_highlight_all:
+ * @terminal: a #VteTerminal
+ * @highlight_all: whether to highlight all matches
+ *
+ * Sets whether all matches of the search regex set with
+ * vte_terminal_search_set_regex() are highlighted. While they are, the
+ * matches in the whole buffer are counted in the background, see
+ * vte_terminal_search_get_match_count().
+ *
+ * Since: 0.50
+ */
+void
+vte_terminal_search_set_highlight_all (VteTerminal *terminal,
+                                       gboolean     highlight_all)
+{
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        if (IMPL(terminal)->search_set_highlight_all(highlight_all != FALSE))
+                g_object_notify_by_pspec(G_OBJECT(terminal), pspecs[PROP_SEARCH_HIGHLIGHT_ALL]);
+}
+
+/**
+ * vte_terminal_search_get_highlight_all:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: whether all matches of the search regex are highlighted
+ *
+ * Since: 0.50
+ */
+gboolean
+vte_terminal_search_get_highlight_all (VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+
+	return IMPL(terminal)->m_search_highlight_all;
+}
+
+/**
+ * vte_terminal_search_get_match_count:
+ * @terminal: a #VteTerminal
+ *
+ * Returns the number of matches of the search regex in the whole buffer,
+ * as counted while #VteTerminal:search-highlight-all is enabled. The count
+ * follows the output; connect to the notify signal of
+ * #VteTerminal:search-match-count to be told when it changes.
+ *
+ * Returns: the number of matches, or -1 if it isn't known (yet)
+ *
+ * Since: 0.50
+ */
+int
+vte_terminal_search_get_match_count (VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), -1);
+
+	return IMPL(terminal)->m_search_match_count;
+}
+
 
 /**
  * vte_terminal_select_all:
@@ -3829,6 +4084,69 @@ vte_terminal_set_scrollback_lines(VteTerminal *terminal, glong lines)
         g_object_thaw_notify(object);
 }
 
+/**
+ * vte_terminal_set_scrollback_bytes:
+ * @terminal: a #VteTerminal
+ * @bytes: the number of bytes the scrollback buffer may use, or 0
+ *
+ * Limits the scrollback buffer by the space it takes rather than by its
+ * number of rows: whenever its usage, see vte_terminal_get_scrollback_usage(),
+ * exceeds @bytes, the oldest rows are dropped until it fits again. The limit
+ * set with vte_terminal_set_scrollback_lines() still applies. 0 means no
+ * limit by bytes.
+ *
+ * The rows on screen are never dropped, so the usage can stay above a
+ * small enough @bytes.
+ *
+ * Since: 0.50
+ */
+void
+vte_terminal_set_scrollback_bytes(VteTerminal *terminal,
+                                  guint64 bytes)
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        if (IMPL(terminal)->set_scrollback_bytes(MIN(bytes, (guint64) G_MAXSIZE)))
+                g_object_notify_by_pspec(G_OBJECT(terminal), pspecs[PROP_SCROLLBACK_BYTES]);
+}
+
+/**
+ * vte_terminal_get_scrollback_bytes:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: the byte limit of the scrollback buffer, or 0 if there is none
+ *
+ * Since: 0.50
+ */
+guint64
+vte_terminal_get_scrollback_bytes(VteTerminal *terminal)
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), 0);
+
+        return IMPL(terminal)->m_scrollback_bytes;
+}
+
+/**
+ * vte_terminal_get_scrollback_usage:
+ * @terminal: a #VteTerminal
+ *
+ * Returns the number of bytes the normal screen's buffer uses: its
+ * scrollback as compressed on disk, plus the cells of the rows kept in
+ * memory and the images that aren't frozen. This is what
+ * vte_terminal_set_scrollback_bytes() limits.
+ *
+ * Returns: the usage in bytes
+ *
+ * Since: 0.50
+ */
+guint64
+vte_terminal_get_scrollback_usage(VteTerminal *terminal)
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), 0);
+
+        return IMPL(terminal)->m_scrollback_usage;
+}
+
 /**
  * vte_terminal_set_scroll_on_keystroke:
  * @terminal: a #VteTerminal
@@ -3947,6 +4265,7 @@ vte_terminal_set_word_char_exceptions(VteTerminal *terminal,
  * This is a synchronous operation and will make the widget (and input
  * processing) during the write operation, which may take a long time
  * depending on scrollback history and @stream availability for writing.
+ * See vte_terminal_write_contents_async() for a version that doesn't block.
  *
  * Returns: %TRUE on success, %FALSE if there was an error
  */
@@ -3963,6 +4282,133 @@ vte_terminal_write_contents_sync (VteTerminal *terminal,
         return IMPL(terminal)->write_contents_sync(stream, flags, cancellable, error);
 }
 
+/**
+ * vte_terminal_write_contents_async:
+ * @terminal: a #VteTerminal
+ * @stream: a #GOutputStream to write to
+ * @flags: a set of #VteWriteFlags
+ * @cancellable: (allow-none): a #GCancellable object, or %NULL
+ * @callback: (scope async): a #GAsyncReadyCallback, or %NULL
+ * @user_data: (closure callback): user data for @callback
+ *
+ * Writes the contents of @terminal as they are now (including any
+ * scrollback history) to @stream according to @flags, like
+ * vte_terminal_write_contents_sync() does, but in a worker thread so that
+ * the widget isn't blocked meanwhile. The #VteTerminal::write-contents-progress
+ * signal is emitted while writing.
+ *
+ * Scrollback history that is dropped before it is written, for example because
+ * the scrollback is cleared, fails to be written.
+ *
+ * Don't use @stream until @callback is called; call
+ * vte_terminal_write_contents_finish() from it to get the result.
+ *
+ * Since: 0.50
+ */
+void
+vte_terminal_write_contents_async (VteTerminal *terminal,
+                                   GOutputStream *stream,
+                                   VteWriteFlags flags,
+                                   GCancellable *cancellable,
+                                   GAsyncReadyCallback callback,
+                                   gpointer user_data)
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+        g_return_if_fail(G_IS_OUTPUT_STREAM(stream));
+        g_return_if_fail(cancellable == nullptr || G_IS_CANCELLABLE(cancellable));
+
+        IMPL(terminal)->write_contents_async(stream, flags, cancellable, callback, user_data);
+}
+
+/**
+ * vte_terminal_write_contents_finish:
+ * @terminal: a #VteTerminal
+ * @result: a #GAsyncResult
+ * @error: (allow-none): return location for a #GError, or %NULL
+ *
+ * Finishes writing started with vte_terminal_write_contents_async(). If the
+ * operation was cancelled, the error %G_IO_ERROR_CANCELLED is returned in
+ * @error.
+ *
+ * Returns: %TRUE on success, %FALSE if there was an error
+ *
+ * Since: 0.50
+ */
+gboolean
+vte_terminal_write_contents_finish (VteTerminal *terminal,
+                                    GAsyncResult *result,
+                                    GError **error)
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+        g_return_val_if_fail(g_task_is_valid(result, terminal), FALSE);
+        g_return_val_if_fail(error == nullptr || *error == nullptr, FALSE);
+
+        return IMPL(terminal)->write_contents_finish(result, error);
+}
+
+/**
+ * vte_terminal_save_scrollback:
+ * @terminal: a #VteTerminal
+ * @file: a #GFile to save to
+ * @cancellable: (allow-none): a #GCancellable object, or %NULL
+ * @error: (allow-none): a #GError location to store the error occuring, or %NULL
+ *
+ * Saves the contents of the normal screen, including the scrollback history,
+ * with their attributes, and the cursor position to @file, to be restored with
+ * vte_terminal_restore_scrollback(), for example after restarting.
+ *
+ * The contents are stored in the clear, and @file is created readable by the
+ * current user only.
+ *
+ * Returns: %TRUE on success, %FALSE if there was an error
+ *
+ * Since: 0.50
+ */
+gboolean
+vte_terminal_save_scrollback (VteTerminal *terminal,
+                              GFile *file,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+        g_return_val_if_fail(G_IS_FILE(file), FALSE);
+        g_return_val_if_fail(error == nullptr || *error == nullptr, FALSE);
+
+        return IMPL(terminal)->save_scrollback(file, cancellable, error);
+}
+
+/**
+ * vte_terminal_restore_scrollback:
+ * @terminal: a #VteTerminal
+ * @file: a local #GFile saved with vte_terminal_save_scrollback()
+ * @cancellable: (allow-none): a #GCancellable object, or %NULL
+ * @error: (allow-none): a #GError location to store the error occuring, or %NULL
+ *
+ * Resets @terminal like vte_terminal_reset() with @clear_history set, and
+ * restores the contents and cursor position saved in @file. The contents are
+ * rewrapped if they were saved at another width and #VteTerminal:rewrap-on-resize
+ * is set. Images are not saved and restored.
+ *
+ * If @file isn't a file saved with vte_terminal_save_scrollback(), @terminal
+ * is left alone and %G_IO_ERROR_INVALID_DATA is returned in @error.
+ *
+ * Returns: %TRUE on success, %FALSE if there was an error
+ *
+ * Since: 0.50
+ */
+gboolean
+vte_terminal_restore_scrollback (VteTerminal *terminal,
+                                 GFile *file,
+                                 GCancellable *cancellable,
+                                 GError **error)
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+        g_return_val_if_fail(G_IS_FILE(file), FALSE);
+        g_return_val_if_fail(error == nullptr || *error == nullptr, FALSE);
+
+        return IMPL(terminal)->restore_scrollback(file, cancellable, error);
+}
+
 /**
  * vte_terminal_set_freezed_image_limit:
  * @terminal: a #VteTerminal
@@ -4026,3 +4472,41 @@ vte_terminal_get_sixel_enabled (VteTerminal *terminal)
         return IMPL(terminal)->m_sixel_enabled;
 }
 
+/**
+ * vte_terminal_set_threaded_rendering:
+ * @terminal: a #VteTerminal
+ * @setting: whether to rasterize on worker threads
+ *
+ * Controls whether large damaged areas of the terminal are split into
+ * bands of rows that are rasterized in parallel on worker threads, and
+ * then composited on the main thread. This helps big terminals with
+ * small fonts, where redrawing the whole view is expensive.
+ *
+ * Since: 0.50
+ */
+void
+vte_terminal_set_threaded_rendering(VteTerminal *terminal,
+                                    gboolean setting)
+{
+        g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        if (IMPL(terminal)->set_threaded_rendering(setting != FALSE))
+                g_object_notify_by_pspec(G_OBJECT(terminal), pspecs[PROP_THREADED_RENDERING]);
+}
+
+/**
+ * vte_terminal_get_threaded_rendering:
+ * @terminal: a #VteTerminal
+ *
+ * Returns: whether large damaged areas are rasterized on worker threads,
+ *   see vte_terminal_set_threaded_rendering()
+ *
+ * Since: 0.50
+ */
+gboolean
+vte_terminal_get_threaded_rendering(VteTerminal *terminal)
+{
+        g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+
+        return IMPL(terminal)->m_threaded_rendering;
+}
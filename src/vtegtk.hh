@@ -51,12 +51,14 @@ enum {
         SIGNAL_REFRESH_WINDOW,
         SIGNAL_RESIZE_WINDOW,
         SIGNAL_RESTORE_WINDOW,
+        SIGNAL_SEARCH_PROGRESS,
         SIGNAL_SELECTION_CHANGED,
         SIGNAL_TEXT_DELETED,
         SIGNAL_TEXT_INSERTED,
         SIGNAL_TEXT_MODIFIED,
         SIGNAL_TEXT_SCROLLED,
         SIGNAL_WINDOW_TITLE_CHANGED,
+        SIGNAL_WRITE_CONTENTS_PROGRESS,
         LAST_SIGNAL
 };
 extern guint signals[LAST_SIGNAL];
@@ -83,10 +85,15 @@ enum {
         PROP_MOUSE_POINTER_AUTOHIDE,
         PROP_PTY,
         PROP_REWRAP_ON_RESIZE,
+        PROP_SCROLLBACK_BYTES,
         PROP_SCROLLBACK_LINES,
+        PROP_SCROLLBACK_USAGE,
         PROP_SCROLL_ON_KEYSTROKE,
         PROP_SCROLL_ON_OUTPUT,
+        PROP_SEARCH_HIGHLIGHT_ALL,
+        PROP_SEARCH_MATCH_COUNT,
         PROP_SIXEL_ENABLED,
+        PROP_THREADED_RENDERING,
         PROP_WINDOW_TITLE,
         PROP_WORD_CHAR_EXCEPTIONS,
         LAST_PROP,
@@ -64,6 +64,19 @@ struct vte_match_regex {
         } cursor;
 };
 
+/* The columns [start_col, end_col) of a row a search match covers. */
+struct vte_search_highlight_span {
+        vte::grid::row_t row;
+        vte::grid::column_t start_col, end_col;
+};
+
+/* The search matches of a paragraph, while its text hashes to hash. */
+struct vte_search_highlight_entry {
+        vte::grid::row_t start_row, end_row;
+        guint hash;
+        GArray *spans;  /* vte_search_highlight_span, nullptr if the entry is unused */
+};
+
 typedef enum _VteCharacterReplacement {
         VTE_CHARACTER_REPLACEMENT_NONE,
         VTE_CHARACTER_REPLACEMENT_LINE_DRAWING,
@@ -296,11 +309,51 @@ public:
         struct _vte_iso2022_state *m_iso2022;
         _vte_incoming_chunk_t *m_incoming; /* pending bytestream */
         GArray *m_pending;                 /* pending characters */
-        /* Array of dirty rectangles in view coordinates; need to
-         * add allocation origin and padding when passing to gtk.
+        /* Damage, as the dirty column span of each row. The spans are kept
+         * in a table indexed by the row number modulo its size, a power of
+         * two larger than the number of visible rows, so recording damage
+         * costs O(1) per row; it is turned into a region once per frame.
          */
-        GArray *m_update_rects;
+        struct damage_span {
+                vte::grid::row_t row;
+                vte::grid::column_t start;
+                vte::grid::column_t end;  /* inclusive; < start if clean */
+        };
+        GArray *m_damage_spans;
+        guint m_damage_n_rows;            /* number of dirty spans */
+        gboolean m_damage_expose_all;     /* the whole widget needs redrawing */
+        guint64 m_damage_frames;          /* for VTE_DEBUG_UPDATES statistics */
+        double m_damage_area_sum;
         gboolean m_invalidated_all;       /* pending refresh of entire terminal */
+        /* Backing store holding the last rendered view. When the view
+         * scrolls its contents are shifted instead of repainted, and only
+         * m_blit_damage (in view coordinates) is painted afresh.
+         */
+        cairo_surface_t *m_blit_surface;
+        int m_blit_width;
+        int m_blit_height;
+        int m_blit_scale;
+        cairo_region_t *m_blit_damage;
+        long m_blit_scroll_pixel;         /* scroll position the damage refers to */
+        long m_blit_dy;                   /* pending shift of the backing store */
+        bool m_threaded_rendering;        /* rasterize large damage in bands on worker threads */
+        GThreadPool *m_render_pool;       /* created on first use */
+        /* Resolved colours of the attribute combinations seen while
+         * drawing, so that runs of identically attributed cells don't
+         * redo determine_colors() and rgb_from_index() for every cell.
+         * Entries are only valid for the current m_color_cache_gen,
+         * which is bumped on palette changes; reverse video is part
+         * of the key.
+         */
+        struct color_cache_entry {
+                guint64 key;
+                guint gen;
+                guint fore;
+                guint back;
+                vte::color::rgb back_rgb;
+        };
+        color_cache_entry m_color_cache[256];
+        guint m_color_cache_gen;
         /* If non-nullptr, contains the GList element for @this in g_active_terminals
          * and means that this terminal is processing data.
          */
@@ -378,7 +431,12 @@ public:
         gboolean m_text_modified_flag;
         gboolean m_text_inserted_flag;
         gboolean m_text_deleted_flag;
+        /* Cells written, and those of them left unchanged (whose repaint was
+         * skipped), for VTE_DEBUG_UPDATES statistics. */
+        guint64 m_cell_writes;
+        guint64 m_cell_writes_elided;
         gboolean m_rewrap_on_resize;
+        guint m_rewrap_tag;  /* rewraps the rest of the scrollback after a resize */
         gboolean m_bracketed_paste_mode;
 
 	/* Scrolling options. */
@@ -386,6 +444,8 @@ public:
         gboolean m_scroll_on_keystroke;
         gboolean m_alternate_screen_scroll;
         vte::grid::row_t m_scrollback_lines;
+        gsize m_scrollback_bytes;  /* 0 for no byte budget */
+        gsize m_scrollback_usage;
 
         /* Restricted scrolling */
         struct vte_scrolling_region m_scrolling_region;     /* the region we scroll in */
@@ -460,6 +520,14 @@ public:
         struct vte_regex_and_flags m_search_regex;
         gboolean m_search_wrap_around;
         GArray* m_search_attrs; /* Cache attrs */
+        bool m_search_highlight_all;
+        struct vte_search_highlight_entry *m_search_highlight_cache; /* direct-mapped by paragraph start row */
+        int m_search_match_count; /* -1 if not known */
+        GArray *m_search_count_matches; /* VteRingTextRange: the frozen text's matches */
+        gsize m_search_count_offset; /* the frozen text before this was counted */
+        VteScreen *m_search_count_screen;
+        GCancellable *m_search_count_cancellable; /* of the count job running */
+        guint m_search_count_source;
 
 	/* Data used when rendering the text which does not require server
 	 * resources and which can be kept after unrealizing. */
@@ -551,6 +619,9 @@ public:
                                        bool fill);
         /* inline */ VteRowData* ring_append(bool fill);
         /* inline */ void ring_remove(vte::grid::row_t position);
+        void ring_rotate(vte::grid::row_t start,
+                         vte::grid::row_t end,
+                         vte::grid::row_t count);
         inline VteRowData const* find_row_data(vte::grid::row_t row) const;
         inline VteRowData* find_row_data_writable(vte::grid::row_t row) const;
         inline VteCell const* find_charcell(vte::grid::column_t col,
@@ -581,21 +652,34 @@ public:
         void save_cursor(VteScreen *screen__);
 
         bool insert_char(gunichar c,
-                         bool insert,
-                         bool invalidate_now);
+                         bool insert);
 
         void invalidate(vte::grid::span const& s, bool block = false);
         void invalidate_match_span();
         void invalidate_cell(vte::grid::column_t column, vte::grid::row_t row);
         void invalidate_cells(vte::grid::column_t sc, int cc,
                               vte::grid::row_t sr, int rc);
+        void invalidate_changed_cells(VteRowData const* rowdata,
+                                      vte::grid::row_t row,
+                                      vte::grid::column_t start,
+                                      vte::grid::column_t end,
+                                      VteCell const* cell);
         void invalidate_region(vte::grid::column_t sc, vte::grid::column_t ec,
                                vte::grid::row_t sr, vte::grid::row_t er,
                                bool block = false);
         void invalidate_selection();
         void invalidate_all();
-
-        void reset_update_rects();
+        void blit_damage_all();
+        void blit_track_scroll();
+        void blit_free();
+
+        cairo_rectangle_int_t cells_rect(vte::grid::column_t sc, int cc,
+                                         vte::grid::row_t sr, int rc) const;
+        void damage_cells(vte::grid::column_t sc, int cc,
+                          vte::grid::row_t sr, int rc);
+        cairo_region_t *damage_take_region();
+        void damage_clear();
+        void reset_damage();
         bool invalidate_dirty_rects_and_process_updates();
         void time_process_incoming();
         void process_incoming();
@@ -695,6 +779,10 @@ public:
 
         void expand_rectangle(cairo_rectangle_int_t& rect) const;
         void paint_area(GdkRectangle const* area);
+        void paint_region(cairo_t *cr,
+                          cairo_region_t const* region);
+        void paint_region_threaded(cairo_t *cr,
+                                   cairo_region_t const* region);
         void paint_cursor();
         void paint_im_preedit_string();
         void draw_cells(struct _vte_draw_text_request *items,
@@ -736,11 +824,23 @@ public:
                        gint start_y,
                        gint column_width,
                        gint row_height);
+        void draw_search_highlights(vte::grid::row_t start_row,
+                                    vte::grid::row_t end_row,
+                                    vte::grid::column_t start_column,
+                                    vte::grid::column_t end_column,
+                                    gint start_x,
+                                    gint start_y,
+                                    gint column_width,
+                                    gint row_height);
 
         bool autoscroll();
         void start_autoscroll();
         void stop_autoscroll();
 
+        bool rewrap_scrollback();
+        void start_rewrap_scrollback();
+        void stop_rewrap_scrollback();
+
         void scroll_region (long row,
                             long count,
                             long delta);
@@ -861,6 +961,9 @@ public:
                                             bool selected,
                                             guint *pfore,
                                             guint *pback) const;
+        inline color_cache_entry const* resolve_colors(VteCell const* cell,
+                                                       bool selected);
+        void color_cache_invalidate();
 
         char *cellattr_to_html(VteCellAttr const* attr,
                                char const* text) const;
@@ -885,6 +988,9 @@ public:
 
         bool cell_is_selected(vte::grid::column_t col,
                               vte::grid::row_t) const;
+        void selection_columns(vte::grid::row_t row,
+                               vte::grid::column_t *start,
+                               vte::grid::column_t *end) const;
 
         void reset_default_attributes(bool reset_hyperlink);
 
@@ -916,6 +1022,8 @@ public:
                          gssize length);
         void emit_eof();
         void emit_selection_changed();
+        void emit_search_progress(double fraction);
+        void emit_write_contents_progress(double fraction);
         void queue_adjustment_changed();
         void queue_adjustment_value_changed(double v);
         void queue_adjustment_value_changed_clamped(double v);
@@ -1008,7 +1116,7 @@ public:
                                     gsize *sattr_ptr,
                                     gsize *eattr_ptr);
 
-        pcre2_match_context_8 *create_match_context();
+        static pcre2_match_context_8 *create_match_context();
         bool match_check_pcre(pcre2_match_data_8 *match_data,
                               pcre2_match_context_8 *match_context,
                               VteRegex *regex,
@@ -1060,8 +1168,51 @@ public:
                               vte::grid::row_t start_row,
                               vte::grid::row_t end_row,
                               bool backward);
+        void search_select_match(vte::grid::row_t start_row,
+                                 vte::grid::column_t start_col,
+                                 vte::grid::row_t end_row,
+                                 vte::grid::column_t end_col,
+                                 bool backward);
+        bool search_select_stream_match(VteStream *text,
+                                        vte::grid::row_t start_row,
+                                        vte::grid::row_t end_row,
+                                        gsize so,
+                                        gsize eo,
+                                        bool backward);
+        bool search_frozen_rows(VteRingSearchQuery const* query,
+                                vte::grid::row_t start_row,
+                                vte::grid::row_t end_row,
+                                bool backward);
+        bool search_rows_range(pcre2_match_context_8 *match_context,
+                               pcre2_match_data_8 *match_data,
+                               VteRingSearchQuery const* query,
+                               vte::grid::row_t start_row,
+                               vte::grid::row_t end_row,
+                               bool backward);
+        vte::grid::row_t search_split_row(vte::grid::row_t start_row,
+                                          vte::grid::row_t end_row);
+        void search_get_last_rows(vte::grid::row_t *last_start_row,
+                                  vte::grid::row_t *last_end_row);
+        void search_select_none(bool backward);
         bool search_find(bool backward);
+        void search_find_async(bool backward,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data);
+        bool search_find_finish(GAsyncResult *result,
+                                guint *n_matches,
+                                GError **error);
         bool search_set_wrap_around(bool wrap);
+        bool search_set_highlight_all(bool setting);
+        void search_highlight_clear();
+        struct vte_search_highlight_entry *search_highlight_lookup(vte::grid::row_t row,
+                                                                   vte::grid::row_t min_row,
+                                                                   vte::grid::row_t max_row);
+        void search_count_set(int count);
+        void search_count_reset();
+        void search_count_queue_update();
+        void search_count_update();
+        void search_count_finish(GAsyncResult *result);
 
         void set_size(long columns,
                       long rows);
@@ -1116,15 +1267,32 @@ public:
         bool set_pty(VtePty *pty);
         bool set_rewrap_on_resize(bool rewrap);
         bool set_scrollback_lines(long lines);
+        bool set_scrollback_bytes(gsize bytes);
+        void update_scrollback_usage();
         bool set_scroll_on_keystroke(bool scroll);
         bool set_scroll_on_output(bool scroll);
         bool set_sixel_enabled(gboolean enabled);
+        bool set_threaded_rendering(bool setting);
         bool set_word_char_exceptions(char const* exceptions);
 
+        void get_palette_rgb(guint32 *palette) const;
         bool write_contents_sync (GOutputStream *stream,
                                   VteWriteFlags flags,
                                   GCancellable *cancellable,
                                   GError **error);
+        void write_contents_async(GOutputStream *stream,
+                                  VteWriteFlags flags,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data);
+        bool write_contents_finish(GAsyncResult *result,
+                                   GError **error);
+        bool save_scrollback(GFile *file,
+                             GCancellable *cancellable,
+                             GError **error);
+        bool restore_scrollback(GFile *file,
+                                GCancellable *cancellable,
+                                GError **error);
 
         /* Sequence handlers and their helper functions */
         void handle_sequence(char const* match,
@@ -24,6 +24,8 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "vtemacros.h"
 #include "vteenums.h"
 #include "vteregex.h"
@@ -35,6 +37,8 @@ struct _VteRegex {
         volatile int ref_count;
         VteRegexPurpose purpose;
         pcre2_code_8 *code;
+        char *literal;  /* text every match contains, or nullptr */
+        gsize literal_length;
 };
 
 #define DEFAULT_COMPILE_OPTIONS (PCRE2_UTF)
@@ -80,6 +84,8 @@ regex_new(pcre2_code_8 *code,
         regex->ref_count = 1;
         regex->purpose = purpose;
         regex->code = code;
+        regex->literal = nullptr;
+        regex->literal_length = 0;
 
         return regex;
 }
@@ -88,9 +94,135 @@ static void
 regex_free(VteRegex *regex)
 {
         pcre2_code_free_8(regex->code);
+        g_free(regex->literal);
         g_slice_free(VteRegex, regex);
 }
 
+#define LITERAL_LENGTH_MAX (256)
+
+/* Whether @pattern has a '|' outside of any group, so that a match needn't contain its prefix */
+static bool
+pattern_has_toplevel_alternative(const char *pattern,
+                                 gsize pattern_length)
+{
+        int depth = 0;
+
+        for (gsize i = 0; i < pattern_length; i++) {
+                switch (pattern[i]) {
+                case '\\':
+                        i++;
+                        break;
+                case '[':
+                        /* Skip the character class; a ']' right at its start is literal */
+                        i++;
+                        if (i < pattern_length && pattern[i] == '^')
+                                i++;
+                        if (i < pattern_length && pattern[i] == ']')
+                                i++;
+                        while (i < pattern_length && pattern[i] != ']') {
+                                if (pattern[i] == '\\')
+                                        i++;
+                                i++;
+                        }
+                        break;
+                case '(':
+                        depth++;
+                        break;
+                case ')':
+                        depth--;
+                        break;
+                case '|':
+                        if (depth <= 0)
+                                return true;
+                        break;
+                default:
+                        break;
+                }
+        }
+
+        return false;
+}
+
+/*
+ * regex_find_literal:
+ *
+ * Finds the literal text @pattern starts with, which every match has to
+ * contain. This is only used to rule out text quickly, so whenever in
+ * doubt, it returns less (or nothing).
+ *
+ * Returns: (transfer full): the literal, or %nullptr
+ */
+static char *
+regex_find_literal(const char *pattern,
+                   gsize pattern_length,
+                   guint32 flags,
+                   gsize *length)
+{
+        static char const metachars[] = "\\^$.[|()?*+{";
+        GString *literal;
+        gsize i = 0;
+
+        *length = 0;
+
+        if (flags & PCRE2_EXTENDED)
+                return nullptr;
+        if (pattern_has_toplevel_alternative(pattern, pattern_length))
+                return nullptr;
+
+        literal = g_string_new(nullptr);
+        if (pattern_length > 0 && pattern[0] == '^')
+                i++;
+        while (i < pattern_length && literal->len < LITERAL_LENGTH_MAX) {
+                gsize char_start = literal->len;
+                char c = pattern[i];
+
+                if (c == '\\') {
+                        /* Only escaped punctuation is literal */
+                        if (i + 1 >= pattern_length ||
+                            g_ascii_isalnum(pattern[i + 1]) ||
+                            (guchar)pattern[i + 1] >= 0x80)
+                                break;
+                        g_string_append_c(literal, pattern[i + 1]);
+                        i += 2;
+                } else if (c == '\0' || memchr(metachars, c, sizeof(metachars) - 1) != nullptr) {
+                        break;
+                } else {
+                        gsize n = g_utf8_skip[(guchar)c];
+                        if (i + n > pattern_length)
+                                break;
+                        g_string_append_len(literal, pattern + i, n);
+                        i += n;
+                }
+
+                /* A quantifier makes the last character optional, or repeats it */
+                if (i < pattern_length && memchr("?*{", pattern[i], 3) != nullptr) {
+                        g_string_truncate(literal, char_start);
+                        break;
+                }
+                if (i < pattern_length && pattern[i] == '+')
+                        break;
+        }
+
+        if (flags & PCRE2_CASELESS) {
+                /* Caseless matching of these goes beyond ASCII case folding
+                 * (e.g. U+212A KELVIN SIGN matches 'k'), so stop at them. */
+                for (i = 0; i < literal->len; i++) {
+                        guchar c = literal->str[i];
+                        if (c >= 0x80 || c == 'k' || c == 'K' || c == 's' || c == 'S')
+                                break;
+                }
+                g_string_truncate(literal, i);
+        }
+
+        if (literal->len < 3) {
+                g_string_free(literal, TRUE);
+                return nullptr;
+        }
+
+        *length = literal->len;
+        return g_string_free(literal, FALSE);
+}
+
 static gboolean
 set_gerror_from_pcre_error(int errcode,
                            GError **error)
@@ -188,7 +320,13 @@ vte_regex_new(VteRegexPurpose purpose,
                 return NULL;
         }
 
-        return regex_new(code, purpose);
+        auto regex = regex_new(code, purpose);
+        regex->literal = regex_find_literal(pattern,
+                                            pattern_length >= 0 ? pattern_length : strlen(pattern),
+                                            flags,
+                                            &regex->literal_length);
+
+        return regex;
 }
 
 VteRegex *
@@ -409,6 +547,23 @@ _vte_regex_get_jited(VteRegex *regex)
         return r == 0 && s != 0;
 }
 
+/*
+ * _vte_regex_get_literal:
+ * @regex: a #VteRegex
+ * @length: (out): the length of the literal in bytes
+ *
+ * Returns: (transfer none): text that every match of @regex contains, or %nullptr if unknown
+ */
+const char *
+_vte_regex_get_literal(VteRegex *regex,
+                       gsize *length)
+{
+        g_return_val_if_fail(regex != nullptr, nullptr);
+
+        *length = regex->literal_length;
+        return regex->literal;
+}
+
 /*
  * _vte_regex_get_compile_flags:
  *
@@ -29,6 +29,9 @@ gboolean _vte_regex_get_jited(VteRegex *regex);
 
 guint32 _vte_regex_get_compile_flags (VteRegex *regex);
 
+const char *_vte_regex_get_literal (VteRegex *regex,
+                                    gsize *length);
+
 const pcre2_code_8 *_vte_regex_get_pcre (VteRegex *regex);
 
 /* GRegex translation */
@@ -25,16 +25,17 @@
 
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 /*
  * VteCells: A row's cell array
  */
 
-typedef struct _VteCells VteCells;
-struct _VteCells {
-	guint32 alloc_len;
-	VteCell cells[1];
-};
+#define VTE_CELLS_HEADER_SIZE		G_STRUCT_OFFSET (VteCells, cells)
+#define VTE_CELLS_SLAB_SIZE		(64 * 1024)
 
 static inline VteCells *
 _vte_cells_for_cell_array (VteCell *cells)
@@ -42,26 +43,186 @@ _vte_cells_for_cell_array (VteCell *cells)
 	if (G_UNLIKELY (!cells))
 		return NULL;
 
-	return (VteCells *) (((guchar *) cells) - G_STRUCT_OFFSET (VteCells, cells));
+	return (VteCells *) (((guchar *) cells) - VTE_CELLS_HEADER_SIZE);
+}
+
+static inline guint
+_vte_cells_size_class (guint32 len)
+{
+	return g_bit_storage (MAX (len, 80)) - VTE_CELLS_POOL_MIN_BITS;
+}
+
+static inline guint32
+_vte_cells_class_alloc_len (guint size_class)
+{
+	return (1 << (size_class + VTE_CELLS_POOL_MIN_BITS)) - 1;
+}
+
+/* Keep the blocks carved from a slab aligned for the header. */
+static inline gsize
+_vte_cells_class_block_size (guint size_class)
+{
+	gsize size = VTE_CELLS_HEADER_SIZE + _vte_cells_class_alloc_len (size_class) * sizeof (VteCell);
+	return (size + sizeof (gpointer) - 1) & ~(sizeof (gpointer) - 1);
+}
+
+/* Only classes that fit a few times in a slab are carved from slabs. */
+static inline gboolean
+_vte_cells_class_uses_slabs (guint size_class)
+{
+	return _vte_cells_class_block_size (size_class) * 4 <= VTE_CELLS_SLAB_SIZE;
+}
+
+static void
+_vte_cells_pool_add_slab (VteCellsPool *pool, guint size_class)
+{
+	gsize block_size = _vte_cells_class_block_size (size_class);
+	gsize i, n = VTE_CELLS_SLAB_SIZE / block_size;
+	guchar *slab = (guchar *) g_malloc (VTE_CELLS_SLAB_SIZE);
+
+	_vte_debug_print(VTE_DEBUG_RING, "Adding slab of %" G_GSIZE_FORMAT " cell arrays of %d cells\n",
+			 n, _vte_cells_class_alloc_len (size_class));
+
+	g_ptr_array_add (pool->slabs, slab);
+	pool->stats.slab_bytes += VTE_CELLS_SLAB_SIZE;
+	pool->stats.n_slabs++;
+
+	for (i = n; i > 0; i--) {
+		VteCells *cells = (VteCells *) (slab + (i - 1) * block_size);
+		cells->alloc_len = _vte_cells_class_alloc_len (size_class);
+		cells->size_class = size_class;
+		cells->standalone = 0;
+		cells->next_free = pool->free_lists[size_class];
+		pool->free_lists[size_class] = cells;
+	}
 }
 
 static VteCells *
-_vte_cells_realloc (VteCells *cells, guint32 len)
+_vte_cells_pool_alloc (VteCellsPool *pool, guint32 len)
+{
+	guint size_class = _vte_cells_size_class (len);
+	VteCells *cells;
+
+	g_assert (size_class < VTE_CELLS_POOL_N_CLASSES);
+
+	pool->stats.n_allocs++;
+
+	if (pool->free_lists[size_class] != NULL) {
+		pool->stats.n_reused++;
+	} else if (_vte_cells_class_uses_slabs (size_class)) {
+		_vte_cells_pool_add_slab (pool, size_class);
+	} else {
+		cells = (VteCells *) g_malloc (_vte_cells_class_block_size (size_class));
+		cells->alloc_len = _vte_cells_class_alloc_len (size_class);
+		cells->size_class = size_class;
+		cells->standalone = 1;
+		cells->next_free = NULL;
+		pool->free_lists[size_class] = cells;
+		pool->stats.standalone_bytes += _vte_cells_class_block_size (size_class);
+	}
+
+	cells = pool->free_lists[size_class];
+	pool->free_lists[size_class] = cells->next_free;
+	cells->pool = pool;
+	pool->stats.in_use_bytes += _vte_cells_class_block_size (size_class);
+
+	return cells;
+}
+
+static void
+_vte_cells_pool_release (VteCellsPool *pool, VteCells *cells)
+{
+	pool->stats.in_use_bytes -= _vte_cells_class_block_size (cells->size_class);
+	cells->next_free = pool->free_lists[cells->size_class];
+	pool->free_lists[cells->size_class] = cells;
+}
+
+void
+_vte_cells_pool_init (VteCellsPool *pool)
 {
+	memset (pool, 0, sizeof (*pool));
+	pool->slabs = g_ptr_array_new_with_free_func (g_free);
+	pool->empty.pool = pool;
+	pool->empty.alloc_len = 0;
+}
+
+/* Free the arrays on the free lists that aren't part of a slab. */
+void
+_vte_cells_pool_trim (VteCellsPool *pool)
+{
+	guint i;
+
+	for (i = 0; i < VTE_CELLS_POOL_N_CLASSES; i++) {
+		VteCells **link = &pool->free_lists[i];
+
+		while (*link != NULL) {
+			VteCells *cells = *link;
+
+			if (!cells->standalone) {
+				link = &cells->next_free;
+				continue;
+			}
+
+			*link = cells->next_free;
+			pool->stats.standalone_bytes -= _vte_cells_class_block_size (i);
+			g_free (cells);
+		}
+	}
+}
+
+/* All the rows using the pool have to be finalized before the pool. */
+void
+_vte_cells_pool_fini (VteCellsPool *pool)
+{
+	_vte_debug_print(VTE_DEBUG_RING,
+			 "Cell pool: %" G_GSIZE_FORMAT " slabs (%" G_GSIZE_FORMAT " bytes), "
+			 "%" G_GSIZE_FORMAT " standalone bytes, "
+			 "%" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " allocations reused\n",
+			 pool->stats.n_slabs, pool->stats.slab_bytes,
+			 pool->stats.standalone_bytes,
+			 pool->stats.n_reused, pool->stats.n_allocs);
+
+	g_warn_if_fail (pool->stats.in_use_bytes == 0);
+
+	_vte_cells_pool_trim (pool);
+	g_ptr_array_free (pool->slabs, TRUE);
+	pool->slabs = NULL;
+}
+
+static VteCells *
+_vte_cells_realloc (VteCells *cells, guint32 len, guint32 copy_len)
+{
+	VteCellsPool *pool = cells ? cells->pool : NULL;
+	VteCells *new_cells;
 	guint32 alloc_len = (1 << g_bit_storage (MAX (len, 80))) - 1;
 
 	_vte_debug_print(VTE_DEBUG_RING, "Enlarging cell array of %d cells to %d cells\n", cells ? cells->alloc_len : 0, alloc_len);
-	cells = (VteCells *)g_realloc (cells, G_STRUCT_OFFSET (VteCells, cells) + alloc_len * sizeof (cells->cells[0]));
-	cells->alloc_len = alloc_len;
 
-	return cells;
+	if (pool == NULL) {
+		cells = (VteCells *)g_realloc (cells, VTE_CELLS_HEADER_SIZE + alloc_len * sizeof (cells->cells[0]));
+		cells->pool = NULL;
+		cells->alloc_len = alloc_len;
+		return cells;
+	}
+
+	new_cells = _vte_cells_pool_alloc (pool, len);
+	if (copy_len)
+		memcpy (new_cells->cells, cells->cells, copy_len * sizeof (cells->cells[0]));
+	if (cells != &pool->empty)
+		_vte_cells_pool_release (pool, cells);
+
+	return new_cells;
 }
 
 static void
 _vte_cells_free (VteCells *cells)
 {
 	_vte_debug_print(VTE_DEBUG_RING, "Freeing cell array of %d cells\n", cells->alloc_len);
-	g_free (cells);
+
+	if (cells->pool == NULL)
+		g_free (cells);
+	else if (cells != &cells->pool->empty)
+		_vte_cells_pool_release (cells->pool, cells);
 }
 
 
@@ -75,6 +236,15 @@ _vte_row_data_init (VteRowData *row)
 	memset (row, 0, sizeof (*row));
 }
 
+/* Make the row take its cell arrays from @pool from now on. */
+void
+_vte_row_data_set_pool (VteRowData *row, VteCellsPool *pool)
+{
+	_vte_row_data_fini (row);
+	row->cells = pool->empty.cells;
+	row->len = 0;
+}
+
 void
 _vte_row_data_clear (VteRowData *row)
 {
@@ -101,7 +271,7 @@ _vte_row_data_ensure (VteRowData *row, gulong len)
 	if (G_UNLIKELY (len >= 0xFFFF))
 		return FALSE;
 
-	row->cells = _vte_cells_realloc (cells, len)->cells;
+	row->cells = _vte_cells_realloc (cells, len, row->len)->cells;
 
 	return TRUE;
 }
@@ -162,3 +332,556 @@ void _vte_row_data_shrink (VteRowData *row, gulong max_len)
 		row->len = max_len;
 }
 
+
+
+/*
+ * VteCellAttrTable: Interned cell attributes
+ */
+
+typedef struct _VteCellAttrTableEntry {
+	VteCellAttr attr;
+	guint32 id;
+	guint32 ref_count;
+} VteCellAttrTableEntry;
+
+/* Only the common bytes and the hyperlink idx matter, not the padding. */
+static guint
+_vte_cell_attr_table_entry_hash (gconstpointer key)
+{
+	const VteCellAttrTableEntry *entry = (const VteCellAttrTableEntry *) key;
+	guint64 common;
+
+	_attrcpy (&common, (void *) &entry->attr);
+	return (guint) (common ^ (common >> 32)) * 31 + entry->attr.hyperlink_idx;
+}
+
+static gboolean
+_vte_cell_attr_table_entry_equal (gconstpointer a, gconstpointer b)
+{
+	const VteCellAttrTableEntry *entry_a = (const VteCellAttrTableEntry *) a;
+	const VteCellAttrTableEntry *entry_b = (const VteCellAttrTableEntry *) b;
+
+	return memcmp (&entry_a->attr, &entry_b->attr, VTE_CELL_ATTR_COMMON_BYTES) == 0 &&
+	       entry_a->attr.hyperlink_idx == entry_b->attr.hyperlink_idx;
+}
+
+void
+_vte_cell_attr_table_init (VteCellAttrTable *table)
+{
+	table->entries = g_ptr_array_new ();
+	table->ids = g_hash_table_new_full (_vte_cell_attr_table_entry_hash,
+					    _vte_cell_attr_table_entry_equal,
+					    NULL, g_free);
+	table->free_ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+}
+
+void
+_vte_cell_attr_table_fini (VteCellAttrTable *table)
+{
+	g_hash_table_destroy (table->ids);
+	g_ptr_array_free (table->entries, TRUE);
+	g_array_free (table->free_ids, TRUE);
+}
+
+/* Returns the id of @attr, adding @n_refs references to it. */
+guint32
+_vte_cell_attr_table_intern (VteCellAttrTable *table, const VteCellAttr *attr, guint32 n_refs)
+{
+	VteCellAttrTableEntry key, *entry;
+
+	key.attr = *attr;
+	entry = (VteCellAttrTableEntry *) g_hash_table_lookup (table->ids, &key);
+	if (G_LIKELY (entry != NULL)) {
+		entry->ref_count += n_refs;
+		return entry->id;
+	}
+
+	entry = g_new (VteCellAttrTableEntry, 1);
+	entry->attr = *attr;
+	entry->ref_count = n_refs;
+	if (table->free_ids->len > 0) {
+		entry->id = g_array_index (table->free_ids, guint32, table->free_ids->len - 1);
+		g_array_set_size (table->free_ids, table->free_ids->len - 1);
+		g_ptr_array_index (table->entries, entry->id) = entry;
+	} else {
+		entry->id = table->entries->len;
+		g_ptr_array_add (table->entries, entry);
+	}
+	g_hash_table_add (table->ids, entry);
+
+	_vte_debug_print(VTE_DEBUG_RING, "Interned attribute %u, %u in use\n",
+			 entry->id, g_hash_table_size (table->ids));
+
+	return entry->id;
+}
+
+void
+_vte_cell_attr_table_unref (VteCellAttrTable *table, guint32 id, guint32 n_refs)
+{
+	VteCellAttrTableEntry *entry = (VteCellAttrTableEntry *) g_ptr_array_index (table->entries, id);
+
+	g_assert (entry != NULL && entry->ref_count >= n_refs);
+
+	entry->ref_count -= n_refs;
+	if (entry->ref_count > 0)
+		return;
+
+	g_ptr_array_index (table->entries, id) = NULL;
+	g_array_append_val (table->free_ids, id);
+	g_hash_table_remove (table->ids, entry);
+}
+
+const VteCellAttr *
+_vte_cell_attr_table_lookup (const VteCellAttrTable *table, guint32 id)
+{
+	return &((const VteCellAttrTableEntry *) g_ptr_array_index (table->entries, id))->attr;
+}
+
+/* The number of distinct attributes in use. */
+guint
+_vte_cell_attr_table_size (const VteCellAttrTable *table)
+{
+	return g_hash_table_size (table->ids);
+}
+
+
+/*
+ * VteCompactRowData: A row stored as VteCompactCells
+ */
+
+void
+_vte_compact_row_data_init (VteCompactRowData *row)
+{
+	memset (row, 0, sizeof (*row));
+}
+
+/* Drop the row's references to its attributes, one unref per run of equal ids. */
+void
+_vte_compact_row_data_clear (VteCompactRowData *row, VteCellAttrTable *table)
+{
+	gulong i, run_start;
+
+	for (i = 1, run_start = 0; i <= row->len; i++) {
+		if (i < row->len && row->cells[i].attr_id == row->cells[run_start].attr_id)
+			continue;
+		_vte_cell_attr_table_unref (table, row->cells[run_start].attr_id, i - run_start);
+		run_start = i;
+	}
+
+	row->len = 0;
+	row->attr.soft_wrapped = 0;
+}
+
+/* Make the row take its cells from @pool from now on, as many VteCells
+ * as its compact cells fit in. */
+void
+_vte_compact_row_data_set_pool (VteCompactRowData *row, VteCellsPool *pool)
+{
+	_vte_compact_row_data_init (row);
+	row->cells = (VteCompactCell *) pool->empty.cells;
+}
+
+void
+_vte_compact_row_data_fini (VteCompactRowData *row, VteCellAttrTable *table)
+{
+	_vte_compact_row_data_clear (row, table);
+	if (row->cells)
+		_vte_cells_free (_vte_cells_for_cell_array ((VteCell *) row->cells));
+	_vte_compact_row_data_init (row);
+}
+
+/* Store @row into @compact, interning one reference per cell. */
+void
+_vte_row_data_compact (const VteRowData *row, VteCompactRowData *compact, VteCellAttrTable *table)
+{
+	gulong i, run_start;
+
+	_vte_compact_row_data_clear (compact, table);
+
+	if (compact->alloc_len < row->len) {
+		VteCells *cells = _vte_cells_realloc (_vte_cells_for_cell_array ((VteCell *) compact->cells),
+						      (row->len * sizeof (VteCompactCell) + sizeof (VteCell) - 1) / sizeof (VteCell),
+						      0);
+		compact->cells = (VteCompactCell *) cells->cells;
+		compact->alloc_len = MIN (cells->alloc_len * sizeof (VteCell) / sizeof (VteCompactCell), 0xFFFF);
+	}
+
+	for (i = 0; i < row->len; i++)
+		compact->cells[i].c = row->cells[i].c;
+
+	/* Rows mostly consist of long runs of equal attributes, intern each run once. */
+	for (i = 1, run_start = 0; i <= row->len; i++) {
+		guint32 id;
+		gulong j;
+
+		if (i < row->len &&
+		    memcmp (&row->cells[i].attr, &row->cells[run_start].attr, VTE_CELL_ATTR_COMMON_BYTES) == 0 &&
+		    row->cells[i].attr.hyperlink_idx == row->cells[run_start].attr.hyperlink_idx)
+			continue;
+
+		id = _vte_cell_attr_table_intern (table, &row->cells[run_start].attr, i - run_start);
+		for (j = run_start; j < i; j++)
+			compact->cells[j].attr_id = id;
+		run_start = i;
+	}
+
+	compact->len = row->len;
+	compact->attr = row->attr;
+}
+
+/* Expand @compact into @row, replacing its contents. */
+void
+_vte_row_data_expand (VteRowData *row, const VteCompactRowData *compact, const VteCellAttrTable *table)
+{
+	const VteCellAttr *attr = NULL;
+	guint32 attr_id = 0;
+	gulong i;
+
+	_vte_row_data_clear (row);
+
+	if (G_UNLIKELY (!_vte_row_data_ensure (row, compact->len)))
+		return;
+
+	for (i = 0; i < compact->len; i++) {
+		if (attr == NULL || compact->cells[i].attr_id != attr_id) {
+			attr_id = compact->cells[i].attr_id;
+			attr = _vte_cell_attr_table_lookup (table, attr_id);
+		}
+		row->cells[i].c = compact->cells[i].c;
+		row->cells[i].attr = *attr;
+	}
+
+	row->len = compact->len;
+	row->attr = compact->attr;
+}
+
+
+/*
+ * Scanning kernels
+ *
+ * These look at the packed cells as two arrays: the attributes, each of which
+ * is exactly one SSE2 register, and the characters, gathered four at a time.
+ * Splitting the row into separate arrays first would cost a pass of its own,
+ * so they work on the cells in place.  Each has an SSE2 variant, and a plain
+ * C one which the SSE2 variants also use for the remaining cells.
+ */
+
+#ifdef __SSE2__
+G_STATIC_ASSERT (sizeof (VteCellAttr) == sizeof (__m128i));
+
+static inline __m128i
+_vte_cells_load_attr (const VteCell *cell)
+{
+	return _mm_loadu_si128 ((const __m128i *) &cell->attr);
+}
+
+static inline __m128i
+_vte_cells_load_chars (const VteCell *cells)
+{
+	return _mm_set_epi32 (cells[3].c, cells[2].c, cells[1].c, cells[0].c);
+}
+#endif
+
+/* Returns the index of the first cell after @start whose attributes differ
+ * from those at @start, or @len. */
+gulong
+_vte_cells_attr_run_end (const VteCell *cells, gulong start, gulong len)
+{
+	gulong i = start + 1;
+
+#ifdef __SSE2__
+	__m128i first = _vte_cells_load_attr (&cells[start]);
+
+	for (; i + 2 <= len; i += 2) {
+		__m128i eq0 = _mm_cmpeq_epi8 (first, _vte_cells_load_attr (&cells[i]));
+		__m128i eq1 = _mm_cmpeq_epi8 (first, _vte_cells_load_attr (&cells[i + 1]));
+		if (_mm_movemask_epi8 (_mm_and_si128 (eq0, eq1)) != 0xFFFF)
+			break;
+	}
+#endif
+
+	for (; i < len; i++)
+		if (memcmp (&cells[i].attr, &cells[start].attr, sizeof (VteCellAttr)) != 0)
+			break;
+
+	return i;
+}
+
+/* Whether all the characters are in the 32..126 range. */
+gboolean
+_vte_cells_are_printable_ascii (const VteCell *cells, gulong len)
+{
+	gulong i = 0;
+
+#ifdef __SSE2__
+	/* There's no unsigned 32-bit comparison, flip the sign bit of (c - 32) instead. */
+	const __m128i offset = _mm_set1_epi32 (32);
+	const __m128i bias = _mm_set1_epi32 (G_MININT32);
+	const __m128i last = _mm_set1_epi32 (G_MININT32 + 126 - 32);
+	__m128i outside = _mm_setzero_si128 ();
+
+	for (; i + 4 <= len; i += 4) {
+		__m128i c = _vte_cells_load_chars (&cells[i]);
+		c = _mm_xor_si128 (_mm_sub_epi32 (c, offset), bias);
+		outside = _mm_or_si128 (outside, _mm_cmpgt_epi32 (c, last));
+	}
+	if (_mm_movemask_epi8 (outside) != 0)
+		return FALSE;
+#endif
+
+	for (; i < len; i++)
+		if (cells[i].c < 32 || cells[i].c > 126)
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Returns the length without the trailing empty (zero) characters. */
+gulong
+_vte_cells_nonempty_length (const VteCell *cells, gulong len)
+{
+	gulong i = len;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128 ();
+
+	for (; i >= 4; i -= 4) {
+		__m128i c = _vte_cells_load_chars (&cells[i - 4]);
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (c, zero)) != 0xFFFF)
+			break;
+	}
+#endif
+
+	for (; i > 0; i--)
+		if (cells[i - 1].c != 0)
+			break;
+
+	return i;
+}
+
+/* Narrows characters that are known to be ASCII to bytes. */
+void
+_vte_cells_to_ascii (const VteCell *cells, gulong len, char *out)
+{
+	gulong i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i w0 = _mm_packs_epi32 (_vte_cells_load_chars (&cells[i]),
+					      _vte_cells_load_chars (&cells[i + 4]));
+		__m128i w1 = _mm_packs_epi32 (_vte_cells_load_chars (&cells[i + 8]),
+					      _vte_cells_load_chars (&cells[i + 12]));
+		_mm_storeu_si128 ((__m128i *) &out[i], _mm_packus_epi16 (w0, w1));
+	}
+#endif
+
+	for (; i < len; i++)
+		out[i] = (char) cells[i].c;
+}
+
+#ifdef MAIN
+
+#include <glib.h>
+
+static void
+fill_row (VteRowData *row, gulong len, gboolean ascii)
+{
+	VteCell cell = basic_cell;
+	gulong i;
+
+	_vte_row_data_clear (row);
+	for (i = 0; i < len; i++) {
+		cell.c = ascii ? 'a' + i % 26 : 0x3b1 + i % 24;
+		/* Change the attributes every 16 cells, like a colorful prompt would */
+		cell.attr.fore = (i / 16) % 8;
+		cell.attr.bold = (i / 32) % 2;
+		_vte_row_data_append (row, &cell);
+	}
+}
+
+static void
+test_row_kernels (void)
+{
+	VteRowData row;
+	VteCell cell = basic_cell;
+	char text[400];
+	gulong i, run_end;
+
+	_vte_row_data_init (&row);
+
+	fill_row (&row, 320, TRUE);
+	g_assert_true (_vte_cells_are_printable_ascii (row.cells, row.len));
+
+	for (i = 0; i < row.len; i = run_end) {
+		run_end = _vte_cells_attr_run_end (row.cells, i, row.len);
+		g_assert_cmpuint (run_end, ==, MIN (i + 16, row.len));
+	}
+
+	_vte_cells_to_ascii (row.cells, row.len, text);
+	for (i = 0; i < row.len; i++)
+		g_assert_cmpint (text[i], ==, 'a' + i % 26);
+
+	/* Every position of a single non-ASCII char has to be found */
+	for (i = 0; i < row.len; i++) {
+		vteunistr c = row.cells[i].c;
+
+		row.cells[i].c = i % 2 ? 127 : 31;
+		g_assert_false (_vte_cells_are_printable_ascii (row.cells, row.len));
+		row.cells[i].c = 0x80000000 + i;
+		g_assert_false (_vte_cells_are_printable_ascii (row.cells, row.len));
+		row.cells[i].c = c;
+	}
+
+	/* Trailing empty cells */
+	g_assert_cmpuint (_vte_cells_nonempty_length (row.cells, row.len), ==, 320);
+	cell.c = 0;
+	for (i = 0; i < 37; i++)
+		_vte_row_data_append (&row, &cell);
+	g_assert_cmpuint (_vte_cells_nonempty_length (row.cells, row.len), ==, 320);
+	g_assert_false (_vte_cells_are_printable_ascii (row.cells, row.len));
+	g_assert_cmpuint (_vte_cells_nonempty_length (row.cells, 3), ==, 3);
+	g_assert_cmpuint (_vte_cells_nonempty_length (&row.cells[320], 37), ==, 0);
+
+	_vte_row_data_fini (&row);
+}
+
+static void
+test_row_cells_pool (void)
+{
+	VteCellsPool pool;
+	VteRowData rows[4];
+	VteCell cell = basic_cell;
+	gulong i, j;
+
+	_vte_cells_pool_init (&pool);
+	for (i = 0; i < G_N_ELEMENTS (rows); i++) {
+		_vte_row_data_init (&rows[i]);
+		_vte_row_data_set_pool (&rows[i], &pool);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (rows); i++)
+		for (j = 0; j < 100; j++)
+			_vte_row_data_append (&rows[i], &cell);
+	g_assert_cmpuint (pool.stats.n_allocs, ==, G_N_ELEMENTS (rows));
+	g_assert_cmpuint (pool.stats.n_slabs, ==, 1);
+
+	/* Growing a row hands its old array to the next one that needs it */
+	for (j = 0; j < 200; j++)
+		_vte_row_data_append (&rows[0], &cell);
+	_vte_row_data_fini (&rows[1]);
+	_vte_row_data_set_pool (&rows[1], &pool);
+	_vte_row_data_append (&rows[1], &cell);
+	g_assert_cmpuint (pool.stats.n_reused, >=, 1);
+	g_assert_cmpuint (_vte_row_data_length (&rows[0]), ==, 300);
+	g_assert_cmpuint (_vte_row_data_length (&rows[1]), ==, 1);
+
+	for (i = 0; i < G_N_ELEMENTS (rows); i++)
+		_vte_row_data_fini (&rows[i]);
+	g_assert_cmpuint (pool.stats.in_use_bytes, ==, 0);
+	_vte_cells_pool_fini (&pool);
+}
+
+static void
+test_row_compact (void)
+{
+	VteCellAttrTable table;
+	VteCompactRowData compact;
+	VteCellsPool pool;
+	VteRowData row, expanded;
+	gulong i;
+
+	_vte_cell_attr_table_init (&table);
+	_vte_compact_row_data_init (&compact);
+	_vte_row_data_init (&row);
+	_vte_row_data_init (&expanded);
+
+	fill_row (&row, 320, FALSE);
+	row.attr.soft_wrapped = 1;
+	_vte_row_data_compact (&row, &compact, &table);
+	g_assert_cmpuint (_vte_cell_attr_table_size (&table), ==, 8);
+	_vte_row_data_expand (&expanded, &compact, &table);
+	g_assert_cmpuint (expanded.len, ==, row.len);
+	g_assert_true (expanded.attr.soft_wrapped);
+	for (i = 0; i < row.len; i++)
+		g_assert_true (memcmp (&expanded.cells[i], &row.cells[i], sizeof (VteCell)) == 0);
+
+	/* All the references go away with the row */
+	_vte_compact_row_data_fini (&compact, &table);
+	g_assert_cmpuint (_vte_cell_attr_table_size (&table), ==, 0);
+
+	/* Compact cells can come from a pool too, in fewer cells' worth */
+	_vte_cells_pool_init (&pool);
+	_vte_compact_row_data_set_pool (&compact, &pool);
+	_vte_row_data_compact (&row, &compact, &table);
+	g_assert_cmpuint (compact.alloc_len, >=, row.len);
+	g_assert_cmpuint (pool.stats.in_use_bytes, <, row.len * sizeof (VteCell));
+	_vte_compact_row_data_fini (&compact, &table);
+	g_assert_cmpuint (pool.stats.in_use_bytes, ==, 0);
+	_vte_cells_pool_fini (&pool);
+
+	_vte_row_data_fini (&expanded);
+	_vte_row_data_fini (&row);
+	_vte_cell_attr_table_fini (&table);
+}
+
+/* Compare the kernels with the per-cell loops they replace, on a wide row. */
+static void
+test_row_kernels_perf (void)
+{
+	VteRowData row;
+	char text[400];
+	gulong i, j, n = 0;
+	const gulong iterations = 200000;
+	gboolean is_ascii;
+	gdouble loop_time, kernel_time;
+
+	if (!g_test_perf ())
+		return;
+
+	_vte_row_data_init (&row);
+	fill_row (&row, 320, TRUE);
+
+	g_test_timer_start ();
+	for (i = 0; i < iterations; i++) {
+		is_ascii = TRUE;
+		for (j = 0; j < row.len; j++) {
+			if (row.cells[j].c < 32 || row.cells[j].c > 126)
+				is_ascii = FALSE;
+			if (j > 0 && memcmp (&row.cells[j].attr, &row.cells[j - 1].attr, sizeof (VteCellAttr)) != 0)
+				n++;
+			text[j] = row.cells[j].c;
+		}
+		g_assert_true (is_ascii);
+	}
+	loop_time = g_test_timer_elapsed ();
+
+	g_test_timer_start ();
+	for (i = 0; i < iterations; i++) {
+		g_assert_true (_vte_cells_are_printable_ascii (row.cells, row.len));
+		for (j = 0; j < row.len; j = _vte_cells_attr_run_end (row.cells, j, row.len))
+			n++;
+		_vte_cells_to_ascii (row.cells, row.len, text);
+	}
+	kernel_time = g_test_timer_elapsed ();
+
+	g_test_message ("320 columns, %lu rows: per-cell loop %.3fs, kernels %.3fs (%lu)",
+			iterations, loop_time, kernel_time, n);
+	g_test_minimized_result (kernel_time, "kernels: %.3fs", kernel_time);
+
+	_vte_row_data_fini (&row);
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_test_init (&argc, &argv, nullptr);
+
+	g_test_add_func ("/vte/rowdata/kernels", test_row_kernels);
+	g_test_add_func ("/vte/rowdata/cells-pool", test_row_cells_pool);
+	g_test_add_func ("/vte/rowdata/compact", test_row_compact);
+	g_test_add_func ("/vte/rowdata/kernels-perf", test_row_kernels_perf);
+
+	return g_test_run ();
+}
+
+#endif /* MAIN */
@@ -139,6 +139,92 @@ typedef struct _VteRowAttr {
 } VteRowAttr;
 G_STATIC_ASSERT (sizeof (VteRowAttr) == 1);
 
+/*
+ * VteCellAttrTable: Interned cell attributes
+ *
+ * A screen typically uses a few dozen distinct attribute combinations, so
+ * cells can refer to them by a 32-bit id instead of carrying a full
+ * VteCellAttr each. Every id handed out by _vte_cell_attr_table_intern()
+ * holds a reference; an id is recycled once its last reference is gone.
+ */
+
+typedef struct _VteCellAttrTable {
+	GPtrArray *entries;  /* indexed by id, NULL for free ids */
+	GHashTable *ids;     /* the entries, hashed by their attributes */
+	GArray *free_ids;
+} VteCellAttrTable;
+
+void _vte_cell_attr_table_init (VteCellAttrTable *table);
+void _vte_cell_attr_table_fini (VteCellAttrTable *table);
+guint32 _vte_cell_attr_table_intern (VteCellAttrTable *table, const VteCellAttr *attr, guint32 n_refs);
+void _vte_cell_attr_table_unref (VteCellAttrTable *table, guint32 id, guint32 n_refs);
+const VteCellAttr *_vte_cell_attr_table_lookup (const VteCellAttrTable *table, guint32 id);
+guint _vte_cell_attr_table_size (const VteCellAttrTable *table);
+
+
+/*
+ * VteCompactCell: A cell with its attributes interned in a VteCellAttrTable
+ */
+
+typedef struct _VteCompactCell {
+	vteunistr c;
+	guint32 attr_id;
+} VteCompactCell;
+G_STATIC_ASSERT (sizeof (VteCompactCell) == 8);
+
+
+/*
+ * VteCells: A row's cell array, with a header in front of the cells
+ */
+
+typedef struct _VteCellsPool VteCellsPool;
+
+typedef struct _VteCells VteCells;
+struct _VteCells {
+	union {
+		VteCellsPool *pool;  /* NULL if not pooled */
+		VteCells *next_free;  /* while on a free list */
+	};
+	guint32 alloc_len;
+	guint8 size_class;
+	guint8 standalone: 1;  /* allocated on its own rather than carved from a slab */
+	VteCell cells[1];
+};
+
+
+/*
+ * VteCellsPool: Size-classed free lists and slabs for the cell arrays of a ring's rows
+ *
+ * Cell arrays come in power-of-two sized classes. Arrays of the smaller
+ * classes are carved from slabs which are only freed along with the pool;
+ * free arrays of every class are kept for reuse, so that rows cycling
+ * through the ring don't hit malloc once the pool has warmed up.
+ */
+
+#define VTE_CELLS_POOL_MIN_BITS		7   /* Smallest class holds 2^7-1 cells. */
+#define VTE_CELLS_POOL_N_CLASSES	10  /* Up to 2^16-1 cells, see _vte_row_data_ensure(). */
+
+typedef struct _VteCellsPoolStats {
+	gsize slab_bytes;        /* memory held in slabs */
+	gsize standalone_bytes;  /* memory held in arrays allocated on their own */
+	gsize in_use_bytes;      /* memory of the arrays handed out to rows */
+	gsize n_slabs;
+	gsize n_allocs;          /* arrays handed out */
+	gsize n_reused;          /* arrays handed out from a free list */
+} VteCellsPoolStats;
+
+struct _VteCellsPool {
+	VteCells *free_lists[VTE_CELLS_POOL_N_CLASSES];
+	GPtrArray *slabs;
+	VteCellsPoolStats stats;
+	VteCells empty;  /* Zero-length array that rows start out with. */
+};
+
+void _vte_cells_pool_init (VteCellsPool *pool);
+void _vte_cells_pool_fini (VteCellsPool *pool);
+void _vte_cells_pool_trim (VteCellsPool *pool);
+
+
 /*
  * VteRowData: A single row's data
  */
@@ -147,9 +233,30 @@ typedef struct _VteRowData {
 	VteCell *cells;
 	guint16 len;
 	VteRowAttr attr;
+	guint8 hyperlinks_counted: 1;  /* the ring counts the hyperlink references of the cells */
 } VteRowData;
 
 
+/*
+ * VteCompactRowData: A row stored as VteCompactCells
+ *
+ * Attributes can be compared by comparing their ids, as long as both
+ * cells' ids come from the same table.
+ */
+
+typedef struct _VteCompactRowData {
+	VteCompactCell *cells;
+	guint16 len;
+	guint16 alloc_len;
+	VteRowAttr attr;
+} VteCompactRowData;
+
+void _vte_compact_row_data_init (VteCompactRowData *row);
+void _vte_compact_row_data_set_pool (VteCompactRowData *row, VteCellsPool *pool);
+void _vte_compact_row_data_clear (VteCompactRowData *row, VteCellAttrTable *table);
+void _vte_compact_row_data_fini (VteCompactRowData *row, VteCellAttrTable *table);
+
+
 #define _vte_row_data_length(__row)			((__row)->len + 0)
 
 static inline const VteCell *
@@ -170,6 +277,15 @@ _vte_row_data_get_writable (VteRowData *row, gulong col)
 	return &row->cells[col];
 }
 
+/*
+ * Whether two cells hold the same character with the same attributes.
+ */
+static inline gboolean
+_vte_cell_equal (const VteCell *a, const VteCell *b)
+{
+        return memcmp(a, b, sizeof (VteCell)) == 0;
+}
+
 /*
  * Copy the common attributes from VteCellAttr to VteStreamCellAttr or vice versa.
  */
@@ -180,6 +296,7 @@ _attrcpy (void *dst, void *src)
 }
 
 void _vte_row_data_init (VteRowData *row);
+void _vte_row_data_set_pool (VteRowData *row, VteCellsPool *pool);
 void _vte_row_data_clear (VteRowData *row);
 void _vte_row_data_fini (VteRowData *row);
 void _vte_row_data_insert (VteRowData *row, gulong col, const VteCell *cell);
@@ -187,6 +304,18 @@ void _vte_row_data_append (VteRowData *row, const VteCell *cell);
 void _vte_row_data_remove (VteRowData *row, gulong col);
 void _vte_row_data_fill (VteRowData *row, const VteCell *cell, gulong len);
 void _vte_row_data_shrink (VteRowData *row, gulong max_len);
+void _vte_row_data_compact (const VteRowData *row, VteCompactRowData *compact, VteCellAttrTable *table);
+void _vte_row_data_expand (VteRowData *row, const VteCompactRowData *compact, const VteCellAttrTable *table);
+
+
+/*
+ * Scanning kernels, looking at several cells at once where SSE2 is available
+ */
+
+gulong _vte_cells_attr_run_end (const VteCell *cells, gulong start, gulong len);
+gboolean _vte_cells_are_printable_ascii (const VteCell *cells, gulong len);
+gulong _vte_cells_nonempty_length (const VteCell *cells, gulong len);
+void _vte_cells_to_ascii (const VteCell *cells, gulong len, char *out);
 
 
 G_END_DECLS
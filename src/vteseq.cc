@@ -267,14 +267,14 @@ VteTerminalPrivate::seq_clear_current_line()
 		/* Get the data for the row which the cursor points to. */
                 rowdata = _vte_ring_index_writable(m_screen->row_data, m_screen->cursor.row);
 		g_assert(rowdata != NULL);
+		/* Repaint what changes in this row. */
+                invalidate_changed_cells(rowdata, m_screen->cursor.row,
+                                         0, m_column_count, &m_fill_defaults);
 		/* Remove it. */
 		_vte_row_data_shrink (rowdata, 0);
 		/* Add enough cells to the end of the line to fill out the row. */
                 _vte_row_data_fill (rowdata, &m_fill_defaults, m_column_count);
 		rowdata->attr.soft_wrapped = 0;
-		/* Repaint this row. */
-		invalidate_cells(0, m_column_count,
-                                 m_screen->cursor.row, 1);
 	}
 
 	/* We've modified the display.  Make a note of it. */
@@ -292,13 +292,14 @@ VteTerminalPrivate::seq_clear_above_current()
 			/* Get the data for the row we're erasing. */
                         auto rowdata = _vte_ring_index_writable(m_screen->row_data, i);
 			g_assert(rowdata != NULL);
+			/* Repaint what changes in the row. */
+                        invalidate_changed_cells(rowdata, i, 0, m_column_count,
+                                                 &m_fill_defaults);
 			/* Remove it. */
 			_vte_row_data_shrink (rowdata, 0);
 			/* Add new cells until we fill the row. */
                         _vte_row_data_fill (rowdata, &m_fill_defaults, m_column_count);
 			rowdata->attr.soft_wrapped = 0;
-			/* Repaint the row. */
-			invalidate_cells(0, m_column_count, i, 1);
 		}
 	}
 	/* We've modified the display.  Make a note of it. */
@@ -321,17 +322,7 @@ VteTerminalPrivate::seq_scroll_text(vte::grid::row_t scroll_amount)
         while (_vte_ring_next(m_screen->row_data) <= end)
                 ring_append(false);
 
-	if (scroll_amount > 0) {
-		for (auto i = 0; i < scroll_amount; i++) {
-                        ring_remove(end);
-                        ring_insert(start, true);
-		}
-	} else {
-		for (auto i = 0; i < -scroll_amount; i++) {
-                        ring_remove(start);
-                        ring_insert(end, true);
-		}
-	}
+        ring_rotate(start, end, scroll_amount);
 
 	/* Update the display. */
         scroll_region(start, end - start + 1, scroll_amount);
@@ -1086,6 +1077,9 @@ VteTerminalPrivate::seq_cb()
 	auto rowdata = ensure_row();
         /* Clean up Tab/CJK fragments. */
         cleanup_fragments(0, m_screen->cursor.col + 1);
+	/* Repaint what changes in this row. */
+        invalidate_changed_cells(rowdata, m_screen->cursor.row,
+                                 0, m_screen->cursor.col + 1, &m_color_defaults);
 	/* Clear the data up to the current column with the default
 	 * attributes.  If there is no such character cell, we need
 	 * to add one. */
@@ -1100,9 +1094,6 @@ VteTerminalPrivate::seq_cb()
                         _vte_row_data_append (rowdata, &m_color_defaults);
 		}
 	}
-	/* Repaint this row. */
-        invalidate_cells(0, m_screen->cursor.col+1,
-                         m_screen->cursor.row, 1);
 
 	/* We've modified the display.  Make a note of it. */
         m_text_deleted_flag = TRUE;
@@ -1124,6 +1115,19 @@ VteTerminalPrivate::seq_cd()
                 /* Clean up Tab/CJK fragments. */
                 if ((glong) _vte_row_data_length(rowdata) > m_screen->cursor.col)
                         cleanup_fragments(m_screen->cursor.col, _vte_row_data_length(rowdata));
+	}
+	/* Repaint what changes, before the rows get cleared. */
+        auto fill = m_fill_defaults.attr.back != VTE_DEFAULT_BG ? &m_fill_defaults : nullptr;
+        for (i = m_screen->cursor.row;
+	     i < m_screen->insert_delta + m_row_count;
+	     i++) {
+                invalidate_changed_cells(find_row_data(i), i,
+                                         i == m_screen->cursor.row ? m_screen->cursor.col : 0,
+                                         m_column_count, fill);
+	}
+        i = m_screen->cursor.row;
+	if (i < _vte_ring_next(m_screen->row_data)) {
+                rowdata = _vte_ring_index_writable(m_screen->row_data, i);
 		/* Clear everything to the right of the cursor. */
 		if (rowdata)
                         _vte_row_data_shrink(rowdata, m_screen->cursor.col);
@@ -1150,13 +1154,10 @@ VteTerminalPrivate::seq_cd()
 			rowdata = ring_append(false);
 		}
 		/* Pad out the row. */
-                if (m_fill_defaults.attr.back != VTE_DEFAULT_BG) {
-                        _vte_row_data_fill(rowdata, &m_fill_defaults, m_column_count);
+                if (fill != nullptr) {
+                        _vte_row_data_fill(rowdata, fill, m_column_count);
 		}
 		rowdata->attr.soft_wrapped = 0;
-		/* Repaint this row. */
-		invalidate_cells(0, m_column_count,
-                                 i, 1);
 	}
 
 	/* We've modified the display.  Make a note of it. */
@@ -1178,23 +1179,26 @@ VteTerminalPrivate::seq_ce()
 	/* Get the data for the row which the cursor points to. */
         auto rowdata = ensure_row();
 	g_assert(rowdata != NULL);
+        auto fill = m_fill_defaults.attr.back != VTE_DEFAULT_BG ? &m_fill_defaults : nullptr;
         if ((glong) _vte_row_data_length(rowdata) > m_screen->cursor.col) {
                 /* Clean up Tab/CJK fragments. */
                 cleanup_fragments(m_screen->cursor.col, _vte_row_data_length(rowdata));
+        }
+	/* Repaint what changes in this row. */
+        invalidate_changed_cells(rowdata, m_screen->cursor.row,
+                                 m_screen->cursor.col, m_column_count, fill);
+        if ((glong) _vte_row_data_length(rowdata) > m_screen->cursor.col) {
                 /* Remove the data at the end of the array until the current column
                  * is the end of the array. */
                 _vte_row_data_shrink(rowdata, m_screen->cursor.col);
 		/* We've modified the display.  Make a note of it. */
 		m_text_deleted_flag = TRUE;
 	}
-        if (m_fill_defaults.attr.back != VTE_DEFAULT_BG) {
+        if (fill != nullptr) {
 		/* Add enough cells to fill out the row. */
-                _vte_row_data_fill(rowdata, &m_fill_defaults, m_column_count);
+                _vte_row_data_fill(rowdata, fill, m_column_count);
 	}
 	rowdata->attr.soft_wrapped = 0;
-	/* Repaint this row. */
-	invalidate_cells(m_screen->cursor.col, m_column_count - m_screen->cursor.col,
-                         m_screen->cursor.row, 1);
 }
 
 /* Move the cursor to the given column (horizontal position), 1-based. */
@@ -1544,6 +1548,11 @@ VteTerminalPrivate::seq_erase_characters(long count)
 		g_assert(rowdata != NULL);
                 /* Clean up Tab/CJK fragments. */
                 cleanup_fragments(m_screen->cursor.col, m_screen->cursor.col + count);
+		/* Repaint what changes in this row. */
+                invalidate_changed_cells(rowdata, m_screen->cursor.row,
+                                         m_screen->cursor.col,
+                                         MIN(m_screen->cursor.col + count, m_column_count),
+                                         &m_color_defaults);
 		/* Write over the characters.  (If there aren't enough, we'll
 		 * need to create them.) */
 		for (i = 0; i < count; i++) {
@@ -1560,9 +1569,6 @@ VteTerminalPrivate::seq_erase_characters(long count)
 				}
 			}
 		}
-		/* Repaint this row. */
-                invalidate_cells(m_screen->cursor.col, count,
-                                 m_screen->cursor.row, 1);
 	}
 
 	/* We've modified the display.  Make a note of it. */
@@ -1589,7 +1595,7 @@ VteTerminalPrivate::seq_insert_blank_character()
         ensure_cursor_is_onscreen();
 
         auto save = m_screen->cursor;
-        insert_char(' ', true, true);
+        insert_char(' ', true);
         m_screen->cursor = save;
 }
 
@@ -1873,8 +1879,7 @@ VteTerminalPrivate::seq_reverse_index()
         if (m_screen->cursor.row == start) {
 		/* If we're at the top of the scrolling region, add a
 		 * line at the top to scroll the bottom off. */
-		ring_remove(end);
-		ring_insert(start, true);
+		ring_rotate(start, end, 1);
 		/* Update the display. */
 		scroll_region(start, end - start + 1, 1);
                 invalidate_cells(0, m_column_count,
@@ -2845,7 +2850,7 @@ vte_sequence_handler_insert_lines (VteTerminalPrivate *that, GValueArray *params
 void
 VteTerminalPrivate::seq_insert_lines(vte::grid::row_t param)
 {
-        vte::grid::row_t end, i;
+        vte::grid::row_t end;
 
 	/* Find the region we're messing with. */
         auto row = m_screen->cursor.row;
@@ -2861,12 +2866,9 @@ VteTerminalPrivate::seq_insert_lines(vte::grid::row_t param)
         auto limit = end - row + 1;
         param = MIN (param, limit);
 
-	for (i = 0; i < param; i++) {
-		/* Clear a line off the end of the region and add one to the
-		 * top of the region. */
-                ring_remove(end);
-                ring_insert(row, true);
-	}
+	/* Clear lines off the end of the region and add as many to the
+	 * top of the region. */
+        ring_rotate(row, end, param);
         m_screen->cursor.col = 0;
 	/* Update the display. */
         scroll_region(row, end - row + 1, param);
@@ -2896,7 +2898,7 @@ vte_sequence_handler_delete_lines (VteTerminalPrivate *that, GValueArray *params
 void
 VteTerminalPrivate::seq_delete_lines(vte::grid::row_t param)
 {
-        vte::grid::row_t end, i;
+        vte::grid::row_t end;
 
 	/* Find the region we're messing with. */
         auto row = m_screen->cursor.row;
@@ -2913,12 +2915,9 @@ VteTerminalPrivate::seq_delete_lines(vte::grid::row_t param)
         param = MIN (param, limit);
 
 	/* Clear them from below the current cursor. */
-	for (i = 0; i < param; i++) {
-		/* Insert a line at the end of the region and remove one from
-		 * the top of the region. */
-                ring_remove(row);
-                ring_insert(end, true);
-	}
+	/* Insert lines at the end of the region and remove as many from
+	 * the top of the region. */
+        ring_rotate(row, end, -param);
         m_screen->cursor.col = 0;
 	/* Update the display. */
         scroll_region(row, end - row + 1, -param);
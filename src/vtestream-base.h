@@ -41,6 +41,8 @@ typedef struct _VteStreamClass {
 	void (*advance_tail) (VteStream *stream, gsize offset);
 	gsize (*tail) (VteStream *stream);
 	gsize (*head) (VteStream *stream);
+	gsize (*disk_usage) (VteStream *stream);
+	VteStream * (*snapshot) (VteStream *stream);
 } VteStreamClass;
 
 static GType _vte_stream_get_type (void);
@@ -101,5 +103,17 @@ _vte_stream_head (VteStream *stream)
 	return VTE_STREAM_GET_CLASS (stream)->head (stream);
 }
 
+gsize
+_vte_stream_disk_usage (VteStream *stream)
+{
+	return VTE_STREAM_GET_CLASS (stream)->disk_usage (stream);
+}
+
+VteStream *
+_vte_stream_snapshot (VteStream *stream)
+{
+	return VTE_STREAM_GET_CLASS (stream)->snapshot (stream);
+}
+
 G_END_DECLS
 
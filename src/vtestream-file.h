@@ -347,6 +347,9 @@ typedef struct _VteSnake {
                 gsize fd_head;  /* FD's physical head offset. One of these four is redundant, nevermind. */
         } segment[3];           /* At most 3 segments, [0] at the tail. */
         gsize tail, head;       /* These are redundant too, for convenience. */
+        GArray *block_lens;     /* The bytes written to each block from the tail on, from [block_lens_first]. */
+        guint block_lens_first;
+        gsize disk_bytes;       /* Their sum: what the file takes up, not counting the holes. */
 } VteSnake;
 #define VTE_SNAKE_SEGMENTS(s) ((s)->state == 4 ? 2 : (s)->state)
 
@@ -372,6 +375,7 @@ _vte_snake_init (VteSnake *snake)
 {
         snake->fd = -1;
         snake->state = 1;
+        snake->block_lens = g_array_new (FALSE, FALSE, sizeof (guint32));
 }
 
 static void
@@ -380,6 +384,7 @@ _vte_snake_finalize (GObject *object)
         VteSnake *snake = (VteSnake *) object;
 
         _file_close (snake->fd);
+        g_array_free (snake->block_lens, TRUE);
 
         G_OBJECT_CLASS (_vte_snake_parent_class)->finalize(object);
 }
@@ -393,6 +398,24 @@ _vte_snake_ensure_file (VteSnake *snake)
         snake->fd = _vte_mkstemp ();
 }
 
+/* Forgets the lengths of the blocks before offset. */
+static void
+_vte_snake_drop_block_lens (VteSnake *snake, gsize offset)
+{
+        guint i, n = (offset - snake->tail) / VTE_SNAKE_BLOCKSIZE;
+
+        n = MIN (n, snake->block_lens->len - snake->block_lens_first);
+        for (i = 0; i < n; i++)
+                snake->disk_bytes -= g_array_index (snake->block_lens, guint32, snake->block_lens_first + i);
+        snake->block_lens_first += n;
+
+        /* Compact once most of the array is unused */
+        if (snake->block_lens_first * 2 > snake->block_lens->len) {
+                g_array_remove_range (snake->block_lens, 0, snake->block_lens_first);
+                snake->block_lens_first = 0;
+        }
+}
+
 static void _vte_snake_advance_tail (VteSnake *snake, gsize offset);
 static void
 _vte_snake_reset (VteSnake *snake, gsize offset)
@@ -404,6 +427,9 @@ _vte_snake_reset (VteSnake *snake, gsize offset)
 
         if (G_LIKELY (offset >= snake->head)) {
                 _file_reset (snake->fd);
+                g_array_set_size (snake->block_lens, 0);
+                snake->block_lens_first = 0;
+                snake->disk_bytes = 0;
                 snake->segment[0].st_tail = snake->segment[0].st_head = snake->tail = snake->head = offset;
                 snake->segment[0].fd_tail = snake->segment[0].fd_head = 0;
                 snake->state = 1;
@@ -461,6 +487,7 @@ static void
 _vte_snake_write (VteSnake *snake, gsize offset, const char *data, gsize len)
 {
         gsize fd_offset;
+        guint32 len32 = len;
 
         g_assert_cmpuint (offset, >=, snake->tail);
         g_assert_cmpuint (offset, <=, snake->head);
@@ -501,12 +528,18 @@ _vte_snake_write (VteSnake *snake, gsize offset, const char *data, gsize len)
 #endif
                 }
                 snake->head = offset + VTE_SNAKE_BLOCKSIZE;
+                g_array_append_val (snake->block_lens, len32);
         } else {
                 /* Overwriting an existing block. The new block might be shorter than the old one,
                  * punch a hole to potentially free up disk space (and for easier unit testing). */
+                guint32 *block_len = &g_array_index (snake->block_lens, guint32,
+                                                     snake->block_lens_first + (offset - snake->tail) / VTE_SNAKE_BLOCKSIZE);
                 fd_offset = _vte_snake_offset_map(snake, offset);
                 _file_try_punch_hole (snake->fd, fd_offset, VTE_SNAKE_BLOCKSIZE);
+                snake->disk_bytes -= *block_len;
+                *block_len = len32;
         }
+        snake->disk_bytes += len;
         _file_write (snake->fd, data, len, fd_offset);
 }
 
@@ -527,6 +560,8 @@ _vte_snake_advance_tail (VteSnake *snake, gsize offset)
 		return;
         }
 
+        _vte_snake_drop_block_lens (snake, offset);
+
         while (offset > snake->segment[0].st_tail) {
                 if (offset < snake->segment[0].st_head) {
                         /* Drop some (but not all) bytes from the first segment. */
@@ -649,8 +684,13 @@ typedef struct _VteBoa {
 #if !defined VTESTREAM_MAIN && defined WITH_GNUTLS
         gnutls_cipher_hd_t cipher_hd;
         VteIv iv;
+        GMutex cipher_lock;  /* snapshots decrypt from other threads */
 #endif
         int compressBound;
+
+        /* For snapshots reading from other threads: odd while a block is
+         * being overwritten in place.  The tail is also set atomically. */
+        volatile gint rewrites;
 } VteBoa;
 
 typedef struct _VteBoaClass {
@@ -680,11 +720,13 @@ _vte_boa_encrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, char *da
 {
 #ifndef VTESTREAM_MAIN
 # ifdef WITH_GNUTLS
+        g_mutex_lock (&boa->cipher_lock);
         boa->iv.offset = offset;
         boa->iv.overwrite_counter = overwrite_counter;
         gnutls_cipher_set_iv (boa->cipher_hd, &boa->iv, VTE_CIPHER_IV_SIZE);
         gnutls_cipher_encrypt (boa->cipher_hd, data, len);
         gnutls_cipher_tag (boa->cipher_hd, data + len, VTE_CIPHER_TAG_SIZE);
+        g_mutex_unlock (&boa->cipher_lock);
 # endif
 #else
         /* Fake encryption for unit testing: uppercase <-> lowercase, followed by verification tag which is
@@ -711,11 +753,13 @@ _vte_boa_decrypt (VteBoa *boa, gsize offset, guint32 overwrite_counter, char *da
 
 #ifndef VTESTREAM_MAIN
 # ifdef WITH_GNUTLS
+        g_mutex_lock (&boa->cipher_lock);
         boa->iv.offset = offset;
         boa->iv.overwrite_counter = overwrite_counter;
         gnutls_cipher_set_iv (boa->cipher_hd, &boa->iv, VTE_CIPHER_IV_SIZE);
         gnutls_cipher_decrypt (boa->cipher_hd, data, len);
         gnutls_cipher_tag (boa->cipher_hd, tag, VTE_CIPHER_TAG_SIZE);
+        g_mutex_unlock (&boa->cipher_lock);
 # endif
 #else
         /* Fake decryption for unit testing; see above. */
@@ -838,6 +882,8 @@ _vte_boa_init (VteBoa *boa)
 
         /* Empty IV. */
         explicit_bzero(&boa->iv, sizeof(boa->iv));
+
+        g_mutex_init (&boa->cipher_lock);
 #endif
 
         boa->compressBound = _vte_boa_compressBound(VTE_BOA_BLOCKSIZE);
@@ -853,6 +899,8 @@ _vte_boa_finalize (GObject *object)
 
         gnutls_cipher_deinit (boa->cipher_hd);
         gnutls_global_deinit ();
+
+        g_mutex_clear (&boa->cipher_lock);
 #endif
 
         G_OBJECT_CLASS (_vte_boa_parent_class)->finalize(object);
@@ -874,24 +922,21 @@ _vte_boa_reset (VteBoa *boa, gsize offset)
 
         _vte_snake_reset (&boa->parent, OFFSET_BOA_TO_SNAKE(offset));
 
-        boa->tail = offset;
+        g_atomic_pointer_set (&boa->tail, offset);
         /* Never retreat the head: bug 748484. */
         boa->head = MAX(boa->head, offset);
 }
 
-/* Place VTE_BOA_BLOCKSIZE bytes at data.
- * data can be NULL if we're only interested in integrity verification and the overwrite_counter. */
+/* Decode the VTE_SNAKE_BLOCKSIZE bytes read from the snake at buf, in place,
+ * into VTE_BOA_BLOCKSIZE bytes at data.
+ * data can be NULL if we're only interested in integrity verification and the overwrite_counter.
+ * concurrent is set if the block may have been rewritten while it was read, so
+ * that bad data is an error rather than a bug. */
 static gboolean
-_vte_boa_read_with_overwrite_counter (VteBoa *boa, gsize offset, char *data, _vte_overwrite_counter_t *overwrite_counter)
+_vte_boa_decode (VteBoa *boa, gsize offset, char *buf, char *data, _vte_overwrite_counter_t *overwrite_counter,
+                 gboolean concurrent)
 {
         _vte_block_datalength_t compressed_len;
-        char *buf = g_newa(char, VTE_SNAKE_BLOCKSIZE);
-
-        g_assert_cmpuint (offset % VTE_BOA_BLOCKSIZE, ==, 0);
-
-        /* Read */
-        if (G_UNLIKELY (!_vte_snake_read (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf)))
-                return FALSE;
 
         compressed_len = *((_vte_block_datalength_t *) buf);
         *overwrite_counter = *((_vte_overwrite_counter_t *) (buf + VTE_BLOCK_DATALENGTH_SIZE));
@@ -911,12 +956,30 @@ _vte_boa_read_with_overwrite_counter (VteBoa *boa, gsize offset, char *data, _vt
                 } else {
                         unsigned int uncompressed_len;
                         uncompressed_len = _vte_boa_uncompress(data, VTE_BOA_BLOCKSIZE, buf + VTE_BLOCK_DATALENGTH_SIZE + VTE_OVERWRITE_COUNTER_SIZE, compressed_len);
+                        if (G_UNLIKELY (concurrent && uncompressed_len != VTE_BOA_BLOCKSIZE))
+                                return FALSE;
                         g_assert_cmpuint (uncompressed_len, ==, VTE_BOA_BLOCKSIZE);
                 }
         }
         return TRUE;
 }
 
+/* Place VTE_BOA_BLOCKSIZE bytes at data.
+ * data can be NULL if we're only interested in integrity verification and the overwrite_counter. */
+static gboolean
+_vte_boa_read_with_overwrite_counter (VteBoa *boa, gsize offset, char *data, _vte_overwrite_counter_t *overwrite_counter)
+{
+        char *buf = g_newa(char, VTE_SNAKE_BLOCKSIZE);
+
+        g_assert_cmpuint (offset % VTE_BOA_BLOCKSIZE, ==, 0);
+
+        /* Read */
+        if (G_UNLIKELY (!_vte_snake_read (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf)))
+                return FALSE;
+
+        return _vte_boa_decode (boa, offset, buf, data, overwrite_counter, FALSE);
+}
+
 static gboolean
 _vte_boa_read (VteBoa *boa, gsize offset, char *data)
 {
@@ -953,12 +1016,14 @@ _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
                  * This is to never reuse the same IV/nonce for encryption.
                  * In case of read failure, do our best to destroy that block (overwrite with zeros, then punch a hole)
                  * and return, forcing this and all subsequent reads and writes to fail. */
+                g_atomic_int_inc (&boa->rewrites);
                 if (G_UNLIKELY (!_vte_boa_read_with_overwrite_counter (boa, offset, NULL, &overwrite_counter))) {
                         /* Try to overwrite with explicit zeros */
                         memset (buf, 0, VTE_SNAKE_BLOCKSIZE);
                         _vte_snake_write (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), buf, VTE_SNAKE_BLOCKSIZE);
                         /* Try to punch out from the FS */
                         _vte_snake_write (&boa->parent, OFFSET_BOA_TO_SNAKE(offset), "", 0);
+                        g_atomic_int_inc (&boa->rewrites);
                         return;
                 }
                 overwrite_counter++;
@@ -985,6 +1050,8 @@ _vte_boa_write (VteBoa *boa, gsize offset, const char *data)
 
         if (G_LIKELY (offset == boa->head)) {
                 boa->head += VTE_BOA_BLOCKSIZE;
+        } else {
+                g_atomic_int_inc (&boa->rewrites);
         }
 }
 
@@ -997,7 +1064,7 @@ _vte_boa_advance_tail (VteBoa *boa, gsize offset)
 
         _vte_snake_advance_tail (&boa->parent, OFFSET_BOA_TO_SNAKE(offset));
 
-        boa->tail = offset;
+        g_atomic_pointer_set (&boa->tail, offset);
 }
 
 static gsize
@@ -1057,6 +1124,40 @@ static GType _vte_file_stream_get_type (void);
 
 G_DEFINE_TYPE (VteFileStream, _vte_file_stream, VTE_TYPE_STREAM)
 
+typedef struct _VteFileStreamSnapshot {
+        GObject parent;
+
+        VteBoa *boa;
+        int fd;
+
+        /* The snake's offset mapping at the time of the snapshot */
+        int state;
+        struct {
+                gsize st_tail;
+                gsize st_head;
+                gsize fd_tail;
+                gsize fd_head;
+        } segment[3];
+        gsize snake_tail, snake_head;
+
+        char *rbuf;
+        gsize rbuf_offset;
+
+        char *wbuf;
+        gsize wbuf_len;
+
+        gsize head, tail;
+} VteFileStreamSnapshot;
+
+typedef VteStreamClass VteFileStreamSnapshotClass;
+
+static GType _vte_file_stream_snapshot_get_type (void);
+#define VTE_TYPE_FILE_STREAM_SNAPSHOT _vte_file_stream_snapshot_get_type ()
+
+G_DEFINE_TYPE (VteFileStreamSnapshot, _vte_file_stream_snapshot, VTE_TYPE_STREAM)
+
+static VteStream *_vte_file_stream_take_snapshot (VteStream *astream);
+
 VteStream *
 _vte_file_stream_new (void)
 {
@@ -1226,6 +1327,15 @@ _vte_file_stream_head (VteStream *astream)
 	return stream->head;
 }
 
+static gsize
+_vte_file_stream_disk_usage (VteStream *astream)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+
+	/* The compressed and encrypted blocks on disk, plus the pending one still in memory */
+	return stream->boa->parent.disk_bytes + stream->wbuf_len;
+}
+
 static void
 _vte_file_stream_class_init (VteFileStreamClass *klass)
 {
@@ -1240,6 +1350,206 @@ _vte_file_stream_class_init (VteFileStreamClass *klass)
 	klass->advance_tail = _vte_file_stream_advance_tail;
 	klass->tail = _vte_file_stream_tail;
 	klass->head = _vte_file_stream_head;
+	klass->disk_usage = _vte_file_stream_disk_usage;
+	klass->snapshot = _vte_file_stream_take_snapshot;
+}
+
+/******************************************************************************************/
+
+/*
+ * VteFileStreamSnapshot: A read-only copy of a VteFileStream.
+ *
+ * It keeps a reference to the stream's boa for the file and the cipher, and
+ * copies of the snake's offset mapping and of the stream's write buffer, so
+ * that it can be read from another thread while the stream goes on.
+ *
+ * The mapping stays valid for as long as a block is not dropped, since the
+ * snake never moves the blocks it keeps. So after reading a block, it is
+ * only used if the boa's tail hasn't passed it meanwhile, and no block was
+ * being overwritten in place while reading; otherwise the read fails. This
+ * doesn't rely on the integrity check, which is only done with encryption.
+ * A block overwritten in place (after a truncate) before it's read reads
+ * back the new data.
+ */
+
+static gboolean
+_vte_file_stream_snapshot_read_block (VteFileStreamSnapshot *snapshot, gsize offset, char *data)
+{
+        _vte_overwrite_counter_t overwrite_counter;
+        char *buf = g_newa(char, VTE_SNAKE_BLOCKSIZE);
+        gsize snake_offset = OFFSET_BOA_TO_SNAKE(offset);
+        gint rewrites;
+        int i;
+        int segments = VTE_SNAKE_SEGMENTS(snapshot);
+
+        if (G_UNLIKELY (snake_offset < snapshot->snake_tail || snake_offset >= snapshot->snake_head))
+                return FALSE;
+
+        for (i = 0; i < segments; i++) {
+                if (snake_offset >= snapshot->segment[i].st_tail && snake_offset < snapshot->segment[i].st_head)
+                        break;
+        }
+        if (G_UNLIKELY (i == segments))
+                return FALSE;
+
+        rewrites = g_atomic_int_get (&snapshot->boa->rewrites);
+        if (G_UNLIKELY (rewrites & 1))
+                return FALSE;
+
+        if (G_UNLIKELY (_file_read (snapshot->fd, buf, VTE_SNAKE_BLOCKSIZE,
+                                    snake_offset - snapshot->segment[i].st_tail + snapshot->segment[i].fd_tail) != VTE_SNAKE_BLOCKSIZE))
+                return FALSE;
+
+        /* Dropped, and maybe its place reused, or torn by an overwrite */
+        if (G_UNLIKELY (offset < (gsize) g_atomic_pointer_get (&snapshot->boa->tail) ||
+                        rewrites != g_atomic_int_get (&snapshot->boa->rewrites)))
+                return FALSE;
+
+        return _vte_boa_decode (snapshot->boa, offset, buf, data, &overwrite_counter, TRUE);
+}
+
+static gboolean
+_vte_file_stream_snapshot_read (VteStream *astream, gsize offset, char *data, gsize len)
+{
+	VteFileStreamSnapshot *snapshot = (VteFileStreamSnapshot *) astream;
+
+        if (G_UNLIKELY (offset < snapshot->tail || offset + len > snapshot->head || offset + len < offset))
+                return FALSE;
+
+        while (len && offset < ALIGN_BOA(snapshot->head)) {
+                gsize l = MIN(VTE_BOA_BLOCKSIZE - MOD_BOA(offset), len);
+                gsize offset_aligned = ALIGN_BOA(offset);
+                if (l == VTE_BOA_BLOCKSIZE && offset_aligned != snapshot->rbuf_offset) {
+                        /* A whole block: decode it right into the caller's buffer */
+                        if (G_UNLIKELY (!_vte_file_stream_snapshot_read_block (snapshot, offset_aligned, data)))
+                                return FALSE;
+                        offset += l; data += l; len -= l;
+                        continue;
+                }
+                if (offset_aligned != snapshot->rbuf_offset) {
+                        if (G_UNLIKELY (!_vte_file_stream_snapshot_read_block (snapshot, offset_aligned, snapshot->rbuf))) {
+                                snapshot->rbuf_offset = 1;  /* Invalidate */
+                                return FALSE;
+                        }
+                        snapshot->rbuf_offset = offset_aligned;
+                }
+                memcpy(data, snapshot->rbuf + MOD_BOA(offset), l);
+                offset += l; data += l; len -= l;
+        }
+        if (len) {
+                g_assert_cmpuint (MOD_BOA(offset) + len, <=, snapshot->wbuf_len);
+                memcpy(data, snapshot->wbuf + MOD_BOA(offset), len);
+        }
+        return TRUE;
+}
+
+static void
+_vte_file_stream_snapshot_reset (VteStream *astream G_GNUC_UNUSED, gsize offset G_GNUC_UNUSED)
+{
+        g_assert_not_reached ();
+}
+
+static void
+_vte_file_stream_snapshot_append (VteStream *astream G_GNUC_UNUSED, const char *data G_GNUC_UNUSED, gsize len G_GNUC_UNUSED)
+{
+        g_assert_not_reached ();
+}
+
+static void
+_vte_file_stream_snapshot_truncate (VteStream *astream G_GNUC_UNUSED, gsize offset G_GNUC_UNUSED)
+{
+        g_assert_not_reached ();
+}
+
+static void
+_vte_file_stream_snapshot_advance_tail (VteStream *astream G_GNUC_UNUSED, gsize offset G_GNUC_UNUSED)
+{
+        g_assert_not_reached ();
+}
+
+static gsize
+_vte_file_stream_snapshot_tail (VteStream *astream)
+{
+	VteFileStreamSnapshot *snapshot = (VteFileStreamSnapshot *) astream;
+
+	return snapshot->tail;
+}
+
+static gsize
+_vte_file_stream_snapshot_head (VteStream *astream)
+{
+	VteFileStreamSnapshot *snapshot = (VteFileStreamSnapshot *) astream;
+
+	return snapshot->head;
+}
+
+static gsize
+_vte_file_stream_snapshot_disk_usage (VteStream *astream G_GNUC_UNUSED)
+{
+        /* The data belongs to the stream that the snapshot was taken of */
+        return 0;
+}
+
+static void
+_vte_file_stream_snapshot_init (VteFileStreamSnapshot *snapshot)
+{
+        snapshot->fd = -1;
+        snapshot->rbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+        snapshot->wbuf = (char *)g_malloc(VTE_BOA_BLOCKSIZE);
+        snapshot->rbuf_offset = 1;  /* Invalidate */
+}
+
+static void
+_vte_file_stream_snapshot_finalize (GObject *object)
+{
+        VteFileStreamSnapshot *snapshot = (VteFileStreamSnapshot *) object;
+
+        g_free(snapshot->rbuf);
+        g_free(snapshot->wbuf);
+        if (snapshot->boa != NULL)
+                g_object_unref (snapshot->boa);
+
+        G_OBJECT_CLASS (_vte_file_stream_snapshot_parent_class)->finalize(object);
+}
+
+static void
+_vte_file_stream_snapshot_class_init (VteFileStreamSnapshotClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+	gobject_class->finalize = _vte_file_stream_snapshot_finalize;
+
+	klass->reset = _vte_file_stream_snapshot_reset;
+	klass->read = _vte_file_stream_snapshot_read;
+	klass->append = _vte_file_stream_snapshot_append;
+	klass->truncate = _vte_file_stream_snapshot_truncate;
+	klass->advance_tail = _vte_file_stream_snapshot_advance_tail;
+	klass->tail = _vte_file_stream_snapshot_tail;
+	klass->head = _vte_file_stream_snapshot_head;
+	klass->disk_usage = _vte_file_stream_snapshot_disk_usage;
+}
+
+static VteStream *
+_vte_file_stream_take_snapshot (VteStream *astream)
+{
+	VteFileStream *stream = (VteFileStream *) astream;
+        VteSnake *snake = &stream->boa->parent;
+        VteFileStreamSnapshot *snapshot;
+
+        snapshot = (VteFileStreamSnapshot *) g_object_new (VTE_TYPE_FILE_STREAM_SNAPSHOT, NULL);
+        snapshot->boa = (VteBoa *) g_object_ref (stream->boa);
+        snapshot->fd = snake->fd;
+        snapshot->state = snake->state;
+        G_STATIC_ASSERT (sizeof (snapshot->segment) == sizeof (snake->segment));
+        memcpy (snapshot->segment, snake->segment, sizeof (snake->segment));
+        snapshot->snake_tail = snake->tail;
+        snapshot->snake_head = snake->head;
+        memcpy (snapshot->wbuf, stream->wbuf, stream->wbuf_len);
+        snapshot->wbuf_len = stream->wbuf_len;
+        snapshot->tail = stream->tail;
+        snapshot->head = stream->head;
+
+        return (VteStream *) snapshot;
 }
 
 G_END_DECLS
@@ -1369,26 +1679,32 @@ test_snake (void)
         /* Test overwriting data */
         snake_write (snake, 0, "Armadillo");
         assert_snake (snake, 1, 0, 10, "Armadillo.");
+        g_assert_cmpuint (snake->disk_bytes, ==, 9);
 
         snake_write (snake, 10, "Bobcat");
         assert_file (snake->fd, "Armadillo.Bobcat....");
         assert_snake (snake, 1, 0, 20, "Armadillo.Bobcat....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 15);
 
         snake_write (snake, 10, "Chinchilla");
         assert_file (snake->fd, "Armadillo.Chinchilla");
         assert_snake (snake, 1, 0, 20, "Armadillo.Chinchilla");
+        g_assert_cmpuint (snake->disk_bytes, ==, 19);
 
         snake_write (snake, 0, "Duck");
         assert_file (snake->fd, "Duck......Chinchilla");
         assert_snake (snake, 1, 0, 20, "Duck......Chinchilla");
+        g_assert_cmpuint (snake->disk_bytes, ==, 14);
 
         snake_write (snake, 20, "");
         assert_file (snake->fd, "Duck......Chinchilla..........");
         assert_snake (snake, 1, 0, 30, "Duck......Chinchilla..........");
+        g_assert_cmpuint (snake->disk_bytes, ==, 14);
 
         snake_write (snake, 30, "Ferret");
         assert_file (snake->fd, "Duck......Chinchilla..........Ferret....");
         assert_snake (snake, 1, 0, 40, "Duck......Chinchilla..........Ferret....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 20);
 
         /* Start over */
         g_object_unref (snake);
@@ -1399,57 +1715,68 @@ test_snake (void)
         snake_write (snake, 10, "Bobcat");
         assert_file (snake->fd, "Armadillo.Bobcat....");
         assert_snake (snake, 1, 0, 20, "Armadillo.Bobcat....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 15);
 
         /* Stay in state 1 */
         _vte_snake_advance_tail (snake, 10);
         snake_write (snake, 20, "Chinchilla");
         assert_file (snake->fd, "..........Bobcat....Chinchilla");
         assert_snake (snake, 1, 10, 30, "Bobcat....Chinchilla");
+        g_assert_cmpuint (snake->disk_bytes, ==, 16);
 
         /* State 1 -> 2 */
         _vte_snake_advance_tail (snake, 20);
         snake_write (snake, 30, "Duck");
         assert_file (snake->fd, "Duck................Chinchilla");
         assert_snake (snake, 2, 20, 40, "ChinchillaDuck......");
+        g_assert_cmpuint (snake->disk_bytes, ==, 14);
 
         /* Stay in state 2 */
         snake_write (snake, 40, "Elephant");
         assert_file (snake->fd, "Duck......Elephant..Chinchilla");
         assert_snake (snake, 2, 20, 50, "ChinchillaDuck......Elephant..");
+        g_assert_cmpuint (snake->disk_bytes, ==, 22);
 
         /* State 2 -> 3 */
         snake_write (snake, 50, "Ferret");
         assert_file (snake->fd, "Duck......Elephant..ChinchillaFerret....");
         assert_snake (snake, 3, 20, 60, "ChinchillaDuck......Elephant..Ferret....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 28);
 
         /* State 3 -> 4 */
         _vte_snake_advance_tail (snake, 30);
         assert_file (snake->fd, "Duck......Elephant............Ferret....");
         assert_snake (snake, 4, 30, 60, "Duck......Elephant..Ferret....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 18);
 
         /* Stay in state 4 */
         _vte_snake_advance_tail (snake, 40);
         assert_file (snake->fd, "..........Elephant............Ferret....");
         assert_snake (snake, 4, 40, 60, "Elephant..Ferret....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 14);
 
         /* State 4 -> 1 */
         _vte_snake_advance_tail (snake, 50);
         assert_file (snake->fd, "..............................Ferret....");
         assert_snake (snake, 1, 50, 60, "Ferret....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 6);
 
         /* State 1 -> 2 */
         snake_write (snake, 60, "Giraffe");
         assert_file (snake->fd, "Giraffe.......................Ferret....");
         assert_snake (snake, 2, 50, 70, "Ferret....Giraffe...");
+        g_assert_cmpuint (snake->disk_bytes, ==, 13);
 
         /* Reset, back to state 1 */
         _vte_snake_reset (snake, 250);
         assert_snake (snake, 1, 250, 250, "");
+        g_assert_cmpuint (snake->disk_bytes, ==, 0);
 
         /* Stay in state 1 */
         snake_write (snake, 250, "Zebra");
         assert_file (snake->fd, "Zebra.....");
         assert_snake (snake, 1, 250, 260, "Zebra.....");
+        g_assert_cmpuint (snake->disk_bytes, ==, 5);
 
         g_object_unref (snake);
 }
@@ -1754,6 +2081,31 @@ test_stream (void)
         g_object_unref (astream);
 }
 
+static void
+test_stream_snapshot (void)
+{
+        VteStream *snapshot;
+        char buf[8];
+
+        VteStream *astream = _vte_file_stream_new();
+
+        stream_append (astream, "axolotl" "beeeees" "cat");
+        snapshot = _vte_stream_snapshot (astream);
+        assert_stream (snapshot, 0, 17, "axolotl" "beeeees" "cat");
+
+        /* Changes to the stream don't show up in the snapshot */
+        _vte_stream_truncate (astream, 15);
+        stream_append (astream, "ow" "dingo");
+        assert_stream (astream, 0, 22, "axolotl" "beeeees" "cow" "dingo");
+        assert_stream (snapshot, 0, 17, "axolotl" "beeeees" "cat");
+
+        /* Out of bounds */
+        g_assert (!_vte_stream_read (snapshot, 16, buf, 2));
+
+        g_object_unref (snapshot);
+        g_object_unref (astream);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -1762,6 +2114,7 @@ main (int argc, char **argv)
         test_snake();
         test_boa();
         test_stream();
+        test_stream_snapshot();
 
         printf("vtestream-file tests passed :)\n");
         return 0;
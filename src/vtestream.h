@@ -36,6 +36,15 @@ void _vte_stream_advance_tail (VteStream *stream, gsize offset);
 gsize _vte_stream_tail (VteStream *stream);
 gsize _vte_stream_head (VteStream *stream);
 
+/* The number of bytes the stream's contents take up in storage, after
+ * compression; not to be confused with head - tail. */
+gsize _vte_stream_disk_usage (VteStream *stream);
+
+/* A read-only copy of the stream's current contents that can be read from
+ * another thread while the stream itself goes on being written to. Reads of
+ * data that the stream has dropped or overwritten since then fail. */
+VteStream *_vte_stream_snapshot (VteStream *stream);
+
 /* Various streams */
 
 VteStream *